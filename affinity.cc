@@ -0,0 +1,47 @@
+/**
+ * File: affinity.cc
+ * -----------------
+ * Presents the implementation of the helpers exported by affinity.h.
+ */
+
+#include "affinity.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * The set of permitted cores is captured once, before main runs, since
+ * querying it later from a thread that's already been pinned would report
+ * just the one core.
+ */
+static cpu_set_t readAvailableCores() {
+  cpu_set_t available;
+  if (sched_getaffinity(0, sizeof(available), &available) != 0) {
+    CPU_ZERO(&available);
+    CPU_SET(0, &available);
+  }
+  return available;
+}
+
+static const cpu_set_t kAvailableCores = readAvailableCores();
+
+size_t countAvailableCores() {
+  size_t count = CPU_COUNT(&kAvailableCores);
+  return count == 0 ? 1 : count;
+}
+
+bool pinThreadToCore(size_t index) {
+  size_t count = CPU_COUNT(&kAvailableCores);
+  if (count == 0) return false;
+  index %= count;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &kAvailableCores)) continue;
+    if (index-- > 0) continue;
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    CPU_SET(cpu, &pinned);
+    return pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned) == 0;
+  }
+
+  return false;
+}
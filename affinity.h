@@ -0,0 +1,27 @@
+/**
+ * File: affinity.h
+ * ----------------
+ * Exports a pair of helpers for spreading threads across the cores the
+ * proxy is permitted to run on, so that each acceptor (or event loop)
+ * thread can keep to a core of its own.
+ */
+
+#ifndef _affinity_
+#define _affinity_
+
+#include <cstddef>   // for size_t
+
+/**
+ * Returns the number of cores the process is permitted to run on
+ * (which, in a container, may be far fewer than the machine has).
+ */
+size_t countAvailableCores();
+
+/**
+ * Pins the calling thread to the index'th of the cores the process is
+ * permitted to run on, wrapping around if there are fewer than index + 1
+ * of them.  Returns true if and only if the thread was pinned.
+ */
+bool pinThreadToCore(size_t index);
+
+#endif
@@ -0,0 +1,122 @@
+/**
+ * File: arena.cc
+ * --------------
+ * Presents the implementation of the Arena class.
+ */
+
+#include "arena.h"
+
+#include <cstdint>
+#include <cstdlib>
+
+using namespace std;
+
+static const size_t kBlockSize = 16 * 1024;
+static const size_t kLargeAllocation = kBlockSize / 4;
+static const size_t kMaxRetainedBlocks = 8;   // per arena, across resets
+static const size_t kMaxPooledArenas = 64;    // per thread
+static const size_t kMaxAlignment = alignof(max_align_t);
+
+/**
+ * Dedicated allocations are preceded by a header linking them into the
+ * arena's list, padded so the memory that follows is maximally aligned.
+ */
+static const size_t kLargeHeaderSize = (2 * sizeof(void *) + kMaxAlignment - 1) & ~(kMaxAlignment - 1);
+
+Arena::Arena() : current(0), cursor(NULL), limit(NULL), larges(NULL) {}
+
+Arena::~Arena() {
+  reset();
+  for (char *block: blocks) free(block);
+}
+
+void *Arena::allocate(size_t size, size_t alignment) {
+  if (size > kLargeAllocation) {
+    char *memory = static_cast<char *>(malloc(kLargeHeaderSize + size));
+    if (memory == NULL) throw bad_alloc();
+    large_t *large = reinterpret_cast<large_t *>(memory);
+    large->prev = NULL;
+    large->next = larges;
+    if (larges != NULL) larges->prev = large;
+    larges = large;
+    return memory + kLargeHeaderSize;
+  }
+
+  while (true) {
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) & ~(alignment - 1);
+    char *start = reinterpret_cast<char *>(aligned);
+    if (cursor != NULL && start + size <= limit) {
+      cursor = start + size;
+      return start;
+    }
+
+    if (cursor != NULL) current++;
+    if (current == blocks.size()) {
+      char *block = static_cast<char *>(malloc(kBlockSize));
+      if (block == NULL) throw bad_alloc();
+      blocks.push_back(block);
+    }
+    cursor = blocks[current];
+    limit = cursor + kBlockSize;
+  }
+}
+
+void Arena::deallocate(void *ptr, size_t size) {
+  if (size <= kLargeAllocation) return;
+  large_t *large = reinterpret_cast<large_t *>(static_cast<char *>(ptr) - kLargeHeaderSize);
+  if (large->prev != NULL) large->prev->next = large->next;
+  else larges = large->next;
+  if (large->next != NULL) large->next->prev = large->prev;
+  free(large);
+}
+
+/**
+ * Keeps the first few blocks for the next request to bump through, which
+ * is typically all of them.  A request that needed more than that leaves
+ * the rest to be freed, so one outsized request doesn't inflate the arena
+ * for good.
+ */
+void Arena::reset() {
+  while (larges != NULL) {
+    large_t *next = larges->next;
+    free(larges);
+    larges = next;
+  }
+
+  while (blocks.size() > kMaxRetainedBlocks) {
+    free(blocks.back());
+    blocks.pop_back();
+  }
+
+  current = 0;
+  cursor = limit = NULL;
+}
+
+/**
+ * Each thread keeps its own pool of released arenas, so recycling them
+ * needs no locking, and whatever is left in the pool is destroyed when
+ * the thread exits.
+ */
+class ArenaPool {
+ public:
+  ~ArenaPool() { for (Arena *arena: arenas) delete arena; }
+  vector<Arena *> arenas;
+};
+
+static thread_local ArenaPool pool;
+
+Arena *Arena::acquire() {
+  if (pool.arenas.empty()) return new Arena;
+  Arena *arena = pool.arenas.back();
+  pool.arenas.pop_back();
+  return arena;
+}
+
+void Arena::release(Arena *arena) {
+  arena->reset();
+  if (pool.arenas.size() < kMaxPooledArenas) {
+    pool.arenas.push_back(arena);
+  } else {
+    delete arena;
+  }
+}
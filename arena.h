@@ -0,0 +1,139 @@
+/**
+ * File: arena.h
+ * -------------
+ * Defines the Arena class, which hands out memory for everything a single
+ * request and its response need (header fields, small payloads) by bumping
+ * a pointer through a few large blocks, and which gives all of that memory
+ * back at once, when the request has been serviced, by resetting the
+ * pointer.  Individual deallocations cost nothing, and the blocks themselves
+ * are kept around, since an arena is recycled (through acquire and release)
+ * by the thread that's done with it rather than destroyed, so a thread that
+ * services one request after another stops calling malloc for them at all.
+ *
+ * ArenaAllocator adapts an Arena to the allocator interface the standard
+ * containers expect.  An ArenaAllocator with no arena falls back to the
+ * heap, and so does a copy of any container built on one, since copies
+ * (say, of a response headed into a cache) can easily outlive the arena.
+ */
+
+#ifndef _http_arena_
+#define _http_arena_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+class Arena {
+ public:
+  Arena();
+  ~Arena();
+
+/**
+ * Returns size bytes aligned to alignment, which must be a power of two
+ * no larger than that of max_align_t.  Requests larger than a quarter of a
+ * block get dedicated memory of their own, so a payload growing to several
+ * megabytes doesn't strand block after block of abandoned copies.  Throws
+ * bad_alloc if the memory can't be had.
+ */
+  void *allocate(size_t size, size_t alignment);
+
+/**
+ * Returns the size bytes at ptr, as previously handed out by allocate.
+ * That's a no-op unless the bytes were dedicated memory, which is freed
+ * right away.
+ */
+  void deallocate(void *ptr, size_t size);
+
+/**
+ * Reclaims everything the arena has handed out since it was last reset,
+ * so nothing allocated from it may be used afterwards.
+ */
+  void reset();
+
+/**
+ * Returns an empty arena, recycled from the calling thread's pool of
+ * released ones if possible.
+ */
+  static Arena *acquire();
+
+/**
+ * Resets the arena and returns it to the calling thread's pool.
+ */
+  static void release(Arena *arena);
+
+ private:
+  typedef struct large {
+    struct large *prev;
+    struct large *next;
+  } large_t;
+
+  std::vector<char *> blocks;
+  size_t current;          // index of the block being bumped through
+  char *cursor;
+  char *limit;
+  large_t *larges;         // dedicated allocations, for freeing on reset
+
+  Arena(const Arena& original) = delete;
+  Arena& operator=(const Arena& rhs) = delete;
+};
+
+/**
+ * Acquires an arena when constructed and releases it when destroyed,
+ * so an arena can be scoped to a single request.
+ */
+class ArenaLease {
+ public:
+  ArenaLease() : arena(Arena::acquire()) {}
+  ~ArenaLease() { Arena::release(arena); }
+  Arena *get() const { return arena; }
+
+ private:
+  Arena *arena;
+
+  ArenaLease(const ArenaLease& original) = delete;
+  ArenaLease& operator=(const ArenaLease& rhs) = delete;
+};
+
+template <typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+  typedef std::false_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  ArenaAllocator(Arena *arena = NULL) : arena(arena) {}
+  template <typename U> ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.getArena()) {}
+
+  T *allocate(size_t count) {
+    size_t size = count * sizeof(T);
+    return static_cast<T *>(arena == NULL ? ::operator new(size) : arena->allocate(size, alignof(T)));
+  }
+
+  void deallocate(T *ptr, size_t count) {
+    if (arena == NULL) {
+      ::operator delete(ptr);
+    } else {
+      arena->deallocate(ptr, count * sizeof(T));
+    }
+  }
+
+  ArenaAllocator select_on_container_copy_construction() const { return ArenaAllocator(); }
+  Arena *getArena() const { return arena; }
+
+ private:
+  Arena *arena;
+};
+
+template <typename T, typename U>
+inline bool operator==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+  return lhs.getArena() == rhs.getArena();
+}
+
+template <typename T, typename U>
+inline bool operator!=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+  return !(lhs == rhs);
+}
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * File: cache-control.cc
+ * ----------------------
+ * Presents the implementation of the CacheControl class.
+ */
+
+#include "cache-control.h"
+
+#include <climits>
+
+using namespace std;
+
+/**
+ * Directives are separated by commas, and each is a name optionally
+ * followed by '=' and an argument, which may be a quoted string (and a
+ * quoted string may contain commas of its own).
+ */
+CacheControl::CacheControl(const StringView& value) :
+  noStore(false), noCache(false), isPrivate(false), isPublic(false),
+  mustRevalidate(false), proxyRevalidate(false), maxAge(kUnset), sharedMaxAge(kUnset),
+  staleWhileRevalidate(kUnset), staleIfError(kUnset) {
+  size_t pos = 0;
+  while (pos < value.size()) {
+    size_t start = pos;
+    bool quoted = false;
+    while (pos < value.size() && (quoted || value[pos] != ',')) {
+      if (value[pos] == '"') quoted = !quoted;
+      pos++;
+    }
+
+    StringView directive = value.substr(start, pos - start).trim();
+    pos++; // past the comma
+    if (directive.empty()) continue;
+    size_t equals = directive.find('=');
+    StringView name = directive.substr(0, equals).trim();
+    StringView argument;
+    if (equals != StringView::npos) argument = directive.substr(equals + 1).trim();
+    if (argument.size() >= 2 && argument[0] == '"' && argument[argument.size() - 1] == '"') {
+      argument = argument.substr(1, argument.size() - 2);
+    }
+    parseDirective(name, argument);
+  }
+}
+
+/** Private methods **/
+
+/**
+ * Parses delta-seconds.  An argument that isn't one is taken to be 0,
+ * which errs on the side of the response being stale, and values too large
+ * to represent are capped, as RFC 9111 suggests.
+ */
+static long parseDeltaSeconds(const StringView& argument) {
+  if (argument.empty()) return 0;
+  long seconds = 0;
+  for (size_t i = 0; i < argument.size(); i++) {
+    if (argument[i] < '0' || argument[i] > '9') return 0;
+    if (seconds < (INT_MAX - 9) / 10) seconds = seconds * 10 + (argument[i] - '0');
+    else seconds = INT_MAX;
+  }
+  return seconds;
+}
+
+/**
+ * no-cache and private may carry a list of header names, in which case
+ * they only restrict those headers.  The proxy doesn't bother stripping
+ * individual headers, so they're treated as though no list were given.
+ */
+void CacheControl::parseDirective(const StringView& name, const StringView& argument) {
+  if (name.equalsIgnoreCase("no-store")) noStore = true;
+  else if (name.equalsIgnoreCase("no-cache")) noCache = true;
+  else if (name.equalsIgnoreCase("private")) isPrivate = true;
+  else if (name.equalsIgnoreCase("public")) isPublic = true;
+  else if (name.equalsIgnoreCase("must-revalidate")) mustRevalidate = true;
+  else if (name.equalsIgnoreCase("proxy-revalidate")) proxyRevalidate = true;
+  else if (name.equalsIgnoreCase("max-age")) maxAge = parseDeltaSeconds(argument);
+  else if (name.equalsIgnoreCase("s-maxage")) sharedMaxAge = parseDeltaSeconds(argument);
+  else if (name.equalsIgnoreCase("stale-while-revalidate")) {
+    staleWhileRevalidate = parseDeltaSeconds(argument);
+  } else if (name.equalsIgnoreCase("stale-if-error")) {
+    staleIfError = parseDeltaSeconds(argument);
+  }
+}
@@ -0,0 +1,58 @@
+/**
+ * File: cache-control.h
+ * ---------------------
+ * Defines the CacheControl class, which holds the directives of a
+ * Cache-Control header (RFC 9111, section 5.2), parsed once, so that
+ * deciding whether and for how long something can be cached never has to
+ * search the header text again.  The same class serves for requests and
+ * responses; directives that only make sense for one of them are simply
+ * never set for the other.
+ */
+
+#ifndef _cache_control_
+#define _cache_control_
+
+#include "string-view.h"
+
+class CacheControl {
+ public:
+
+/**
+ * The value of any delta-seconds directive that isn't present.
+ */
+  static const long kUnset = -1;
+
+/**
+ * Constructs the directives in the supplied header value, which may be
+ * the comma-joined values of several Cache-Control headers.  Unrecognized
+ * directives are ignored, as RFC 9111 requires.
+ */
+  CacheControl(const StringView& value = StringView());
+
+  bool hasNoStore() const { return noStore; }
+  bool hasNoCache() const { return noCache; }
+  bool hasPrivate() const { return isPrivate; }
+  bool hasPublic() const { return isPublic; }
+  bool hasMustRevalidate() const { return mustRevalidate; }
+  bool hasProxyRevalidate() const { return proxyRevalidate; }
+  long getMaxAge() const { return maxAge; }
+  long getSharedMaxAge() const { return sharedMaxAge; }
+  long getStaleWhileRevalidate() const { return staleWhileRevalidate; }
+  long getStaleIfError() const { return staleIfError; }
+
+ private:
+  bool noStore;
+  bool noCache;
+  bool isPrivate;
+  bool isPublic;
+  bool mustRevalidate;
+  bool proxyRevalidate;
+  long maxAge;
+  long sharedMaxAge;
+  long staleWhileRevalidate;
+  long staleIfError;
+
+  void parseDirective(const StringView& name, const StringView& argument);
+};
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * File: cache-key.cc
+ * ------------------
+ * Presents the implementation of the CacheKey class.  The digest is the
+ * 128-bit variant of SipHash-2-4, as given by its reference implementation.
+ * The secret's low half supplies the first eight bytes of the 16-byte
+ * SipHash key, and the digest's first eight bytes become the low half of
+ * the CacheKey.
+ */
+
+#include "cache-key.h"
+
+#include <cstring>
+
+using namespace std;
+
+static inline uint64_t rotateLeft(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t readLittleEndian(const unsigned char *bytes) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) value = (value << 8) | bytes[i];
+  return value;
+}
+
+static inline void writeLittleEndian(uint64_t value, char *bytes) {
+  for (int i = 0; i < 8; i++) bytes[i] = char(value >> (8 * i));
+}
+
+static inline void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+  v0 += v1; v1 = rotateLeft(v1, 13); v1 ^= v0; v0 = rotateLeft(v0, 32);
+  v2 += v3; v3 = rotateLeft(v3, 16); v3 ^= v2;
+  v0 += v3; v3 = rotateLeft(v3, 21); v3 ^= v0;
+  v2 += v1; v1 = rotateLeft(v1, 17); v1 ^= v2; v2 = rotateLeft(v2, 32);
+}
+
+CacheKey CacheKey::hash(const CacheKey& secret, const void *data, size_t length) {
+  uint64_t v0 = 0x736f6d6570736575ULL ^ secret.low;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ secret.high ^ 0xee;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ secret.low;
+  uint64_t v3 = 0x7465646279746573ULL ^ secret.high;
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  const unsigned char *end = bytes + (length & ~size_t(7));
+  for (; bytes < end; bytes += 8) {
+    uint64_t m = readLittleEndian(bytes);
+    v3 ^= m;
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+
+  uint64_t last = uint64_t(length) << 56;
+  for (size_t i = 0; i < (length & 7); i++) last |= uint64_t(bytes[i]) << (8 * i);
+  v3 ^= last;
+  sipRound(v0, v1, v2, v3);
+  sipRound(v0, v1, v2, v3);
+  v0 ^= last;
+
+  v2 ^= 0xee;
+  for (int i = 0; i < 4; i++) sipRound(v0, v1, v2, v3);
+  uint64_t first = v0 ^ v1 ^ v2 ^ v3;
+  v1 ^= 0xdd;
+  for (int i = 0; i < 4; i++) sipRound(v0, v1, v2, v3);
+  return CacheKey(v0 ^ v1 ^ v2 ^ v3, first);
+}
+
+CacheKey CacheKey::derive(const CacheKey& secret, const string& suffix) const {
+  string material(16, '\0');
+  writeLittleEndian(low, &material[0]);
+  writeLittleEndian(high, &material[8]);
+  material += suffix;
+  return hash(secret, material.data(), material.size());
+}
+
+string CacheKey::toString() const {
+  static const char kHexDigits[] = "0123456789abcdef";
+  string digits(32, '0');
+  for (int i = 0; i < 16; i++) {
+    digits[15 - i] = kHexDigits[(high >> (4 * i)) & 0xf];
+    digits[31 - i] = kHexDigits[(low >> (4 * i)) & 0xf];
+  }
+  return digits;
+}
@@ -0,0 +1,63 @@
+/**
+ * File: cache-key.h
+ * -----------------
+ * Defines the CacheKey class, the 128-bit key the cache files each
+ * response under.  Keys are SipHash-2-4 digests (in its 128-bit variant)
+ * keyed with a secret, so that nobody who doesn't know the secret can
+ * craft a request whose key collides with another's and have the wrong
+ * response served for it.  At 128 bits, accidental collisions aren't a
+ * practical concern either.
+ */
+
+#ifndef _http_cache_key_
+#define _http_cache_key_
+
+#include <cstddef>    // for size_t
+#include <cstdint>
+#include <functional> // for hash
+#include <string>
+
+class CacheKey {
+ public:
+  CacheKey() : high(0), low(0) {}
+  CacheKey(uint64_t high, uint64_t low) : high(high), low(low) {}
+
+/**
+ * Returns the SipHash-2-4-128 digest of the length bytes at data, keyed
+ * with secret.
+ */
+  static CacheKey hash(const CacheKey& secret, const void *data, size_t length);
+
+/**
+ * Returns the digest, keyed with secret, of the key's own 16 bytes followed
+ * by suffix, so that keys can be derived from this one without collision.
+ */
+  CacheKey derive(const CacheKey& secret, const std::string& suffix) const;
+
+  uint64_t getHigh() const { return high; }
+  uint64_t getLow() const { return low; }
+
+/**
+ * Returns the key as 32 hexadecimal digits.
+ */
+  std::string toString() const;
+
+  bool operator==(const CacheKey& other) const { return high == other.high && low == other.low; }
+  bool operator!=(const CacheKey& other) const { return !(*this == other); }
+
+ private:
+  uint64_t high;
+  uint64_t low;
+};
+
+/**
+ * Keys are already uniformly distributed, so either half of one makes for
+ * a perfectly good hash code.
+ */
+namespace std {
+  template <> struct hash<CacheKey> {
+    size_t operator()(const CacheKey& key) const { return key.getLow(); }
+  };
+}
+
+#endif
@@ -0,0 +1,111 @@
+/**
+ * File: cache-writer.cc
+ * ---------------------
+ * Presents the implementation of the HTTPCacheWriter class.
+ */
+
+#include "cache-writer.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+using namespace std;
+
+HTTPCacheWriter::HTTPCacheWriter(size_t numThreads, size_t maxQueuedBytes, size_t maxBatch,
+                                 const function<void(vector<write_t>&)>& store) :
+  maxQueuedBytes(maxQueuedBytes), maxBatch(maxBatch), store(store), queuedBytes(0) {
+  for (size_t i = 0; i < numThreads; i++) {
+    queues.push_back(unique_ptr<queue_t>(new queue_t));
+    queues.back()->stopping = false;
+  }
+  for (const unique_ptr<queue_t>& queue: queues) {
+    queue_t *q = queue.get();
+    q->writer = thread([this, q]() -> void { drain(*q); });
+  }
+}
+
+HTTPCacheWriter::~HTTPCacheWriter() {
+  for (const unique_ptr<queue_t>& queue: queues) {
+    {
+      lock_guard<mutex> lg(queue->lock);
+      queue->stopping = true;
+    }
+    queue->pending.notify_all();
+  }
+  for (const unique_ptr<queue_t>& queue: queues) {
+    queue->writer.join();
+  }
+}
+
+/**
+ * The bound isn't applied to a write that arrives while nothing else is
+ * queued, so that entries larger than the bound can still be stored.
+ */
+bool HTTPCacheWriter::submit(const write_t& write) {
+  size_t bytes = write.entry->serialized.size();
+  size_t previous = queuedBytes.fetch_add(bytes);
+  if (previous > 0 && previous + bytes > maxQueuedBytes) {
+    queuedBytes -= bytes;
+    return false;
+  }
+
+  queue_t& queue = *queues[write.primary.getHigh() % queues.size()];
+  {
+    lock_guard<mutex> lg(queue.lock);
+    queue.writes.push_back(write);
+  }
+  queue.pending.notify_one();
+  return true;
+}
+
+/** Private methods **/
+
+/**
+ * Hands the queued writes to store, a batch at a time, until the writer is
+ * stopped and the queue is empty.  The bytes a batch holds are only
+ * released once it's been stored, so the bound covers writes in flight too.
+ */
+void HTTPCacheWriter::drain(queue_t& queue) {
+  while (true) {
+    vector<write_t> batch;
+    {
+      unique_lock<mutex> ul(queue.lock);
+      queue.pending.wait(ul, [&queue]() { return queue.stopping || !queue.writes.empty(); });
+      if (queue.writes.empty()) return;
+      while (!queue.writes.empty() && batch.size() < maxBatch) {
+        batch.push_back(queue.writes.front());
+        queue.writes.pop_front();
+      }
+    }
+
+    size_t bytes = 0;
+    for (const write_t& write: batch) {
+      bytes += write.entry->serialized.size();
+    }
+    coalesce(batch);
+    store(batch);
+    queuedBytes -= bytes;
+  }
+}
+
+/**
+ * Drops every write in the batch that a later one under the same key
+ * supersedes, passing the fetch it was to end on to the later one.  What's
+ * left stays in the order it was queued.
+ */
+void HTTPCacheWriter::coalesce(vector<write_t>& batch) {
+  unordered_map<CacheKey, size_t> latest;
+  vector<write_t> coalesced;
+  for (size_t i = batch.size(); i-- > 0; ) {
+    auto found = latest.find(batch[i].key);
+    if (found == latest.end()) {
+      latest[batch[i].key] = coalesced.size();
+      coalesced.push_back(batch[i]);
+    } else if (batch[i].endingFetch) {
+      coalesced[found->second].endingFetch = true;
+    }
+  }
+
+  reverse(coalesced.begin(), coalesced.end());
+  batch.swap(coalesced);
+}
@@ -0,0 +1,91 @@
+/**
+ * File: cache-writer.h
+ * --------------------
+ * Defines the HTTPCacheWriter class, which stores cache entries behind the
+ * backs of the threads that fetched them, so that a miss costs the client
+ * no more than relaying the response does.  Entries are queued to a small
+ * number of writer threads, each of which drains its queue in batches and
+ * hands every batch to the cache to be stored in one go.  A request's
+ * entries always go to the same writer, so they're stored in the order
+ * they were queued.
+ *
+ * The queues are bounded by the bytes they hold.  Once the writers fall
+ * that far behind, entries are dropped rather than queued, since a cache
+ * that misses a little more often beats one that slows every miss down.
+ */
+
+#ifndef _http_cache_writer_
+#define _http_cache_writer_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>      // for size_t
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cache-key.h"
+#include "memory-cache.h"
+
+class HTTPCacheWriter {
+ public:
+
+/**
+ * An entry waiting to be stored under key.  primary is the key of the
+ * request it answers (which key is derived from, when the response
+ * varies on varyNames), and endingFetch says whether the fetch of that
+ * request is to be ended once the entry has been stored.
+ */
+  typedef struct {
+    CacheKey primary;
+    CacheKey key;
+    std::string varyNames;
+    std::shared_ptr<const HTTPMemoryCache::entry_t> entry;
+    bool endingFetch;
+  } write_t;
+
+/**
+ * Starts numThreads writer threads, which hand batches of at most
+ * maxBatch entries to store.  No more than maxQueuedBytes bytes of
+ * entries are ever waiting to be stored.
+ */
+  HTTPCacheWriter(size_t numThreads, size_t maxQueuedBytes, size_t maxBatch,
+                  const std::function<void(std::vector<write_t>&)>& store);
+
+/**
+ * Stores whatever's still queued, and stops the writer threads.
+ */
+  ~HTTPCacheWriter();
+
+/**
+ * Queues the write and returns true, or returns false if it's been
+ * dropped because the writers are too far behind.
+ */
+  bool submit(const write_t& write);
+
+ private:
+  typedef struct {
+    std::mutex lock;
+    std::condition_variable pending;
+    std::deque<write_t> writes;
+    bool stopping;
+    std::thread writer;
+  } queue_t;
+
+  size_t maxQueuedBytes;
+  size_t maxBatch;
+  std::function<void(std::vector<write_t>&)> store;
+  std::vector<std::unique_ptr<queue_t> > queues;
+  std::atomic<size_t> queuedBytes;
+
+  void drain(queue_t& queue);
+  static void coalesce(std::vector<write_t>& batch);
+
+  HTTPCacheWriter(const HTTPCacheWriter& original) = delete;
+  HTTPCacheWriter& operator=(const HTTPCacheWriter& rhs) = delete;
+};
+
+#endif
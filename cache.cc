@@ -6,190 +6,762 @@
  */
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <cerrno>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <functional>
+#include <random>
 #include <sys/stat.h>
-#include <sys/time.h>
-#include <sys/dir.h>
-//#include <dirent.h>
 
 #include "cache.h"
+#include "io-vector.h"
+#include "parser.h"
 #include "request.h"
 #include "response.h"
 #include "proxy-exception.h"
 #include "ostreamlock.h"
+#include "string-utils.h"
 
 #define MUTEX_NUM       997
 
 using namespace std;
 
 static const string kCacheSubdirectory = ".http-proxy-cache";
-HTTPCache::HTTPCache() {
+static const size_t kMemoryCacheCapacity = 64 << 20; // 64MB
+static const long kStaleRetention = 24 * 60 * 60;     // in seconds
+static const string kKeySecretFile = "key-secret";
+static const size_t kNumCacheWriters = 2;
+static const size_t kMaxQueuedBytes = 64 << 20;        // 64MB
+static const size_t kMaxWriteBatch = 64;
+HTTPCache::HTTPCache(EvictionPolicy::Kind policy, uint64_t maxBytes, uint64_t maxEntries,
+                     long staleGrace) :
+  staleGrace(staleGrace), memoryCache(kMemoryCacheCapacity) {
   string homeDirectoryEnv = getenv("HOME");
   cacheDirectory = homeDirectoryEnv + "/" + kCacheSubdirectory;
   ensureDirectoryExists(cacheDirectory);
+  loadKeySecret();
+  store.reset(new HTTPSegmentStore(cacheDirectory, policy, maxBytes, maxEntries,
+                                   max(kStaleRetention, staleGrace)));
   //initilize requestLock
   for(int i=0; i<MUTEX_NUM; i++)
     requestLocks[i].reset(new mutex);
+  writer.reset(new HTTPCacheWriter(kNumCacheWriters, kMaxQueuedBytes, kMaxWriteBatch,
+                                   [this](vector<HTTPCacheWriter::write_t>& batch) -> void {
+                                     storeEntries(batch);
+                                   }));
 }
 
+/**
+ * Applies the conditions RFC 9111 (section 3) places on what a shared
+ * cache may store, on top of those HTTPResponse::permitsCaching applies
+ * on its own: the client mustn't have asked that nothing be stored, and a
+ * response to a request carrying credentials is only stored if the origin
+ * says explicitly that sharing it is fine.  Nor is a response stored if
+ * it declares a payload too large to be retained while it's relayed.
+ */
 bool HTTPCache::shouldCache(const HTTPRequest& request, const HTTPResponse& response) const {
-  static const int kMinTTLForCache = 100; // in seconds (don't bother if it can't live for very long)
-  return
-    request.getMethod() == "GET" &&
-    response.getResponseCode() == 200 &&
-    response.permitsCaching() &&
-    response.getTTL() >= kMinTTLForCache;
+  if (request.getMethod() != "GET" || request.getCacheControl().hasNoStore()) return false;
+  size_t contentLength = response.getHeader().getValueAsNumber(HTTPHeader::kContentLength);
+  if (contentLength > HTTPPayload::kMaxRetainedSize) return false;
+  const CacheControl& cacheControl = response.getCacheControl();
+  if (request.getHeader().containsName(HTTPHeader::kAuthorization) &&
+      !cacheControl.hasPublic() && !cacheControl.hasMustRevalidate() &&
+      cacheControl.getSharedMaxAge() == CacheControl::kUnset) {
+    return false;
+  }
+
+  return response.permitsCaching();
 }
 
 bool HTTPCache::containsCacheEntry_r(const HTTPRequest& request, HTTPResponse& response) {
-  bool ret;
-  hash<string> hasher;
-  size_t hashValue = hasher(serializeRequest(request)) % MUTEX_NUM;
-  requestLocks[hashValue]->lock();
-  ret = containsCacheEntry(request, response);
-  requestLocks[hashValue]->unlock();
-  return ret;
-} 
-
-bool HTTPCache::containsCacheEntry(const HTTPRequest& request, HTTPResponse& response) const {
-  if (request.getMethod() != "GET") return false;
-  string requestHash = hashRequest(request);
-  bool exists = cacheEntryExists(requestHash);
-  if (!exists) return false;
-  string cachedFileName = getRequestHashCacheEntryName(requestHash);
-  if (cachedFileName.empty()) return false;
-  string fullCacheEntryName = cacheDirectory + "/" + requestHash + "/" + cachedFileName;
-  if (!cachedEntryIsValid(cachedFileName)) {
-    remove(fullCacheEntryName.c_str());
-    string fullCacheDirectoryName = cacheDirectory + "/" + requestHash;
-    unlink(fullCacheDirectoryName.c_str());
-    return false;
+  cached_payload_t payload;
+  if (!containsCacheEntry_r(request, response, payload)) return false;
+  if (payload.entry) {
+    istringstream payloadStream(payload.entry->serialized.substr(payload.offset));
+    return response.ingestPayload(payloadStream);
   }
 
-  ifstream instream(fullCacheEntryName.c_str(), ios::in | ios::binary);
-  try {
-    response.ingestResponseHeader(instream);
-    response.ingestPayload(instream);
-    cout << oslock << "     [Using cached copy of previous request for "
-	 << request.getURL() << ".]" << endl << osunlock;
+  string buffer(payload.length, '\0');
+  ssize_t count = pread(payload.fd, &buffer[0], buffer.size(), payload.offset);
+  close(payload.fd);
+  if (count != ssize_t(buffer.size())) return false;
+  istringstream payloadStream(buffer);
+  return response.ingestPayload(payloadStream);
+}
+
+/**
+ * Checks the memory tier before the store on disk, and without taking
+ * the lock that serializes access to the request's entry, since the
+ * memory tier's shards are locked on their own.  A memory hit is still
+ * reported to the store, so its eviction policy sees every hit.  The
+ * memory tier only ever holds fresh entries, so stale ones are always
+ * served from the store.
+ */
+bool HTTPCache::containsCacheEntry_r(const HTTPRequest& request, HTTPResponse& response,
+                                     cached_payload_t& payload) {
+  if (!permitsCachedResponse(request)) return false;
+  const CacheKey& primary = getPrimaryKey(request);
+  CacheKey key = resolveKey(primary, request);
+  if (containsMemoryEntry(key, request, response, payload)) {
+    store->touch(key);
     return true;
-  } catch (HTTPProxyException& hpe) {
-    cerr << oslock << "     [Problem rehydrating previously cached response for "
-	 << request.getURL() << ".]" << endl;
-    cerr << "     [Operating as if cached entry doesn't exist and forwarding request to origin server.]"
-	 << endl << osunlock;
+  }
+
+  bool stale;
+  {
+    lock_guard<mutex> lg(getRequestLock(primary));
+    if (!containsCacheEntry(key, request, response, payload, kWhileRevalidating, stale)) {
+      return false;
+    }
+  }
+
+  if (stale) scheduleRefresh(primary, request);
+  return true;
+}
+
+bool HTTPCache::containsStaleEntry_r(const HTTPRequest& request, HTTPResponse& response,
+                                     cached_payload_t& payload) {
+  if (!permitsCachedResponse(request)) return false;
+  const CacheKey& primary = getPrimaryKey(request);
+  lock_guard<mutex> lg(getRequestLock(primary));
+  bool stale;
+  return containsCacheEntry(resolveKey(primary, request), request, response, payload,
+                            kIfError, stale);
+}
+
+/**
+ * Looks the request up in the store.  Fresh entries small enough for the
+ * memory tier are read in whole, with a single pread, and promoted to it,
+ * and served from there.  A stale entry is only served if use permits it,
+ * which takes a look at its header first, and sets stale to true.
+ * Stale entries that can't be served are left in the store, so they can
+ * be revalidated.
+ */
+bool HTTPCache::containsCacheEntry(const CacheKey& key, const HTTPRequest& request,
+                                   HTTPResponse& response, cached_payload_t& payload,
+                                   StaleUse use, bool& stale) {
+  HTTPSegmentStore::location_t location;
+  if (!store->find(key, location)) return false;
+  stale = time(NULL) > location.expiration;
+  if (!stale && memoryCache.admits(location.length)) {
+    return promoteCacheEntry(key, location) &&
+      containsMemoryEntry(key, request, response, payload);
+  }
+
+  if (stale) {
+    HTTPResponse stored;
+    if (readCachedHeader(location, stored) == 0 ||
+        !permitsStaleResponse(stored, location.expiration, use)) {
+      return false;
+    }
+  }
+
+  if (!openCacheEntry(location, response, payload)) return false;
+  cout << oslock << "     [Using " << (stale ? "stale " : "")
+       << "cached copy of previous request for " << request.getURL() << ".]" << endl << osunlock;
+  return true;
+}
+
+/**
+ * A response may be served stale for as long as its stale-while-revalidate
+ * or stale-if-error directive says (RFC 5861), or for staleGrace seconds if
+ * it doesn't say, unless it insists on being revalidated once it's stale
+ * (RFC 9111, section 4.2.4).  An s-maxage implies as much, but an explicit
+ * window is taken to override it, as shared caches commonly do.  Nothing is
+ * served stale while revalidating unless there's a refresher to revalidate it.
+ */
+bool HTTPCache::permitsStaleResponse(const HTTPResponse& stored, time_t expiration,
+                                     StaleUse use) const {
+  if (use == kWhileRevalidating && !refresher) return false;
+  const CacheControl& cacheControl = stored.getCacheControl();
+  if (cacheControl.hasMustRevalidate() || cacheControl.hasProxyRevalidate() ||
+      cacheControl.hasNoCache()) {
+    return false;
+  }
+
+  long window = use == kWhileRevalidating ?
+    cacheControl.getStaleWhileRevalidate() : cacheControl.getStaleIfError();
+  if (window == CacheControl::kUnset) {
+    if (cacheControl.getSharedMaxAge() != CacheControl::kUnset) return false;
+    window = staleGrace;
+  }
+
+  return time(NULL) - expiration <= window;
+}
+
+/**
+ * Populates response and payload to serve the entry at location.  Small
+ * entries are read in whole, with a single pread, and served from memory
+ * (without being promoted, since the memory tier may not want them).
+ * Otherwise just enough of the entry is read to ingest the response header,
+ * and payload is left identifying where the payload lies in the segment, so
+ * it can be sent without ever being read into memory.
+ */
+bool HTTPCache::openCacheEntry(const HTTPSegmentStore::location_t& location,
+                               HTTPResponse& response, cached_payload_t& payload) const {
+  if (memoryCache.admits(location.length)) {
+    shared_ptr<HTTPMemoryCache::entry_t> entry = loadCacheEntry(location);
+    return entry && publishEntry(entry, response, payload);
+  }
+
+  int fd = store->duplicate(location);
+  if (fd < 0) return false;
+  size_t headerSize = readCachedHeader(location, response);
+  if (headerSize == 0) {
+    close(fd);
     return false;
   }
+
+  response.setAge(max<long>(0, time(NULL) - location.generated));
+  payload.fd = fd;
+  payload.offset = location.offset + headerSize;
+  payload.length = location.length - headerSize;
+  return true;
 }
 
 void HTTPCache::cacheEntry_r(const HTTPRequest& request, const HTTPResponse& response) {
-  hash<string> hasher;
-  size_t hashValue = hasher(serializeRequest(request)) % MUTEX_NUM;
-  requestLocks[hashValue]->lock();
-  cacheEntry(request, response);
-  requestLocks[hashValue]->unlock();
+  vector<HTTPCacheWriter::write_t> batch(1, prepareEntry(request, response));
+  storeEntries(batch);
+}
+
+void HTTPCache::cacheEntryBehind_r(const HTTPRequest& request, const HTTPResponse& response,
+                                   bool endingFetch) {
+  HTTPCacheWriter::write_t write = prepareEntry(request, response);
+  write.endingFetch = endingFetch;
+  if (writer->submit(write)) return;
+  cout << oslock << "     [Cache writers are behind, so not caching response to "
+       << request.getURL() << " after all.]" << endl << osunlock;
+  if (endingFetch) endFetch(write.primary);
+}
+
+/**
+ * Only the client's own requests are left alone, since a 304 in response
+ * to one of those is meant for the client, not the cache.
+ */
+bool HTTPCache::addValidators_r(HTTPRequest& request) {
+  if (!permitsCachedResponse(request) || request.isConditional()) return false;
+  const CacheKey& primary = getPrimaryKey(request);
+  lock_guard<mutex> lg(getRequestLock(primary));
+  HTTPSegmentStore::location_t location;
+  HTTPResponse stored;
+  if (!store->peek(resolveKey(primary, request), location) || readCachedHeader(location, stored) == 0) return false;
+  string etag = stored.getHeader().getValueAsString(HTTPHeader::kETag).toString();
+  string lastModified = stored.getHeader().getValueAsString(HTTPHeader::kLastModified).toString();
+  if (etag.empty() && lastModified.empty()) return false;
+  request.setValidators(etag, lastModified);
+  cout << oslock << "     [Revalidating stale cached copy of " << request.getURL()
+       << ".]" << endl << osunlock;
+  return true;
 }
 
-void HTTPCache::cacheEntry(const HTTPRequest& request, const HTTPResponse& response) {
-  string requestHash = hashRequest(request);
-  cout << oslock << "     [Okay to cache response, so caching response under hash of "
-       << requestHash << " for next " << response.getTTL() << " seconds.]" << endl << osunlock;
-  ensureDirectoryExists(cacheDirectory + "/" + requestHash, /* empty = */ true);
-  string cacheEntryName = cacheDirectory + "/" + requestHash + "/" + getExpirationTime(response.getTTL());
-  ofstream outfile(cacheEntryName.c_str(), ios::out | ios::binary);
-  outfile << response;
-  outfile.flush();
+/**
+ * The store never rewrites a record, so the stored payload is read back in
+ * and appended again behind the refreshed header, which costs a local copy
+ * rather than another trip to the origin.  A refreshed response that may
+ * no longer be stored is still served, just the once.
+ */
+bool HTTPCache::refreshCacheEntry_r(const HTTPRequest& request, const HTTPResponse& notModified,
+                                    HTTPResponse& response, cached_payload_t& payload) {
+  const CacheKey& primary = getPrimaryKey(request);
+  lock_guard<mutex> lg(getRequestLock(primary));
+  CacheKey key = resolveKey(primary, request);
+  HTTPSegmentStore::location_t location;
+  string stored;
+  if (!store->peek(key, location) || !readCacheEntry(location, stored)) return false;
+  size_t headerEnd = stored.find("\r\n\r\n");
+  if (headerEnd == string::npos) return false;
+
+  HTTPResponse refreshed;
+  istringstream headerStream(stored.substr(0, headerEnd + 4));
+  refreshed.ingestResponseHeader(headerStream);
+  refreshed.refresh(notModified);
+  shared_ptr<HTTPMemoryCache::entry_t> entry(new HTTPMemoryCache::entry_t);
+  IOVector iov;
+  refreshed.serialize(iov, /* includePayload = */ false);
+  iov.appendTo(entry->serialized);
+  entry->payloadOffset = entry->serialized.size();
+  entry->serialized.append(stored, headerEnd + 4, string::npos);
+  entry->generated = time(NULL) - refreshed.getCurrentAge();
+  entry->expiration = entry->generated + refreshed.getFreshnessLifetime();
+  if (shouldCache(request, refreshed)) {
+    cout << oslock << "     [Origin says cached copy of " << request.getURL()
+         << " is still good, so keeping it for next " << refreshed.getTTL() << " seconds.]"
+         << endl << osunlock;
+    storeEntry(key, entry);
+  } else {
+    store->remove(key);
+    memoryCache.remove(key);
+  }
+
+  return publishEntry(entry, response, payload);
+}
+
+/**
+ * There's a narrow window in which a request that just missed calls in
+ * after the fetch it could have waited on has ended, and so becomes a
+ * fetcher itself even though its response is now cached.  That costs one
+ * redundant fetch, which is all it would have cost without collapsing.
+ */
+HTTPCache::FetchRole HTTPCache::beginFetch_r(const HTTPRequest& request,
+                                             const function<void(void)>& onFetched) {
+  if (!permitsCachedResponse(request)) return kUncollapsed;
+  const CacheKey& primary = getPrimaryKey(request);
+  lock_guard<mutex> lg(fetchesLock);
+  auto found = fetches.find(primary);
+  if (found == fetches.end()) {
+    fetches[primary];
+    return kFetching;
+  }
+
+  found->second.push_back(onFetched);
+  cout << oslock << "     [Waiting on the fetch of " << request.getURL()
+       << " already in flight.]" << endl << osunlock;
+  return kWaiting;
 }
 
-string HTTPCache::hashRequest(const HTTPRequest& request) const {
-  hash<string> hasher;
-  ostringstream oss;
-  size_t hashValue = hasher(serializeRequest(request));
-  oss << hashValue;
-  return oss.str();
+void HTTPCache::setRefresher(const function<void(const HTTPRequest&)>& refresher) {
+  this->refresher = refresher;
 }
 
-string HTTPCache::serializeRequest(const HTTPRequest& request) const {
-  ostringstream oss;
-  oss << request;
-  return oss.str();
+void HTTPCache::endFetch_r(const HTTPRequest& request) {
+  endFetch(getPrimaryKey(request));
 }
 
-bool HTTPCache::cacheEntryExists(const string& requestHash) const {
-  string path = cacheDirectory + "/" + requestHash;
-  struct stat st;
-  if (lstat(path.c_str(), &st) != 0) return false;
-  if (!S_ISDIR(st.st_mode)) return false;
-
-  DIR *dir = opendir(path.c_str());
-  bool exists = false;
-  struct dirent entry, *result;
-  int ret;
-  for(ret = readdir_r(dir, &entry, &result); 
-    ret == 0 && result != NULL; 
-    ret = readdir_r(dir, &entry, &result)){
-    string dirEntry = entry.d_name;
-    exists = dirEntry != "." && dirEntry != "..";
-  }
-
-  closedir(dir);
-  return exists;
-}
-
-string HTTPCache::getRequestHashCacheEntryName(const string& requestHash) const {
-  string requestHashDirectory = cacheDirectory + "/" + requestHash;
-  DIR *dir = opendir(requestHashDirectory.c_str());
-  if (dir == NULL) return "";
-  string cachedEntryName;
-  struct dirent entry, *result;
-  int ret;
-  for(ret = readdir_r(dir, &entry, &result); 
-    ret == 0 && result != NULL; 
-    ret = readdir_r(dir, &entry, &result)){
-    cachedEntryName = entry.d_name;
-    if (cachedEntryName != "." && cachedEntryName != "..") break;
-  }
-  closedir(dir);
-  if (cachedEntryName == ".." || cachedEntryName == ".") return "";
-  return cachedEntryName;
+/**
+ * Serializes the response just once, into an entry that's stored as is,
+ * under the key the request selects.  A response that varies on some of
+ * the request headers (RFC 9111, section 4.1) is filed under a variant
+ * key, derived from the values the request supplies for them.
+ */
+HTTPCacheWriter::write_t HTTPCache::prepareEntry(const HTTPRequest& request,
+                                                 const HTTPResponse& response) const {
+  HTTPCacheWriter::write_t write;
+  write.primary = getPrimaryKey(request);
+  write.varyNames = response.getVaryNames();
+  write.key = write.varyNames.empty() ?
+    write.primary : getVariantKey(write.primary, write.varyNames, request);
+  write.endingFetch = false;
+  cout << oslock << "     [Okay to cache response, so caching response under key "
+       << write.key.toString() << " for next " << response.getTTL() << " seconds.]"
+       << endl << osunlock;
+  shared_ptr<HTTPMemoryCache::entry_t> entry(new HTTPMemoryCache::entry_t);
+  IOVector iov;
+  response.serialize(iov);
+  iov.appendTo(entry->serialized);
+  entry->payloadOffset = entry->serialized.find("\r\n\r\n") + 4;
+  entry->generated = time(NULL) - response.getCurrentAge();
+  entry->expiration = entry->generated + response.getFreshnessLifetime();
+  write.entry = entry;
+  return write;
 }
 
-static const int kDefaultPermissions = 0755;
-void HTTPCache::ensureDirectoryExists(const string& directory, bool empty) const {
-  struct stat st;
-  if (lstat(directory.c_str(), &st) != 0){
-    mkdir(directory.c_str(), kDefaultPermissions);
+/**
+ * Stores a batch of entries with a single append to the store, and then
+ * hands them to the memory tier and ends whatever fetches they end.  When
+ * a response varies, the names of the headers it varies on are recorded
+ * under a key of their own, so that later requests can derive their
+ * variant keys, and whatever was filed under the primary key is dropped.
+ * When it doesn't, any record of an earlier response's Vary is dropped
+ * instead, which orphans the old variants until they're evicted.
+ */
+void HTTPCache::storeEntries(vector<HTTPCacheWriter::write_t>& batch) {
+  vector<CacheKey> keys;
+  vector<shared_ptr<const HTTPMemoryCache::entry_t> > entries;
+  for (const HTTPCacheWriter::write_t& write: batch) {
+    lock_guard<mutex> lg(getRequestLock(write.primary));
+    if (write.varyNames.empty()) {
+      CacheKey varyKey = getVaryKey(write.primary);
+      store->remove(varyKey);
+      memoryCache.remove(varyKey);
+    } else {
+      store->remove(write.primary);
+      memoryCache.remove(write.primary);
+      shared_ptr<const HTTPMemoryCache::entry_t> record =
+        makeVaryRecord(write.primary, write.varyNames, write.entry->expiration);
+      if (record) {
+        keys.push_back(getVaryKey(write.primary));
+        entries.push_back(record);
+      }
+    }
+
+    keys.push_back(write.key);
+    entries.push_back(write.entry);
+  }
+
+  vector<HTTPSegmentStore::pending_t> pending;
+  for (size_t i = 0; i < keys.size(); i++) {
+    pending.push_back({keys[i], &entries[i]->serialized, entries[i]->expiration,
+                       entries[i]->generated, false});
+  }
+  store->append(pending);
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (pending[i].appended) {
+      memoryCache.insert(keys[i], entries[i]);
+    } else {
+      memoryCache.remove(keys[i]);
+    }
+  }
+
+  for (const HTTPCacheWriter::write_t& write: batch) {
+    if (write.endingFetch) endFetch(write.primary);
+  }
+}
+
+void HTTPCache::endFetch(const CacheKey& primary) {
+  vector<function<void(void)> > waiters;
+  {
+    lock_guard<mutex> lg(fetchesLock);
+    auto found = fetches.find(primary);
+    if (found == fetches.end()) return;
+    waiters.swap(found->second);
+    fetches.erase(found);
+  }
+
+  for (const function<void(void)>& onFetched: waiters) {
+    onFetched();
   }
+}
 
-  if (!empty) return;
-  DIR *dir = opendir(directory.c_str());
-  struct dirent entry, *result;
-  int ret;
-  for(ret = readdir_r(dir, &entry, &result); 
-    ret == 0 && result != NULL; 
-    ret = readdir_r(dir, &entry, &result)){
-    string dirEntry = entry.d_name;
-    if (dirEntry != "." && dirEntry != "..")
-      remove(dirEntry.c_str());
+/**
+ * Appends the entry to the store and then hands it to the memory tier,
+ * which keeps it if it's small enough (and otherwise drops whatever older
+ * response it may have held for the same request).  An entry the store's
+ * eviction policy turns away isn't kept in memory either.
+ */
+void HTTPCache::storeEntry(const CacheKey& key,
+                           const shared_ptr<const HTTPMemoryCache::entry_t>& entry) {
+  if (store->append(key, entry->serialized, entry->expiration, entry->generated)) {
+    memoryCache.insert(key, entry);
+  } else {
+    memoryCache.remove(key);
   }
-  closedir(dir);
 }
 
-string HTTPCache::getExpirationTime(int ttl) const {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  if (ttl > 0) tv.tv_sec += ttl;
-  ostringstream oss;
-  oss << tv.tv_sec;
-  return oss.str();
+/**
+ * Serves the request from the memory tier if it holds a fresh response
+ * for it.  The header is parsed straight out of the entry, and the payload
+ * is left in the entry, which payload holds on to until it's been sent.
+ */
+bool HTTPCache::containsMemoryEntry(const CacheKey& key, const HTTPRequest& request,
+                                    HTTPResponse& response, cached_payload_t& payload) {
+  shared_ptr<const HTTPMemoryCache::entry_t> entry = memoryCache.find(key);
+  if (!entry) return false;
+  if (!publishEntry(entry, response, payload)) {
+    memoryCache.remove(key);
+    return false;
+  }
+
+  cout << oslock << "     [Using cached copy of previous request for "
+       << request.getURL() << ".]" << endl << osunlock;
+  return true;
 }
 
-bool HTTPCache::cachedEntryIsValid(const string& cachedFileName) const {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  time_t expirationTime = strtol(cachedFileName.c_str(), NULL, 0);
-  return tv.tv_sec <= expirationTime;
+/**
+ * Parses the entry's header into response, and leaves its payload in the
+ * entry, which payload holds on to until it's been sent.  Returns false if
+ * the entry doesn't look like a cached response.
+ */
+bool HTTPCache::publishEntry(const shared_ptr<const HTTPMemoryCache::entry_t>& entry,
+                             HTTPResponse& response, cached_payload_t& payload) const {
+  HTTPParser parser(HTTPParser::kResponse, entry->payloadOffset);
+  if (parser.parse(entry->serialized.data(), entry->payloadOffset) != HTTPParser::kComplete) {
+    return false;
+  }
+
+  response.ingestResponseHeader(parser);
+  response.setAge(max<long>(0, time(NULL) - entry->generated));
+  payload.fd = -1;
+  payload.entry = entry;
+  payload.offset = entry->payloadOffset;
+  payload.length = entry->serialized.size() - entry->payloadOffset;
+  return true;
+}
+
+/**
+ * Hands the request to the refresher unless its entry is already being
+ * fetched, claiming the fetch on its behalf, so that whoever misses on the
+ * entry in the meantime waits on the refresh rather than going to the
+ * origin as well.
+ */
+void HTTPCache::scheduleRefresh(const CacheKey& primary, const HTTPRequest& request) {
+  {
+    lock_guard<mutex> lg(fetchesLock);
+    if (fetches.count(primary) > 0) return;
+    fetches[primary];
+  }
+
+  cout << oslock << "     [Refreshing stale cached copy of " << request.getURL()
+       << " in the background.]" << endl << osunlock;
+  refresher(request);
+}
+
+/**
+ * Reads the entry at location in its entirety and hands it to the memory
+ * tier, so later hits needn't touch the disk.  Returns false if it couldn't
+ * be read or doesn't look like a cached response.
+ */
+bool HTTPCache::promoteCacheEntry(const CacheKey& key,
+                                  const HTTPSegmentStore::location_t& location) {
+  shared_ptr<HTTPMemoryCache::entry_t> entry = loadCacheEntry(location);
+  return entry && memoryCache.insert(key, entry);
+}
+
+/**
+ * Reads the entry at location in its entirety into a memory tier entry,
+ * or returns an empty pointer if it couldn't be read or doesn't look like
+ * a cached response.
+ */
+shared_ptr<HTTPMemoryCache::entry_t>
+HTTPCache::loadCacheEntry(const HTTPSegmentStore::location_t& location) const {
+  shared_ptr<HTTPMemoryCache::entry_t> entry(new HTTPMemoryCache::entry_t);
+  if (!readCacheEntry(location, entry->serialized)) return shared_ptr<HTTPMemoryCache::entry_t>();
+  size_t headerEnd = entry->serialized.find("\r\n\r\n");
+  if (headerEnd == string::npos) return shared_ptr<HTTPMemoryCache::entry_t>();
+  entry->payloadOffset = headerEnd + 4;
+  entry->expiration = location.expiration;
+  entry->generated = location.generated;
+  return entry;
+}
+
+bool HTTPCache::readCacheEntry(const HTTPSegmentStore::location_t& location, string& data) const {
+  data.resize(location.length);
+  size_t total = 0;
+  while (total < location.length) {
+    ssize_t count = store->read(location, &data[total], location.length - total, total);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return false;
+    total += count;
+  }
+
+  return true;
+}
+
+/**
+ * Reads just enough of the entry at location to ingest its header into
+ * response, and returns the size of the header, or 0 if it couldn't be
+ * read.
+ */
+static const size_t kMaxCachedHeaderSize = 64 * 1024;
+size_t HTTPCache::readCachedHeader(const HTTPSegmentStore::location_t& location,
+                                   HTTPResponse& response) const {
+  string header(min<size_t>(kMaxCachedHeaderSize, location.length), '\0');
+  ssize_t count = store->read(location, &header[0], header.size());
+  size_t headerEnd = count > 0 ? header.find("\r\n\r\n") : string::npos;
+  if (headerEnd == string::npos || headerEnd + 4 > size_t(count)) return 0;
+  header.resize(headerEnd + 4);
+  istringstream headerStream(header);
+  response.ingestResponseHeader(headerStream);
+  return header.size();
+}
+
+bool HTTPCache::permitsCachedResponse(const HTTPRequest& request) const {
+  return request.getMethod() == "GET" && request.permitsCachedResponse();
+}
+
+static int hexValue(char ch) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+  return -1;
+}
+
+static bool isUnreserved(char ch) {
+  return isalnum(static_cast<unsigned char>(ch)) || ch == '-' || ch == '.' || ch == '_' ||
+    ch == '~';
+}
+
+/**
+ * Returns the target the request names as "host:port/path", where the host
+ * is lowercased, an empty path is taken to be "/", and percent-encodings
+ * are normalized as RFC 3986 (section 6.2.2) has it: the hex digits are
+ * uppercased, and unreserved characters are decoded, since encoding them
+ * doesn't change what's named.
+ */
+static string normalizeTarget(const HTTPRequest& request) {
+  static const char kHexDigits[] = "0123456789ABCDEF";
+  string target = toLowerCase(request.getServer()) + ":" + to_string(request.getPort());
+  const string& path = request.getPath();
+  if (path.empty()) target += '/';
+  for (size_t i = 0; i < path.size(); i++) {
+    int high, low;
+    if (path[i] != '%' || i + 2 >= path.size() ||
+        (high = hexValue(path[i + 1])) < 0 || (low = hexValue(path[i + 2])) < 0) {
+      target += path[i];
+      continue;
+    }
+
+    char decoded = char(high * 16 + low);
+    if (isUnreserved(decoded)) {
+      target += decoded;
+    } else {
+      target += '%';
+      target += kHexDigits[high];
+      target += kHexDigits[low];
+    }
+    i += 2;
+  }
+
+  return target;
+}
+
+/**
+ * The primary key covers the method and the target the request names, in
+ * a normal form (see normalizeTarget), and nothing else: the headers the
+ * client happens to send (and the X-Forwarded-For the proxy adds) don't
+ * bear on which response it's after, except for those the response says
+ * it varies on, which are left to variant keys (see getVariantKey).
+ */
+const CacheKey& HTTPCache::getPrimaryKey(const HTTPRequest& request) const {
+  if (!request.hasCacheKey()) {
+    string target = request.getMethod() + " " + normalizeTarget(request);
+    request.rememberCacheKey(CacheKey::hash(keySecret, target.data(), target.size()));
+  }
+
+  return request.getCacheKey();
+}
+
+/**
+ * Returns the key under which the names of the request headers that the
+ * response filed under primary varies on are recorded.
+ */
+CacheKey HTTPCache::getVaryKey(const CacheKey& primary) const {
+  return primary.derive(keySecret, "vary");
+}
+
+/**
+ * Derives the key for the variant the request selects, from the value it
+ * supplies for each of varyNames (as given by HTTPResponse::getVaryNames).
+ * Leading and trailing whitespace is insignificant, and a header that's
+ * absent is told apart from one that's empty.
+ */
+CacheKey HTTPCache::getVariantKey(const CacheKey& primary, const string& varyNames,
+                                  const HTTPRequest& request) const {
+  string material = varyNames + "\n";
+  string name;
+  for (size_t start = 0; start < varyNames.size(); start += name.size() + 1) {
+    size_t comma = varyNames.find(',', start);
+    name.assign(varyNames, start, comma == string::npos ? string::npos : comma - start);
+    material += name;
+    if (request.getHeader().containsName(name)) {
+      material += ':';
+      material += StringView(request.getHeader().getValuesAsString(name)).trim().toString();
+    }
+    material += '\n';
+  }
+
+  return primary.derive(keySecret, material);
+}
+
+/**
+ * Returns the key the request's response is filed under: its variant key,
+ * if responses to it vary, and otherwise its primary key.
+ */
+CacheKey HTTPCache::resolveKey(const CacheKey& primary, const HTTPRequest& request) {
+  string varyNames;
+  return findVaryNames(primary, varyNames) ?
+    getVariantKey(primary, varyNames, request) : primary;
+}
+
+/**
+ * Looks up the names of the headers the response filed under primary
+ * varies on, in the memory tier and then in the store, and returns false
+ * if none are recorded.  The record is held in the memory tier (with
+ * its payload empty) once it's been read, and hits are reported to the
+ * store, just like those on any other entry, so that it's evicted no
+ * sooner than the variants that depend on it.
+ */
+bool HTTPCache::findVaryNames(const CacheKey& primary, string& varyNames) {
+  CacheKey varyKey = getVaryKey(primary);
+  shared_ptr<const HTTPMemoryCache::entry_t> cached = memoryCache.find(varyKey);
+  if (!cached) {
+    HTTPSegmentStore::location_t location;
+    shared_ptr<HTTPMemoryCache::entry_t> entry(new HTTPMemoryCache::entry_t);
+    if (!store->peek(varyKey, location) || !readCacheEntry(location, entry->serialized)) {
+      return false;
+    }
+
+    entry->payloadOffset = entry->serialized.size();
+    entry->expiration = location.expiration;
+    entry->generated = location.generated;
+    memoryCache.insert(varyKey, entry);
+    cached = entry;
+  }
+
+  store->touch(varyKey);
+  varyNames = cached->serialized;
+  return true;
+}
+
+/**
+ * Returns the record of varyNames for the response filed under primary,
+ * which is kept for as long as a variant that expires at expiration is
+ * kept, stale or not.  The store never rewrites a record, so an empty
+ * pointer is returned instead unless the record is missing, names
+ * different headers, or would expire sooner.
+ */
+shared_ptr<const HTTPMemoryCache::entry_t>
+HTTPCache::makeVaryRecord(const CacheKey& primary, const string& varyNames, time_t expiration) {
+  CacheKey varyKey = getVaryKey(primary);
+  expiration += max(kStaleRetention, staleGrace);
+  HTTPSegmentStore::location_t location;
+  string recorded;
+  if (store->peek(varyKey, location) && location.expiration >= expiration &&
+      readCacheEntry(location, recorded) && recorded == varyNames) {
+    return shared_ptr<const HTTPMemoryCache::entry_t>();
+  }
+
+  shared_ptr<HTTPMemoryCache::entry_t> entry(new HTTPMemoryCache::entry_t);
+  entry->serialized = varyNames;
+  entry->payloadOffset = varyNames.size();
+  entry->expiration = expiration;
+  entry->generated = time(NULL);
+  return entry;
+}
+
+/**
+ * All variants of a response share the lock of its primary key, since
+ * which of them a request selects can change whenever the response is
+ * cached again.
+ */
+mutex& HTTPCache::getRequestLock(const CacheKey& primary) {
+  return *requestLocks[primary.getLow() % MUTEX_NUM];
+}
+
+/**
+ * Loads the secret the cache keys are hashed with from the cache directory,
+ * generating one (and saving it, readable by the owner alone) the first time
+ * the cache is used.  Entries filed under another secret can't be found, so
+ * a cache that loses its secret just starts over.
+ */
+void HTTPCache::loadKeySecret() {
+  string path = cacheDirectory + "/" + kKeySecretFile;
+  uint64_t halves[2];
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    ssize_t count = read(fd, halves, sizeof(halves));
+    close(fd);
+    if (count == ssize_t(sizeof(halves))) {
+      keySecret = CacheKey(halves[0], halves[1]);
+      return;
+    }
+  }
+
+  random_device device;
+  for (uint64_t& half: halves) half = (uint64_t(device()) << 32) | device();
+  keySecret = CacheKey(halves[0], halves[1]);
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) return;
+  if (write(fd, halves, sizeof(halves)) != ssize_t(sizeof(halves))) unlink(path.c_str());
+  close(fd);
+}
+
+static const int kDefaultPermissions = 0755;
+void HTTPCache::ensureDirectoryExists(const string& directory) const {
+  struct stat st;
+  if (lstat(directory.c_str(), &st) != 0){
+    mkdir(directory.c_str(), kDefaultPermissions);
+  }
 }
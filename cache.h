@@ -8,10 +8,19 @@
 #ifndef _http_cache_
 #define _http_cache_
 
+#include <functional>
 #include <string>
 #include <memory>
+#include <unordered_map>
+#include <sys/types.h>  // for off_t
 #include <map>
 #include <mutex>
+#include <vector>
+#include "cache-key.h"
+#include "cache-writer.h"
+#include "eviction-policy.h"
+#include "memory-cache.h"
+#include "segment-store.h"
 #include "request.h"
 #include "response.h"
 
@@ -19,28 +28,165 @@ class HTTPCache {
  public:
 
 /**
- * Constructs the HTTPCache object.
+ * Constructs the HTTPCache object, which keeps no more than maxBytes
+ * bytes and maxEntries entries on disk, choosing what to keep with the
+ * specified eviction policy.  Responses that don't say for how long they
+ * may be served stale (with stale-while-revalidate or stale-if-error) may
+ * be for staleGrace seconds.
  */
 
-  HTTPCache();
+  HTTPCache(EvictionPolicy::Kind policy, uint64_t maxBytes, uint64_t maxEntries,
+            long staleGrace = 0);
 
+/**
+ * Identifies the stretch of a segment file that holds a cached
+ * response's payload, so that it can be published with sendfile rather
+ * than being read in and serialized all over again.  Whoever receives
+ * one is responsible for closing fd.  When the response was found in the
+ * memory tier, fd is -1 and the payload is instead the stretch of entry's
+ * serialized response, which entry keeps alive until it's released.
+ */
+  typedef struct {
+    int fd;
+    off_t offset;
+    size_t length;
+    std::shared_ptr<const HTTPMemoryCache::entry_t> entry;
+  } cached_payload_t;
+
+/**
+ * Populates response with the cached response to request and returns
+ * true, or returns false if there isn't one that can be served.  A stale
+ * response is served if it's still within its stale-while-revalidate
+ * window, in which case it's handed to the refresher (see setRefresher)
+ * to be refreshed in the background.
+ */
   bool containsCacheEntry_r(const HTTPRequest& request, HTTPResponse& response);
+
+/**
+ * Like the two-argument version, except that only the cached response's
+ * header is ingested into response.  On success, payload identifies the
+ * open segment file and where within it the payload can be found.
+ */
+  bool containsCacheEntry_r(const HTTPRequest& request, HTTPResponse& response,
+                            cached_payload_t& payload);
+
+/**
+ * Like containsCacheEntry_r, except that the response is served if it's
+ * within its stale-if-error window instead, for when the origin can't be
+ * reached or reports that it failed (see HTTPResponse::reportsOriginFailure).
+ */
+  bool containsStaleEntry_r(const HTTPRequest& request, HTTPResponse& response,
+                            cached_payload_t& payload);
   bool shouldCache(const HTTPRequest& request, const HTTPResponse& response) const;
   void cacheEntry_r(const HTTPRequest& request, const HTTPResponse& response);
 
+/**
+ * Like cacheEntry_r, except that the response is only serialized on the
+ * calling thread, and is stored later on by a writer thread (see
+ * HTTPCacheWriter), so the caller needn't wait on the disk.  A caller that
+ * is the request's fetcher (see beginFetch_r) passes true for endingFetch,
+ * and leaves it to the cache to end the fetch once the response has been
+ * stored, so that whoever's waiting on the fetch finds it there.  Should the
+ * writers be too far behind, the response isn't cached at all.
+ */
+  void cacheEntryBehind_r(const HTTPRequest& request, const HTTPResponse& response,
+                          bool endingFetch);
+
+/**
+ * Stale entries that can't be served are still kept for a while, so they
+ * can be revalidated rather than fetched all over again.  If the request has
+ * a stale entry with validators (ETag or Last-Modified), addValidators_r
+ * makes the request conditional on it having changed and returns true,
+ * unless the client made the request conditional itself.  Should the
+ * origin answer 304 (Not Modified), refreshCacheEntry_r freshens the
+ * entry with it and, just like containsCacheEntry_r, populates response
+ * and payload to serve the entry.  It returns false if the entry has
+ * vanished in the meantime, in which case the request should be sent
+ * again without the validators.
+ */
+  bool addValidators_r(HTTPRequest& request);
+  bool refreshCacheEntry_r(const HTTPRequest& request, const HTTPResponse& notModified,
+                           HTTPResponse& response, cached_payload_t& payload);
+
+/**
+ * Collapses concurrent misses on the same request into a single fetch
+ * from the origin.  The first to call beginFetch_r for a request that the
+ * cache could answer becomes its fetcher (kFetching), and must call
+ * endFetch_r once the response has been cached, or as soon as it's clear
+ * that it won't be.  Whoever calls while that fetch is in flight gets
+ * kWaiting instead, and onFetched is invoked (on whichever thread calls
+ * endFetch_r) once it's over, at which point the cache is worth checking
+ * again.  Requests the cache could never answer get kUncollapsed, and
+ * should go straight to the origin.
+ */
+  enum FetchRole { kUncollapsed, kFetching, kWaiting };
+  FetchRole beginFetch_r(const HTTPRequest& request, const std::function<void(void)>& onFetched);
+  void endFetch_r(const HTTPRequest& request);
+
+/**
+ * Installs the function stale entries are handed to for refreshing.  It's
+ * invoked on the thread that served the entry, so it should do no more
+ * than schedule the refresh, and it's only invoked if the entry isn't
+ * already being fetched, in which case the fetch is claimed on its behalf
+ * (just as with beginFetch_r), so endFetch_r must be called once the
+ * refresh is over.  Nothing is served stale while revalidating until a
+ * refresher is installed.
+ */
+  void setRefresher(const std::function<void(const HTTPRequest&)>& refresher);
+
+/**
+ * Returns the hit and miss counters of the eviction policy, and of the
+ * policies shadowing it.
+ */
+  std::vector<HTTPSegmentStore::stats_t> getStats() const { return store->getStats(); }
+
  private:
-  std::string hashRequest(const HTTPRequest& request) const;
-  std::string serializeRequest(const HTTPRequest& request) const;
-  bool cacheEntryExists(const std::string& filename) const;
-  std::string getRequestHashCacheEntryName(const std::string& requestHash) const;
-  void ensureDirectoryExists(const std::string& directory, bool empty = false) const;
-  std::string getExpirationTime(int ttl) const;
-  bool cachedEntryIsValid(const std::string& cachedFileName) const;
-  bool containsCacheEntry(const HTTPRequest& request, HTTPResponse& response) const;
-  void cacheEntry(const HTTPRequest& request, const HTTPResponse& response);
+  bool permitsCachedResponse(const HTTPRequest& request) const;
+  void ensureDirectoryExists(const std::string& directory) const;
+  void loadKeySecret();
+  const CacheKey& getPrimaryKey(const HTTPRequest& request) const;
+  CacheKey getVaryKey(const CacheKey& primary) const;
+  CacheKey getVariantKey(const CacheKey& primary, const std::string& varyNames,
+                         const HTTPRequest& request) const;
+  CacheKey resolveKey(const CacheKey& primary, const HTTPRequest& request);
+  bool findVaryNames(const CacheKey& primary, std::string& varyNames);
+  std::shared_ptr<const HTTPMemoryCache::entry_t>
+    makeVaryRecord(const CacheKey& primary, const std::string& varyNames, time_t expiration);
+  std::mutex& getRequestLock(const CacheKey& primary);
+  enum StaleUse { kWhileRevalidating, kIfError };
+  bool containsCacheEntry(const CacheKey& key, const HTTPRequest& request,
+                          HTTPResponse& response, cached_payload_t& payload,
+                          StaleUse use, bool& stale);
+  bool permitsStaleResponse(const HTTPResponse& stored, time_t expiration, StaleUse use) const;
+  bool openCacheEntry(const HTTPSegmentStore::location_t& location,
+                      HTTPResponse& response, cached_payload_t& payload) const;
+  void scheduleRefresh(const CacheKey& primary, const HTTPRequest& request);
+  bool containsMemoryEntry(const CacheKey& key, const HTTPRequest& request,
+                           HTTPResponse& response, cached_payload_t& payload);
+  bool promoteCacheEntry(const CacheKey& key, const HTTPSegmentStore::location_t& location);
+  std::shared_ptr<HTTPMemoryCache::entry_t>
+    loadCacheEntry(const HTTPSegmentStore::location_t& location) const;
+  bool publishEntry(const std::shared_ptr<const HTTPMemoryCache::entry_t>& entry,
+                    HTTPResponse& response, cached_payload_t& payload) const;
+  bool readCacheEntry(const HTTPSegmentStore::location_t& location, std::string& data) const;
+  size_t readCachedHeader(const HTTPSegmentStore::location_t& location,
+                          HTTPResponse& response) const;
+  HTTPCacheWriter::write_t prepareEntry(const HTTPRequest& request,
+                                       const HTTPResponse& response) const;
+  void storeEntries(std::vector<HTTPCacheWriter::write_t>& batch);
+  void endFetch(const CacheKey& primary);
+  void storeEntry(const CacheKey& key, const std::shared_ptr<const HTTPMemoryCache::entry_t>& entry);
 
   std::string cacheDirectory;
+  CacheKey keySecret;
+  long staleGrace;
+  std::unique_ptr<HTTPSegmentStore> store;
+  HTTPMemoryCache memoryCache;
   std::map<uint32_t, std::unique_ptr<std::mutex> > requestLocks;
+  std::mutex fetchesLock;
+  std::unordered_map<CacheKey, std::vector<std::function<void(void)> > > fetches; // waiters, by key
+  std::function<void(const HTTPRequest&)> refresher;
+  std::unique_ptr<HTTPCacheWriter> writer; // last, so it's stopped before anything it uses goes
 };
 
 #endif
@@ -0,0 +1,86 @@
+/**
+ * File: checksum.cc
+ * -----------------
+ * Presents the implementation of the CRC-32C exported by checksum.h.  As
+ * with the scanning kernels, the SSE4.2 kernel is compiled with a target
+ * attribute rather than with -msse4.2, and which kernel gets used is
+ * decided at runtime, the first time a checksum is needed.
+ */
+
+#include "checksum.h"
+
+#include <cstring>   // for memcpy
+
+#if defined(__x86_64__)
+#define HAVE_X86_CRC32C_KERNEL
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const uint32_t kCastagnoliPolynomial = 0x82f63b78; // reflected
+
+typedef struct {
+  uint32_t entries[256];
+} table_t;
+
+static table_t buildTable() {
+  table_t table;
+  for (uint32_t byte = 0; byte < 256; byte++) {
+    uint32_t crc = byte;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (crc & 1 ? kCastagnoliPolynomial : 0);
+    }
+    table.entries[byte] = crc;
+  }
+  return table;
+}
+
+static uint32_t scalarCrc32c(uint32_t crc, const unsigned char *data, size_t length) {
+  static const table_t table = buildTable();
+  for (size_t pos = 0; pos < length; pos++) {
+    crc = table.entries[(crc ^ data[pos]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef HAVE_X86_CRC32C_KERNEL
+
+__attribute__((target("sse4.2")))
+static uint32_t sse42Crc32c(uint32_t crc, const unsigned char *data, size_t length) {
+  uint64_t wide = crc;
+  size_t pos = 0;
+  for (; pos + 8 <= length; pos += 8) {
+    uint64_t word;
+    memcpy(&word, data + pos, sizeof(word));
+    wide = _mm_crc32_u64(wide, word);
+  }
+
+  crc = uint32_t(wide);
+  for (; pos < length; pos++) {
+    crc = _mm_crc32_u8(crc, data[pos]);
+  }
+  return crc;
+}
+
+#endif
+
+typedef uint32_t (*kernel_t)(uint32_t crc, const unsigned char *data, size_t length);
+
+static kernel_t selectKernel() {
+#ifdef HAVE_X86_CRC32C_KERNEL
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) return sse42Crc32c;
+#endif
+  return scalarCrc32c;
+}
+
+/**
+ * The kernels work on the checksum's complement, which is what's
+ * exchanged with callers, so that continuing a checksum needs nothing
+ * more than passing it back in.
+ */
+uint32_t crc32c(const void *data, size_t length, uint32_t crc) {
+  static const kernel_t kernel = selectKernel();
+  return ~kernel(~crc, static_cast<const unsigned char *>(data), length);
+}
@@ -0,0 +1,23 @@
+/**
+ * File: checksum.h
+ * ----------------
+ * Exports the CRC-32C (Castagnoli) checksum the segment store guards its
+ * records with.  On x86-64 processors with SSE4.2, it's computed eight
+ * bytes at a time by the crc32 instruction; elsewhere, a byte at a time
+ * from a table.
+ */
+
+#ifndef _checksum_
+#define _checksum_
+
+#include <cstddef>   // for size_t
+#include <cstdint>
+
+/**
+ * Returns the CRC-32C of the length bytes at data.  Passing the checksum
+ * of whatever preceded them as crc continues it, so that the checksum of
+ * several pieces is that of their concatenation.
+ */
+uint32_t crc32c(const void *data, size_t length, uint32_t crc = 0);
+
+#endif
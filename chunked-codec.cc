@@ -0,0 +1,161 @@
+/**
+ * File: chunked-codec.cc
+ * ----------------------
+ * Presents the implementation of the ChunkedDecoder class and the chunk
+ * framing functions.
+ */
+
+#include "chunked-codec.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "scan.h"
+
+using namespace std;
+
+static const size_t kMaxSizeDigits = 15; // keeps chunk sizes well within a size_t
+
+ChunkedDecoder::ChunkedDecoder(size_t maxLineLength, size_t maxTrailerSize) :
+  maxLineLength(maxLineLength), maxTrailerSize(maxTrailerSize) {
+  reset();
+}
+
+void ChunkedDecoder::reset() {
+  startChunk();
+  trailerSize = 0;
+  decodedLength = 0;
+}
+
+static int hexValue(char ch) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+  return -1;
+}
+
+/**
+ * Chunk data is consumed in bulk, and so are the extensions and trailer
+ * lines being skipped over; the rest of the framing is handled a byte at a
+ * time.  Lines may end in either "\r\n" or just "\n".
+ */
+size_t ChunkedDecoder::decode(const char *data, size_t length, string *decoded) {
+  size_t pos = 0;
+  while (pos < length && phase != kDone && phase != kError) {
+    char ch = data[pos];
+    switch (phase) {
+    case kSize: {
+      int value = hexValue(ch);
+      if (value >= 0) {
+        if (++sizeDigits > kMaxSizeDigits) { fail(); break; }
+        remaining = remaining * 16 + value;
+        lineLength++;
+        pos++;
+      } else if (sizeDigits == 0) {
+        fail();
+      } else {
+        phase = kExtension;
+      }
+      break;
+    }
+    case kExtension: {
+      size_t count = scanForByte(data + pos, length - pos, '\n');
+      lineLength += count;
+      if (lineLength > maxLineLength) { fail(); break; }
+      pos += count;
+      if (pos == length) break;
+      pos++; // the '\n'
+      lineLength = 0;
+      phase = remaining == 0 ? kTrailerStart : kData;
+      break;
+    }
+    case kData: {
+      size_t count = min(remaining, length - pos);
+      if (decoded != NULL) decoded->append(data + pos, count);
+      decodedLength += count;
+      remaining -= count;
+      pos += count;
+      if (remaining == 0) phase = kDataCR;
+      break;
+    }
+    case kDataCR:
+    case kDataLF:
+      if (ch == '\r' && phase == kDataCR) {
+        phase = kDataLF;
+      } else if (ch == '\n') {
+        startChunk();
+      } else {
+        fail();
+        break;
+      }
+      pos++;
+      break;
+    case kTrailerStart:
+      if (ch == '\n') {
+        phase = kDone;
+      } else if (ch == '\r') {
+        phase = kFinalLF;
+      } else {
+        phase = kTrailerLine;
+        break;
+      }
+      pos++;
+      break;
+    case kTrailerLine: {
+      size_t count = scanForByte(data + pos, length - pos, '\n');
+      trailerSize += count;
+      if (trailerSize > maxTrailerSize) { fail(); break; }
+      pos += count;
+      if (pos == length) break;
+      pos++; // the '\n'
+      trailerSize++;
+      phase = kTrailerStart;
+      break;
+    }
+    case kFinalLF:
+      if (ch != '\n') { fail(); break; }
+      pos++;
+      phase = kDone;
+      break;
+    case kDone:  // excluded by the loop test
+    case kError:
+      break;
+    }
+  }
+
+  return pos;
+}
+
+void ChunkedDecoder::skipData(size_t count) {
+  decodedLength += count;
+  remaining -= count;
+  if (remaining == 0) phase = kDataCR;
+}
+
+ChunkedDecoder::Status ChunkedDecoder::getStatus() const {
+  if (phase == kDone) return kComplete;
+  if (phase == kError) return kMalformed;
+  return kIncomplete;
+}
+
+void appendChunk(const char *data, size_t length, string& out) {
+  if (length == 0) return;
+  char sizeLine[32];
+  int count = snprintf(sizeLine, sizeof(sizeLine), "%zx\r\n", length);
+  out.append(sizeLine, count);
+  out.append(data, length);
+  out.append("\r\n", 2);
+}
+
+void appendLastChunk(string& out) {
+  out.append("0\r\n\r\n", 5);
+}
+
+/** Private methods **/
+
+void ChunkedDecoder::startChunk() {
+  phase = kSize;
+  remaining = 0;
+  sizeDigits = 0;
+  lineLength = 0;
+}
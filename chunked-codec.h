@@ -0,0 +1,107 @@
+/**
+ * File: chunked-codec.h
+ * ---------------------
+ * Defines the ChunkedDecoder class, which follows a chunked payload
+ * (RFC 7230, section 4.1) through whatever pieces it happens to arrive in,
+ * and the functions that frame data as chunks.  The decoder never needs to
+ * see more than the bytes it's handed: it keeps a handful of counters
+ * rather than buffering anything, so it can be fed straight from a receive
+ * buffer, a few bytes or a few megabytes at a time.  Chunk extensions and
+ * trailers are accepted and skipped, subject to limits on their length, so
+ * a peer can't make the decoder (or whoever buffers on its behalf) hold
+ * onto an unbounded amount of framing.
+ */
+
+#ifndef _chunked_codec_
+#define _chunked_codec_
+
+#include <cstddef>
+#include <string>
+
+class ChunkedDecoder {
+ public:
+  enum Status { kIncomplete, kComplete, kMalformed };
+
+/**
+ * Constructs a decoder for a payload whose chunk-size lines (extensions
+ * included) may be at most maxLineLength bytes long, and whose trailers
+ * may be at most maxTrailerSize bytes long in all.
+ */
+  ChunkedDecoder(size_t maxLineLength = 4096, size_t maxTrailerSize = 16 * 1024);
+
+/**
+ * Readies the decoder for the next chunked payload.
+ */
+  void reset();
+
+/**
+ * Advances over the first length bytes at data, and returns how many of
+ * them belong to the payload: all of them, unless the payload ends (or
+ * turns out to be malformed) somewhere in the middle.  If decoded is
+ * supplied, the chunk data in those bytes is appended to it, without any
+ * of the framing.
+ */
+  size_t decode(const char *data, size_t length, std::string *decoded = NULL);
+
+/**
+ * Advances over count bytes of chunk data that the caller has dealt
+ * with itself (say, by splicing them elsewhere), where count can't exceed
+ * getDataRemaining().
+ */
+  void skipData(size_t count);
+
+/**
+ * Returns how much of the current chunk's data is yet to be decoded, or 0
+ * if the decoder is in the midst of framing.  Any bytes up to that count can
+ * be handed over without fear of reading past the end of the payload.
+ */
+  size_t getDataRemaining() const { return phase == kData ? remaining : 0; }
+
+  Status getStatus() const;
+
+/**
+ * Returns the total number of chunk data bytes decoded thus far.
+ */
+  size_t getDecodedLength() const { return decodedLength; }
+
+ private:
+  enum Phase {
+    kSize,           // the hexadecimal chunk size
+    kExtension,      // anything else on the chunk-size line
+    kData,           // the chunk data itself
+    kDataCR,         // the CRLF that follows the chunk data
+    kDataLF,
+    kTrailerStart,   // the first byte of a trailer line (or of the final CRLF)
+    kTrailerLine,    // the rest of a trailer line
+    kFinalLF,        // the LF of the final CRLF
+    kDone,
+    kError
+  };
+
+  size_t maxLineLength;
+  size_t maxTrailerSize;
+  Phase phase;
+  size_t remaining;      // bytes left in the chunk (or its size, while it's being read)
+  size_t sizeDigits;
+  size_t lineLength;
+  size_t trailerSize;
+  size_t decodedLength;
+
+  void startChunk();
+  void fail() { phase = kError; }
+};
+
+/**
+ * Appends the length bytes at data to out as a single chunk, framing and
+ * all.  Nothing is appended if length is 0, since an empty chunk would
+ * end the payload; appendLastChunk does that.
+ */
+void appendChunk(const char *data, size_t length, std::string& out);
+
+/**
+ * Appends the zero-length chunk (without trailers) that ends a chunked
+ * payload to out.
+ */
+void appendLastChunk(std::string& out);
+
+#endif
@@ -0,0 +1,1026 @@
+/**
+ * File: connection.cc
+ * -------------------
+ * Presents the implementation of the HTTPConnection class.
+ */
+
+#include "connection.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "io-vector.h"
+#include "ostreamlock.h"
+#include "tunnel.h"
+
+using namespace std;
+
+static const int kNoSocket = -1;
+static const size_t kReadBufferSize = 16 * 1024;
+static const size_t kMaxRequestHeaderSize = 64 * 1024;
+static const size_t kMaxResponseHeaderSize = 256 * 1024;
+static const size_t kMaxBufferedPayload = 256 * 1024;
+static const size_t kMinSplicedPayload = 64 * 1024;
+static const int kBadRequest = 400;
+static const int kNotModified = 304;
+static const int kForbiddenRequest = 403;
+static const int kPayloadTooLarge = 413;
+static const int kBadGateway = 502;
+static const long kClientIdleTimeout = 5000; // in milliseconds
+static const long kFetchWaitTimeout = 5000;  // in milliseconds
+static const size_t kNoTimer = 0;
+
+static bool responseHasNoPayload(const HTTPRequest& request, const HTTPResponse& response) {
+  int code = response.getResponseCode();
+  return request.getMethod() == "HEAD" || (code >= 100 && code < 200) ||
+    code == 204 || code == 304;
+}
+
+/** Public methods **/
+
+HTTPConnection::HTTPConnection(EventLoop& loop, int clientfd, const string& clientIPAddress,
+                               const HTTPBlacklist& blacklist, HTTPCache& cache,
+                               HTTPResolver& resolver, HTTPOriginPool& originPool) :
+  loop(loop), clientfd(clientfd), originfd(kNoSocket), clientIPAddress(clientIPAddress),
+  blacklist(blacklist), cache(cache), resolver(resolver), originPool(originPool), state(kReadingRequest),
+  originReused(false), clientPersistent(false), idleTimer(kNoTimer), fetchTimer(kNoTimer),
+  fetching(false), revalidating(false), clientEvents(0),
+  originEvents(0), request(arena.get()), response(arena.get()), requestParser(HTTPParser::kRequest, kMaxRequestHeaderSize),
+  responseParser(HTTPParser::kResponse, kMaxResponseHeaderSize), clientOutOffset(0),
+  originOutOffset(0), requestHeaderEnd(string::npos), requestEnd(string::npos),
+  originReusable(false), cacheable(false), payloadFraming(kNoPayload), payloadRemaining(0),
+  requestChunksDecoded(0), rechunking(false),
+  splicing(false) {
+  cachedPayload.fd = kNoSocket;
+}
+
+HTTPConnection::~HTTPConnection() {
+  if (cachedPayload.fd != kNoSocket) ::close(cachedPayload.fd);
+  if (originfd != kNoSocket) ::close(originfd);
+  if (clientfd != kNoSocket) ::close(clientfd);
+}
+
+void HTTPConnection::start() {
+  shared_ptr<HTTPConnection> self = shared_from_this();
+  clientEvents = EPOLLIN;
+  loop.watch(clientfd, clientEvents, [self](uint32_t events) {
+      self->runGuarded([self, events]() { self->onClientEvent(events); });
+    });
+  armIdleTimer();
+}
+
+/** Private methods **/
+
+/**
+ * Runs one step of servicing the connection: a handler, or a posted or
+ * timer thunk.  Should it throw, the connection is in no state to carry
+ * on, so it's closed, which unregisters its handlers and so releases it
+ * (along with any fetch it has claimed).  Left to the event loop, the
+ * exception would be confined, but the connection would stay registered
+ * and hold on to its sockets until its peers gave up on it.
+ */
+void HTTPConnection::runGuarded(const function<void(void)>& step) {
+  try {
+    step();
+  } catch (const exception& e) {
+    cerr << oslock << "Unexpected failure while servicing " << clientIPAddress
+         << ": " << e.what() << endl << osunlock;
+    close();
+  } catch (...) {
+    cerr << oslock << "Unexpected failure while servicing " << clientIPAddress
+         << "." << endl << osunlock;
+    close();
+  }
+}
+
+void HTTPConnection::onClientEvent(uint32_t events) {
+  if (state == kReadingRequest) {
+    readRequest();
+  } else if ((state == kRelayingResponse || state == kWritingResponse) && (events & EPOLLOUT)) {
+    flushToClient();
+  } else if (events & (EPOLLERR | EPOLLHUP)) {
+    close(); // client gave up while we were waiting on the origin
+  }
+}
+
+void HTTPConnection::onOriginEvent(uint32_t events) {
+  if (state == kWritingRequest) {
+    flushToOrigin();
+  } else if (state == kReadingResponse || state == kRelayingResponse) {
+    readResponse();
+  }
+}
+
+void HTTPConnection::readRequest() {
+  char buffer[kReadBufferSize];
+  bool peerClosed = false;
+  while (true) {
+    ssize_t count = loop.receive(clientfd, buffer, sizeof(buffer));
+    if (count > 0) {
+      clientIn.append(buffer, count);
+    } else if (count == 0) {
+      peerClosed = true;
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else {
+      close();
+      return;
+    }
+  }
+
+  ingestBufferedRequest(peerClosed);
+}
+
+/**
+ * Advances as far as possible with whatever portion of the next request
+ * has been accumulated in clientIn, and hands it off to processRequest once
+ * all of it has arrived.
+ */
+void HTTPConnection::ingestBufferedRequest(bool peerClosed) {
+  if (requestHeaderEnd == string::npos && !ingestRequestHeader()) {
+    if (state == kReadingRequest && peerClosed) close();
+    return;
+  }
+
+  size_t payloadEnd = findRequestPayloadEnd();
+  if (requestChunks.getStatus() == ChunkedDecoder::kMalformed) {
+    respondWithError(kBadRequest, "Malformed chunked payload.");
+    return;
+  }
+
+  const HTTPHeader& header = request.getHeader();
+  size_t payloadSize = header.hasChunkedPayload() ?
+    requestChunksDecoded + requestChunks.getDataRemaining() : // counts the chunk announced
+    header.getValueAsNumber(HTTPHeader::kContentLength);
+  if (payloadSize > HTTPPayload::kMaxIngestedSize) {
+    respondWithError(kPayloadTooLarge, "Payload too large.");
+    return;
+  }
+
+  if (payloadEnd == string::npos) {
+    if (peerClosed) close();
+    return;
+  }
+
+  istringstream payloadStream(clientIn.substr(requestHeaderEnd, payloadEnd - requestHeaderEnd));
+  HTTPPayload::Status status = request.ingestPayload(payloadStream);
+  if (status == HTTPPayload::kTooLarge) {
+    respondWithError(kPayloadTooLarge, "Payload too large.");
+    return;
+  } else if (status != HTTPPayload::kComplete) {
+    respondWithError(kBadRequest, "Malformed payload.");
+    return;
+  }
+  requestEnd = payloadEnd;
+  clientPersistent = !peerClosed && request.permitsPersistentConnection();
+  loop.cancelTimer(idleTimer);
+  idleTimer = kNoTimer;
+  processRequest();
+}
+
+/**
+ * Advances the request parser over whatever's arrived since the last
+ * call, and populates the request once the header is complete.  Returns
+ * true if and only if the header was ingested and the request should
+ * proceed (an error response is queued up for malformed or oversized requests).
+ */
+bool HTTPConnection::ingestRequestHeader() {
+  HTTPParser::Status status = requestParser.parse(clientIn.data(), clientIn.size());
+  if (status == HTTPParser::kIncomplete) return false;
+  if (status == HTTPParser::kMalformed) {
+    respondWithError(kBadRequest, requestParser.getError());
+    return false;
+  }
+
+  try {
+    request.ingestRequestLine(requestParser);
+  } catch (const HTTPBadRequestException& hbre) {
+    respondWithError(kBadRequest, hbre.what());
+    return false;
+  }
+
+  request.ingestHeader(requestParser, clientIPAddress);
+  if (!request.hasValidFraming()) {
+    respondWithError(kBadRequest, "Ambiguous payload framing.");
+    return false;
+  }
+  requestHeaderEnd = requestParser.getHeaderLength();
+  return true;
+}
+
+/**
+ * Returns the offset just beyond the request's payload, or string::npos
+ * if more of it is needed.  A chunked payload is decoded incrementally, so
+ * only the bytes that have arrived since the last call are examined.
+ * Requests without a Transfer-Encoding or Content-Length are treated as
+ * having no payload.
+ */
+size_t HTTPConnection::findRequestPayloadEnd() {
+  const HTTPHeader& header = request.getHeader();
+  if (header.hasChunkedPayload()) {
+    size_t start = requestHeaderEnd + requestChunksDecoded;
+    requestChunksDecoded += requestChunks.decode(clientIn.data() + start, clientIn.size() - start);
+    if (requestChunks.getStatus() != ChunkedDecoder::kComplete) return string::npos;
+    return requestHeaderEnd + requestChunksDecoded;
+  }
+
+  size_t end = requestHeaderEnd + header.getValueAsNumber(HTTPHeader::kContentLength);
+  return clientIn.size() >= end ? end : string::npos;
+}
+
+/**
+ * Decides how the fully ingested request is to be serviced: rejected
+ * outright, tunneled, answered from the cache, or forwarded to the origin server.
+ * Cache lookups are still serviced synchronously on the loop thread.  A miss
+ * on a response another connection is already fetching waits for that
+ * fetch rather than going to the origin as well.
+ */
+void HTTPConnection::processRequest() {
+  if (!blacklist.serverIsAllowed(request.getServer())) {
+    respondWithError(kForbiddenRequest, "Forbidden Content");
+    return;
+  }
+
+  if (request.getMethod() == "CONNECT") {
+    connectToOrigin();
+    return;
+  }
+
+  if (cache.containsCacheEntry_r(request, response, cachedPayload)) {
+    queueCachedResponse();
+    return;
+  }
+
+  awaitFetch();
+}
+
+/**
+ * Claims the fetch of the request from the origin and goes ahead with it,
+ * or, if another connection already has, sits in kAwaitingFetch until the
+ * fetcher's thread posts word that it's over, or until kFetchWaitTimeout
+ * milliseconds pass, whichever comes first.
+ */
+void HTTPConnection::awaitFetch() {
+  weak_ptr<HTTPConnection> weak = shared_from_this();
+  EventLoop *lp = &loop;
+  HTTPCache::FetchRole role = cache.beginFetch_r(request, [weak, lp]() -> void {
+      lp->post([weak]() -> void {
+          shared_ptr<HTTPConnection> self = weak.lock();
+          if (self && self->state == kAwaitingFetch) {
+            self->runGuarded([self]() { self->resumeAfterFetch(); });
+          }
+        });
+    });
+  if (role != HTTPCache::kWaiting) {
+    fetching = role == HTTPCache::kFetching;
+    fetchFromOrigin();
+    return;
+  }
+
+  state = kAwaitingFetch;
+  watchClient(0);
+  fetchTimer = loop.addTimer(kFetchWaitTimeout, [weak]() -> void {
+      shared_ptr<HTTPConnection> self = weak.lock();
+      if (!self) return;
+      self->fetchTimer = kNoTimer;
+      if (self->state == kAwaitingFetch) {
+        self->runGuarded([self]() { self->resumeAfterFetch(); });
+      }
+    });
+}
+
+/**
+ * Serves the request from the cache if the fetch it waited on left a
+ * response there, and otherwise goes to the origin after all.
+ */
+void HTTPConnection::resumeAfterFetch() {
+  loop.cancelTimer(fetchTimer);
+  fetchTimer = kNoTimer;
+  if (cache.containsCacheEntry_r(request, response, cachedPayload)) {
+    queueCachedResponse();
+    return;
+  }
+
+  fetchFromOrigin();
+}
+
+/**
+ * Goes to the origin for a request the cache couldn't answer, asking only
+ * whether the stale entry it has is still good if it has one.
+ */
+void HTTPConnection::fetchFromOrigin() {
+  revalidating = cache.addValidators_r(request);
+  connectToOrigin();
+}
+
+/**
+ * Serves the stale entry the request revalidated, now that the origin has
+ * answered 304 (Not Modified).  Should the entry have vanished in the
+ * meantime, the request is sent again without its validators.
+ */
+void HTTPConnection::serveRefreshedResponse() {
+  if (originReusable && originIn.empty()) {
+    loop.unwatch(originfd);
+    originPool.release(request.getServer(), request.getPort(), originfd);
+    originfd = kNoSocket;
+  } else {
+    closeOrigin();
+  }
+
+  HTTPResponse notModified(response);
+  response = HTTPResponse(arena.get());
+  revalidating = false;
+  if (cache.refreshCacheEntry_r(request, notModified, response, cachedPayload)) {
+    endFetch();
+    queueCachedResponse();
+    return;
+  }
+
+  request.setValidators("", "");
+  connectToOrigin();
+}
+
+/**
+ * Serves the request's stale cache entry in place of the response the
+ * origin failed to deliver, if the entry's stale-if-error window permits,
+ * and returns false otherwise.
+ */
+bool HTTPConnection::serveStaleResponse() {
+  HTTPResponse stale(arena.get());
+  if (!cache.containsStaleEntry_r(request, stale, cachedPayload)) return false;
+  closeOrigin();
+  response = stale;
+  endFetch();
+  queueCachedResponse();
+  return true;
+}
+
+/**
+ * Releases whoever's waiting on this connection's fetch, if it's the
+ * fetcher.  That happens as soon as the response is known not to be
+ * cacheable, once it's been cached, or when the fetch fails.
+ */
+void HTTPConnection::endFetch() {
+  if (!fetching) return;
+  fetching = false;
+  cache.endFetch_r(request);
+}
+
+/**
+ * Forwards the request over an idle pooled connection if there is one, and
+ * otherwise resolves the origin server and opens a new connection to it.
+ * Tunnels always get a connection of their own.
+ * Resolution only holds things up if the answer isn't already cached, in
+ * which case the connection sits in kResolvingOrigin until the resolver's
+ * callback (which runs on a resolver thread) posts the answer back to the loop.
+ */
+void HTTPConnection::connectToOrigin() {
+  bool tunneling = request.getMethod() == "CONNECT";
+  originfd = tunneling ? kNoSocket : originPool.acquireIdle(request.getServer(), request.getPort());
+  originReused = originfd != kNoSocket;
+  if (originReused) {
+    forwardToOrigin();
+    return;
+  }
+
+  bool resolved;
+  struct in_addr address;
+  weak_ptr<HTTPConnection> weak = shared_from_this();
+  EventLoop *lp = &loop;
+  if (resolver.resolve(request.getServer(), resolved, address,
+                       [weak, lp](bool resolved, const struct in_addr& address) {
+        lp->post([weak, resolved, address]() -> void {
+            shared_ptr<HTTPConnection> self = weak.lock();
+            if (self && self->state == kResolvingOrigin) {
+              self->runGuarded([self, resolved, address]() {
+                  self->connectToAddress(resolved, address);
+                });
+            }
+          });
+      })) {
+    connectToAddress(resolved, address);
+    return;
+  }
+
+  state = kResolvingOrigin;
+  watchClient(0);
+}
+
+void HTTPConnection::connectToAddress(bool resolved, const struct in_addr& address) {
+  if (!resolved) {
+    respondWithError(kBadGateway, "Could not resolve origin server.");
+    return;
+  }
+
+  originfd = originPool.connect(address, request.getPort());
+  if (originfd == kNoSocket) {
+    cerr << oslock << "can not open a client socket" << endl << osunlock;
+    respondWithError(kBadGateway, "Could not connect to origin server.");
+    return;
+  }
+
+  forwardToOrigin();
+}
+
+void HTTPConnection::forwardToOrigin() {
+  responseParser.reset();
+  originOut.clear();
+  originOutOffset = 0;
+  if (request.getMethod() != "CONNECT") {
+    request.requestPersistentConnection();
+    IOVector iov;
+    request.serialize(iov);
+    iov.appendTo(originOut);
+  }
+
+  response.setRequestTime(time(NULL));
+
+  state = kWritingRequest;
+  watchClient(0);
+  shared_ptr<HTTPConnection> self = shared_from_this();
+  originEvents = EPOLLOUT;
+  loop.watch(originfd, originEvents, [self](uint32_t events) {
+      self->runGuarded([self, events]() { self->onOriginEvent(events); });
+    });
+}
+
+void HTTPConnection::flushToOrigin() {
+  if (originOutOffset == 0) { // first writable event, so the connect has resolved
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(originfd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+      closeOrigin();
+      respondWithError(kBadGateway, "Could not connect to origin server.");
+      return;
+    }
+  }
+
+  while (originOutOffset < originOut.size()) {
+    ssize_t count = loop.send(originfd, originOut.data() + originOutOffset,
+                              originOut.size() - originOutOffset, MSG_NOSIGNAL);
+    if (count > 0) {
+      originOutOffset += count;
+    } else if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      closeOrigin();
+      if (originReused) {
+        connectToOrigin(); // pooled connection went stale while idle
+      } else {
+        respondWithError(kBadGateway, "Lost connection to origin server.");
+      }
+      return;
+    }
+  }
+
+  if (request.getMethod() == "CONNECT") {
+    startTunnel();
+    return;
+  }
+
+  state = kReadingResponse;
+  watchOrigin(EPOLLIN);
+}
+
+/**
+ * Hands both sockets over to an HTTPTunnel on the same loop, along with
+ * the response confirming the tunnel and anything the client has already
+ * sent through it, and then retires the connection without closing them.
+ * The tunnel watches both sockets in the connection's place, which
+ * releases the connection's handlers without dropping anything the loop
+ * has already received on the tunnel's behalf.
+ */
+void HTTPConnection::startTunnel() {
+  shared_ptr<HTTPTunnel> tunnel(new HTTPTunnel(loop, clientfd, originfd, HTTPTunnel::kEstablishedResponse,
+                                               clientIn.substr(requestEnd), request.getURL()));
+  clientfd = originfd = kNoSocket;
+  state = kClosed;
+  tunnel->start();
+}
+
+/**
+ * Reads whatever the origin has sent since the last event.  Until the
+ * response header is complete, everything is accumulated; from then on,
+ * the payload is streamed to the client as it arrives.  Reading stops
+ * once kMaxBufferedPayload bytes are pending so that a fast origin feeding
+ * a slow client can't balloon the connection's memory footprint.
+ */
+void HTTPConnection::readResponse() {
+  if (splicing) {
+    if (clientOut.empty()) {
+      splicePayload();
+    } else {
+      watchOrigin(0); // the splice can't start until what's buffered is flushed
+    }
+    return;
+  }
+
+  char buffer[kReadBufferSize];
+  bool peerClosed = false;
+  bool peerFailed = false;
+  while (originIn.size() < kMaxBufferedPayload) {
+    ssize_t count = loop.receive(originfd, buffer, sizeof(buffer));
+    if (count > 0) {
+      originIn.append(buffer, count);
+    } else if (count == 0) {
+      peerClosed = true;
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else {
+      peerClosed = peerFailed = true;
+      break;
+    }
+  }
+
+  if (state == kReadingResponse && !ingestResponseHeader()) {
+    if (peerClosed && state == kReadingResponse) {
+      closeOrigin();
+      if (originReused && originIn.empty()) {
+        connectToOrigin(); // pooled connection went stale while idle
+      } else {
+        respondWithError(kBadGateway, "Origin server closed the connection prematurely.");
+      }
+    }
+    return;
+  }
+
+  relayPayload(peerClosed, peerFailed);
+}
+
+/**
+ * Parses the response header once all of it has arrived, and then
+ * commits to the response: the header is queued up for the client right
+ * away (with the Connection header rewritten for the client's benefit),
+ * and the decisions about how the payload is delimited and whether it's to
+ * be cached are made once, up front.
+ */
+bool HTTPConnection::ingestResponseHeader() {
+  HTTPParser::Status status = responseParser.parse(originIn.data(), originIn.size());
+  if (status == HTTPParser::kIncomplete) return false;
+  if (status == HTTPParser::kMalformed) {
+    closeOrigin();
+    respondWithError(kBadGateway, "Origin server sent a malformed response.");
+    return false;
+  }
+
+  response.ingestResponseHeader(responseParser);
+  if (!response.hasValidFraming()) {
+    closeOrigin();
+    respondWithError(kBadGateway, "Origin server sent a malformed response.");
+    return false;
+  }
+  originIn.erase(0, responseParser.getHeaderLength());
+
+  originReusable = response.permitsConnectionReuse();
+  if (revalidating && response.getResponseCode() == kNotModified) {
+    serveRefreshedResponse();
+    return false;
+  }
+
+  if (response.reportsOriginFailure() && serveStaleResponse()) return false;
+
+  cacheable = cache.shouldCache(request, response) && response.hasDelimitedPayload();
+  if (!cacheable) endFetch();
+  const HTTPHeader& header = response.getHeader();
+  if (responseHasNoPayload(request, response)) {
+    payloadFraming = kNoPayload;
+  } else if (header.hasChunkedPayload()) {
+    payloadFraming = kChunkedPayload;
+    responseChunks.reset();
+  } else if (header.containsName(HTTPHeader::kContentLength)) {
+    payloadFraming = kSizedPayload;
+    payloadRemaining = header.getValueAsNumber(HTTPHeader::kContentLength);
+    splicing = !cacheable && payloadRemaining >= kMinSplicedPayload &&
+      loop.getBackend() == EventLoop::kEpoll && splicePipe.open(/* nonblocking = */ true);
+  } else {
+    payloadFraming = kPayloadUntilClose;
+    rechunking = clientPersistent && request.getProtocol() == "HTTP/1.1";
+    if (rechunking) {
+      response.setProtocol("HTTP/1.1");
+      response.setChunkedTransferEncoding();
+    }
+  }
+
+  clientPersistent = clientPersistent && (payloadFraming != kPayloadUntilClose || rechunking);
+  response.setPersistentConnection(clientPersistent);
+  IOVector iov;
+  response.serialize(iov, /* includePayload = */ false);
+  clientOut.clear();
+  iov.appendTo(clientOut);
+  clientOutOffset = 0;
+  state = kRelayingResponse;
+  return true;
+}
+
+/**
+ * Moves as much of the buffered payload as belongs to the current response
+ * over to the client's output buffer (and, for cacheable responses, to the
+ * copy destined for the cache), and pushes it along to the client.  Chunked
+ * payloads are relayed exactly as they arrived, but the copy destined for
+ * the cache is de-chunked along the way.  A copy that outgrows
+ * HTTPPayload::kMaxRetainedSize is dropped, and the response isn't cached.  A payload that ends only when the
+ * origin closes is framed as chunks when rechunking, so the client can tell
+ * where it ends without the connection being closed on it.  Such a payload
+ * is only complete if the origin closed the connection cleanly; one cut
+ * short by a failed read (a reset, say) is as truncated as any other.
+ */
+void HTTPConnection::relayPayload(bool peerClosed, bool peerFailed) {
+  size_t usable = originIn.size();
+  bool complete = false;
+  bool malformed = false;
+  switch (payloadFraming) {
+  case kNoPayload:
+    usable = 0;
+    complete = true;
+    break;
+  case kSizedPayload:
+    usable = min<size_t>(usable, payloadRemaining);
+    payloadRemaining -= usable;
+    complete = payloadRemaining == 0;
+    break;
+  case kChunkedPayload:
+    usable = responseChunks.decode(originIn.data(), originIn.size(),
+                                   cacheable ? &retainedPayload : NULL);
+    complete = responseChunks.getStatus() == ChunkedDecoder::kComplete;
+    malformed = responseChunks.getStatus() == ChunkedDecoder::kMalformed;
+    break;
+  case kPayloadUntilClose:
+    complete = peerClosed && !peerFailed;
+    break;
+  }
+
+  if (rechunking) {
+    appendChunk(originIn.data(), usable, clientOut);
+    if (complete) appendLastChunk(clientOut);
+  } else {
+    clientOut.append(originIn, 0, usable);
+  }
+
+  if (cacheable && payloadFraming != kChunkedPayload) retainedPayload.append(originIn, 0, usable);
+  if (cacheable && retainedPayload.size() > HTTPPayload::kMaxRetainedSize) {
+    // too large to cache after all, so the rest is relayed without a copy
+    cacheable = false;
+    string().swap(retainedPayload);
+    endFetch();
+  }
+  originIn.erase(0, usable);
+  if (complete) {
+    finishRelay(originIn.empty() && payloadFraming != kPayloadUntilClose);
+  } else if (peerClosed || malformed) {
+    // truncated (or garbled) response, and the status line can't be taken back,
+    // so whatever did arrive is published and the client connection dropped
+    closeOrigin();
+    clientPersistent = false;
+    state = kWritingResponse;
+  } else if (clientOut.size() - clientOutOffset >= kMaxBufferedPayload) {
+    watchOrigin(0); // resumed by flushToClient once the client catches up
+  }
+
+  flushToClient();
+}
+
+/**
+ * Moves the rest of a large, uncacheable payload from the origin to the
+ * client through splicePipe, so none of it is copied into user space.  This
+ * only happens once everything relayed the ordinary way has been flushed.
+ * At most a pipe's worth of payload is ever in flight: the origin isn't
+ * read from again until the client has taken all of it.
+ */
+void HTTPConnection::splicePayload() {
+  while (true) {
+    if (splicePipe.buffered() > 0) {
+      if (splicePipe.drain(clientfd) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        close();
+        return;
+      }
+      if (splicePipe.buffered() > 0) break; // client isn't keeping up
+    }
+
+    if (payloadRemaining == 0) break;
+    ssize_t count = splicePipe.fill(originfd, payloadRemaining);
+    if (count > 0) {
+      payloadRemaining -= count;
+    } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      // truncated response, and whatever arrived has already been published,
+      // so dropping the connection is the only way left to tell the client
+      close();
+      return;
+    }
+  }
+
+  if (payloadRemaining == 0 && splicePipe.buffered() == 0) {
+    splicing = false;
+    splicePipe.close();
+    finishRelay(/* atMessageBoundary = */ true);
+    flushToClient();
+  } else if (splicePipe.buffered() > 0) {
+    watchOrigin(0);
+    watchClient(EPOLLOUT);
+  } else {
+    watchClient(0);
+    watchOrigin(EPOLLIN);
+  }
+}
+
+/**
+ * Returns the origin connection to the pool if it's been left cleanly
+ * at a message boundary and the origin agreed to keep it alive, and closes
+ * it otherwise.  A cacheable response is cached from the retained copy of
+ * its payload, which is never chunked, so the cached response is framed by
+ * a Content-Length instead, and it's left to the cache's writers to store
+ * it and end the fetch, so the loop never waits on the disk.  Whatever the client hasn't received yet is
+ * flushed.
+ */
+void HTTPConnection::finishRelay(bool atMessageBoundary) {
+  if (atMessageBoundary && originReusable) {
+    loop.unwatch(originfd);
+    originPool.release(request.getServer(), request.getPort(), originfd);
+    originfd = kNoSocket;
+  } else {
+    closeOrigin();
+  }
+
+  if (cacheable) {
+    if (payloadFraming != kNoPayload) response.setPayload(retainedPayload);
+    string().swap(retainedPayload); // released now, not when the next response is
+    cache.cacheEntryBehind_r(request, response, fetching);
+    fetching = false;
+  }
+
+  endFetch();
+  state = kWritingResponse;
+}
+
+/**
+ * A Bad Gateway means the origin couldn't deliver a response at all, so
+ * a stale one stands in for it if there's one that may.
+ */
+void HTTPConnection::respondWithError(int code, const string& message) {
+  if (code == kBadGateway && serveStaleResponse()) return;
+  endFetch();
+  if (code == kBadRequest || code == kPayloadTooLarge) {
+    clientPersistent = false; // can't find the next request
+  }
+  response.setProtocol("HTTP/1.1");
+  response.setResponseCode(code);
+  response.setPayload(message);
+  queueResponse();
+}
+
+void HTTPConnection::queueResponse() {
+  clientPersistent = clientPersistent && response.hasDelimitedPayload();
+  response.setPersistentConnection(clientPersistent);
+  IOVector iov;
+  response.serialize(iov);
+  clientOut.clear();
+  iov.appendTo(clientOut);
+  clientOutOffset = 0;
+  state = kWritingResponse;
+  flushToClient();
+}
+
+/**
+ * Queues up the header of a cache hit.  The payload is left where it is,
+ * in the cache entry file, and is sent from there once the header has been
+ * flushed.
+ */
+void HTTPConnection::queueCachedResponse() {
+  clientPersistent = clientPersistent && response.hasDelimitedPayload();
+  response.setPersistentConnection(clientPersistent);
+  IOVector iov;
+  response.serialize(iov, /* includePayload = */ false);
+  clientOut.clear();
+  iov.appendTo(clientOut);
+  clientOutOffset = 0;
+  state = kWritingResponse;
+  flushToClient();
+}
+
+/**
+ * When the payload is to follow by sendfile or splice, whatever's in
+ * clientOut is sent with MSG_MORE, so the kernel corks it until the payload
+ * arrives rather than pushing the header out in a segment of its own.
+ * (With io_uring, the loop ignores the flag, but the header and the first
+ * of the payload usually go out together from its backlog anyway.)
+ */
+void HTTPConnection::flushToClient() {
+  bool more = (hasCachedPayload() && cachedPayload.length > 0) ||
+    (state == kRelayingResponse && splicing);
+  while (clientOutOffset < clientOut.size()) {
+    ssize_t count = loop.send(clientfd, clientOut.data() + clientOutOffset,
+                              clientOut.size() - clientOutOffset,
+                              MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (count > 0) {
+      clientOutOffset += count;
+    } else if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      watchClient(EPOLLOUT);
+      return;
+    } else {
+      close();
+      return;
+    }
+  }
+
+  clientOut.clear();
+  clientOutOffset = 0;
+  if (hasCachedPayload() && !sendCachedPayload()) return;
+  if (state == kRelayingResponse && splicing) {
+    splicePayload();
+  } else if (state == kRelayingResponse) {
+    // caught up with the origin, so stop waiting on the client and (in case
+    // the origin was paused because the client fell behind) resume reading
+    watchClient(0);
+    watchOrigin(EPOLLIN);
+  } else if (clientPersistent) {
+    prepareForNextRequest();
+  } else {
+    close();
+  }
+}
+
+bool HTTPConnection::hasCachedPayload() const {
+  return cachedPayload.fd != kNoSocket || cachedPayload.entry;
+}
+
+/**
+ * Sends as much of a cache hit's payload as the client will take, straight
+ * from the cache entry file (or, for hits from the memory tier, straight
+ * from the cached entry).  Returns true once all of it has been sent (and
+ * the file closed), and false if the client's fallen behind (in which case
+ * the rest is sent once it's writable again) or the connection was closed.
+ */
+bool HTTPConnection::sendCachedPayload() {
+  while (cachedPayload.length > 0) {
+    ssize_t count;
+    if (cachedPayload.entry) {
+      count = loop.send(clientfd, cachedPayload.entry->serialized.data() + cachedPayload.offset,
+                        cachedPayload.length, MSG_NOSIGNAL);
+      if (count > 0) cachedPayload.offset += count;
+    } else if (loop.getBackend() == EventLoop::kEpoll) {
+      count = sendfile(clientfd, cachedPayload.fd, &cachedPayload.offset, cachedPayload.length);
+    } else {
+      count = sendCachedBlock();
+    }
+    if (count > 0) {
+      cachedPayload.length -= count;
+    } else if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      watchClient(EPOLLOUT);
+      return false;
+    } else {
+      close(); // the entry was truncated out from under us, or the client left
+      return false;
+    }
+  }
+
+  if (cachedPayload.fd != kNoSocket) ::close(cachedPayload.fd);
+  cachedPayload.fd = kNoSocket;
+  cachedPayload.entry.reset();
+  return true;
+}
+
+/**
+ * Stands in for sendfile when the loop sends on the client's behalf (as
+ * it does with io_uring), where the payload has to pass through a buffer
+ * the loop can hold on to.  Reads the next block of the cache entry file
+ * and sends as much of it as the loop will take, returning what sendfile
+ * would have.  A block the loop won't take all of is simply read again.
+ */
+ssize_t HTTPConnection::sendCachedBlock() {
+  char buffer[kReadBufferSize];
+  ssize_t count = pread(cachedPayload.fd, buffer, min(sizeof(buffer), cachedPayload.length),
+                        cachedPayload.offset);
+  if (count <= 0) return count;
+  count = loop.send(clientfd, buffer, count, MSG_NOSIGNAL);
+  if (count > 0) cachedPayload.offset += count;
+  return count;
+}
+
+/**
+ * Resets the connection so that it's ready to service the client's next
+ * request.  If the client pipelined that request behind the one just
+ * serviced, it's already sitting in clientIn, so it's picked up on the
+ * next trip through the loop (rather than right away, so that a long run of
+ * pipelined cache hits doesn't recurse arbitrarily deeply).  Responses
+ * are therefore always published in the order the requests arrived.
+ * The arena is only reset once the request and response have let go of
+ * everything they'd allocated from it.
+ */
+void HTTPConnection::prepareForNextRequest() {
+  clientIn.erase(0, requestEnd);
+  request = HTTPRequest(arena.get());
+  response = HTTPResponse(arena.get());
+  arena.get()->reset();
+  requestParser.reset();
+  responseParser.reset();
+  clientOut.clear();
+  clientOutOffset = 0;
+  originIn.clear();
+  originOut.clear();
+  originOutOffset = 0;
+  string().swap(retainedPayload);
+  requestChunks.reset();
+  requestChunksDecoded = 0;
+  rechunking = false;
+  revalidating = false;
+  splicing = false;
+  splicePipe.close();
+  requestHeaderEnd = requestEnd = string::npos;
+  state = kReadingRequest;
+  watchClient(EPOLLIN);
+  armIdleTimer();
+  if (clientIn.empty()) return;
+  shared_ptr<HTTPConnection> self = shared_from_this();
+  loop.post([self]() -> void {
+      if (self->state == kReadingRequest) {
+        self->runGuarded([self]() { self->ingestBufferedRequest(false); });
+      }
+    });
+}
+
+/**
+ * Arranges for the connection to be closed should the client fail to
+ * deliver its next request within kClientIdleTimeout milliseconds.  The
+ * timer only holds a weak reference, so it never keeps a connection alive.
+ */
+void HTTPConnection::armIdleTimer() {
+  weak_ptr<HTTPConnection> weak = shared_from_this();
+  loop.cancelTimer(idleTimer);
+  idleTimer = loop.addTimer(kClientIdleTimeout, [weak]() -> void {
+      shared_ptr<HTTPConnection> self = weak.lock();
+      if (!self) return;
+      self->idleTimer = kNoTimer;
+      if (self->state == kReadingRequest) self->close();
+    });
+}
+
+/**
+ * Changes the set of events the client (or origin) socket is watched for,
+ * skipping the system call when the set isn't actually changing, as is
+ * usually the case while a payload is being relayed.
+ */
+void HTTPConnection::watchClient(uint32_t events) {
+  if (events == clientEvents) return;
+  clientEvents = events;
+  loop.modify(clientfd, events);
+}
+
+void HTTPConnection::watchOrigin(uint32_t events) {
+  if (events == originEvents) return;
+  originEvents = events;
+  loop.modify(originfd, events);
+}
+
+void HTTPConnection::closeOrigin() {
+  if (originfd == kNoSocket) return;
+  loop.unwatch(originfd);
+  ::close(originfd);
+  originfd = kNoSocket;
+}
+
+/**
+ * Tears down both sockets and unregisters their handlers, which in turn
+ * releases the last references to this connection once the currently
+ * executing handler returns.
+ */
+void HTTPConnection::close() {
+  if (state == kClosed) return;
+  state = kClosed;
+  loop.cancelTimer(idleTimer);
+  idleTimer = kNoTimer;
+  loop.cancelTimer(fetchTimer);
+  fetchTimer = kNoTimer;
+  endFetch();
+  closeOrigin();
+  splicePipe.close();
+  if (cachedPayload.fd != kNoSocket) {
+    ::close(cachedPayload.fd);
+    cachedPayload.fd = kNoSocket;
+  }
+  cachedPayload.entry.reset();
+  loop.unwatch(clientfd);
+  ::close(clientfd);
+  clientfd = kNoSocket;
+}
@@ -0,0 +1,160 @@
+/**
+ * File: connection.h
+ * ------------------
+ * Defines the HTTPConnection class, which services a single client
+ * connection on behalf of an EventLoop.  Where HTTPRequestHandler
+ * dedicates a thread to a request and blocks on every read and write,
+ * an HTTPConnection is a state machine that's advanced one step each
+ * time one of its (non-blocking) sockets becomes ready, so that a single
+ * loop thread can interleave thousands of connections.  Connections are
+ * persistent: once a response has been published, the connection cycles
+ * back to read the client's next (possibly already pipelined) request.
+ * CONNECT requests are the exception: once the connection to the origin
+ * is established, both sockets are handed off to an HTTPTunnel.
+ */
+
+#ifndef _http_connection_
+#define _http_connection_
+
+#include <cstdint>    // for uint32_t
+#include <functional> // for function
+#include <memory>     // for enable_shared_from_this
+#include <string>
+
+#include "arena.h"
+#include "event-loop.h"
+#include "blacklist.h"
+#include "chunked-codec.h"
+#include "cache.h"
+#include "origin-pool.h"
+#include "parser.h"
+#include "resolver.h"
+#include "request.h"
+#include "response.h"
+#include "zero-copy.h"
+
+class HTTPConnection: public std::enable_shared_from_this<HTTPConnection> {
+ public:
+
+/**
+ * Constructs an HTTPConnection around the supplied (already non-blocking)
+ * client socket.  The connection doesn't do anything until start is called.
+ */
+  HTTPConnection(EventLoop& loop, int clientfd, const std::string& clientIPAddress,
+                 const HTTPBlacklist& blacklist, HTTPCache& cache,
+                 HTTPResolver& resolver, HTTPOriginPool& originPool);
+  ~HTTPConnection();
+
+/**
+ * Registers the client socket with the event loop.  From that point
+ * on, the connection keeps itself alive (by way of the handlers it
+ * registers) until it closes itself.
+ */
+  void start();
+
+ private:
+  enum State {
+    kReadingRequest,     // accumulating the client's request
+    kAwaitingFetch,      // waiting on another connection's fetch of the same response
+    kResolvingOrigin,    // waiting on the resolver for the origin's address
+    kWritingRequest,     // connecting to the origin and forwarding the request
+    kReadingResponse,    // accumulating the origin's response header
+    kRelayingResponse,   // streaming the payload from the origin to the client
+    kWritingResponse,    // flushing whatever the client hasn't yet received
+    kClosed
+  };
+
+  enum PayloadFraming {
+    kNoPayload,          // HEAD responses, 1xx, 204, 304
+    kSizedPayload,       // Content-Length
+    kChunkedPayload,     // Transfer-Encoding: chunked
+    kPayloadUntilClose   // neither, so the origin closing the connection ends it
+  };
+
+  EventLoop& loop;
+  int clientfd;
+  int originfd;
+  std::string clientIPAddress;
+  const HTTPBlacklist& blacklist;
+  HTTPCache& cache;
+  HTTPResolver& resolver;
+  HTTPOriginPool& originPool;
+  State state;
+  bool originReused;
+  bool clientPersistent;
+  size_t idleTimer;
+  size_t fetchTimer;
+  bool fetching;           // the fetcher others with the same request are waiting on
+  bool revalidating;       // the request carries the validators of a stale cache entry
+  uint32_t clientEvents;
+  uint32_t originEvents;
+
+  ArenaLease arena;        // backs request and response, so declared first
+  HTTPRequest request;
+  HTTPResponse response;
+  HTTPParser requestParser;
+  HTTPParser responseParser;
+  std::string clientIn;
+  std::string clientOut;
+  size_t clientOutOffset;
+  std::string originIn;
+  std::string originOut;
+  size_t originOutOffset;
+  size_t requestHeaderEnd;
+  size_t requestEnd;
+  bool originReusable;
+  bool cacheable;
+  PayloadFraming payloadFraming;
+  size_t payloadRemaining;
+  ChunkedDecoder requestChunks;
+  size_t requestChunksDecoded; // how much of the request payload requestChunks has seen
+  ChunkedDecoder responseChunks;
+  bool rechunking;             // framing a read-until-close payload as chunks
+  std::string retainedPayload;
+  bool splicing;
+  SplicePipe splicePipe;
+  HTTPCache::cached_payload_t cachedPayload;
+
+  void runGuarded(const std::function<void(void)>& step);
+  void onClientEvent(uint32_t events);
+  void onOriginEvent(uint32_t events);
+  void readRequest();
+  void ingestBufferedRequest(bool peerClosed);
+  bool ingestRequestHeader();
+  size_t findRequestPayloadEnd();
+  void processRequest();
+  void awaitFetch();
+  void resumeAfterFetch();
+  void endFetch();
+  void fetchFromOrigin();
+  void serveRefreshedResponse();
+  bool serveStaleResponse();
+  void connectToOrigin();
+  void connectToAddress(bool resolved, const struct in_addr& address);
+  void forwardToOrigin();
+  void startTunnel();
+  void flushToOrigin();
+  void readResponse();
+  bool ingestResponseHeader();
+  void relayPayload(bool peerClosed, bool peerFailed);
+  void splicePayload();
+  void finishRelay(bool atMessageBoundary);
+  void respondWithError(int code, const std::string& message);
+  void queueResponse();
+  void queueCachedResponse();
+  void flushToClient();
+  bool sendCachedPayload();
+  ssize_t sendCachedBlock();
+  bool hasCachedPayload() const;
+  void prepareForNextRequest();
+  void armIdleTimer();
+  void watchClient(uint32_t events);
+  void watchOrigin(uint32_t events);
+  void closeOrigin();
+  void close();
+
+  HTTPConnection(const HTTPConnection& original) = delete;
+  HTTPConnection& operator=(const HTTPConnection& rhs) = delete;
+};
+
+#endif
@@ -0,0 +1,708 @@
+/**
+ * File: event-loop.cc
+ * -------------------
+ * Presents the implementation of the EventLoop class.
+ */
+
+#include "event-loop.h"
+
+#include <algorithm>  // for min
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "ostreamlock.h"
+
+using namespace std;
+
+static const unsigned int kRingEntries = 4096;
+static const unsigned int kProvidedBuffers = 1024;
+static const size_t kProvidedBufferSize = 16 * 1024;
+static const size_t kMaxReceivedBuffers = 8;   // per stream, before its receive is cancelled
+static const size_t kMaxBacklog = 256 * 1024;  // per stream, before send fails with EAGAIN
+
+EventLoop::EventLoop(Backend backend) throw (HTTPProxyException) :
+  epollfd(-1), wakeupfd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), nextGeneration(1),
+  nextStreamID(1), nextTimerID(1) {
+  if (wakeupfd < 0) {
+    throw HTTPProxyException("Failed to create the eventfd backing an event loop.");
+  }
+
+  if (backend == kIOUring) {
+    try {
+      ring.reset(new IOUring(kRingEntries, kProvidedBuffers, kProvidedBufferSize));
+    } catch (const HTTPProxyException& hpe) {
+      close(wakeupfd);
+      throw;
+    }
+  } else {
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0) {
+      close(wakeupfd);
+      throw HTTPProxyException("Failed to create the epoll instance backing an event loop.");
+    }
+  }
+
+  addInterest(wakeupfd, EPOLLIN);
+}
+
+EventLoop::~EventLoop() {
+  for (const auto& entry: streamsByID) {
+    if (entry.second->retired && entry.second->fd >= 0) close(entry.second->fd);
+  }
+  ring.reset();
+  close(wakeupfd);
+  if (epollfd >= 0) close(epollfd);
+}
+
+void EventLoop::run() {
+  ready_list_t ready;
+  while (true) {
+    ready.clear();
+    if (!waitForEvents(computeWaitTimeout(), ready)) {
+      throw HTTPProxyException("Failed to wait for events on an event loop.");
+    }
+
+    bool thunksPosted = false;
+    for (const ready_t& event: ready) {
+      if (event.fd == wakeupfd && event.stream == 0) {
+        thunksPosted = true;
+      } else {
+        dispatch(event);
+      }
+    }
+
+    runAcceptHandlers();
+    if (thunksPosted) runPostedThunks();
+    runExpiredTimers();
+  }
+}
+
+/**
+ * With io_uring, a newly watched descriptor becomes a stream, whose
+ * receive (if it's watched for EPOLLIN) and poll (if it's watched for
+ * EPOLLOUT) are queued up once the current round of handlers is done.
+ */
+void EventLoop::watch(int fd, uint32_t events, const IOHandler& handler) {
+  if (ring) {
+    stream_t *stream = findStream(fd);
+    if (stream == NULL) {
+      stream = new stream_t(); // value-initialized, so every flag starts out false
+      stream->fd = fd;
+      stream->id = nextStreamID++;
+      streamsByID[stream->id].reset(stream);
+      streams[fd] = stream;
+    }
+    stream->events = events;
+    unsettled.insert(stream->id);
+  } else if (!addInterest(fd, events)) {
+    if (errno != EEXIST) {
+      throw HTTPProxyException("Failed to register a descriptor with an event loop.");
+    }
+    changeInterest(fd, events); // already watched, so only its handler is replaced
+  }
+
+  handlers[fd] = make_shared<IOHandler>(handler);
+}
+
+void EventLoop::watchAccepts(int listenfd, uint32_t events, const AcceptHandler& handler) {
+  if (!ring) {
+    watch(listenfd, events, [this, listenfd, handler](uint32_t events) {
+        acceptConnections(listenfd, handler);
+      });
+    return;
+  }
+
+  acceptor_t acceptor;
+  acceptor.listenfd = listenfd;
+  acceptor.handler = make_shared<AcceptHandler>(handler);
+  acceptor.armed = false; // armed along with the next wait
+  acceptors.push_back(acceptor);
+}
+
+void EventLoop::modify(int fd, uint32_t events) {
+  stream_t *stream = findStream(fd);
+  if (stream == NULL) {
+    changeInterest(fd, events);
+    return;
+  }
+
+  stream->events = events;
+  unsettled.insert(stream->id);
+}
+
+void EventLoop::unwatch(int fd) {
+  handlers.erase(fd);
+  stream_t *stream = findStream(fd);
+  if (stream == NULL) {
+    removeInterest(fd);
+  } else {
+    retireStream(stream);
+  }
+}
+
+ssize_t EventLoop::receive(int fd, void *buffer, size_t length) {
+  stream_t *stream = findStream(fd);
+  if (stream == NULL) return recv(fd, buffer, length, 0);
+
+  unsettled.insert(stream->id);
+  size_t copied = 0;
+  while (copied < length && !stream->received.empty()) {
+    const received_t& front = stream->received.front();
+    size_t count = min(length - copied, front.length - stream->receivedOffset);
+    memcpy(static_cast<char *>(buffer) + copied,
+           ring->getBuffer(front.buffer) + stream->receivedOffset, count);
+    copied += count;
+    stream->receivedOffset += count;
+    if (stream->receivedOffset == front.length) {
+      ring->recycleBuffer(front.buffer);
+      stream->received.pop_front();
+      stream->receivedOffset = 0;
+    }
+  }
+
+  if (copied > 0) return copied;
+  if (stream->endOfFile) return 0;
+  errno = stream->error != 0 ? stream->error : EAGAIN;
+  return -1;
+}
+
+ssize_t EventLoop::send(int fd, const void *data, size_t length, int flags) {
+  stream_t *stream = findStream(fd);
+  if (stream == NULL) return ::send(fd, data, length, flags);
+
+  unsettled.insert(stream->id);
+  if (stream->error != 0 || stream->shutdownPending) {
+    errno = stream->error != 0 ? stream->error : EPIPE;
+    return -1;
+  }
+
+  size_t backlog = stream->queued.size() + stream->inFlight.size() - stream->inFlightOffset;
+  if (backlog >= kMaxBacklog) {
+    stream->writable = false;
+    errno = EAGAIN;
+    return -1;
+  }
+
+  size_t count = min(length, kMaxBacklog - backlog);
+  if (count == 0) return 0;
+  stream->queued.append(static_cast<const char *>(data), count);
+  if (!stream->sending) startSend(stream);
+  if (count < length) stream->writable = false;
+  return count;
+}
+
+void EventLoop::shutdownWrites(int fd) {
+  stream_t *stream = findStream(fd);
+  if (stream == NULL) {
+    shutdown(fd, SHUT_WR);
+    return;
+  }
+
+  stream->shutdownPending = true;
+  if (!stream->sending) shutdown(fd, SHUT_WR);
+}
+
+void EventLoop::post(const function<void(void)>& thunk) {
+  postedLock.lock();
+  posted.push_back(thunk);
+  postedLock.unlock();
+  uint64_t one = 1;
+  ssize_t ignored = write(wakeupfd, &one, sizeof(one));
+  (void) ignored; // a full counter still leaves the eventfd readable
+}
+
+size_t EventLoop::addTimer(long milliseconds, const function<void(void)>& thunk) {
+  deadline_t deadline = chrono::steady_clock::now() + chrono::milliseconds(milliseconds);
+  size_t id = nextTimerID++;
+  timersByID[id] = timers.insert(make_pair(deadline, make_pair(id, thunk)));
+  return id;
+}
+
+void EventLoop::cancelTimer(size_t id) {
+  auto found = timersByID.find(id);
+  if (found == timersByID.end()) return;
+  timers.erase(found->second);
+  timersByID.erase(found);
+}
+
+/** Private methods **/
+
+/**
+ * With io_uring, a poll request for a descriptor that isn't a stream (the
+ * eventfd, that is) is identified by the descriptor together with a
+ * generation number, so that the completion of a request that's been
+ * superseded (because the descriptor's interests changed, or because it
+ * was unwatched and its number reused) is recognized and ignored.  The
+ * requests made on behalf of streams (and acceptors) set the top bit
+ * instead, which generation numbers never reach, and identify the stream
+ * along with the kind of request.  User data of 0 identifies the
+ * completions of removal and cancellation requests, which are ignored.
+ */
+static const uint64_t kIgnoredCompletion = 0;
+static const uint32_t kGenerationLimit = 1U << 31;
+static const uint64_t kStreamRequest = 1ULL << 63;
+static const int kRequestShift = 56;
+static const uint64_t kIDMask = (1ULL << kRequestShift) - 1;
+enum { kReceiveRequest = 1, kSendRequest, kPollRequest, kAcceptRequest };
+
+static uint64_t encodePoll(int fd, uint32_t generation) {
+  return ((uint64_t) generation << 32) | (uint32_t) fd;
+}
+
+static uint64_t encodeRequest(uint64_t kind, uint64_t id) {
+  return kStreamRequest | (kind << kRequestShift) | id;
+}
+
+bool EventLoop::addInterest(int fd, uint32_t events) {
+  if (!ring) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == 0;
+  }
+
+  if (polls.find(fd) != polls.end()) return false;
+  poll_t& poll = polls[fd];
+  poll.events = events & ~EPOLLEXCLUSIVE; // epoll only, and one-shot polls don't stampede anyway
+  poll.generation = 0;
+  poll.armed = false;
+  armPoll(fd, poll);
+  return true;
+}
+
+/**
+ * A poll request that's still outstanding is replaced by one for the new
+ * interests.  One that's already completed needn't be, since the
+ * descriptor will be polled for its current interests once its handler
+ * has run.
+ */
+void EventLoop::changeInterest(int fd, uint32_t events) {
+  if (!ring) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+    return;
+  }
+
+  auto found = polls.find(fd);
+  if (found == polls.end()) return;
+  poll_t& poll = found->second;
+  poll.events = events & ~EPOLLEXCLUSIVE;
+  if (poll.armed) {
+    ring->queuePollRemove(encodePoll(fd, poll.generation), kIgnoredCompletion);
+    armPoll(fd, poll);
+  }
+}
+
+void EventLoop::removeInterest(int fd) {
+  if (!ring) {
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    return;
+  }
+
+  auto found = polls.find(fd);
+  if (found == polls.end()) return;
+  if (found->second.armed) {
+    ring->queuePollRemove(encodePoll(fd, found->second.generation), kIgnoredCompletion);
+  }
+  polls.erase(found);
+}
+
+/**
+ * Queues a new poll request for the supplied descriptor.  Errors and
+ * hangups are always of interest, just as they always are with epoll.
+ */
+void EventLoop::armPoll(int fd, poll_t& poll) {
+  poll.generation = nextGeneration++;
+  if (nextGeneration == kGenerationLimit) nextGeneration = 1;
+  poll.armed = true;
+  ring->queuePoll(fd, poll.events | EPOLLERR | EPOLLHUP, encodePoll(fd, poll.generation));
+}
+
+/**
+ * Accepts as many pending connections as are available (up to a fixed
+ * batch size, so that one busy listener can't starve the connections
+ * already being serviced by the same loop) and hands each of them over to
+ * the supplied handler.
+ */
+static const int kMaxAcceptsPerWakeup = 64;
+void EventLoop::acceptConnections(int listenfd, const AcceptHandler& handler) {
+  for (int i = 0; i < kMaxAcceptsPerWakeup; i++) {
+    struct sockaddr_in address;
+    socklen_t addressSize = sizeof(address);
+    int fd = accept4(listenfd, (struct sockaddr *) &address, &addressSize,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        cerr << oslock << "Call to accept failed to return a valid client socket."
+             << endl << osunlock;
+      }
+      return;
+    }
+
+    handler(fd, &address);
+  }
+}
+
+EventLoop::stream_t *EventLoop::findStream(int fd) const {
+  if (!ring) return NULL;
+  auto found = streams.find(fd);
+  return found == streams.end() ? NULL : found->second;
+}
+
+/**
+ * Detaches an unwatched stream from its descriptor.  Its receive and poll
+ * are cancelled synchronously, since the descriptor may be closed (and its
+ * number reused) or handed to another loop the moment unwatch returns, and
+ * everything else queued up is submitted, so that a send that's been
+ * queued takes hold of the socket before it can be closed.  The rest of
+ * the backlog goes out through a duplicate of the descriptor, which is
+ * closed once it's been sent.
+ */
+void EventLoop::retireStream(stream_t *stream) {
+  streams.erase(stream->fd);
+  stream->retired = true;
+  for (const received_t& received: stream->received) {
+    ring->recycleBuffer(received.buffer);
+  }
+  stream->received.clear();
+  if (stream->receiving) ring->cancel(encodeRequest(kReceiveRequest, stream->id));
+  if (stream->polling) ring->cancel(encodeRequest(kPollRequest, stream->id));
+  ring->submit();
+  stream->fd = stream->sending ? dup(stream->fd) : -1;
+  if (stream->fd < 0) stream->queued.clear();
+  releaseStream(stream);
+}
+
+/**
+ * Deletes a retired stream once none of its requests are outstanding.
+ */
+void EventLoop::releaseStream(stream_t *stream) {
+  if (stream->receiving || stream->polling || stream->sending) return;
+  if (stream->fd >= 0) close(stream->fd);
+  streamsByID.erase(stream->id);
+}
+
+/**
+ * Brings every stream whose state may have changed since the last wait
+ * up to date: its receive is queued up if it's watched for EPOLLIN and
+ * hasn't received all it may hold on to, its poll is queued up if it's
+ * watched for EPOLLOUT and hasn't been found writable, and whatever it's
+ * ready for is noted, to be reported in the next batch.  Streams are
+ * therefore reported for as long as they're ready, just as level-triggered
+ * epoll reports descriptors.  A stream that needs a receive while every
+ * provided buffer is taken waits for one to be recycled.
+ */
+void EventLoop::settleStreams() {
+  for (uint64_t id: unsettled) {
+    auto found = streamsByID.find(id);
+    if (found == streamsByID.end() || found->second->retired) continue;
+    stream_t *stream = found->second.get();
+    if ((stream->events & EPOLLIN) && !stream->receiving && !stream->endOfFile &&
+        stream->error == 0 && stream->received.size() < kMaxReceivedBuffers) {
+      if (ring->hasBuffersAvailable()) {
+        ring->queueReceive(stream->fd, encodeRequest(kReceiveRequest, id));
+        stream->receiving = true;
+      } else {
+        starved.insert(id);
+      }
+    }
+
+    if ((stream->events & EPOLLOUT) && !stream->writable && !stream->sending &&
+        !stream->polling && stream->error == 0) {
+      ring->queuePoll(stream->fd, EPOLLOUT, encodeRequest(kPollRequest, id));
+      stream->polling = true;
+    }
+
+    uint32_t events = 0;
+    if ((stream->events & EPOLLIN) &&
+        (!stream->received.empty() || stream->endOfFile || stream->error != 0)) {
+      events |= EPOLLIN;
+    }
+    if ((stream->events & EPOLLOUT) && stream->writable && !stream->sending) events |= EPOLLOUT;
+    if (stream->error != 0) events |= EPOLLERR;
+    if (events != 0) reports[id] |= events;
+  }
+
+  unsettled.clear();
+}
+
+/**
+ * Hands everything queued up by send to the kernel in a single request.
+ * inFlight isn't touched again until that request completes.
+ */
+void EventLoop::startSend(stream_t *stream) {
+  stream->inFlight.clear();
+  stream->inFlight.swap(stream->queued);
+  stream->inFlightOffset = 0;
+  stream->sending = true;
+  ring->queueSend(stream->fd, stream->inFlight.data(), stream->inFlight.size(),
+                  encodeRequest(kSendRequest, stream->id));
+}
+
+/**
+ * Applies the completion of one of a stream's requests to the stream.
+ * Data that lands in a provided buffer is held on to until it's taken by
+ * receive, but once a stream holds kMaxReceivedBuffers of them, its
+ * receive is cancelled (and queued up again once some have been taken),
+ * so that a stream that isn't being read from can't take every buffer.
+ */
+void EventLoop::onStreamCompletion(uint64_t userData, int result, uint32_t flags) {
+  uint64_t kind = (userData & ~kStreamRequest) >> kRequestShift;
+  uint64_t id = userData & kIDMask;
+  if (kind == kAcceptRequest) {
+    onAcceptCompletion(id, result, flags);
+    return;
+  }
+
+  auto found = streamsByID.find(id);
+  if (found == streamsByID.end()) return;
+  stream_t *stream = found->second.get();
+  if (kind == kReceiveRequest) {
+    if (flags & IORING_CQE_F_BUFFER) {
+      ring->noteBufferTaken();
+      uint16_t buffer = IOUring::getBufferID(flags);
+      if (result > 0 && !stream->retired) {
+        stream->received.push_back({ buffer, size_t(result) });
+      } else {
+        ring->recycleBuffer(buffer);
+      }
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) stream->receiving = stream->cancelling = false;
+    if (result == 0) {
+      stream->endOfFile = true;
+    } else if (result < 0 && result != -ECANCELED && result != -ENOBUFS) {
+      stream->error = -result;
+    }
+
+    if (stream->receiving && !stream->cancelling && !stream->retired &&
+        stream->received.size() >= kMaxReceivedBuffers) {
+      ring->queueCancel(userData, kIgnoredCompletion);
+      stream->cancelling = true;
+    }
+  } else if (kind == kSendRequest) {
+    stream->sending = false;
+    if (result <= 0) {
+      if (stream->error == 0) stream->error = result < 0 ? -result : EPIPE;
+      stream->queued.clear();
+    } else if (stream->inFlightOffset + result < stream->inFlight.size()) {
+      stream->inFlightOffset += result; // cut short, so the rest goes out on its own
+      stream->sending = true;
+      ring->queueSend(stream->fd, stream->inFlight.data() + stream->inFlightOffset,
+                      stream->inFlight.size() - stream->inFlightOffset, userData);
+    } else if (!stream->queued.empty()) {
+      startSend(stream);
+    }
+
+    if (!stream->sending) {
+      stream->inFlight.clear();
+      stream->writable = true;
+      if (stream->shutdownPending && stream->fd >= 0) shutdown(stream->fd, SHUT_WR);
+    }
+  } else if (kind == kPollRequest) {
+    stream->polling = false;
+    if (result >= 0) {
+      stream->writable = true;
+      if (!stream->retired && (result & (EPOLLERR | EPOLLHUP))) {
+        reports[id] |= result & (EPOLLERR | EPOLLHUP);
+      }
+    }
+  }
+
+  if (stream->retired) {
+    releaseStream(stream);
+  } else {
+    unsettled.insert(id);
+  }
+}
+
+/**
+ * Notes a connection accepted on behalf of the identified acceptor, to
+ * be handed over once the batch of events has been dispatched.  Should the
+ * multishot accept end (because accepting failed), it's queued up again
+ * along with the next wait.
+ */
+void EventLoop::onAcceptCompletion(size_t index, int result, uint32_t flags) {
+  if (!(flags & IORING_CQE_F_MORE)) acceptors[index].armed = false;
+  if (result >= 0) {
+    accepted.push_back(make_pair(index, result));
+  } else if (result != -ECONNABORTED && result != -EINTR && result != -EAGAIN) {
+    cerr << oslock << "Call to accept failed to return a valid client socket."
+         << endl << osunlock;
+  }
+}
+
+/**
+ * Waits for at most timeout milliseconds, and appends every descriptor
+ * found to be ready (along with its events) to the supplied list.  With
+ * io_uring, poll requests are one-shot, so descriptors that were reported
+ * on the previous round are polled again first, once their handlers have
+ * had the chance to consume whatever made them ready; a descriptor that's
+ * still ready is reported again right away, which is exactly what
+ * level-triggered epoll does.  Streams are settled both before the wait
+ * (which doesn't block at all if some are still ready) and after it, once
+ * the completions have been applied.  All of the requests that settling
+ * queues up go to the kernel along with the wait itself.
+ */
+static const int kMaxEventsPerWait = 256;
+bool EventLoop::waitForEvents(int timeout, ready_list_t& ready) {
+  if (!ring) {
+    struct epoll_event events[kMaxEventsPerWait];
+    int count = epoll_wait(epollfd, events, kMaxEventsPerWait, timeout);
+    if (count < 0) return errno == EINTR;
+    for (int i = 0; i < count; i++) {
+      ready.push_back({ int(events[i].data.fd), uint32_t(events[i].events), 0 });
+    }
+    return true;
+  }
+
+  for (int fd: fired) {
+    auto found = polls.find(fd);
+    if (found != polls.end() && !found->second.armed) armPoll(fd, found->second);
+  }
+  fired.clear();
+
+  for (size_t i = 0; i < acceptors.size(); i++) {
+    if (acceptors[i].armed) continue;
+    ring->queueAccept(acceptors[i].listenfd, encodeRequest(kAcceptRequest, i));
+    acceptors[i].armed = true;
+  }
+
+  if (!starved.empty() && ring->hasBuffersAvailable()) {
+    unsettled.insert(starved.begin(), starved.end());
+    starved.clear();
+  }
+
+  settleStreams();
+  if (!reports.empty()) timeout = 0;
+  bool succeeded = ring->submitAndWait(timeout, [this, &ready](uint64_t userData, int result,
+                                                               uint32_t flags) {
+      if (userData == kIgnoredCompletion) return;
+      if (userData & kStreamRequest) {
+        onStreamCompletion(userData, result, flags);
+        return;
+      }
+
+      int fd = (int) (uint32_t) userData;
+      auto found = polls.find(fd);
+      if (found == polls.end() || found->second.generation != userData >> 32) return;
+      found->second.armed = false;
+      fired.push_back(fd);
+      ready.push_back({ fd, result < 0 ? (uint32_t) EPOLLERR : (uint32_t) result, 0 });
+    });
+
+  settleStreams();
+  for (const auto& report: reports) {
+    auto found = streamsByID.find(report.first);
+    if (found == streamsByID.end() || found->second->retired) continue;
+    ready.push_back({ found->second->fd, report.second, report.first });
+  }
+  reports.clear();
+  return succeeded;
+}
+
+/**
+ * Invokes the handler associated with the supplied descriptor.  A
+ * copy of the shared_ptr is held for the duration of the call so that a
+ * handler can unwatch (and thereby release) itself without pulling the
+ * function out from under its own feet.  Handlers are expected to deal with
+ * their own failures, but any stray exception is confined to the one
+ * descriptor so that it doesn't bring down every other connection on the loop.
+ * Events for a stream are dropped if it's been unwatched earlier in the
+ * same batch, even if its descriptor has since been watched again, and
+ * otherwise the stream is settled again once the batch has been dispatched.
+ */
+void EventLoop::dispatch(const ready_t& event) {
+  if (event.stream != 0) {
+    stream_t *stream = findStream(event.fd);
+    if (stream == NULL || stream->id != event.stream) return;
+    unsettled.insert(event.stream);
+  }
+
+  auto found = handlers.find(event.fd);
+  if (found == handlers.end()) return; // unwatched earlier in the same batch
+  shared_ptr<IOHandler> handler = found->second;
+  try {
+    (*handler)(event.events);
+  } catch (const exception& e) {
+    cerr << oslock << "Unexpected failure while servicing descriptor " << event.fd
+         << ": " << e.what() << endl << osunlock;
+  } catch (...) {
+    cerr << oslock << "Unexpected failure while servicing descriptor " << event.fd
+         << "." << endl << osunlock;
+  }
+}
+
+/**
+ * Hands every connection accepted by io_uring during the last wait over
+ * to its acceptor's handler.
+ */
+void EventLoop::runAcceptHandlers() {
+  vector<pair<size_t, int> > batch;
+  batch.swap(accepted);
+  for (const pair<size_t, int>& connection: batch) {
+    shared_ptr<AcceptHandler> handler = acceptors[connection.first].handler;
+    int fd = connection.second;
+    runThunk([handler, fd]() { (*handler)(fd, NULL); }, "accept handler");
+  }
+}
+
+/**
+ * Returns the number of milliseconds the loop should block for: until
+ * the earliest timer is due (rounded up, so the loop doesn't spin waking
+ * up a hair too early), or indefinitely if there are no timers at all.
+ */
+int EventLoop::computeWaitTimeout() const {
+  if (timers.empty()) return -1;
+  chrono::steady_clock::duration remaining = timers.begin()->first - chrono::steady_clock::now();
+  if (remaining <= chrono::steady_clock::duration::zero()) return 0;
+  return chrono::duration_cast<chrono::milliseconds>(remaining).count() + 1;
+}
+
+void EventLoop::runExpiredTimers() {
+  deadline_t now = chrono::steady_clock::now();
+  while (!timers.empty() && timers.begin()->first <= now) {
+    function<void(void)> thunk = timers.begin()->second.second;
+    timersByID.erase(timers.begin()->second.first);
+    timers.erase(timers.begin());
+    runThunk(thunk, "timer");
+  }
+}
+
+void EventLoop::runPostedThunks() {
+  uint64_t count;
+  while (read(wakeupfd, &count, sizeof(count)) > 0);
+  vector<function<void(void)> > thunks;
+  postedLock.lock();
+  thunks.swap(posted);
+  postedLock.unlock();
+  for (const function<void(void)>& thunk: thunks) {
+    runThunk(thunk, "posted thunk");
+  }
+}
+
+/**
+ * Invokes a timer or posted thunk, confining any stray exception to that
+ * one thunk in the same way dispatch does for descriptor handlers.
+ */
+void EventLoop::runThunk(const function<void(void)>& thunk, const char *kind) {
+  try {
+    thunk();
+  } catch (const exception& e) {
+    cerr << oslock << "Unexpected failure while running " << kind
+         << ": " << e.what() << endl << osunlock;
+  } catch (...) {
+    cerr << oslock << "Unexpected failure while running " << kind
+         << "." << endl << osunlock;
+  }
+}
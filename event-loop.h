@@ -0,0 +1,259 @@
+/**
+ * File: event-loop.h
+ * ------------------
+ * Defines the EventLoop class, which is a thin wrapper around either a
+ * Linux epoll instance or (should one be requested) an io_uring instance.
+ * An EventLoop is driven by exactly one thread (the one that calls run),
+ * and it dispatches readiness events for every registered file descriptor
+ * to the handler registered alongside it.  Other threads communicate with
+ * a loop by posting thunks to it, which are then executed on the loop's
+ * own thread.
+ */
+
+#ifndef _event_loop_
+#define _event_loop_
+
+#include <chrono>        // for steady_clock
+#include <cstddef>       // for size_t
+#include <cstdint>       // for uint32_t, uint64_t
+#include <deque>
+#include <functional>    // for function
+#include <map>
+#include <memory>        // for shared_ptr, unique_ptr
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>       // for pair
+#include <vector>
+#include <netinet/in.h>  // for sockaddr_in
+#include <sys/types.h>   // for ssize_t
+
+#include "io-uring.h"
+#include "proxy-exception.h"
+
+class EventLoop {
+ public:
+
+/**
+ * Handlers are invoked with the epoll event mask (some combination of
+ * EPOLLIN, EPOLLOUT, EPOLLHUP, EPOLLERR, etc.) describing why the
+ * descriptor they're associated with was reported as ready.
+ */
+  typedef std::function<void(uint32_t events)> IOHandler;
+
+/**
+ * Accept handlers are invoked with each newly accepted (non-blocking)
+ * connection, along with the client's address, or NULL if the backend
+ * didn't collect it.  The handler takes ownership of the connection.
+ */
+  typedef std::function<void(int fd, const struct sockaddr_in *address)> AcceptHandler;
+
+/**
+ * Identifies the mechanism a loop is built on.  With kEpoll, handlers
+ * are told a socket is ready and then perform the system calls themselves.
+ * With kIOUring, the loop performs the I/O itself, by way of requests that
+ * complete on an io_uring instance: every watched socket has a multishot
+ * receive outstanding (feeding a ring of buffers registered with the
+ * kernel) for as long as it's watched for EPOLLIN, sends are queued up and
+ * go out without waiting for the socket to be writable, and listening
+ * sockets have a multishot accept outstanding.  Every request made by one
+ * round of handlers is submitted in a single batch along with the next
+ * wait.  Handlers see exactly what they see with epoll, provided they move
+ * data with receive and send rather than with the system calls.
+ */
+  enum Backend { kEpoll, kIOUring };
+
+/**
+ * Creates the epoll (or io_uring) instance, along with the eventfd used
+ * to wake the loop up whenever a thunk is posted.  If either can't be
+ * created, then an HTTPProxyException is thrown.
+ */
+  EventLoop(Backend backend = kEpoll) throw (HTTPProxyException);
+  ~EventLoop();
+
+/**
+ * Returns the backend the loop was created with.
+ */
+  Backend getBackend() const { return ring ? kIOUring : kEpoll; }
+
+/**
+ * Waits for and dispatches events forever.  run should only be called
+ * once, and only from the thread that's to own the loop.
+ */
+  void run();
+
+/**
+ * Registers the provided descriptor so that the supplied handler is
+ * invoked whenever any of the identified events are detected.  Watching a
+ * descriptor that's already watched replaces its handler and interests
+ * (and, with kIOUring, keeps whatever it's received but no one has taken
+ * yet).  watch, modify, unwatch, and everything else short of post should
+ * only be called from the loop's own thread (typically from within a
+ * handler or a posted thunk).  With kIOUring, the descriptor must be a
+ * connected (or connecting) stream socket.
+ */
+  void watch(int fd, uint32_t events, const IOHandler& handler);
+
+/**
+ * Registers the provided listening socket so that the supplied handler is
+ * invoked with every connection accepted on it.  With kEpoll, the socket
+ * is watched for the supplied events (EPOLLEXCLUSIVE among them, if the
+ * socket is shared with other loops), and a limited batch of connections
+ * is accepted every time it's reported as ready.
+ */
+  void watchAccepts(int listenfd, uint32_t events, const AcceptHandler& handler);
+
+/**
+ * Changes the set of events the already watched descriptor is
+ * interested in.
+ */
+  void modify(int fd, uint32_t events);
+
+/**
+ * Unregisters the provided descriptor and releases its handler.  It's
+ * safe for a handler to unwatch its own descriptor while it's running.
+ * With kIOUring, anything received but not yet taken is discarded, any
+ * receive is cancelled before unwatch returns (so the descriptor can
+ * safely be handed to another loop), and anything accepted by send that
+ * hasn't gone out yet still does, even if the descriptor is then closed.
+ */
+  void unwatch(int fd);
+
+/**
+ * Behaves just like recv (with no flags) on the supplied descriptor.
+ * With kIOUring, it takes whatever a watched socket has already received,
+ * and fails with EAGAIN if there's nothing.
+ */
+  ssize_t receive(int fd, void *buffer, size_t length);
+
+/**
+ * Behaves just like send on the supplied descriptor.  With kIOUring, a
+ * watched socket's data is copied into a backlog of bounded size, and the
+ * flags are ignored (SIGPIPE is never raised); should the backlog be full,
+ * send fails with EAGAIN, and EPOLLOUT is reported once it has drained.
+ */
+  ssize_t send(int fd, const void *data, size_t length, int flags);
+
+/**
+ * Shuts down the write side of the supplied socket, once (with kIOUring)
+ * everything sent through the loop has gone out.
+ */
+  void shutdownWrites(int fd);
+
+/**
+ * Schedules the provided thunk to be executed on the loop's thread the
+ * next time it wakes up.  Unlike the other methods, post can be called
+ * from any thread.
+ */
+  void post(const std::function<void(void)>& thunk);
+
+/**
+ * Arranges for the provided thunk to be executed on the loop's thread
+ * once the specified number of milliseconds has elapsed, and returns an
+ * identifier (never 0) that can be passed to cancelTimer should the thunk
+ * no longer need to run.  Like watch, addTimer and cancelTimer should only be called
+ * from the loop's own thread.
+ */
+  size_t addTimer(long milliseconds, const std::function<void(void)>& thunk);
+
+/**
+ * Cancels the identified timer.  Cancelling a timer that has already
+ * fired (or has already been cancelled) is a harmless no-op.
+ */
+  void cancelTimer(size_t id);
+
+ private:
+  typedef std::chrono::steady_clock::time_point deadline_t;
+  typedef std::multimap<deadline_t, std::pair<size_t, std::function<void(void)> > > timer_queue_t;
+
+  typedef struct {
+    int fd;
+    uint32_t events;
+    uint64_t stream;         // the id of the stream the events are for, or 0
+  } ready_t;
+  typedef std::vector<ready_t> ready_list_t;
+
+  typedef struct {
+    uint32_t events;
+    uint32_t generation;     // distinguishes this poll from earlier ones on the same fd
+    bool armed;              // a poll request is outstanding
+  } poll_t;
+
+  typedef struct {
+    uint16_t buffer;         // provided buffer the data landed in
+    size_t length;
+  } received_t;
+
+  typedef struct {
+    int fd;                  // a duplicate once retired with a send outstanding
+    uint64_t id;
+    uint32_t events;
+    bool receiving;          // a multishot receive is outstanding
+    bool cancelling;         // ...and its cancellation has been requested
+    bool polling;            // a poll for writability is outstanding
+    bool sending;            // a send of inFlight is outstanding
+    bool writable;           // the backlog has drained (or the poll has fired) since it last filled
+    bool endOfFile;
+    int error;               // sticky errno of a failed receive or send, or 0
+    std::deque<received_t> received;
+    size_t receivedOffset;   // into the first of received
+    std::string queued;      // accepted by send, but not yet handed to the kernel
+    std::string inFlight;
+    size_t inFlightOffset;
+    bool shutdownPending;
+    bool retired;            // unwatched, but with requests still outstanding
+  } stream_t;
+
+  typedef struct {
+    int listenfd;
+    std::shared_ptr<AcceptHandler> handler;
+    bool armed;
+  } acceptor_t;
+
+  int epollfd;               // -1 when backed by an io_uring instance
+  int wakeupfd;
+  std::unique_ptr<IOUring> ring;
+  std::unordered_map<int, poll_t> polls;
+  std::vector<int> fired;    // polled descriptors awaiting a new poll request
+  uint32_t nextGeneration;
+  std::unordered_map<int, stream_t *> streams;
+  std::unordered_map<uint64_t, std::unique_ptr<stream_t> > streamsByID;
+  std::unordered_set<uint64_t> unsettled;  // streams whose state may have changed
+  std::unordered_set<uint64_t> starved;    // streams waiting on provided buffers
+  std::unordered_map<uint64_t, uint32_t> reports;
+  uint64_t nextStreamID;
+  std::vector<acceptor_t> acceptors;
+  std::vector<std::pair<size_t, int> > accepted;
+  std::unordered_map<int, std::shared_ptr<IOHandler> > handlers;
+  std::mutex postedLock;
+  std::vector<std::function<void(void)> > posted;
+  timer_queue_t timers;
+  std::unordered_map<size_t, timer_queue_t::iterator> timersByID;
+  size_t nextTimerID;
+
+  bool addInterest(int fd, uint32_t events);
+  void changeInterest(int fd, uint32_t events);
+  void removeInterest(int fd);
+  void armPoll(int fd, poll_t& poll);
+  void acceptConnections(int listenfd, const AcceptHandler& handler);
+  stream_t *findStream(int fd) const;
+  void retireStream(stream_t *stream);
+  void releaseStream(stream_t *stream);
+  void settleStreams();
+  void startSend(stream_t *stream);
+  void onStreamCompletion(uint64_t userData, int result, uint32_t flags);
+  void onAcceptCompletion(size_t index, int result, uint32_t flags);
+  bool waitForEvents(int timeout, ready_list_t& ready);
+  void dispatch(const ready_t& event);
+  void runAcceptHandlers();
+  void runPostedThunks();
+  static void runThunk(const std::function<void(void)>& thunk, const char *kind);
+  int computeWaitTimeout() const;
+  void runExpiredTimers();
+
+  EventLoop(const EventLoop& original) = delete;
+  EventLoop& operator=(const EventLoop& rhs) = delete;
+};
+
+#endif
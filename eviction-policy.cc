@@ -0,0 +1,372 @@
+/**
+ * File: eviction-policy.cc
+ * ------------------------
+ * Presents the implementation of the EvictionPolicy class and the three
+ * policies it provides.
+ */
+
+#include "eviction-policy.h"
+
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+
+using namespace std;
+
+static const char *const kPolicyNames[] = { "lru", "clock", "tinylfu" };
+
+EvictionPolicy::EvictionPolicy(uint64_t maxBytes, uint64_t maxEntries) :
+  maxBytes(maxBytes), maxEntries(max<uint64_t>(maxEntries, 1)), bytes(0), entries(0),
+  hits(0), misses(0) {}
+
+void EvictionPolicy::recordAccess(const CacheKey& key, bool hit) {
+  if (hit) {
+    hits++;
+    onHit(key);
+  } else {
+    misses++;
+    onMiss(key);
+  }
+}
+
+/**
+ * Keeps entries in order of use, most recent first, and evicts from
+ * the back.
+ */
+class LRUPolicy : public EvictionPolicy {
+ public:
+  LRUPolicy(uint64_t maxBytes, uint64_t maxEntries) : EvictionPolicy(maxBytes, maxEntries) {}
+  const char *getName() const { return kPolicyNames[kLRU]; }
+  bool contains(const CacheKey& key) const { return index.count(key) > 0; }
+
+  bool admit(const CacheKey& key, uint64_t size, vector<CacheKey>& evicted) {
+    remove(key);
+    if (size > maxBytes) return false;
+    while (!fits(size)) {
+      evicted.push_back(items.back().key);
+      remove(items.back().key);
+    }
+
+    items.push_front({key, size});
+    index[key] = items.begin();
+    bytes += size;
+    entries++;
+    return true;
+  }
+
+  void remove(const CacheKey& key) {
+    auto found = index.find(key);
+    if (found == index.end()) return;
+    bytes -= found->second->size;
+    entries--;
+    items.erase(found->second);
+    index.erase(found);
+  }
+
+ protected:
+  void onHit(const CacheKey& key) {
+    auto found = index.find(key);
+    if (found != index.end()) items.splice(items.begin(), items, found->second);
+  }
+
+ private:
+  typedef struct {
+    CacheKey key;
+    uint64_t size;
+  } item_t;
+
+  list<item_t> items;
+  unordered_map<CacheKey, list<item_t>::iterator> index;
+};
+
+/**
+ * Keeps entries in a ring, each with a reference bit that's set whenever
+ * it's hit.  To evict, the hand sweeps around the ring, clearing the bits
+ * it finds set, until it comes upon one that's clear.  New entries are
+ * placed just behind the hand, so they're the last the hand comes back to.
+ */
+class ClockPolicy : public EvictionPolicy {
+ public:
+  ClockPolicy(uint64_t maxBytes, uint64_t maxEntries) :
+    EvictionPolicy(maxBytes, maxEntries), hand(ring.end()) {}
+  const char *getName() const { return kPolicyNames[kClock]; }
+  bool contains(const CacheKey& key) const { return index.count(key) > 0; }
+
+  bool admit(const CacheKey& key, uint64_t size, vector<CacheKey>& evicted) {
+    remove(key);
+    if (size > maxBytes) return false;
+    while (!fits(size)) {
+      if (hand == ring.end()) hand = ring.begin();
+      if (hand->referenced) {
+        hand->referenced = false;
+        ++hand;
+      } else {
+        evicted.push_back(hand->key);
+        remove(hand->key);
+      }
+    }
+
+    index[key] = ring.insert(hand, {key, size, false});
+    bytes += size;
+    entries++;
+    return true;
+  }
+
+  void remove(const CacheKey& key) {
+    auto found = index.find(key);
+    if (found == index.end()) return;
+    if (hand == found->second) ++hand;
+    bytes -= found->second->size;
+    entries--;
+    ring.erase(found->second);
+    index.erase(found);
+  }
+
+ protected:
+  void onHit(const CacheKey& key) {
+    auto found = index.find(key);
+    if (found != index.end()) found->second->referenced = true;
+  }
+
+ private:
+  typedef struct {
+    CacheKey key;
+    uint64_t size;
+    bool referenced;
+  } item_t;
+
+  list<item_t> ring;
+  list<item_t>::iterator hand;
+  unordered_map<CacheKey, list<item_t>::iterator> index;
+};
+
+/**
+ * Estimates how often each key has been accessed recently, in a fixed
+ * amount of space: each key maps to one counter in each of four rows, and
+ * its estimate is the smallest of those counters, which can overestimate
+ * (when other keys share all four) but never underestimate.  Counters
+ * saturate at 15, and every so often all of them are halved, so that
+ * what was popular long ago gradually stops counting.
+ */
+class CountMinSketch {
+ public:
+  CountMinSketch(uint64_t expectedKeys) : additions(0) {
+    size_t width = 16;
+    while (width < expectedKeys && width < kMaxWidth) width <<= 1;
+    mask = width - 1;
+    counters.assign(kDepth * width, 0);
+    resetThreshold = 10 * width;
+  }
+
+  unsigned estimate(const CacheKey& key) const {
+    unsigned frequency = kMaxCount;
+    for (size_t row = 0; row < kDepth; row++) {
+      frequency = min<unsigned>(frequency, counters[getIndex(key, row)]);
+    }
+    return frequency;
+  }
+
+  void increment(const CacheKey& key) {
+    for (size_t row = 0; row < kDepth; row++) {
+      uint8_t& counter = counters[getIndex(key, row)];
+      if (counter < kMaxCount) counter++;
+    }
+    if (++additions == resetThreshold) {
+      for (uint8_t& counter: counters) counter >>= 1;
+      additions /= 2;
+    }
+  }
+
+ private:
+  static const size_t kDepth = 4;
+  static const size_t kMaxWidth = 1 << 24;
+  static const unsigned kMaxCount = 15;
+
+  vector<uint8_t> counters;
+  uint64_t mask;
+  uint64_t additions;
+  uint64_t resetThreshold;
+
+  size_t getIndex(const CacheKey& key, size_t row) const {
+    static const uint64_t kSeeds[kDepth] = {
+      0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+    };
+    uint64_t hash = (key.getLow() + kSeeds[row]) * kSeeds[(row + 1) % kDepth];
+    return row * (mask + 1) + ((hash ^ (hash >> 32)) & mask);
+  }
+};
+
+/**
+ * New entries go to the front of the window, which gets 1% of the budget.
+ * What falls off the back of the window is a candidate for the main
+ * region, and it's let in only if there's room or it's more popular than
+ * the entry that would be evicted to make room (the coldest one on
+ * probation); otherwise the candidate itself is evicted.  The main region
+ * is a segmented LRU: entries enter on probation, and are promoted to the
+ * protected segment (which gets 80% of the main region) when hit again,
+ * with the coldest protected entries demoted back to probation as needed.
+ */
+class TinyLFUPolicy : public EvictionPolicy {
+ public:
+  TinyLFUPolicy(uint64_t maxBytes, uint64_t maxEntries) :
+    EvictionPolicy(maxBytes, maxEntries), sketch(this->maxEntries) {
+    regions[kWindow].maxBytes = max<uint64_t>(maxBytes / 100, 1);
+    regions[kWindow].maxEntries = max<uint64_t>(this->maxEntries / 100, 1);
+    uint64_t mainBytes = maxBytes - regions[kWindow].maxBytes;
+    uint64_t mainEntries = max<uint64_t>(this->maxEntries - regions[kWindow].maxEntries, 1);
+    regions[kProtected].maxBytes = mainBytes * 4 / 5;
+    regions[kProtected].maxEntries = mainEntries * 4 / 5;
+    regions[kProbation].maxBytes = mainBytes;   // so probation and protected
+    regions[kProbation].maxEntries = mainEntries; // are limited together
+    for (region_t& region: regions) {
+      region.bytes = 0;
+      region.entries = 0;
+    }
+  }
+
+  const char *getName() const { return kPolicyNames[kTinyLFU]; }
+  bool contains(const CacheKey& key) const { return index.count(key) > 0; }
+
+  bool admit(const CacheKey& key, uint64_t size, vector<CacheKey>& evicted) {
+    remove(key);
+    if (size > maxBytes) return false;
+    insert(kWindow, key, size);
+    bool admitted = true;
+    region_t& window = regions[kWindow];
+    while (window.bytes > window.maxBytes || window.entries > window.maxEntries) {
+      item_t candidate = window.items.back();
+      erase(candidate.key);
+      if (!admitToMain(candidate, evicted)) {
+        if (candidate.key == key) admitted = false; // too big for the window, and not popular
+        else evicted.push_back(candidate.key);
+      }
+    }
+    return admitted;
+  }
+
+  void remove(const CacheKey& key) {
+    erase(key);
+  }
+
+ protected:
+  void onHit(const CacheKey& key) {
+    sketch.increment(key);
+    auto found = index.find(key);
+    if (found == index.end()) return;
+    Region region = found->second.region;
+    region_t& current = regions[region];
+    if (region != kProbation) {
+      current.items.splice(current.items.begin(), current.items, found->second.item);
+      return;
+    }
+
+    item_t item = *found->second.item;
+    erase(key);
+    insert(kProtected, item.key, item.size);
+    region_t& protectedRegion = regions[kProtected];
+    while (protectedRegion.entries > 1 && (protectedRegion.bytes > protectedRegion.maxBytes ||
+                                           protectedRegion.entries > protectedRegion.maxEntries)) {
+      item_t demoted = protectedRegion.items.back();
+      erase(demoted.key);
+      insert(kProbation, demoted.key, demoted.size);
+    }
+  }
+
+  void onMiss(const CacheKey& key) {
+    sketch.increment(key);
+  }
+
+ private:
+  enum Region { kWindow, kProbation, kProtected, kNumRegions };
+
+  typedef struct {
+    CacheKey key;
+    uint64_t size;
+  } item_t;
+
+  typedef struct {
+    list<item_t> items;      // most recently used first
+    uint64_t bytes;
+    uint64_t entries;
+    uint64_t maxBytes;
+    uint64_t maxEntries;
+  } region_t;
+
+  typedef struct {
+    Region region;
+    list<item_t>::iterator item;
+  } location_t;
+
+  CountMinSketch sketch;
+  region_t regions[kNumRegions];
+  unordered_map<CacheKey, location_t> index;
+
+  uint64_t getMainBytes() const { return regions[kProbation].bytes + regions[kProtected].bytes; }
+  uint64_t getMainEntries() const {
+    return regions[kProbation].entries + regions[kProtected].entries;
+  }
+
+/**
+ * Makes room in the main region for candidate by evicting the coldest
+ * entries there, for as long as candidate is the more popular, and admits
+ * it to probation if that makes enough room.
+ */
+  bool admitToMain(const item_t& candidate, vector<CacheKey>& evicted) {
+    const region_t& probation = regions[kProbation];
+    if (candidate.size > probation.maxBytes) return false;
+    while (getMainBytes() + candidate.size > probation.maxBytes ||
+           getMainEntries() + 1 > probation.maxEntries) {
+      region_t& main = regions[kProbation].entries > 0 ? regions[kProbation] : regions[kProtected];
+      if (main.entries == 0) return false;
+      const item_t& victim = main.items.back();
+      if (sketch.estimate(candidate.key) <= sketch.estimate(victim.key)) return false;
+      evicted.push_back(victim.key);
+      erase(victim.key);
+    }
+
+    insert(kProbation, candidate.key, candidate.size);
+    return true;
+  }
+
+  void insert(Region region, const CacheKey& key, uint64_t size) {
+    region_t& r = regions[region];
+    r.items.push_front({key, size});
+    r.bytes += size;
+    r.entries++;
+    index[key] = {region, r.items.begin()};
+    bytes += size;
+    entries++;
+  }
+
+  void erase(const CacheKey& key) {
+    auto found = index.find(key);
+    if (found == index.end()) return;
+    region_t& r = regions[found->second.region];
+    uint64_t size = found->second.item->size;
+    r.bytes -= size;
+    r.entries--;
+    r.items.erase(found->second.item);
+    index.erase(found);
+    bytes -= size;
+    entries--;
+  }
+};
+
+EvictionPolicy *EvictionPolicy::create(Kind kind, uint64_t maxBytes, uint64_t maxEntries) {
+  switch (kind) {
+  case kLRU: return new LRUPolicy(maxBytes, maxEntries);
+  case kClock: return new ClockPolicy(maxBytes, maxEntries);
+  default: return new TinyLFUPolicy(maxBytes, maxEntries);
+  }
+}
+
+bool EvictionPolicy::parseKind(const string& name, Kind& kind) {
+  for (int k = 0; k < kNumKinds; k++) {
+    if (name == kPolicyNames[k]) {
+      kind = Kind(k);
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,98 @@
+/**
+ * File: eviction-policy.h
+ * -----------------------
+ * Defines the EvictionPolicy class, which decides what the cache keeps
+ * when it's full: whether a new entry is worth admitting at all, and
+ * which entries must go to make room for it.  A policy knows entries only
+ * by key and size, and keeps the cache within a budget of bytes and a
+ * budget of entries.  Three policies are provided:
+ *
+ *   - LRU evicts whatever was used least recently.
+ *   - CLOCK approximates LRU with a reference bit per entry and a hand
+ *     that sweeps around them, so a hit needn't reorder anything.
+ *   - W-TinyLFU admits new entries to a small LRU window, and lets them
+ *     into the main (segmented LRU) region only if a count-min sketch of
+ *     recent access frequencies says they're used more often than what
+ *     they'd displace, so a burst of one-hit wonders can't flush out the
+ *     entries that are actually popular.
+ *
+ * Every policy counts the hits and misses reported to it, so policies
+ * can be compared by hit ratio.  Policies aren't thread-safe.
+ */
+
+#ifndef _http_eviction_policy_
+#define _http_eviction_policy_
+
+#include <cstddef>   // for size_t
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cache-key.h"
+
+class EvictionPolicy {
+ public:
+  enum Kind { kLRU, kClock, kTinyLFU, kNumKinds };
+
+/**
+ * Returns a newly allocated policy of the supplied kind, which keeps the
+ * cache within maxBytes bytes and maxEntries entries.
+ */
+  static EvictionPolicy *create(Kind kind, uint64_t maxBytes, uint64_t maxEntries);
+
+/**
+ * Sets kind to the policy named by name ("lru", "clock", or "tinylfu") and
+ * returns true, or returns false if there's no policy by that name.
+ */
+  static bool parseKind(const std::string& name, Kind& kind);
+
+  virtual ~EvictionPolicy() {}
+  virtual const char *getName() const = 0;
+
+/**
+ * Returns whether key is one of the entries the policy is keeping.
+ */
+  virtual bool contains(const CacheKey& key) const = 0;
+
+/**
+ * Notes that key was looked up, and whether it was found.
+ */
+  void recordAccess(const CacheKey& key, bool hit);
+
+/**
+ * Offers key, whose entry takes up size bytes, for admission, replacing
+ * whatever entry was previously admitted under key.  Returns whether it
+ * was admitted, and appends the keys of every other entry that was evicted
+ * as a result (whether to make room, or because it lost out to key) to
+ * evicted.
+ */
+  virtual bool admit(const CacheKey& key, uint64_t size, std::vector<CacheKey>& evicted) = 0;
+
+/**
+ * Forgets key, which is no longer in the cache for reasons of its own
+ * (it expired, say).
+ */
+  virtual void remove(const CacheKey& key) = 0;
+
+  uint64_t getHits() const { return hits; }
+  uint64_t getMisses() const { return misses; }
+  uint64_t getBytes() const { return bytes; }
+  uint64_t getEntries() const { return entries; }
+
+ protected:
+  EvictionPolicy(uint64_t maxBytes, uint64_t maxEntries);
+  virtual void onHit(const CacheKey& key) = 0;
+  virtual void onMiss(const CacheKey& key) {}
+  bool fits(uint64_t size) const { return bytes + size <= maxBytes && entries < maxEntries; }
+
+  uint64_t maxBytes;
+  uint64_t maxEntries;
+  uint64_t bytes;
+  uint64_t entries;
+
+ private:
+  uint64_t hits;
+  uint64_t misses;
+};
+
+#endif
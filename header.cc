@@ -8,6 +8,8 @@
 #include "header.h"
 
 #include <iostream> // for cerr
+#include <algorithm> // for max
+#include <climits>  // for LONG_MAX
 #include <sstream>
 #include "string-utils.h"
 
@@ -15,8 +17,51 @@ using namespace std;
 
 /** public methods and functions **/
 
-void HTTPHeader::ingestHeader(std::istream& instream) {
+HTTPHeader::HTTPHeader(Arena *arena) : fields(ArenaAllocator<field_t>(arena)) {}
+
+/**
+ * The known names are matched by hash first, and the canonical name is
+ * compared to be sure, since an unknown name could share a known one's hash.
+ */
+HTTPHeader::Name HTTPHeader::lookupName(const StringView& name) {
+  Name id;
+  switch (hashName(name)) {
+    case hashName("accept"): id = kAccept; break;
+    case hashName("accept-encoding"): id = kAcceptEncoding; break;
+    case hashName("age"): id = kAge; break;
+    case hashName("authorization"): id = kAuthorization; break;
+    case hashName("cache-control"): id = kCacheControl; break;
+    case hashName("connection"): id = kConnection; break;
+    case hashName("content-encoding"): id = kContentEncoding; break;
+    case hashName("content-length"): id = kContentLength; break;
+    case hashName("content-type"): id = kContentType; break;
+    case hashName("date"): id = kDate; break;
+    case hashName("etag"): id = kETag; break;
+    case hashName("expires"): id = kExpires; break;
+    case hashName("host"): id = kHost; break;
+    case hashName("if-modified-since"): id = kIfModifiedSince; break;
+    case hashName("if-none-match"): id = kIfNoneMatch; break;
+    case hashName("keep-alive"): id = kKeepAlive; break;
+    case hashName("last-modified"): id = kLastModified; break;
+    case hashName("location"): id = kLocation; break;
+    case hashName("pragma"): id = kPragma; break;
+    case hashName("proxy-connection"): id = kProxyConnection; break;
+    case hashName("server"): id = kServer; break;
+    case hashName("transfer-encoding"): id = kTransferEncoding; break;
+    case hashName("user-agent"): id = kUserAgent; break;
+    case hashName("vary"): id = kVary; break;
+    case hashName("x-forwarded-for"): id = kXForwardedFor; break;
+    case hashName("x-forwarded-proto"): id = kXForwardedProto; break;
+    default: return kUnknownName;
+  }
+
+  return name.equalsIgnoreCase(getCanonicalName(id)) ? id : kUnknownName;
+}
+
+bool HTTPHeader::ingestHeader(std::istream& instream) {
   string name;
+  int last = -1;
+  bool wellFormed = true;
   while (true) {
     string line;
     getline(instream, line);
@@ -24,17 +69,39 @@ void HTTPHeader::ingestHeader(std::istream& instream) {
     if (line.empty()) break;
     if (line[0] == ' ') {
       line = trim(line);
-      extendHeader(name, line);
+      if (last >= 0) extendField(last, line);
     } else {
       istringstream iss(line);
       getline(iss, name, ':');
+      if (!name.empty() && (name.back() == ' ' || name.back() == '\t')) wellFormed = false;
       name = trim(name);
       string value;
       getline(iss, value);
       value = trim(value);
-      addHeader(name, value);
+      last = appendField(lookupName(name), name, value);
+    }
+  }
+  collapseContentLength();
+  return wellFormed;
+}
+
+/**
+ * Fields are appended in the order they arrive, repeated names included,
+ * so the header is relayed in its original order.  The array is sized
+ * once, up front, since the parser already knows how many fields there are.
+ */
+void HTTPHeader::ingestHeader(const HTTPParser& parser) {
+  fields.reserve(fields.size() + parser.getFieldCount());
+  int last = -1;
+  for (size_t i = 0; i < parser.getFieldCount(); i++) {
+    HTTPParser::field_t field = parser.getField(i);
+    if (field.continuation) {
+      if (last >= 0) extendField(last, field.value);
+    } else {
+      last = appendField(lookupName(field.name), field.name, field.value);
     }
   }
+  collapseContentLength();
 }
 
 void HTTPHeader::addHeader(const string& name, int value) {
@@ -44,45 +111,283 @@ void HTTPHeader::addHeader(const string& name, int value) {
 }
 
 void HTTPHeader::addHeader(const string& name, const string& value) {
-  string normalizedName = toLowerCase(name);
-  headers[normalizedName] = value;
+  setField(lookupName(name), name, value);
+}
+
+void HTTPHeader::addHeader(Name name, const string& value) {
+  setField(name, getCanonicalName(name), value);
+}
+
+static bool describesOwnMessage(HTTPHeader::Name id) {
+  switch (id) {
+  case HTTPHeader::kConnection: case HTTPHeader::kContentLength: case HTTPHeader::kKeepAlive:
+  case HTTPHeader::kProxyConnection: case HTTPHeader::kTransferEncoding:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * All of the fields under a name other has are removed before any of
+ * other's are added, so that a name other repeats is replaced by every one
+ * of its fields rather than just the last.
+ */
+void HTTPHeader::updateHeader(const HTTPHeader& other) {
+  for (const field_t& field: other.fields) {
+    if (!describesOwnMessage(field.id)) {
+      removeField(field.id, StringView(field.name.data(), field.name.size()));
+    }
+  }
+  for (const field_t& field: other.fields) {
+    if (!describesOwnMessage(field.id)) {
+      appendField(field.id, StringView(field.name.data(), field.name.size()),
+                  StringView(field.value.data(), field.value.size()));
+    }
+  }
 }
 
 void HTTPHeader::removeHeader(const string& name) {
-  headers.erase(toLowerCase(name));
+  removeField(lookupName(name), name);
+}
+
+void HTTPHeader::removeHeader(Name name) {
+  removeField(name, getCanonicalName(name));
 }
 
 bool HTTPHeader::containsName(const string& name) const {
-  string normalizedName = toLowerCase(name);
-  return headers.find(normalizedName) != headers.end();
+  return findField(lookupName(name), name) >= 0;
+}
+
+bool HTTPHeader::containsName(Name name) const {
+  return findField(name, StringView()) >= 0;
+}
+
+StringView HTTPHeader::getValueAsString(const string& name) const {
+  int index = findField(lookupName(name), name);
+  return index < 0 ? StringView() : StringView(fields[index].value.data(), fields[index].value.size());
 }
 
-static const string kEmptyString;
-const string& HTTPHeader::getValueAsString(const string& name) const {
-  string normalizedName = toLowerCase(name);
-  auto found = headers.find(normalizedName);
-  return found == headers.end() ? kEmptyString : found->second;
+StringView HTTPHeader::getValueAsString(Name name) const {
+  int index = findField(name, StringView());
+  return index < 0 ? StringView() : StringView(fields[index].value.data(), fields[index].value.size());
+}
+
+string HTTPHeader::getValuesAsString(const string& name) const {
+  return joinValues(lookupName(name), name);
+}
+
+string HTTPHeader::getValuesAsString(Name name) const {
+  return joinValues(name, StringView());
+}
+
+/**
+ * Parses the value as 1*DIGIT in base 10 (RFC 9110, section 8.6), so
+ * nothing strtol would otherwise accept (a sign, leading whitespace, or a
+ * hexadecimal or octal prefix) sneaks through.  Returns -1 if the value
+ * isn't one, or if it doesn't fit in a long.
+ */
+static long parseDecimal(const StringView& value) {
+  if (value.empty()) return -1L;
+  long number = 0;
+  for (size_t i = 0; i < value.size(); i++) {
+    char ch = value[i];
+    if (ch < '0' || ch > '9') return -1L;
+    if (number > (LONG_MAX - (ch - '0')) / 10) return -1L;
+    number = number * 10 + (ch - '0');
+  }
+  return number;
+}
+
+static long parseNumber(const StringView& value) {
+  return max(parseDecimal(value), 0L);
 }
 
 long HTTPHeader::getValueAsNumber(const string& name) const {
-  string value = getValueAsString(name);
-  if (value.empty()) return 0L;
-  char *endptr;
-  long number = strtol(value.c_str(), &endptr, 0);
-  return *endptr == '\0' ? number : 0L;
+  return parseNumber(getValueAsString(name));
 }
 
-std::ostream& operator<<(std::ostream& os, const HTTPHeader& hh) {
-  for (const pair<string, string>& p: hh.headers) {
-    os << p.first << ": " << p.second << "\r\n";
+long HTTPHeader::getValueAsNumber(Name name) const {
+  return parseNumber(getValueAsString(name));
+}
+
+bool HTTPHeader::hasChunkedPayload() const {
+  string codings = getValuesAsString(kTransferEncoding);
+  size_t start = codings.rfind(',');
+  StringView finalCoding = StringView(codings).substr(start == string::npos ? 0 : start + 1).trim();
+  return finalCoding.equalsIgnoreCase("chunked");
+}
+
+bool HTTPHeader::hasValidContentLength() const {
+  return findContentLength() >= 0;
+}
+
+static const string kNameValueSeparator = ": ";
+static const string kLineTerminator = "\r\n";
+void HTTPHeader::serialize(IOVector& iov) const {
+  for (const field_t& field: fields) {
+    if (field.id == kUnknownName) {
+      iov.append(field.name.data(), field.name.size());
+    } else {
+      iov.append(getCanonicalName(field.id));
+    }
+    iov.append(kNameValueSeparator);
+    iov.append(field.value.data(), field.value.size());
+    iov.append(kLineTerminator);
   }
+}
 
+std::ostream& operator<<(std::ostream& os, const HTTPHeader& hh) {
+  IOVector iov;
+  hh.serialize(iov);
+  iov.writeTo(os);
   return os;
 }
 
 /** Private methods **/
 
-void HTTPHeader::extendHeader(const string& name, const string& value) {
-  string normalizedName = toLowerCase(name);
-  headers[normalizedName] += ' ' + value;
+/**
+ * Returns the length every Content-Length field agrees on, reading a field
+ * that lists the same length several times (as in "42, 42") as a recipient
+ * may (RFC 9112, section 6.3), or 0 if there aren't any.  Returns -1 if any
+ * value isn't a plain decimal number, or if they don't all agree.
+ */
+long HTTPHeader::findContentLength() const {
+  long length = 0;
+  bool seen = false;
+  for (const field_t& field: fields) {
+    if (field.id != kContentLength) continue;
+    StringView values(field.value.data(), field.value.size());
+    size_t start = 0;
+    while (true) {
+      size_t comma = values.find(",", start);
+      size_t end = comma == StringView::npos ? values.size() : comma;
+      long number = parseDecimal(values.substr(start, end - start).trim());
+      if (number < 0 || (seen && number != length)) return -1L;
+      length = number;
+      seen = true;
+      if (comma == StringView::npos) break;
+      start = comma + 1;
+    }
+  }
+  return length;
+}
+
+/**
+ * Replaces Content-Length fields that repeat the same length with a single
+ * field naming it once, so the rest of the proxy, and whoever the message
+ * is forwarded to, sees just the one.  Fields that disagree are left alone,
+ * for hasValidContentLength to reject.
+ */
+void HTTPHeader::collapseContentLength() {
+  if (!containsName(kContentLength)) return;
+  long length = findContentLength();
+  if (length < 0) return;
+  string value = to_string(length);
+  if (getValuesAsString(kContentLength) != value) {
+    setField(kContentLength, getCanonicalName(kContentLength), value);
+  }
+}
+
+uint32_t HTTPHeader::hashName(const StringView& name) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < name.size(); i++) {
+    hash = (hash ^ uint8_t(StringView::toLower(name[i]))) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * The names are spelled in lowercase, which is how the proxy has always
+ * relayed header names.
+ */
+static const string kCanonicalNames[] = {
+  "", "accept", "accept-encoding", "age", "authorization", "cache-control", "connection",
+  "content-encoding", "content-length", "content-type", "date", "etag",
+  "expires", "host", "if-modified-since", "if-none-match", "keep-alive",
+  "last-modified", "location", "pragma", "proxy-connection", "server",
+  "transfer-encoding", "user-agent", "vary", "x-forwarded-for",
+  "x-forwarded-proto"
+};
+
+static_assert(sizeof(kCanonicalNames) / sizeof(kCanonicalNames[0]) == HTTPHeader::kNameCount,
+              "kCanonicalNames must have one entry per HTTPHeader::Name");
+
+const string& HTTPHeader::getCanonicalName(Name name) {
+  return kCanonicalNames[name];
+}
+
+/**
+ * Known names are found by comparing ids alone; the name itself is only
+ * examined for fields the proxy doesn't know about, and then only when the
+ * lengths agree.  Returns the index of the field, or -1 if there isn't one.
+ */
+int HTTPHeader::findField(Name id, const StringView& name) const {
+  for (size_t i = 0; i < fields.size(); i++) {
+    if (matchesField(fields[i], id, name)) return i;
+  }
+  return -1;
+}
+
+bool HTTPHeader::matchesField(const field_t& field, Name id, const StringView& name) {
+  if (field.id != id) return false;
+  if (id != kUnknownName) return true;
+  return name.equalsIgnoreCase(StringView(field.name.data(), field.name.size()));
+}
+
+/**
+ * The first field under the name takes on the value, so the field stays
+ * where it was, and any others under the same name are removed.
+ */
+void HTTPHeader::setField(Name id, const StringView& name, const StringView& value) {
+  int index = findField(id, name);
+  if (index < 0) {
+    appendField(id, name, value);
+    return;
+  }
+
+  fields[index].value.assign(value.data(), value.size());
+  for (size_t i = fields.size() - 1; i > size_t(index); i--) {
+    if (matchesField(fields[i], id, name)) fields.erase(fields.begin() + i);
+  }
+}
+
+/**
+ * The strings are built with the array's allocator, so they come out of
+ * the same arena as the array itself.
+ */
+int HTTPHeader::appendField(Name id, const StringView& name, const StringView& value) {
+  ArenaAllocator<char> allocator(fields.get_allocator());
+  field_t field = { id, string_t(allocator), string_t(value.data(), value.size(), allocator) };
+  if (id == kUnknownName) {
+    field.name.reserve(name.size());
+    for (size_t i = 0; i < name.size(); i++) field.name += StringView::toLower(name[i]);
+  }
+  fields.push_back(move(field));
+  return fields.size() - 1;
+}
+
+string HTTPHeader::joinValues(Name id, const StringView& name) const {
+  string values;
+  for (const field_t& field: fields) {
+    if (!matchesField(field, id, name)) continue;
+    if (!values.empty()) values += ", ";
+    values.append(field.value.data(), field.value.size());
+  }
+  return values;
+}
+
+void HTTPHeader::removeField(Name id, const StringView& name) {
+  for (size_t i = fields.size(); i-- > 0; ) {
+    if (matchesField(fields[i], id, name)) fields.erase(fields.begin() + i);
+  }
+}
+
+/**
+ * Appends an obsolete line folding's continuation to the field at index,
+ * with the folding itself replaced by a single space.
+ */
+void HTTPHeader::extendField(int index, const StringView& value) {
+  fields[index].value += ' ';
+  fields[index].value.append(value.data(), value.size());
 }
@@ -4,13 +4,27 @@
  * Because the request header and response header, save for the first
  * line, are structurally identical, it makes sense to unify the notion
  * of a header to a single class that can be used by both.
+ *
+ * The fields are kept in a flat array, in the order they were added, and
+ * the names the proxy itself cares about are identified by a Name computed
+ * from a compile-time hash of the name, so looking them up comes down to
+ * an integer comparison per field, with nothing lowercased or allocated
+ * along the way.  A name that arrives more than once keeps every one of
+ * its fields, so repeated fields like Set-Cookie are relayed intact;
+ * getValuesAsString sees all of them, and getValueAsString the first.
  */
 
 #ifndef _http_header_
 #define _http_header_
 
 #include <string>
-#include <map>
+#include <vector>
+#include <cstdint>
+
+#include "arena.h"
+#include "io-vector.h"
+#include "parser.h"
+#include "string-view.h"
 
 class HTTPHeader {
 
@@ -24,16 +38,51 @@ class HTTPHeader {
   
  public:
 
+/**
+ * Constructs an empty header whose fields are allocated from the supplied
+ * arena, or from the heap if there isn't one.
+ */
+  HTTPHeader(Arena *arena = NULL);
+
+/**
+ * Identifies the header names the proxy examines or sets itself.  Every
+ * other name is kUnknownName, and is matched by comparing the names.
+ */
+  enum Name {
+    kUnknownName, kAccept, kAcceptEncoding, kAge, kAuthorization, kCacheControl, kConnection,
+    kContentEncoding, kContentLength, kContentType, kDate, kETag, kExpires,
+    kHost, kIfModifiedSince, kIfNoneMatch, kKeepAlive, kLastModified,
+    kLocation, kPragma, kProxyConnection, kServer, kTransferEncoding,
+    kUserAgent, kVary, kXForwardedFor, kXForwardedProto, kNameCount
+  };
+
+/**
+ * Returns the Name of the supplied header name, compared case-insensitively,
+ * or kUnknownName if it isn't one the proxy knows about.
+ */
+  static Name lookupName(const StringView& name);
+
 /**
  * Ingests the entire header of what's assumed to be either an
- * HTTP request or response.
+ * HTTP request or response.  Returns false if a field's name is followed
+ * by whitespace before its colon.  The whitespace is removed and the field
+ * kept either way, which is what a proxy is to do with a response, but a
+ * request with such a field is to be rejected (RFC 9112, section 5.1).
  */
 
-  void ingestHeader(std::istream& instream);
+  bool ingestHeader(std::istream& instream);
+
+/**
+ * Ingests the header fields of a message that's been fully parsed
+ * by the supplied parser.
+ */
+
+  void ingestHeader(const HTTPParser& parser);
 
 /**
  * Adds (or updates) the provided name so that it's associated
- * with the string form of the supplied integer.  Note that the name comparison is
+ * with the string form of the supplied integer, replacing every field
+ * already present under that name.  Note that the name comparison is
  * case-insensitive, so that "Expires" and "EXPIRES" are the considered
  * the same.
  */
@@ -42,18 +91,30 @@ class HTTPHeader {
   
 /**
  * Adds (or updates) the provided name so that it's associated
- * with the provided value string.  Note that the name comparison is
+ * with the provided value string, replacing every field already present
+ * under that name.  Note that the name comparison is
  * case-insensitive, so that "Expires" and "EXPIRES" are the considered
  * the same.
  */
 
   void addHeader(const std::string& name, const std::string& value);
+  void addHeader(Name name, const std::string& value);
 
 /**
- * Removes the provided name from the request header.
+ * Replaces the fields of the header with all of those of the same name in other,
+ * and adds those of other's fields it doesn't have, as a cache does with a
+ * stored response's header on receiving a 304 (RFC 9111, section 3.2).
+ * Content-Length and the hop-by-hop fields describe other's own message,
+ * so they're left alone.
+ */
+  void updateHeader(const HTTPHeader& other);
+
+/**
+ * Removes every field with the provided name from the header.
  */
 
   void removeHeader(const std::string& name);
+  void removeHeader(Name name);
 
 /**
  * Returns true if and only if the collection of name-value pairs
@@ -63,29 +124,98 @@ class HTTPHeader {
  */
 
   bool containsName(const std::string& name) const;
+  bool containsName(Name name) const;
 
 /**
  * Returns the string form of the value associated with the provided
  * name.  Note, as above, that the name comparison is case-insensitive, 
  * so that "Expires" and "EXPIRES" are the considered the same.  If the
- * key isn't present, then the empty string is returned.
+ * key isn't present, then the empty string is returned.  The view is
+ * only good until the header is next modified.
  */
 
-  const std::string& getValueAsString(const std::string& name) const;
+  StringView getValueAsString(const std::string& name) const;
+  StringView getValueAsString(Name name) const;
+
+/**
+ * Returns the values of every field with the provided name, in the order
+ * they arrived and joined by commas, which is how RFC 9110 (section 5.3)
+ * says a list-valued field repeated over several lines is to be read.
+ * If the name isn't present, then the empty string is returned.
+ */
+
+  std::string getValuesAsString(const std::string& name) const;
+  std::string getValuesAsString(Name name) const;
 
 /**
  * Returns the number (as a long) associated with the provided name.
  * Note, as above, that the name comparison is case-insensitive, 
  * so that "Expires" and "EXPIRES" are the considered the same.  If the
- * key isn't present, or if the associated value isn't purely numeric,
- * then 0 is returned.
+ * key isn't present, or if the associated value isn't a plain decimal
+ * number (one or more digits, with no sign) that fits in a long, then 0
+ * is returned.
  */
 
   long getValueAsNumber(const std::string& name) const;
+  long getValueAsNumber(Name name) const;
+
+/**
+ * Returns true if and only if the payload is framed by chunks, which is
+ * the case when chunked is the final transfer coding the Transfer-Encoding
+ * fields list, compared case-insensitively (RFC 9112, section 6.3).
+ */
+
+  bool hasChunkedPayload() const;
+
+/**
+ * Returns true unless there's a Content-Length whose value isn't a plain
+ * decimal number, or Content-Length fields that disagree, either of which
+ * leaves the length of the payload unknowable.  Fields that agree were
+ * collapsed into one when the header was ingested.  A message without a
+ * Content-Length passes.
+ */
+
+  bool hasValidContentLength() const;
+
+/**
+ * Appends every header line (but not the blank line that ends the
+ * header) to the supplied IOVector, by reference, so the header must
+ * outlive the IOVector's use.
+ */
+
+  void serialize(IOVector& iov) const;
   
  private:
-  std::map<std::string, std::string> headers;
-  void extendHeader(const std::string& name, const std::string& value);
+  typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char> > string_t;
+  typedef struct {
+    Name id;
+    string_t name;      // lowercased, and only set when id is kUnknownName
+    string_t value;
+  } field_t;
+
+  std::vector<field_t, ArenaAllocator<field_t> > fields;
+
+/**
+ * Hashes the name (FNV-1a over its lowercased bytes).  It's constexpr so
+ * the hashes of the known names can serve as case labels, which also has
+ * the compiler reject any two of them that collide.
+ */
+  static constexpr uint32_t hashName(const char *name, uint32_t hash = 2166136261u) {
+    return *name == '\0' ? hash :
+      hashName(name + 1, (hash ^ uint8_t(StringView::toLower(*name))) * 16777619u);
+  }
+
+  static uint32_t hashName(const StringView& name);
+  static const std::string& getCanonicalName(Name name);
+  int findField(Name id, const StringView& name) const;
+  static bool matchesField(const field_t& field, Name id, const StringView& name);
+  void setField(Name id, const StringView& name, const StringView& value);
+  int appendField(Name id, const StringView& name, const StringView& value);
+  std::string joinValues(Name id, const StringView& name) const;
+  void removeField(Name id, const StringView& name);
+  void extendField(int index, const StringView& value);
+  long findContentLength() const;
+  void collapseContentLength();
 };
 
 #endif
@@ -0,0 +1,47 @@
+/**
+ * File: http-date.cc
+ * ------------------
+ * Presents the implementation of the HTTP-date functions.  The parsing is
+ * done with strptime and the formatting with strftime, both of which are
+ * locale-sensitive in principle, but the proxy never changes its locale
+ * from the default "C" one, where the day and month names are the English
+ * ones HTTP calls for.
+ */
+
+#include "http-date.h"
+
+#include <cstring>
+
+using namespace std;
+
+static const char *const kDateFormats[] = {
+  "%a, %d %b %Y %H:%M:%S GMT",
+  "%A, %d-%b-%y %H:%M:%S GMT",
+  "%a %b %e %H:%M:%S %Y"
+};
+
+static const size_t kMaxDateLength = 64;
+
+time_t parseHTTPDate(const StringView& value) {
+  StringView trimmed = value.trim();
+  if (trimmed.empty() || trimmed.size() >= kMaxDateLength) return -1;
+  char date[kMaxDateLength];
+  memcpy(date, trimmed.data(), trimmed.size());
+  date[trimmed.size()] = '\0';
+  for (const char *format: kDateFormats) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(date, format, &tm);
+    if (end != NULL && *end == '\0') return timegm(&tm);
+  }
+
+  return -1;
+}
+
+string formatHTTPDate(time_t when) {
+  struct tm tm;
+  gmtime_r(&when, &tm);
+  char date[kMaxDateLength];
+  size_t length = strftime(date, sizeof(date), kDateFormats[0], &tm);
+  return string(date, length);
+}
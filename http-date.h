@@ -0,0 +1,33 @@
+/**
+ * File: http-date.h
+ * -----------------
+ * Exports the functions that convert between HTTP-dates (as they appear
+ * in Date, Expires, Last-Modified, and friends) and time_t values.
+ */
+
+#ifndef _http_date_
+#define _http_date_
+
+#include <ctime>
+#include <string>
+
+#include "string-view.h"
+
+/**
+ * Parses an HTTP-date in any of the three formats RFC 9110 requires
+ * recipients to accept:
+ *
+ *   Sun, 06 Nov 1994 08:49:37 GMT    (the preferred IMF-fixdate)
+ *   Sunday, 06-Nov-94 08:49:37 GMT   (the obsolete RFC 850 format)
+ *   Sun Nov  6 08:49:37 1994         (ANSI C's asctime format)
+ *
+ * Returns the time it names, or -1 if it isn't a valid HTTP-date.
+ */
+time_t parseHTTPDate(const StringView& value);
+
+/**
+ * Returns the supplied time as an IMF-fixdate.
+ */
+std::string formatHTTPDate(time_t when);
+
+#endif
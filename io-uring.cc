@@ -0,0 +1,316 @@
+/**
+ * File: io-uring.cc
+ * -----------------
+ * Presents the implementation of the IOUring class.
+ */
+
+#include "io-uring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+static const uint16_t kBufferGroup = 0;
+
+IOUring::IOUring(unsigned int entries, unsigned int numBuffers, size_t bufferSize)
+  throw (HTTPProxyException) :
+  sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes((struct io_uring_sqe *) MAP_FAILED),
+  bufferRing((struct io_uring_buf_ring *) MAP_FAILED), bufferRingSize(0),
+  buffers((char *) MAP_FAILED), numBuffers(numBuffers), bufferSize(bufferSize),
+  buffersTaken(0), bufferRingTail(0) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ringfd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ringfd < 0) {
+    throw HTTPProxyException("Failed to create an io_uring instance.");
+  }
+
+  if ((params.features & IORING_FEAT_EXT_ARG) == 0) {
+    close(ringfd);
+    throw HTTPProxyException("The kernel's io_uring can't wait with a timeout.");
+  }
+
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool singleMapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMapping) sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+  sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ringfd, IORING_OFF_SQ_RING);
+  if (sqRing != MAP_FAILED) {
+    cqRing = singleMapping ? sqRing :
+      mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+           ringfd, IORING_OFF_CQ_RING);
+  }
+  sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  if (cqRing != MAP_FAILED) {
+    sqes = (struct io_uring_sqe *) mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+  }
+  if (sqes == MAP_FAILED) {
+    unmapRings();
+    close(ringfd);
+    throw HTTPProxyException("Failed to map the queues of an io_uring instance.");
+  }
+
+  char *sq = (char *) sqRing;
+  sqHead = (unsigned int *) (sq + params.sq_off.head);
+  sqTail = (unsigned int *) (sq + params.sq_off.tail);
+  sqMask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+  sqEntries = *(unsigned int *) (sq + params.sq_off.ring_entries);
+  sqArray = (unsigned int *) (sq + params.sq_off.array);
+  sqLocalTail = *sqTail;
+
+  char *cq = (char *) cqRing;
+  cqHead = (unsigned int *) (cq + params.cq_off.head);
+  cqTail = (unsigned int *) (cq + params.cq_off.tail);
+  cqMask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  try {
+    registerBuffers();
+  } catch (const HTTPProxyException& hpe) {
+    unmapBuffers();
+    unmapRings();
+    close(ringfd);
+    throw;
+  }
+}
+
+IOUring::~IOUring() {
+  close(ringfd);
+  unmapBuffers();
+  unmapRings();
+}
+
+void IOUring::queuePoll(int fd, uint32_t events, uint64_t userData) {
+  struct io_uring_sqe *sqe = nextSubmissionEntry();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->user_data = userData;
+}
+
+void IOUring::queuePollRemove(uint64_t targetData, uint64_t userData) {
+  struct io_uring_sqe *sqe = nextSubmissionEntry();
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = targetData;
+  sqe->user_data = userData;
+}
+
+void IOUring::queueReceive(int fd, uint64_t userData) {
+  struct io_uring_sqe *sqe = nextSubmissionEntry();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kBufferGroup;
+  sqe->user_data = userData;
+}
+
+/**
+ * MSG_WAITALL has the kernel carry on with a send that's only partly
+ * gone through (once there's room in the socket's buffer) rather than
+ * completing it early, so a send comes up short only if the socket fails.
+ */
+void IOUring::queueSend(int fd, const void *data, size_t length, uint64_t userData) {
+  struct io_uring_sqe *sqe = nextSubmissionEntry();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) data;
+  sqe->len = length;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->user_data = userData;
+}
+
+void IOUring::queueAccept(int fd, uint64_t userData) {
+  struct io_uring_sqe *sqe = nextSubmissionEntry();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = userData;
+}
+
+void IOUring::queueCancel(uint64_t targetData, uint64_t userData) {
+  struct io_uring_sqe *sqe = nextSubmissionEntry();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = targetData;
+  sqe->user_data = userData;
+}
+
+/**
+ * Whatever's been queued is submitted first, since the request being
+ * cancelled may be among it.  The cancellation fails harmlessly if the
+ * request has already completed.
+ */
+void IOUring::cancel(uint64_t targetData) {
+  submit();
+  struct io_uring_sync_cancel_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.addr = targetData;
+  reg.fd = -1;
+  reg.timeout.tv_sec = reg.timeout.tv_nsec = -1;
+  syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+}
+
+void IOUring::recycleBuffer(uint16_t id) {
+  buffersTaken--;
+  provideBuffer(id);
+  __atomic_store_n(&bufferRing->tail, bufferRingTail, __ATOMIC_RELEASE);
+}
+
+void IOUring::submit() {
+  publishSubmissions();
+  unsigned int toSubmit = sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+  if (toSubmit > 0) enter(toSubmit, 0, 0);
+}
+
+bool IOUring::submitAndWait(int timeout, const CompletionHandler& handler) {
+  publishSubmissions();
+  unsigned int toSubmit = sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+  if (enter(toSubmit, 1, timeout) < 0 &&
+      errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+    return false;
+  }
+
+  reapCompletions(handler);
+  return true;
+}
+
+/** Private methods **/
+
+/**
+ * Maps the provided buffers and the ring that hands them to the kernel,
+ * registers the ring, and fills it.  Synchronous cancellation arrived in
+ * the same kernel release as multishot receives, so it's probed for here
+ * as well, by cancelling a request that doesn't exist.
+ */
+static const uint64_t kProbeData = ~0ULL;
+void IOUring::registerBuffers() throw (HTTPProxyException) {
+  if (numBuffers == 0 || numBuffers > 32768 || (numBuffers & (numBuffers - 1)) != 0) {
+    throw HTTPProxyException("The number of provided buffers must be a power of two.");
+  }
+
+  bufferRingSize = numBuffers * sizeof(struct io_uring_buf);
+  bufferRing = (struct io_uring_buf_ring *) mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE,
+                                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  buffers = (char *) mmap(NULL, numBuffers * bufferSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufferRing == MAP_FAILED || buffers == MAP_FAILED) {
+    throw HTTPProxyException("Failed to allocate the provided buffers of an io_uring instance.");
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) bufferRing;
+  reg.ring_entries = numBuffers;
+  reg.bgid = kBufferGroup;
+  if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    throw HTTPProxyException("The kernel's io_uring doesn't support provided buffer rings.");
+  }
+
+  for (unsigned int id = 0; id < numBuffers; id++) {
+    provideBuffer(id);
+  }
+  __atomic_store_n(&bufferRing->tail, bufferRingTail, __ATOMIC_RELEASE);
+
+  struct io_uring_sync_cancel_reg probe;
+  memset(&probe, 0, sizeof(probe));
+  probe.addr = kProbeData;
+  probe.fd = -1;
+  probe.timeout.tv_sec = probe.timeout.tv_nsec = -1;
+  if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_SYNC_CANCEL, &probe, 1) != 0 &&
+      errno != ENOENT) {
+    throw HTTPProxyException("The kernel's io_uring doesn't support synchronous cancellation.");
+  }
+}
+
+/**
+ * Adds the identified buffer to the ring, without publishing it to the
+ * kernel yet.  Only the fields of the ring entry proper are written, since
+ * the ring's tail overlays the rest of its first entry.  The entries are
+ * located by hand rather than through bufs, since the flexible array some
+ * versions of the kernel headers declare it as lands 8 bytes into the
+ * ring when compiled as C++.
+ */
+void IOUring::provideBuffer(uint16_t id) {
+  struct io_uring_buf *entries = reinterpret_cast<struct io_uring_buf *>(bufferRing);
+  struct io_uring_buf *buffer = &entries[bufferRingTail & (numBuffers - 1)];
+  buffer->addr = (uint64_t) (buffers + id * bufferSize);
+  buffer->len = bufferSize;
+  buffer->bid = id;
+  bufferRingTail++;
+}
+
+/**
+ * Returns a zeroed submission queue entry, publishing and submitting
+ * everything queued so far (without waiting on any of it) should the
+ * submission queue be full.
+ */
+struct io_uring_sqe *IOUring::nextSubmissionEntry() {
+  while (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+    publishSubmissions();
+    if (enter(sqEntries, 0, 0) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+      throw HTTPProxyException("Failed to submit to an io_uring instance.");
+    }
+  }
+
+  unsigned int index = sqLocalTail & sqMask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray[index] = index;
+  sqLocalTail++;
+  return sqe;
+}
+
+/**
+ * Calls io_uring_enter, asking it to wait for minComplete completions
+ * for at most timeout milliseconds (or indefinitely, if timeout is negative).
+ */
+int IOUring::enter(unsigned int toSubmit, unsigned int minComplete, int timeout) {
+  struct __kernel_timespec ts;
+  ts.tv_sec = timeout / 1000;
+  ts.tv_nsec = (timeout % 1000) * 1000000L;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = timeout < 0 ? 0 : (uint64_t) &ts;
+  unsigned int flags = IORING_ENTER_EXT_ARG | (minComplete > 0 ? IORING_ENTER_GETEVENTS : 0);
+  return syscall(__NR_io_uring_enter, ringfd, toSubmit, minComplete, flags, &arg, sizeof(arg));
+}
+
+void IOUring::publishSubmissions() {
+  __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+}
+
+void IOUring::reapCompletions(const CompletionHandler& handler) {
+  unsigned int head = *cqHead;
+  unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    const struct io_uring_cqe& cqe = cqes[head & cqMask];
+    handler(cqe.user_data, cqe.res, cqe.flags);
+    head++;
+  }
+
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+void IOUring::unmapBuffers() {
+  if (buffers != MAP_FAILED) munmap(buffers, numBuffers * bufferSize);
+  if (bufferRing != MAP_FAILED) munmap(bufferRing, bufferRingSize);
+}
+
+void IOUring::unmapRings() {
+  if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+  if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+  if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+}
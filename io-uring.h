@@ -0,0 +1,183 @@
+/**
+ * File: io-uring.h
+ * ----------------
+ * Defines the IOUring class, which is a minimal wrapper around a Linux
+ * io_uring instance, driven through the raw system calls so the proxy
+ * doesn't need liburing.  Submission queue entries are only handed to the
+ * kernel when submitAndWait is called, so any number of requests queued
+ * between two waits cost a single io_uring_enter between them.  Data is
+ * received into a ring of buffers registered with the kernel up front
+ * (so a receive request needn't tie up a buffer of its own while it
+ * waits), and a single multishot request keeps on receiving (or
+ * accepting) until it's cancelled.
+ */
+
+#ifndef _io_uring_
+#define _io_uring_
+
+#include <cstddef>       // for size_t
+#include <cstdint>       // for uint32_t, uint64_t
+#include <functional>    // for function
+#include <linux/io_uring.h>
+
+#include "proxy-exception.h"
+
+class IOUring {
+ public:
+
+/**
+ * Handlers are invoked with the user data the completed request was
+ * submitted with, with its result (which, as with the system calls
+ * themselves, is a negated errno value on failure), and with the
+ * completion's flags.  IORING_CQE_F_MORE among them means a multishot
+ * request has more completions to come, and IORING_CQE_F_BUFFER means
+ * the data landed in the provided buffer identified by getBufferID.
+ */
+  typedef std::function<void(uint64_t userData, int result, uint32_t flags)> CompletionHandler;
+
+/**
+ * Creates a ring with room for the specified number of submission queue
+ * entries, maps its queues into the address space, and registers a ring
+ * of numBuffers (a power of two) provided buffers of bufferSize bytes
+ * apiece.  If the kernel doesn't support io_uring, or any of what
+ * everything built on IOUring relies on (waiting with a timeout,
+ * provided buffer rings, and synchronous cancellation, which together
+ * require Linux 6.0), then an HTTPProxyException is thrown.
+ */
+  IOUring(unsigned int entries = 4096, unsigned int numBuffers = 256,
+          size_t bufferSize = 16 * 1024) throw (HTTPProxyException);
+  ~IOUring();
+
+/**
+ * Queues a one-shot poll for the supplied (epoll-style) events on fd.
+ * Its completion's result is the mask of events that were detected.
+ */
+  void queuePoll(int fd, uint32_t events, uint64_t userData);
+
+/**
+ * Queues the removal of the poll previously queued with targetData.  The
+ * removal's own completion is reported with userData.
+ */
+  void queuePollRemove(uint64_t targetData, uint64_t userData);
+
+/**
+ * Queues a multishot receive on the socket fd, each completion of which
+ * reports data received into one of the provided buffers, until the
+ * socket reaches end of file (a result of 0), fails, the request is
+ * cancelled, or the provided buffers run out (-ENOBUFS).
+ */
+  void queueReceive(int fd, uint64_t userData);
+
+/**
+ * Queues a send of the length bytes at data, which must stay put until
+ * the send completes.  Its result is the number of bytes sent.
+ */
+  void queueSend(int fd, const void *data, size_t length, uint64_t userData);
+
+/**
+ * Queues a multishot accept on the listening socket fd, each completion
+ * of which reports a newly accepted (non-blocking, close-on-exec) socket.
+ */
+  void queueAccept(int fd, uint64_t userData);
+
+/**
+ * Queues the cancellation of the request previously queued with
+ * targetData.  The cancellation's own completion is reported with userData.
+ */
+  void queueCancel(uint64_t targetData, uint64_t userData);
+
+/**
+ * Cancels the request previously submitted with targetData right away,
+ * rather than along with the next wait, so that it's known to be over
+ * once cancel returns.  Its final completion is still reported by the
+ * next wait.
+ */
+  void cancel(uint64_t targetData);
+
+/**
+ * Returns the identifier of the provided buffer a completion's data
+ * landed in, given the completion's flags.
+ */
+  static uint16_t getBufferID(uint32_t flags) { return flags >> IORING_CQE_BUFFER_SHIFT; }
+
+/**
+ * Returns the provided buffer with the supplied identifier.
+ */
+  const char *getBuffer(uint16_t id) const { return buffers + id * bufferSize; }
+
+/**
+ * Hands the provided buffer with the supplied identifier back to the
+ * kernel, once whatever landed in it has been consumed.
+ */
+  void recycleBuffer(uint16_t id);
+
+/**
+ * Returns true if and only if some provided buffers haven't been taken
+ * by the kernel (as far as the ring knows), so a receive stands a chance.
+ */
+  bool hasBuffersAvailable() const { return buffersTaken < numBuffers; }
+
+/**
+ * Notes that the kernel has taken a provided buffer, as reported by a
+ * completion.  Every taken buffer must eventually be recycled.
+ */
+  void noteBufferTaken() { buffersTaken++; }
+
+/**
+ * Submits everything queued since the last call right away, without
+ * waiting for anything.
+ */
+  void submit();
+
+/**
+ * Submits everything queued since the last call, and then waits for at
+ * least one completion or for timeout milliseconds to elapse (a negative
+ * timeout waits indefinitely).  Every completion available by then is
+ * passed to the handler.  Returns false if the wait itself failed for
+ * any reason other than being interrupted or timing out.
+ */
+  bool submitAndWait(int timeout, const CompletionHandler& handler);
+
+ private:
+  int ringfd;
+  void *sqRing;
+  size_t sqRingSize;
+  void *cqRing;
+  size_t cqRingSize;
+  struct io_uring_sqe *sqes;
+  size_t sqesSize;
+
+  unsigned int *sqHead;
+  unsigned int *sqTail;
+  unsigned int sqMask;
+  unsigned int sqEntries;
+  unsigned int *sqArray;
+  unsigned int sqLocalTail;  // queued, but not yet published to the kernel
+
+  unsigned int *cqHead;
+  unsigned int *cqTail;
+  unsigned int cqMask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *bufferRing;
+  size_t bufferRingSize;
+  char *buffers;
+  unsigned int numBuffers;
+  size_t bufferSize;
+  unsigned int buffersTaken;
+  unsigned short bufferRingTail;
+
+  void registerBuffers() throw (HTTPProxyException);
+  void provideBuffer(uint16_t id);
+  struct io_uring_sqe *nextSubmissionEntry();
+  int enter(unsigned int toSubmit, unsigned int minComplete, int timeout);
+  void publishSubmissions();
+  void reapCompletions(const CompletionHandler& handler);
+  void unmapRings();
+  void unmapBuffers();
+
+  IOUring(const IOUring& original) = delete;
+  IOUring& operator=(const IOUring& rhs) = delete;
+};
+
+#endif
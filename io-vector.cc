@@ -0,0 +1,84 @@
+/**
+ * File: io-vector.cc
+ * ------------------
+ * Presents the implementation of the IOVector class.
+ */
+
+#include "io-vector.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>      // for IOV_MAX
+#include <cstring>
+#include <sys/socket.h>
+
+using namespace std;
+
+IOVector::IOVector() : next(0), remaining(0) {}
+
+void IOVector::append(const char *data, size_t length) {
+  if (length == 0) return;
+  struct iovec segment;
+  segment.iov_base = const_cast<char *>(data);
+  segment.iov_len = length;
+  segments.push_back(segment);
+  remaining += length;
+}
+
+void IOVector::appendCopy(const string& str) {
+  copies.push_back(str);
+  append(copies.back());
+}
+
+/**
+ * sendmsg accepts at most IOV_MAX segments at a time, which only matters
+ * for messages with hundreds of header lines.
+ */
+ssize_t IOVector::send(int fd, int flags) {
+  if (remaining == 0) return 0;
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &segments[next];
+  message.msg_iovlen = min(segments.size() - next, (size_t) IOV_MAX);
+  ssize_t count = sendmsg(fd, &message, flags | MSG_NOSIGNAL);
+  if (count > 0) consume(count);
+  return count;
+}
+
+bool IOVector::sendCompletely(int fd, int flags) {
+  while (remaining > 0) {
+    if (send(fd, flags) < 0 && errno != EINTR) return false;
+  }
+
+  return true;
+}
+
+void IOVector::writeTo(ostream& os) const {
+  for (size_t i = next; i < segments.size(); i++) {
+    os.write((const char *) segments[i].iov_base, segments[i].iov_len);
+  }
+}
+
+void IOVector::appendTo(string& str) const {
+  str.reserve(str.size() + remaining);
+  for (size_t i = next; i < segments.size(); i++) {
+    str.append((const char *) segments[i].iov_base, segments[i].iov_len);
+  }
+}
+
+/** Private methods **/
+
+void IOVector::consume(size_t count) {
+  remaining -= count;
+  while (count > 0) {
+    struct iovec& segment = segments[next];
+    if (count < segment.iov_len) {
+      segment.iov_base = (char *) segment.iov_base + count;
+      segment.iov_len -= count;
+      return;
+    }
+
+    count -= segment.iov_len;
+    next++;
+  }
+}
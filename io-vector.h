@@ -0,0 +1,75 @@
+/**
+ * File: io-vector.h
+ * -----------------
+ * Defines the IOVector class, which gathers the pieces of an outgoing
+ * message (status line, header lines, payload) as a list of references to
+ * wherever those pieces already live, so the whole message can be handed
+ * to the kernel with a single sendmsg rather than being formatted into a
+ * stream or a string first.
+ */
+
+#ifndef _io_vector_
+#define _io_vector_
+
+#include <cstddef>       // for size_t
+#include <list>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <sys/types.h>   // for ssize_t
+#include <sys/uio.h>     // for struct iovec
+
+class IOVector {
+ public:
+  IOVector();
+
+/**
+ * Appends a reference to the supplied bytes, which must stay put (and
+ * unchanged) until the IOVector has been sent or written out.
+ */
+  void append(const char *data, size_t length);
+  void append(const std::string& str) { append(str.data(), str.size()); }
+
+/**
+ * Appends a copy of the supplied string, for pieces that are formatted on
+ * the fly and have nowhere else to live.
+ */
+  void appendCopy(const std::string& str);
+
+/**
+ * Returns the number of bytes that have yet to be sent.
+ */
+  size_t size() const { return remaining; }
+  bool empty() const { return remaining == 0; }
+
+/**
+ * Sends as much as the socket will take with a single sendmsg, and
+ * forgets about whatever was sent.  flags are passed along to sendmsg
+ * (MSG_NOSIGNAL is always added), so MSG_DONTWAIT or MSG_MORE can be
+ * supplied.  Returns what sendmsg does.
+ */
+  ssize_t send(int fd, int flags = 0);
+
+/**
+ * Sends everything, blocking as necessary.  Returns true if and only if
+ * all of it was sent.
+ */
+  bool sendCompletely(int fd, int flags = 0);
+
+/**
+ * Appends everything that has yet to be sent to the supplied stream (or
+ * string), for the destinations that aren't sockets.
+ */
+  void writeTo(std::ostream& os) const;
+  void appendTo(std::string& str) const;
+
+ private:
+  std::vector<struct iovec> segments;
+  size_t next;          // index of the first segment not completely sent
+  size_t remaining;
+  std::list<std::string> copies;
+
+  void consume(size_t count);
+};
+
+#endif
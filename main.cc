@@ -82,8 +82,12 @@ int main(int argc, char *argv[]) {
   try {
     HTTPProxy proxy(argc, argv);
     cout << "Listening for all incoming traffic on port " << proxy.getPortNumber() << "." << endl;
-    while (true) {
-      proxy.acceptAndProxyRequest();
+    if (proxy.usesEventLoops()) {
+      proxy.runEventLoops();
+    } else {
+      while (true) {
+        proxy.acceptAndProxyRequest();
+      }
     }
   } catch (const HTTPProxyException& hpe) {
     cerr << "Fatal Error: " << hpe.what() << endl;
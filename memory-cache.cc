@@ -0,0 +1,71 @@
+/**
+ * File: memory-cache.cc
+ * ---------------------
+ * Presents the implementation of the HTTPMemoryCache class.
+ */
+
+#include "memory-cache.h"
+
+using namespace std;
+
+HTTPMemoryCache::HTTPMemoryCache(size_t capacity, size_t numShards) {
+  if (numShards == 0) numShards = 1;
+  for (size_t i = 0; i < numShards; i++) {
+    shards.push_back(unique_ptr<shard_t>(new shard_t));
+    shards.back()->size = 0;
+  }
+  shardCapacity = capacity / numShards;
+  maxEntrySize = shardCapacity / 4;
+}
+
+shared_ptr<const HTTPMemoryCache::entry_t> HTTPMemoryCache::find(const CacheKey& key) {
+  shard_t& shard = getShard(key);
+  lock_guard<mutex> lg(shard.lock);
+  auto found = shard.index.find(key);
+  if (found == shard.index.end()) return shared_ptr<const entry_t>();
+  lru_t::iterator it = found->second;
+  if (time(NULL) > it->second->expiration) {
+    erase(shard, it);
+    return shared_ptr<const entry_t>();
+  }
+
+  shard.lru.splice(shard.lru.begin(), shard.lru, it);
+  return it->second;
+}
+
+bool HTTPMemoryCache::insert(const CacheKey& key, const shared_ptr<const entry_t>& entry) {
+  size_t size = entry->serialized.size();
+  shard_t& shard = getShard(key);
+  lock_guard<mutex> lg(shard.lock);
+  auto found = shard.index.find(key);
+  if (found != shard.index.end()) erase(shard, found->second);
+  if (!admits(size)) return false;
+  while (!shard.lru.empty() && shard.size + size > shardCapacity) {
+    erase(shard, --shard.lru.end());
+  }
+
+  shard.lru.push_front(make_pair(key, entry));
+  shard.index[key] = shard.lru.begin();
+  shard.size += size;
+  return true;
+}
+
+void HTTPMemoryCache::remove(const CacheKey& key) {
+  shard_t& shard = getShard(key);
+  lock_guard<mutex> lg(shard.lock);
+  auto found = shard.index.find(key);
+  if (found != shard.index.end()) erase(shard, found->second);
+}
+
+/** Private methods **/
+
+/**
+ * Unlinks the entry from the shard.  The entry itself is only freed once
+ * whoever's still sending it lets go of it as well.  The caller must hold
+ * the shard's lock.
+ */
+void HTTPMemoryCache::erase(shard_t& shard, lru_t::iterator it) {
+  shard.size -= it->second->serialized.size();
+  shard.index.erase(it->first);
+  shard.lru.erase(it);
+}
@@ -0,0 +1,101 @@
+/**
+ * File: memory-cache.h
+ * --------------------
+ * Defines the HTTPMemoryCache class, which keeps the most recently used
+ * cached responses in memory, in front of the cache directory, so that
+ * hot objects are served without touching the filesystem at all.  Each
+ * response is held serialized, exactly as it's stored on disk, in an
+ * immutable entry that's shared (by reference count) with every connection
+ * currently sending it, so an entry evicted or replaced mid-send stays
+ * alive until the last of them is done with it.
+ *
+ * Entries are spread across a number of shards, each with a lock and a
+ * least-recently-used list of its own, so threads looking up unrelated
+ * responses rarely contend.  The total size of the entries is bounded, and
+ * each shard evicts from the cold end of its list to stay within its share.
+ */
+
+#ifndef _http_memory_cache_
+#define _http_memory_cache_
+
+#include <cstddef>   // for size_t
+#include <ctime>     // for time_t
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cache-key.h"
+
+class HTTPMemoryCache {
+ public:
+
+/**
+ * A cached response: its serialized status line and header, followed
+ * immediately by its payload, which begins at payloadOffset.  The
+ * response stops being fresh after expiration, and was generated (that
+ * is, had an age of 0) at generated.
+ */
+  typedef struct {
+    std::string serialized;
+    size_t payloadOffset;
+    time_t expiration;
+    time_t generated;
+  } entry_t;
+
+/**
+ * Constructs an empty cache holding at most capacity bytes' worth of
+ * entries across numShards shards.  Entries taking up more than a
+ * quarter of a shard's share are never admitted, so that no single large
+ * response can flush out everything else.
+ */
+  HTTPMemoryCache(size_t capacity, size_t numShards = 16);
+
+/**
+ * Returns the fresh entry stored under key, marking it as the most
+ * recently used in its shard, or an empty pointer if there isn't one.
+ * An entry that's found to have expired is dropped.
+ */
+  std::shared_ptr<const entry_t> find(const CacheKey& key);
+
+/**
+ * Stores entry under key, replacing whatever was there, and evicts the
+ * shard's least recently used entries until it's back within its share.
+ * Returns false (and stores nothing) if the entry is too large to admit.
+ */
+  bool insert(const CacheKey& key, const std::shared_ptr<const entry_t>& entry);
+
+/**
+ * Drops whatever's stored under key.
+ */
+  void remove(const CacheKey& key);
+
+/**
+ * Returns whether an entry of the supplied size would be admitted.
+ */
+  bool admits(size_t size) const { return size <= maxEntrySize; }
+
+ private:
+  typedef std::list<std::pair<CacheKey, std::shared_ptr<const entry_t> > > lru_t;
+  typedef struct {
+    std::mutex lock;
+    lru_t lru;               // most recently used at the front
+    std::unordered_map<CacheKey, lru_t::iterator> index;
+    size_t size;
+  } shard_t;
+
+  std::vector<std::unique_ptr<shard_t> > shards;
+  size_t shardCapacity;
+  size_t maxEntrySize;
+
+  // shards are picked by the key's high half, since the index hashes the low half
+  shard_t& getShard(const CacheKey& key) { return *shards[key.getHigh() % shards.size()]; }
+  static void erase(shard_t& shard, lru_t::iterator it);
+
+  HTTPMemoryCache(const HTTPMemoryCache& original) = delete;
+  HTTPMemoryCache& operator=(const HTTPMemoryCache& rhs) = delete;
+};
+
+#endif
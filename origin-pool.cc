@@ -0,0 +1,157 @@
+/**
+ * File: origin-pool.cc
+ * --------------------
+ * Presents the implementation of the HTTPOriginPool class.
+ */
+
+#include "origin-pool.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+using namespace std;
+
+static const int kClientSocketError = -1;
+
+static string getPoolKey(const string& server, unsigned short port) {
+  ostringstream oss;
+  oss << server << ":" << port;
+  return oss.str();
+}
+
+HTTPOriginPool::HTTPOriginPool(HTTPResolver& resolver, bool nonblocking, size_t maxIdlePerHost,
+                               size_t maxIdle, int idleTimeout) :
+  resolver(resolver), nonblocking(nonblocking), maxIdlePerHost(maxIdlePerHost), maxIdle(maxIdle),
+  idleTimeout(idleTimeout), numIdle(0) {}
+
+HTTPOriginPool::~HTTPOriginPool() {
+  for (const pair<const string, deque<idle_connection_t> >& p: idleConnections) {
+    for (const idle_connection_t& connection: p.second) {
+      close(connection.fd);
+    }
+  }
+}
+
+int HTTPOriginPool::acquire(const string& server, unsigned short port, bool& reused) {
+  int fd = acquireIdle(server, port);
+  reused = fd != kClientSocketError;
+  if (reused) return fd;
+  return connect(server, port);
+}
+
+/**
+ * Idle connections are handed out most-recently-released first, since
+ * those are the least likely to have been timed out by the origin.
+ */
+int HTTPOriginPool::acquireIdle(const string& server, unsigned short port) {
+  string key = getPoolKey(server, port);
+  time_t now = time(NULL);
+  m.lock();
+  auto found = idleConnections.find(key);
+  while (found != idleConnections.end() && !found->second.empty()) {
+    idle_connection_t candidate = found->second.back();
+    found->second.pop_back();
+    numIdle--;
+    if (now - candidate.releaseTime <= idleTimeout && connectionIsAlive(candidate.fd)) {
+      m.unlock();
+      return candidate.fd;
+    }
+
+    close(candidate.fd);
+  }
+  m.unlock();
+  return kClientSocketError;
+}
+
+/**
+ * For non-blocking pools, the connection is very likely still in progress
+ * when the descriptor is returned, so the caller must wait for it to become
+ * writable (and then check SO_ERROR) before trusting it.
+ */
+int HTTPOriginPool::connect(const struct in_addr& address, unsigned short port) const {
+  int type = SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0);
+  int s = socket(AF_INET, type, 0);
+  if (s < 0) return kClientSocketError;
+
+  struct sockaddr_in serverAddress;
+  memset(&serverAddress, 0, sizeof(serverAddress));
+  serverAddress.sin_family = AF_INET;
+  serverAddress.sin_port = htons(port);
+  serverAddress.sin_addr = address;
+  if (::connect(s, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) != 0 &&
+      !(nonblocking && errno == EINPROGRESS)) {
+    close(s);
+    return kClientSocketError;
+  }
+
+  return s;
+}
+
+void HTTPOriginPool::release(const string& server, unsigned short port, int fd) {
+  if (maxIdlePerHost == 0 || maxIdle == 0) {
+    close(fd);
+    return;
+  }
+
+  string key = getPoolKey(server, port);
+  time_t now = time(NULL);
+  lock_guard<mutex> lg(m);
+  auto found = idleConnections.find(key);
+  if (found != idleConnections.end()) {
+    deque<idle_connection_t>& connections = found->second;
+    while (!connections.empty() &&
+           (connections.size() >= maxIdlePerHost ||
+            now - connections.front().releaseTime > idleTimeout)) {
+      close(connections.front().fd);
+      connections.pop_front();
+      numIdle--;
+    }
+  }
+
+  if (numIdle >= maxIdle) evictOldest();
+  idle_connection_t connection = { fd, now };
+  idleConnections[key].push_back(connection);
+  numIdle++;
+}
+
+/** Private methods **/
+
+int HTTPOriginPool::connect(const string& server, unsigned short port) {
+  struct in_addr address;
+  if (!resolver.resolve(server, address)) return kClientSocketError;
+  return connect(address, port);
+}
+
+/**
+ * An idle connection should have nothing to read.  If a peek reports
+ * end-of-file, the origin has closed its end; if it reports data, the
+ * origin sent something unsolicited and the connection can't be trusted
+ * to be at a message boundary.  Either way, it's not worth keeping.
+ */
+bool HTTPOriginPool::connectionIsAlive(int fd) const {
+  char byte;
+  ssize_t count = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void HTTPOriginPool::evictOldest() {
+  auto oldest = idleConnections.end();
+  for (auto it = idleConnections.begin(); it != idleConnections.end(); ++it) {
+    if (it->second.empty()) continue;
+    if (oldest == idleConnections.end() ||
+        it->second.front().releaseTime < oldest->second.front().releaseTime) {
+      oldest = it;
+    }
+  }
+
+  if (oldest == idleConnections.end()) return;
+  close(oldest->second.front().fd);
+  oldest->second.pop_front();
+  numIdle--;
+  if (oldest->second.empty()) idleConnections.erase(oldest);
+}
@@ -0,0 +1,98 @@
+/**
+ * File: origin-pool.h
+ * -------------------
+ * Defines the HTTPOriginPool class, which manages the proxy's
+ * connections to origin servers.  Rather than resolving, connecting,
+ * and tearing down a fresh socket for every proxied request, the pool
+ * holds on to idle persistent connections (keyed by server and port)
+ * so that later requests to the same origin can skip the handshake.
+ */
+
+#ifndef _http_origin_pool_
+#define _http_origin_pool_
+
+#include <cstddef>   // for size_t
+#include <ctime>     // for time_t
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <netinet/in.h>  // for struct in_addr
+
+#include "resolver.h"
+
+class HTTPOriginPool {
+ public:
+
+/**
+ * Constructs an empty pool.  Sockets opened by the pool are placed in
+ * non-blocking mode if and only if nonblocking is true.  At most
+ * maxIdlePerHost idle connections are retained for any one server/port
+ * pair, at most maxIdle are retained in total, and none are retained for
+ * longer than idleTimeout seconds.
+ */
+  HTTPOriginPool(HTTPResolver& resolver, bool nonblocking, size_t maxIdlePerHost = 8,
+                 size_t maxIdle = 256, int idleTimeout = 30);
+  ~HTTPOriginPool();
+
+/**
+ * Returns a socket connected (or, for non-blocking pools, connecting) to
+ * the identified origin server, or -1 if one couldn't be opened.  Idle
+ * connections are handed out in preference to new ones, in which case
+ * reused is set to true so the caller knows to retry with a fresh
+ * connection should the server have closed the idle one in the meantime.
+ */
+  int acquire(const std::string& server, unsigned short port, bool& reused);
+
+/**
+ * Returns an idle connection to the identified origin server, or -1 if
+ * there aren't any.  Unlike acquire, acquireIdle never resolves or connects,
+ * so callers that can't afford to block can resolve the server themselves
+ * and then call connect.
+ */
+  int acquireIdle(const std::string& server, unsigned short port);
+
+/**
+ * Opens a new socket connected (or connecting) to the supplied, already
+ * resolved address, or returns -1 if one couldn't be opened.
+ */
+  int connect(const struct in_addr& address, unsigned short port) const;
+
+/**
+ * Resolves the identified origin server (blocking if need be) and opens
+ * a new socket connected to it, bypassing the idle connections entirely.
+ * Returns -1 if the server can't be resolved or connected to.
+ */
+  int connect(const std::string& server, unsigned short port);
+
+/**
+ * Returns a socket that's no longer needed to the pool.  The caller should
+ * only release sockets that have been left at a message boundary (i.e.
+ * the full response has been consumed and the origin agreed to keep the
+ * connection alive); the pool closes the socket if it's already full.
+ */
+  void release(const std::string& server, unsigned short port, int fd);
+
+ private:
+  typedef struct {
+    int fd;
+    time_t releaseTime;
+  } idle_connection_t;
+
+  HTTPResolver& resolver;
+  bool nonblocking;
+  size_t maxIdlePerHost;
+  size_t maxIdle;
+  int idleTimeout;
+  size_t numIdle;
+  std::map<std::string, std::deque<idle_connection_t> > idleConnections;
+  std::mutex m;
+
+  bool connectionIsAlive(int fd) const;
+  void evictOldest();
+
+  HTTPOriginPool(const HTTPOriginPool& original) = delete;
+  HTTPOriginPool& operator=(const HTTPOriginPool& rhs) = delete;
+};
+
+#endif
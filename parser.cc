@@ -0,0 +1,184 @@
+/**
+ * File: parser.cc
+ * ---------------
+ * Presents the implementation of the HTTPParser class.
+ */
+
+#include "parser.h"
+
+#include <cstring>
+
+#include "scan.h"
+
+using namespace std;
+
+HTTPParser::HTTPParser(Kind kind, size_t maxHeaderSize) :
+  kind(kind), maxHeaderSize(maxHeaderSize) {
+  reset();
+}
+
+void HTTPParser::reset() {
+  base = NULL;
+  lineStart = scanned = 0;
+  startLineParsed = false;
+  headerLength = 0;
+  memset(&first, 0, sizeof(first));
+  memset(&second, 0, sizeof(second));
+  memset(&third, 0, sizeof(third));
+  statusCode = 0;
+  fields.clear();
+  error.clear();
+}
+
+/**
+ * Works through the buffer a line at a time.  A line that's only partially
+ * arrived is left alone, but scanned records how much of it has already
+ * been searched for its newline, so that search is never repeated.  Lines
+ * may end in either "\r\n" or just "\n", and blank lines ahead of the start
+ * line are skipped, as RFC 7230 recommends.
+ */
+HTTPParser::Status HTTPParser::parse(const char *buffer, size_t length) {
+  base = buffer;
+  if (headerLength > 0) return kComplete;
+  if (!error.empty()) return kMalformed;
+  StringView data(buffer, length);
+  while (true) {
+    size_t lineEnd = scanned + scanForByte(buffer + scanned, length - scanned, '\n');
+    if (lineEnd == length) {
+      scanned = length;
+      if (length > maxHeaderSize) return fail("Header too large.");
+      return kIncomplete;
+    }
+
+    StringView line = data.substr(lineStart, lineEnd - lineStart);
+    if (!line.empty() && line[line.size() - 1] == '\r') line = line.substr(0, line.size() - 1);
+    lineStart = scanned = lineEnd + 1;
+    if (lineStart > maxHeaderSize) return fail("Header too large.");
+    if (!startLineParsed) {
+      if (line.empty()) continue;
+      if (!parseStartLine(line)) return kMalformed;
+      startLineParsed = true;
+    } else if (line.empty()) {
+      headerLength = lineStart;
+      return kComplete;
+    } else if (!parseFieldLine(line)) {
+      return kMalformed;
+    }
+  }
+}
+
+HTTPParser::field_t HTTPParser::getField(size_t index) const {
+  field_t field;
+  field.name = view(fields[index].name);
+  field.value = view(fields[index].value);
+  field.continuation = fields[index].continuation;
+  return field;
+}
+
+/** Private methods **/
+
+HTTPParser::span_t HTTPParser::spanOf(const StringView& sv) const {
+  span_t span;
+  span.offset = sv.data() - base;
+  span.length = sv.size();
+  return span;
+}
+
+bool HTTPParser::parseStartLine(const StringView& line) {
+  return kind == kRequest ? parseRequestLine(line) : parseStatusLine(line);
+}
+
+/**
+ * Splits the line into its three space-separated tokens, which is all
+ * the parser needs to know about it.  Making sense of the target is left
+ * to HTTPRequest.
+ */
+static bool nextToken(const StringView& line, size_t& pos, StringView& token) {
+  while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t')) pos++;
+  size_t start = pos;
+  pos += scanForEither(line.data() + pos, line.size() - pos, ' ', '\t');
+  token = line.substr(start, pos - start);
+  return !token.empty();
+}
+
+bool HTTPParser::parseRequestLine(const StringView& line) {
+  size_t pos = 0;
+  StringView method, target, protocol;
+  if (!nextToken(line, pos, method) || !nextToken(line, pos, target) ||
+      !nextToken(line, pos, protocol)) {
+    fail("Malformed request line.");
+    return false;
+  }
+
+  first = spanOf(method);
+  second = spanOf(target);
+  third = spanOf(protocol);
+  return true;
+}
+
+/**
+ * A status line is the protocol, a three-digit code, and a reason phrase
+ * that runs to the end of the line (and may well be empty).
+ */
+bool HTTPParser::parseStatusLine(const StringView& line) {
+  size_t pos = 0;
+  StringView protocol, code;
+  if (!nextToken(line, pos, protocol) || !nextToken(line, pos, code) || code.size() != 3) {
+    fail("Malformed status line.");
+    return false;
+  }
+
+  statusCode = 0;
+  for (size_t i = 0; i < code.size(); i++) {
+    if (code[i] < '0' || code[i] > '9') {
+      fail("Malformed status line.");
+      return false;
+    }
+    statusCode = statusCode * 10 + (code[i] - '0');
+  }
+
+  first = spanOf(protocol);
+  second = spanOf(code);
+  third = spanOf(line.substr(pos).trim());
+  return true;
+}
+
+/**
+ * Lines without a colon aren't fields at all, and are ignored rather
+ * than failing the entire message over them.  Whitespace between a field's
+ * name and its colon fails a request (RFC 9112, section 5.1), since servers
+ * that ignore it and servers that don't disagree about what the field is;
+ * in a response, it's removed, as a proxy is to do.
+ */
+bool HTTPParser::parseFieldLine(const StringView& line) {
+  field_span_t field;
+  if (line[0] == ' ' || line[0] == '\t') {
+    if (fields.empty()) return true; // nothing to continue
+    field.name = spanOf(StringView(line.data(), 0));
+    field.value = spanOf(line.trim());
+    field.continuation = true;
+  } else {
+    size_t colon = scanForByte(line.data(), line.size(), ':');
+    if (colon == line.size()) return true;
+    StringView name = line.substr(0, colon);
+    if (name.trim().size() != name.size()) {
+      if (kind == kRequest) {
+        fail("Whitespace before a header field's colon.");
+        return false;
+      }
+      name = name.trim();
+    }
+    if (name.empty()) return true;
+    field.name = spanOf(name);
+    field.value = spanOf(line.substr(colon + 1).trim());
+    field.continuation = false;
+  }
+
+  fields.push_back(field);
+  return true;
+}
+
+HTTPParser::Status HTTPParser::fail(const string& message) {
+  error = message;
+  return kMalformed;
+}
@@ -0,0 +1,118 @@
+/**
+ * File: parser.h
+ * --------------
+ * Defines the HTTPParser class, which parses the start line and header
+ * of an HTTP/1.x request or response directly out of the buffer it's being
+ * received into.  Parsing is incremental: the parser can be handed the
+ * buffer every time more of the message arrives, and it resumes wherever
+ * it left off rather than starting over.  Nothing is copied along the
+ * way; the method, target, reason phrase, and header fields are all exposed
+ * as StringViews into the buffer, and HTTPRequest and HTTPResponse can be
+ * populated from a parser once the header is complete.
+ */
+
+#ifndef _http_parser_
+#define _http_parser_
+
+#include <cstddef>    // for size_t
+#include <string>
+#include <vector>
+
+#include "string-view.h"
+
+class HTTPParser {
+ public:
+  enum Kind { kRequest, kResponse };
+  enum Status { kIncomplete, kComplete, kMalformed };
+
+/**
+ * A header field.  Lines that begin with whitespace continue the value
+ * of the field before them (the obsolete line folding of RFC 7230), and
+ * are reported as separate fields, with continuation set to true and an
+ * empty name.
+ */
+  typedef struct {
+    StringView name;
+    StringView value;
+    bool continuation;
+  } field_t;
+
+/**
+ * Constructs a parser for requests or responses.  A header that has yet
+ * to end after maxHeaderSize bytes is reported as malformed.
+ */
+  HTTPParser(Kind kind, size_t maxHeaderSize = 64 * 1024);
+
+/**
+ * Forgets everything about the current message, so the parser is ready
+ * for the next one.
+ */
+  void reset();
+
+/**
+ * Parses as much of the message header as the first length bytes of
+ * buffer contain, where buffer holds the message from its very first byte.
+ * The same message may be parsed any number of times as it grows (and the
+ * buffer may move in the meantime), and only the bytes that haven't been
+ * seen before are examined.  Returns kComplete once the blank line ending
+ * the header has been parsed, kIncomplete if more bytes are needed, and
+ * kMalformed if the message can't be parsed (in which case getError
+ * explains why).
+ */
+  Status parse(const char *buffer, size_t length);
+
+/**
+ * Returns the number of bytes taken up by the start line and header,
+ * including the blank line, once parse has returned kComplete.  The
+ * payload (if any) begins at that offset.
+ */
+  size_t getHeaderLength() const { return headerLength; }
+
+/**
+ * The accessors below return views into the buffer most recently passed
+ * to parse, and are only meaningful once it's returned kComplete.
+ */
+  StringView getMethod() const { return view(first); }
+  StringView getTarget() const { return view(second); }
+  StringView getProtocol() const { return view(kind == kRequest ? third : first); }
+  int getStatusCode() const { return statusCode; }
+  StringView getReason() const { return view(third); }
+  size_t getFieldCount() const { return fields.size(); }
+  field_t getField(size_t index) const;
+
+  const std::string& getError() const { return error; }
+
+ private:
+  typedef struct {
+    size_t offset;
+    size_t length;
+  } span_t;
+
+  typedef struct {
+    span_t name;
+    span_t value;
+    bool continuation;
+  } field_span_t;
+
+  Kind kind;
+  size_t maxHeaderSize;
+  const char *base;          // the buffer most recently passed to parse
+  size_t lineStart;          // where the line being parsed begins
+  size_t scanned;            // how far the search for its end has gotten
+  bool startLineParsed;
+  size_t headerLength;
+  span_t first, second, third;
+  int statusCode;
+  std::vector<field_span_t> fields;
+  std::string error;
+
+  StringView view(const span_t& span) const { return StringView(base + span.offset, span.length); }
+  span_t spanOf(const StringView& sv) const;
+  bool parseStartLine(const StringView& line);
+  bool parseRequestLine(const StringView& line);
+  bool parseStatusLine(const StringView& line);
+  bool parseFieldLine(const StringView& line);
+  Status fail(const std::string& message);
+};
+
+#endif
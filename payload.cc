@@ -11,65 +11,213 @@
 #include <iostream>
 #include <vector>
 #include <iterator>
-#include "string-utils.h"
+#include <algorithm>
+#include "chunked-codec.h"
+#include "zero-copy.h"
 
 using namespace std;
 
+static const size_t kRelayBufferSize = 16 * 1024;
+
 /** Public methods and functions **/
 
-void HTTPPayload::ingestPayload(const HTTPHeader& header, istream& instream) {
-  if (isChunkedPayload(header)) {
-    ingestChunkedPayload(instream);
-  } else {
-    size_t contentLength = header.getValueAsNumber("Content-Length");
-    ingestCompletePayload(instream, contentLength);
-  }
+HTTPPayload::Status HTTPPayload::ingestPayload(const HTTPHeader& header, istream& instream) {
+  if (header.hasChunkedPayload()) return ingestChunkedPayload(instream);
+  size_t contentLength = header.getValueAsNumber(HTTPHeader::kContentLength);
+  return ingestCompletePayload(instream, contentLength);
 }
 
 void HTTPPayload::setPayload(HTTPHeader& header, const string& payload) {
   this->payload.clear();
   appendData(payload);
-  header.addHeader("Content-Length", int(payload.size()));
+  frameByLength(header);
+}
+
+bool HTTPPayload::relayPayload(HTTPHeader& header, istream& instream,
+                               ostream& outstream, bool& retain, int infd, int outfd) {
+  if (header.hasChunkedPayload()) {
+    if (!relayChunkedPayload(instream, outstream, retain, infd, outfd)) return false;
+    if (retain) frameByLength(header);
+    return true;
+  } else {
+    size_t contentLength = header.getValueAsNumber(HTTPHeader::kContentLength);
+    return relayCompletePayload(instream, outstream, contentLength, retain, infd, outfd);
+  }
+}
+
+bool HTTPPayload::relayPayloadUntilClose(istream& instream, ostream& outstream) {
+  char buffer[kRelayBufferSize];
+  while (true) {
+    instream.read(buffer, kRelayBufferSize);
+    size_t count = instream.gcount();
+    if (count == 0) return !instream.bad();
+    outstream.write(buffer, count);
+  }
+}
+
+void HTTPPayload::serialize(IOVector& iov) const {
+  if (!payload.empty()) iov.append(&payload[0], payload.size());
 }
 
 ostream& operator<<(ostream& os, const HTTPPayload& hp) {
-  copy(hp.payload.begin(), hp.payload.end(), ostream_iterator<char>(os));
+  if (!hp.payload.empty()) os.write(&hp.payload[0], hp.payload.size());
   return os;
 }
 
 /** Private methods **/
 
-bool HTTPPayload::isChunkedPayload(const HTTPHeader& header) const {
-  return header.getValueAsString("Transfer-Encoding") == "chunked";
+void HTTPPayload::frameByLength(HTTPHeader& header) const {
+  header.removeHeader(HTTPHeader::kTransferEncoding);
+  header.addHeader(HTTPHeader::kContentLength, to_string(payload.size()));
 }
 
-void HTTPPayload::ingestChunkedPayload(istream& instream) {
-  while (true) {
-    string chunkSizeStr;
-    getline(instream, chunkSizeStr);
-    chunkSizeStr = trim(chunkSizeStr);
-    appendData(chunkSizeStr + "\r\n");
-    chunkSizeStr = "0x" + chunkSizeStr;
-    int chunkSize = strtol(chunkSizeStr.c_str(), NULL, 16);
-    if (chunkSize == 0) break;
-    vector<char> content(chunkSize + 2);
-    instream.read(&*content.begin(), chunkSize + 2);
-    appendData(content);
+/**
+ * Reads the framing ahead of the next chunk's data (or that ends the
+ * payload) a byte at a time, so nothing beyond the payload is ever read,
+ * and appends it to framing.  Returns false if the stream fails or the
+ * framing is malformed.
+ */
+static bool readChunkFraming(istream& instream, ChunkedDecoder& decoder, string& framing) {
+  while (decoder.getDataRemaining() == 0 && decoder.getStatus() == ChunkedDecoder::kIncomplete) {
+    int ch = instream.get();
+    if (ch == EOF) return false;
+    char byte = ch;
+    decoder.decode(&byte, 1);
+    framing += byte;
   }
 
-  appendData("\r\n");
+  return decoder.getStatus() != ChunkedDecoder::kMalformed;
 }
 
-void HTTPPayload::ingestCompletePayload(istream& instream, size_t contentLength) {
-  vector<char> content(contentLength);
-  instream.read(&*content.begin(), contentLength);
-  appendData(content);
+/**
+ * The payload is retained exactly as it arrived, framing and all, since
+ * the header still describes it as chunked.  Chunk data is read straight
+ * into place, but never more of it at a time than has actually arrived,
+ * since the sender is free to announce a chunk of any size.
+ */
+HTTPPayload::Status HTTPPayload::ingestChunkedPayload(istream& instream) {
+  ChunkedDecoder decoder;
+  string framing;
+  while (readChunkFraming(instream, decoder, framing)) {
+    appendData(framing);
+    framing.clear();
+    if (decoder.getStatus() == ChunkedDecoder::kComplete) return kComplete;
+    size_t count = decoder.getDataRemaining();
+    if (payload.size() > kMaxIngestedSize || count > kMaxIngestedSize - payload.size()) return kTooLarge;
+    if (!ingestData(instream, count)) return kIncomplete;
+    decoder.skipData(count);
+  }
+
+  return decoder.getStatus() == ChunkedDecoder::kMalformed ? kMalformed : kIncomplete;
+}
+
+HTTPPayload::Status HTTPPayload::ingestCompletePayload(istream& instream, size_t contentLength) {
+  if (contentLength > kMaxIngestedSize) return kTooLarge;
+  return ingestData(instream, contentLength) ? kComplete : kIncomplete;
+}
+
+/**
+ * Appends up to length bytes from instream to the payload, a buffer's worth
+ * at a time, so the payload only grows as the bytes actually arrive.
+ * Returns false if the stream ends before all of them have.
+ */
+bool HTTPPayload::ingestData(istream& instream, size_t length) {
+  while (length > 0) {
+    size_t count = min(length, kRelayBufferSize);
+    size_t offset = payload.size();
+    payload.resize(offset + count);
+    instream.read(&payload[offset], count);
+    payload.resize(offset + instream.gcount());
+    if (size_t(instream.gcount()) < count) return false;
+    length -= count;
+  }
+
+  return true;
+}
+
+/**
+ * The framing is relayed as it arrived, and each chunk's data is relayed
+ * (or spliced) just as a payload of that length would be.  Only the data
+ * is retained, though.
+ */
+bool HTTPPayload::relayChunkedPayload(istream& instream, ostream& outstream, bool& retain,
+                                      int infd, int outfd) {
+  ChunkedDecoder decoder;
+  string framing;
+  while (readChunkFraming(instream, decoder, framing)) {
+    outstream.write(framing.data(), framing.size());
+    framing.clear();
+    if (decoder.getStatus() == ChunkedDecoder::kComplete) return true;
+    size_t count = decoder.getDataRemaining();
+    if (!relayCompletePayload(instream, outstream, count, retain, infd, outfd)) return false;
+    decoder.skipData(count);
+  }
+
+  return false;
+}
+
+bool HTTPPayload::relayCompletePayload(istream& instream, ostream& outstream,
+                                       size_t contentLength, bool& retain, int infd, int outfd) {
+  if (!retain && infd != -1 && outfd != -1 && contentLength > kRelayBufferSize) {
+    return spliceCompletePayload(instream, outstream, contentLength, infd, outfd);
+  }
+
+  char buffer[kRelayBufferSize];
+  while (contentLength > 0) {
+    size_t count = min(contentLength, kRelayBufferSize);
+    instream.read(buffer, count);
+    count = instream.gcount();
+    if (count == 0) return false;
+    outstream.write(buffer, count);
+    if (retain) retainData(buffer, count, retain);
+    contentLength -= count;
+  }
+
+  return true;
+}
+
+/**
+ * Relays whatever instream has already read ahead the usual way, and then
+ * flushes outstream so that everything written to it so far precedes the
+ * spliced bytes.  Once instream's buffer has been drained, the stream and
+ * infd agree on where the payload resumes, so the remainder is spliced
+ * directly, and anything beyond it is left for instream to read as usual.
+ */
+bool HTTPPayload::spliceCompletePayload(istream& instream, ostream& outstream,
+                                        size_t contentLength, int infd, int outfd) {
+  char buffer[kRelayBufferSize];
+  streamsize buffered = instream.rdbuf()->in_avail();
+  while (buffered > 0 && contentLength > 0) {
+    size_t count = min<size_t>(min<size_t>(buffered, contentLength), kRelayBufferSize);
+    instream.read(buffer, count);
+    outstream.write(buffer, count);
+    buffered -= count;
+    contentLength -= count;
+  }
+
+  outstream.flush();
+  if (!outstream) return false;
+  return spliceCompletely(infd, outfd, contentLength);
 }
 
 void HTTPPayload::appendData(const string& data) {
   copy(data.begin(), data.end(), back_inserter(this->payload));
 }
 
-void HTTPPayload::appendData(const vector<char>& data) {
-  copy(data.begin(), data.end(), back_inserter(this->payload));
+void HTTPPayload::appendData(const char *data, size_t length) {
+  this->payload.insert(this->payload.end(), data, data + length);
+}
+
+/**
+ * Once the payload proves too large to retain, its memory is released
+ * right away rather than when the payload itself is destroyed.
+ */
+void HTTPPayload::retainData(const char *data, size_t length, bool& retain) {
+  if (payload.size() > kMaxRetainedSize || length > kMaxRetainedSize - payload.size()) {
+    vector<char, ArenaAllocator<char> >(payload.get_allocator()).swap(payload);
+    retain = false;
+    return;
+  }
+
+  appendData(data, length);
 }
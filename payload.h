@@ -25,29 +25,105 @@ class HTTPPayload {
 
  public:
 
+/**
+ * Constructs an empty payload whose bytes are allocated from the supplied
+ * arena, or from the heap if there isn't one.
+ */
+
+  HTTPPayload(Arena *arena = NULL) : payload(ArenaAllocator<char>(arena)) {}
+
+/**
+ * The most an ingested payload may hold, since the sender decides how
+ * large a payload it announces, and ingestPayload holds all of it in memory.
+ */
+
+  static const size_t kMaxIngestedSize = 64 << 20; // 64MB
+
+/**
+ * The most a relayed payload may retain (see relayPayload), since the
+ * retained copy is held in memory until it's been cached.
+ */
+  static const size_t kMaxRetainedSize = 16 << 20; // 16MB
+
+/**
+ * Describes how ingesting a payload went: all of it arrived, it was larger
+ * than kMaxIngestedSize, its chunked framing was malformed, or the stream
+ * ended before all of it arrived.
+ */
+
+  enum Status { kComplete, kTooLarge, kMalformed, kIncomplete };
+
 /**
  * Ingests the entire payload from the provided istream, relying
  * on information present in the supplied HTTPHeader to determine
  * the payload size, and whether or not the payload is complete
- * or chunked.
+ * or chunked.  Unless kComplete is returned, the payload is
+ * ingested no further, and the stream is left partway through it.
  */
 
-  void ingestPayload(const HTTPHeader& header, std::istream& instream);
+  Status ingestPayload(const HTTPHeader& header, std::istream& instream);
 
 /**
  * Sets the payload to be equal to the stream of characters contained
- * in the payload string.
+ * in the payload string, and updates the header to frame it by its
+ * Content-Length.
  */
 
   void setPayload(HTTPHeader& header, const std::string& payload);
 
+/**
+ * Relays the payload from instream to outstream through a fixed-size
+ * buffer rather than ingesting all of it first, so the recipient sees the
+ * first bytes as soon as they arrive.  Chunked payloads are relayed chunk by
+ * chunk, framing and all.  If retain is true, the relayed bytes are also
+ * accumulated, exactly as ingestPayload would have accumulated them, so
+ * the full payload is available once the relay is complete.  Returns true
+ * if and only if the entire payload was relayed.  A chunked payload is
+ * retained de-chunked, and the header is updated to frame it by its
+ * Content-Length instead.  Should the payload prove larger than
+ * kMaxRetainedSize, whatever was retained is discarded, retain is set to
+ * false, and the rest of the payload is relayed without being retained.
+ *
+ * If the descriptors underlying the two streams are supplied (and nothing
+ * needs to be retained), then whatever instream has already buffered is
+ * relayed as usual, but the rest of the payload is spliced from infd to
+ * outfd without ever being copied into user space.
+ */
+
+  bool relayPayload(HTTPHeader& header, std::istream& instream,
+                    std::ostream& outstream, bool& retain,
+                    int infd = -1, int outfd = -1);
+
+/**
+ * Relays a payload that's delimited by neither Content-Length nor chunked
+ * framing, and so ends only when the sender closes the connection, from
+ * instream to outstream.  Nothing is retained, since a payload cut short
+ * can't be told apart from a complete one.
+ */
+
+  bool relayPayloadUntilClose(std::istream& instream, std::ostream& outstream);
+
+/**
+ * Appends the payload to the supplied IOVector, by reference.
+ */
+
+  void serialize(IOVector& iov) const;
+
  private:
-  std::vector<char> payload;
-  bool isChunkedPayload(const HTTPHeader& header) const;
-  void ingestChunkedPayload(std::istream& instream);
-  void ingestCompletePayload(std::istream& instream, size_t contentLength);
+  std::vector<char, ArenaAllocator<char> > payload;
+  void frameByLength(HTTPHeader& header) const;
+  Status ingestChunkedPayload(std::istream& instream);
+  Status ingestCompletePayload(std::istream& instream, size_t contentLength);
+  bool ingestData(std::istream& instream, size_t length);
+  bool relayChunkedPayload(std::istream& instream, std::ostream& outstream, bool& retain,
+                           int infd, int outfd);
+  bool relayCompletePayload(std::istream& instream, std::ostream& outstream,
+                            size_t contentLength, bool& retain, int infd, int outfd);
+  bool spliceCompletePayload(std::istream& instream, std::ostream& outstream,
+                             size_t contentLength, int infd, int outfd);
   void appendData(const std::string& content);
-  void appendData(const std::vector<char>& content);
+  void appendData(const char *content, size_t length);
+  void retainData(const char *content, size_t length, bool& retain);
 };
 
 #endif
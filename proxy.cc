@@ -7,12 +7,14 @@
 
 #include "proxy.h"
 
+#include <chrono>
 #include <climits>
 #include <cstring>
 #include <sstream>
 #include <string>
 #include <utility>
 #include <iostream>
+#include <thread>
 #include <unistd.h>
 
 #include <sys/socket.h>
@@ -23,6 +25,8 @@
 #include <getopt.h>
 
 #include "proxy-exception.h"
+#include "ostreamlock.h"
+#include "affinity.h"
 
 using namespace std;
 
@@ -36,15 +40,35 @@ using namespace std;
  * to the specified port number), then an HTTPProxyException
  * is thrown.
  */
-static const int kUnitializedSocket = -1;
+static const int kDefaultBacklog = 128;
+static const uint64_t kDefaultCacheMegabytes = 1024;
+static const uint64_t kDefaultCacheEntries = 1 << 20;
 HTTPProxy::HTTPProxy(int argc, char *argv[]) throw (HTTPProxyException) :
-  portNumber(computeDefaultPortForUser()), listenfd(kUnitializedSocket) {
+  portNumber(computeDefaultPortForUser()), numEventLoops(0), statsInterval(0),
+  reusePort(false), backlog(kDefaultBacklog), ioEngine(EventLoop::kEpoll),
+  cachePolicy(EvictionPolicy::kTinyLFU), cacheBytes(kDefaultCacheMegabytes << 20),
+  cacheEntries(kDefaultCacheEntries), staleGrace(0) {
   try {
     configureFromArgumentList(argc, argv);
-    createServerSocket();
-    configureServerSocket();
+    cache.reset(new HTTPCache(cachePolicy, cacheBytes, cacheEntries, staleGrace));
+    refresher.reset(new HTTPRefresher(resolver, *cache));
+    if (usesEventLoops()) {
+      reactor.reset(new HTTPProxyReactor(numEventLoops, resolver, *cache, ioEngine));
+    } else {
+      scheduler.reset(new HTTPProxyScheduler(resolver, *cache));
+    }
+    size_t numListeners = !reusePort ? 1 : usesEventLoops() ? numEventLoops : countAvailableCores();
+    for (size_t i = 0; i < numListeners; i++) {
+      listenfds.push_back(createServerSocket());
+      configureServerSocket(listenfds.back());
+    }
+    if (statsInterval > 0) {
+      thread t([this]() -> void { reportStatsPeriodically(); });
+      t.detach();
+    }
+    if (reusePort && !usesEventLoops()) startAcceptorThreads();
   } catch (const HTTPProxyException& hpe) {
-    if (listenfd != kUnitializedSocket) {
+    for (int listenfd: listenfds) {
       close(listenfd);
     }
     throw;
@@ -60,9 +84,26 @@ HTTPProxy::HTTPProxy(int argc, char *argv[]) throw (HTTPProxyException) :
  * proxied on to the origin server.
  */
 void HTTPProxy::acceptAndProxyRequest() throw(HTTPProxyException) {
+  acceptAndProxyRequest(listenfds[0]);
+}
+
+/**
+ * Method: runEventLoops
+ * ---------------------
+ * Passes the listening socket(s) to the reactor, whose event loops
+ * take over all accepting and proxying for the lifetime of the process.
+ */
+void HTTPProxy::runEventLoops() {
+  reactor->serve(listenfds, /* pinLoops = */ reusePort);
+}
+
+/** Private methods **/
+
+void HTTPProxy::acceptAndProxyRequest(int listenfd) throw(HTTPProxyException) {
   struct sockaddr_in clientAddr;
   socklen_t clientAddrSize = sizeof(clientAddr);
-  int connectionfd = accept(listenfd, (struct sockaddr *) &clientAddr, &clientAddrSize);
+  int connectionfd = accept4(listenfd, (struct sockaddr *) &clientAddr, &clientAddrSize,
+                             SOCK_CLOEXEC);
   if (connectionfd < 0) {
     // connectionfd isn't open, so we're not orphaning any resources
     throw HTTPProxyException
@@ -71,31 +112,99 @@ void HTTPProxy::acceptAndProxyRequest() throw(HTTPProxyException) {
 
   const char *clientIPAddress = getClientIPAddress(&clientAddr);
   try {
-    scheduler.scheduleRequest(connectionfd, clientIPAddress);
+    scheduler->scheduleRequest(connectionfd, clientIPAddress);
   } catch (...) {
     cerr << "General failure while in communication with " << clientIPAddress << "." << endl;
     cerr << "But it's just one connection, so we're ignoring..." << endl;
   }
 }
 
-/** Private methods **/
+/**
+ * Method: startAcceptorThreads
+ * ----------------------------
+ * With --reuseport and without event loops, every listening socket
+ * but the first gets an acceptor thread of its own, and the main thread
+ * (which goes on to drain the first) is pinned to the first core along
+ * with it.  The kernel spreads incoming connections across the listeners,
+ * so no one acceptor has to keep up with all of them.  The main thread is
+ * only pinned once the others have been started, so none of them
+ * inherits its affinity.
+ */
+void HTTPProxy::startAcceptorThreads() {
+  for (size_t i = 1; i < listenfds.size(); i++) {
+    int listenfd = listenfds[i];
+    thread t([this, i, listenfd]() -> void {
+        pinThreadToCore(i);
+        while (true) {
+          try {
+            acceptAndProxyRequest(listenfd);
+          } catch (const HTTPProxyException& hpe) {
+            cerr << oslock << hpe.what() << endl << osunlock;
+          }
+        }
+      });
+    t.detach();
+  }
 
-static const string kUsageString = "Usage: http-proxy [--port <port-number>]";
+  pinThreadToCore(0);
+}
+
+static const string kUsageString =
+  "Usage: http-proxy [--port <port-number>] [--event-loops <count>] [--stats <seconds>]\n"
+  "                  [--backlog <count>] [--reuseport] [--io-engine epoll|io_uring]\n"
+  "                  [--cache-policy lru|clock|tinylfu] [--cache-size <megabytes>]\n"
+  "                  [--cache-objects <count>] [--stale-grace <seconds>]";
 void HTTPProxy::configureFromArgumentList(int argc, char *argv[]) throw (HTTPProxyException) {
   struct option options[] = {
     {"port", required_argument, NULL, 'p'},
+    {"event-loops", required_argument, NULL, 'e'},
+    {"stats", required_argument, NULL, 's'},
+    {"backlog", required_argument, NULL, 'b'},
+    {"reuseport", no_argument, NULL, 'r'},
+    {"io-engine", required_argument, NULL, 'i'},
+    {"cache-policy", required_argument, NULL, 'C'},
+    {"cache-size", required_argument, NULL, 'S'},
+    {"cache-objects", required_argument, NULL, 'O'},
+    {"stale-grace", required_argument, NULL, 'G'},
     {NULL, 0, NULL, 0},
   };
 
   ostringstream oss;
   pair<string, unsigned short> proxy;
   while (true) {
-    int ch = getopt_long(argc, argv, "p:x:nc", options, NULL);
+    int ch = getopt_long(argc, argv, "p:e:s:b:ri:C:S:O:G:x:nc", options, NULL);
     if (ch == -1) break;
     switch (ch) {
     case 'p':
       portNumber = extractPortNumber(optarg);
       break;
+    case 'e':
+      numEventLoops = extractPositiveNumber(optarg, "--event-loops");
+      break;
+    case 's':
+      statsInterval = extractPositiveNumber(optarg, "--stats");
+      break;
+    case 'b':
+      backlog = extractPositiveNumber(optarg, "--backlog");
+      break;
+    case 'r':
+      reusePort = true;
+      break;
+    case 'i':
+      ioEngine = extractIOEngine(optarg);
+      break;
+    case 'C':
+      cachePolicy = extractCachePolicy(optarg);
+      break;
+    case 'S':
+      cacheBytes = uint64_t(extractPositiveNumber(optarg, "--cache-size")) << 20;
+      break;
+    case 'O':
+      cacheEntries = extractPositiveNumber(optarg, "--cache-objects");
+      break;
+    case 'G':
+      staleGrace = extractPositiveNumber(optarg, "--stale-grace");
+      break;
     default:
       oss << "Unrecognized or improperly supplied flag passed to http-proxy." << endl;
       oss << kUsageString;
@@ -109,6 +218,12 @@ void HTTPProxy::configureFromArgumentList(int argc, char *argv[]) throw (HTTPPro
     oss << kUsageString;
     throw HTTPProxyException(oss.str());
   }
+
+  if (ioEngine != EventLoop::kEpoll && !usesEventLoops()) {
+    oss << "The --io-engine flag only applies when --event-loops is supplied." << endl;
+    oss << kUsageString;
+    throw HTTPProxyException(oss.str());
+  }
 }
 
 /**
@@ -160,13 +275,93 @@ unsigned short HTTPProxy::extractPortNumber(const char *portArgument) throw (HTT
   return rawPort;
 }
 
+/**
+ * Function: extractPositiveNumber
+ * -------------------------------
+ * Converts the string form of a count-like argument (e.g. the
+ * number of event loops) to a size_t and returns it.  If the argument
+ * isn't a well-formed, positive number, then an HTTPProxyException is thrown.
+ */
+size_t HTTPProxy::extractPositiveNumber(const char *argument, const char *flag) throw (HTTPProxyException) {
+  char *endptr;
+  long value = argument == NULL ? 0 : strtol(argument, &endptr, 0);
+  if (argument == NULL || *endptr != '\0' || value < 1) {
+    ostringstream oss;
+    oss << "The " << flag << " flag requires a positive number.";
+    throw HTTPProxyException(oss.str());
+  }
+
+  return value;
+}
+
+/**
+ * Method: extractIOEngine
+ * -----------------------
+ * Maps the argument of --io-engine to the event loop backend it names.
+ * There's deliberately no quiet fallback from io_uring to epoll: a kernel
+ * without io_uring surfaces as a failure to construct the event loops,
+ * so that a benchmark never measures a different engine than it asked for.
+ */
+EventLoop::Backend HTTPProxy::extractIOEngine(const char *argument) throw (HTTPProxyException) {
+  string engine = argument == NULL ? "" : argument;
+  if (engine == "epoll") return EventLoop::kEpoll;
+  if (engine == "io_uring" || engine == "uring") return EventLoop::kIOUring;
+  throw HTTPProxyException("The --io-engine flag requires either epoll or io_uring.");
+}
+
+/**
+ * Method: extractCachePolicy
+ * --------------------------
+ * Maps the argument of --cache-policy to the eviction policy it names.
+ */
+EvictionPolicy::Kind HTTPProxy::extractCachePolicy(const char *argument) throw (HTTPProxyException) {
+  EvictionPolicy::Kind kind;
+  if (argument == NULL || !EvictionPolicy::parseKind(argument, kind)) {
+    throw HTTPProxyException("The --cache-policy flag requires one of lru, clock, or tinylfu.");
+  }
+
+  return kind;
+}
+
+/**
+ * Method: reportStatsPeriodically
+ * -------------------------------
+ * Runs on its own thread when the proxy is launched with --stats, and
+ * publishes the resolver's counters every statsInterval seconds, along
+ * with the hit ratio of the cache's eviction policy and of each of the
+ * policies shadowing it.
+ */
+void HTTPProxy::reportStatsPeriodically() const {
+  while (true) {
+    this_thread::sleep_for(chrono::seconds(statsInterval));
+    HTTPResolver::stats_t stats = resolver.getStats();
+    double averageLookupTime = stats.lookups == 0 ? 0 :
+      double(stats.totalLookupTime) / stats.lookups / 1000;
+    cout << oslock << "     [Resolver: " << stats.hits << " hits, "
+         << stats.negativeHits << " negative hits, " << stats.misses << " misses, "
+         << stats.coalesced << " coalesced, " << stats.failures << " failures, "
+         << stats.lookups << " lookups averaging " << averageLookupTime << "ms (worst "
+         << stats.maxLookupTime / 1000.0 << "ms).]" << endl << osunlock;
+    for (const HTTPSegmentStore::stats_t& policy: cache->getStats()) {
+      uint64_t lookups = policy.hits + policy.misses;
+      double hitRatio = lookups == 0 ? 0 : 100.0 * policy.hits / lookups;
+      cout << oslock << "     [Cache (" << policy.policy << (policy.active ? "" : ", shadow")
+           << "): " << policy.hits << " hits, " << policy.misses << " misses, "
+           << hitRatio << "% hit ratio, " << policy.entries << " entries in "
+           << policy.bytes << " bytes.]" << endl << osunlock;
+    }
+  }
+}
+
 /**
  * Creates a server socket and configures it to
  * be closed more or less immediately if the surrounding
- * application dies or is killed.
+ * application dies or is killed.  With --reuseport, the socket
+ * is also configured to share its port with the proxy's other
+ * listening sockets.
  */
-void HTTPProxy::createServerSocket() {
-  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+int HTTPProxy::createServerSocket() const {
+  int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (listenfd < 0) {
     throw HTTPProxyException
       ("Failed to open a primary socket to poll for connections.");
@@ -179,6 +374,12 @@ void HTTPProxy::createServerSocket() {
   // to just type Ctrl-C.
   const int optval = 1;
   setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval , sizeof(int));
+  if (reusePort && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) < 0) {
+    close(listenfd);
+    throw HTTPProxyException("Failed to configure listening socket for port sharing.");
+  }
+
+  return listenfd;
 }
 
 /**
@@ -187,10 +388,10 @@ void HTTPProxy::createServerSocket() {
  * any host whatsoever on the port number passed in to the
  * HTTPProxy constructor.  ::bind actually ties the socket
  * to the provided port number, and listen clarifies how many
- * pending connections can be queued up before the proxy starts
- * refusing connections.
+ * pending connections can be queued up (--backlog, capped by the
+ * kernel's somaxconn) before the proxy starts refusing connections.
  */
-void HTTPProxy::configureServerSocket() const {
+void HTTPProxy::configureServerSocket(int listenfd) const {
   struct sockaddr_in serverAddr;
   bzero(&serverAddr, sizeof(serverAddr));
   serverAddr.sin_family = AF_INET;
@@ -206,8 +407,7 @@ void HTTPProxy::configureServerSocket() const {
     throw HTTPProxyException(oss.str());
   }
 
-  const size_t kMaxQueuedRequests = 128; // 128 is the largest allowed value
-  if (listen(listenfd, kMaxQueuedRequests) < 0) {
+  if (listen(listenfd, backlog) < 0) {
     throw HTTPProxyException
       ("Failed to set listening socket to accept connection requests");
   }
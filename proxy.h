@@ -11,9 +11,17 @@
 #define _http_proxy_
 
 #include "scheduler.h"
+#include "reactor.h"
+#include "resolver.h"
+#include "cache.h"
+#include "eviction-policy.h"
+#include "refresher.h"
 #include "proxy-exception.h"
+#include <cstddef>
+#include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 class HTTPProxy {
  public:
@@ -41,17 +49,50 @@ class HTTPProxy {
  */
   void acceptAndProxyRequest() throw(HTTPProxyException);
 
+/**
+ * Returns true if and only if the proxy was configured (via --event-loops)
+ * to service connections with non-blocking event loops rather than
+ * with a thread per request.
+ */
+
+  bool usesEventLoops() const { return numEventLoops > 0; }
+
+/**
+ * Hands the listening socket(s) over to the event loops, which accept
+ * and service all connections from that point on.  Never returns.
+ */
+  void runEventLoops();
+
  private:
   unsigned short portNumber;
-  int listenfd;
-  HTTPProxyScheduler scheduler;
+  size_t numEventLoops;
+  size_t statsInterval;
+  bool reusePort;
+  int backlog;
+  EventLoop::Backend ioEngine;
+  EvictionPolicy::Kind cachePolicy;
+  uint64_t cacheBytes;
+  uint64_t cacheEntries;
+  long staleGrace;
+  std::vector<int> listenfds;
+  HTTPResolver resolver;
+  std::unique_ptr<HTTPCache> cache;
+  std::unique_ptr<HTTPRefresher> refresher;
+  std::unique_ptr<HTTPProxyScheduler> scheduler;
+  std::unique_ptr<HTTPProxyReactor> reactor;
 
   /* private methods */
   void configureFromArgumentList(int argc, char *argv[]) throw (HTTPProxyException);
   unsigned short computeDefaultPortForUser();
   unsigned short extractPortNumber(const char *portArgument) throw (HTTPProxyException);
-  void createServerSocket();
-  void configureServerSocket() const;
+  size_t extractPositiveNumber(const char *argument, const char *flag) throw (HTTPProxyException);
+  EventLoop::Backend extractIOEngine(const char *argument) throw (HTTPProxyException);
+  EvictionPolicy::Kind extractCachePolicy(const char *argument) throw (HTTPProxyException);
+  void reportStatsPeriodically() const;
+  void acceptAndProxyRequest(int listenfd) throw(HTTPProxyException);
+  void startAcceptorThreads();
+  int createServerSocket() const;
+  void configureServerSocket(int listenfd) const;
   const char *getClientIPAddress(const struct sockaddr_in *clientAddr) const;
 };
 
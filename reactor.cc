@@ -0,0 +1,119 @@
+/**
+ * File: reactor.cc
+ * ----------------
+ * Presents the implementation of the HTTPProxyReactor class.
+ */
+
+#include "reactor.h"
+
+#include <iostream>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+#include "connection.h"
+#include "ostreamlock.h"
+
+using namespace std;
+
+HTTPProxyReactor::HTTPProxyReactor(size_t numLoops, HTTPResolver& resolver, HTTPCache& cache,
+                                   EventLoop::Backend backend) :
+  resolver(resolver), blacklist("blocked-domains.txt"), cache(cache),
+  originPool(resolver, /* nonblocking = */ true) {
+  raiseDescriptorLimit();
+  for (size_t i = 0; i < numLoops; i++) {
+    loops.push_back(unique_ptr<EventLoop>(new EventLoop(backend)));
+  }
+}
+
+/**
+ * When the loops share a listening socket, EPOLLEXCLUSIVE ensures that an
+ * incoming connection wakes up just one of them rather than stampeding the
+ * entire herd.  With a listening socket per loop, the kernel has already
+ * picked the loop by the time the connection is queued.  (With io_uring,
+ * each loop's multishot accept takes connections off a shared socket one at
+ * a time, so there's no herd to speak of.)
+ */
+void HTTPProxyReactor::serve(const vector<int>& listenfds, bool pinLoops) {
+  bool shared = listenfds.size() != loops.size();
+  for (int listenfd: listenfds) {
+    int flags = fcntl(listenfd, F_GETFL, 0);
+    fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  for (size_t i = 0; i < loops.size(); i++) {
+    EventLoop *lp = loops[i].get();
+    int listenfd = shared ? listenfds[0] : listenfds[i];
+    uint32_t events = shared ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+    lp->watchAccepts(listenfd, events, [this, lp](int connectionfd,
+                                                  const struct sockaddr_in *address) {
+        adoptConnection(*lp, connectionfd, address);
+      });
+  }
+
+  for (size_t i = 1; i < loops.size(); i++) {
+    EventLoop *lp = loops[i].get();
+    thread t([lp, i, pinLoops]() -> void {
+        if (pinLoops) pinThreadToCore(i);
+        lp->run();
+      });
+    t.detach();
+  }
+
+  if (pinLoops) pinThreadToCore(0);
+  loops[0]->run();
+}
+
+/** Private methods **/
+
+/**
+ * Hands a newly accepted connection to a new HTTPConnection owned by the
+ * supplied loop.  Multishot accepts (with io_uring) don't collect the
+ * client's address, so it's looked up when it wasn't supplied.
+ */
+void HTTPProxyReactor::adoptConnection(EventLoop& loop, int connectionfd,
+                                       const struct sockaddr_in *address) {
+  struct sockaddr_in clientAddr;
+  if (address == NULL) {
+    socklen_t clientAddrSize = sizeof(clientAddr);
+    if (getpeername(connectionfd, (struct sockaddr *) &clientAddr, &clientAddrSize) != 0) {
+      close(connectionfd);
+      return;
+    }
+    address = &clientAddr;
+  }
+
+  char clientIPAddress[INET_ADDRSTRLEN];
+  if (inet_ntop(AF_INET, &address->sin_addr, clientIPAddress, sizeof(clientIPAddress)) == NULL) {
+    close(connectionfd);
+    return;
+  }
+
+  try {
+    shared_ptr<HTTPConnection> connection(new HTTPConnection(loop, connectionfd, clientIPAddress,
+                                                             blacklist, cache, resolver,
+                                                             originPool));
+    connection->start();
+  } catch (...) {
+    cerr << oslock << "General failure while in communication with " << clientIPAddress << "." << endl;
+    cerr << "But it's just one connection, so we're ignoring..." << endl << osunlock;
+  }
+}
+
+/**
+ * Holding tens of thousands of concurrent connections (each of which
+ * may also have an origin socket open) requires far more descriptors than
+ * the typical soft limit of 1024, so the soft limit is raised to the hard one.
+ */
+void HTTPProxyReactor::raiseDescriptorLimit() const {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return;
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+}
@@ -0,0 +1,60 @@
+/**
+ * File: reactor.h
+ * ---------------
+ * Defines the HTTPProxyReactor class, which is the event-driven
+ * alternative to the HTTPProxyScheduler.  Rather than handing each
+ * accepted connection to a thread that blocks on it from start to finish,
+ * the reactor runs a small, fixed number of EventLoop threads, each of
+ * which accepts connections on its own and multiplexes all of them as
+ * non-blocking HTTPConnection state machines.
+ */
+
+#ifndef _http_proxy_reactor_
+#define _http_proxy_reactor_
+
+#include <cstddef>    // for size_t
+#include <memory>     // for unique_ptr
+#include <vector>
+#include <netinet/in.h>  // for sockaddr_in
+
+#include "event-loop.h"
+#include "blacklist.h"
+#include "cache.h"
+#include "origin-pool.h"
+#include "resolver.h"
+
+class HTTPProxyReactor {
+ public:
+
+/**
+ * Constructs a reactor that will drive the specified number of
+ * event loops (and therefore the specified number of threads), each of
+ * them relying on the specified backend to detect readiness.
+ */
+  HTTPProxyReactor(size_t numLoops, HTTPResolver& resolver, HTTPCache& cache,
+                   EventLoop::Backend backend = EventLoop::kEpoll);
+
+/**
+ * Registers the supplied listening sockets with the event loops and then
+ * runs the loops forever, the first of them on the calling thread.  If
+ * there's one listening socket per loop (as there is with SO_REUSEPORT),
+ * each loop accepts from its own; otherwise, every loop shares the first.
+ * If pinLoops is true, each loop's thread is pinned to a core of its own.
+ */
+  void serve(const std::vector<int>& listenfds, bool pinLoops);
+
+ private:
+  HTTPResolver& resolver;
+  HTTPBlacklist blacklist;
+  HTTPCache& cache;
+  HTTPOriginPool originPool;
+  std::vector<std::unique_ptr<EventLoop> > loops;
+
+  void adoptConnection(EventLoop& loop, int connectionfd, const struct sockaddr_in *address);
+  void raiseDescriptorLimit() const;
+
+  HTTPProxyReactor(const HTTPProxyReactor& original) = delete;
+  HTTPProxyReactor& operator=(const HTTPProxyReactor& rhs) = delete;
+};
+
+#endif
@@ -0,0 +1,110 @@
+/**
+ * File: refresher.cc
+ * ------------------
+ * Presents the implementation of the HTTPRefresher class.
+ */
+
+#include "refresher.h"
+
+#include <ctime>
+#include <memory>
+#include <unistd.h>               // for close, dup
+
+#include "socket++/sockstream.h" // for sockbuf, iosockstream
+#include "io-vector.h"
+#include "ostreamlock.h"
+#include "response.h"
+
+using namespace std;
+
+static const int kNoSocket = -1;
+static const int kNotModified = 304;
+static const int kMaxFetchAttempts = 2;
+
+HTTPRefresher::HTTPRefresher(HTTPResolver& resolver, HTTPCache& cache, size_t numThreads) :
+  cache(cache), originPool(resolver, /* nonblocking = */ false), pool(numThreads) {
+  cache.setRefresher([this](const HTTPRequest& request) -> void { refresh(request); });
+}
+
+/**
+ * The fetch was claimed on the request's behalf before it got here, so
+ * it's ended once the refresh is over, whatever the outcome.
+ */
+void HTTPRefresher::refresh(const HTTPRequest& request) {
+  shared_ptr<HTTPRequest> copy(new HTTPRequest(request));
+  pool.schedule([this, copy]() -> void {
+      fetch(*copy);
+      cache.endFetch_r(*copy);
+    });
+}
+
+/** Private methods **/
+
+/**
+ * Sends the request to the origin much as HTTPRequestHandler::forwardRequest
+ * does, except that nobody's waiting on the response: the entry's own
+ * validators replace any the client sent, a 304 (Not Modified) freshens
+ * the entry, and a full response replaces it if it may be cached.  Should
+ * the origin fail to answer, the stale entry is simply left as it was.
+ */
+void HTTPRefresher::fetch(HTTPRequest& request) {
+  request.setValidators("", "");
+  request.requestPersistentConnection();
+  bool revalidating = cache.addValidators_r(request);
+  for (int attempt = 0; attempt < kMaxFetchAttempts; attempt++) {
+    bool reused;
+    int server_fd = originPool.acquire(request.getServer(), request.getPort(), reused);
+    if (server_fd == kNoSocket) return;
+    sockbuf sb(dup(server_fd));
+    iosockstream server_stream(&sb);
+    HTTPResponse response;
+    IOVector iov;
+    request.serialize(iov);
+    response.setRequestTime(time(NULL));
+    bool sent = iov.sendCompletely(server_fd);
+    if (sent) response.ingestResponseHeader(server_stream);
+    if (!sent || server_stream.fail() || !response.hasValidFraming()) {
+      close(server_fd);
+      if (reused && response.getProtocol().empty()) continue;
+      return;
+    }
+
+    bool reusable = response.permitsConnectionReuse();
+    if (revalidating && response.getResponseCode() == kNotModified) {
+      if (reusable) {
+        originPool.release(request.getServer(), request.getPort(), server_fd);
+      } else {
+        close(server_fd);
+      }
+      HTTPResponse refreshed;
+      HTTPCache::cached_payload_t payload = { kNoSocket, 0, 0 };
+      if (cache.refreshCacheEntry_r(request, response, refreshed, payload)) {
+        if (payload.fd != kNoSocket) close(payload.fd);
+        return;
+      }
+      request.setValidators("", ""); // the entry vanished, so ask for all of it
+      revalidating = false;
+      continue;
+    }
+
+    if (!cache.shouldCache(request, response) || !response.hasDelimitedPayload()) {
+      close(server_fd);
+      return;
+    }
+
+    if (!response.ingestPayload(server_stream) || server_stream.fail()) {
+      close(server_fd);
+      return;
+    }
+
+    cout << oslock << "     [Refreshed stale cached copy of " << request.getURL()
+         << " in the background.]" << endl << osunlock;
+    cache.cacheEntry_r(request, response);
+    if (reusable) {
+      originPool.release(request.getServer(), request.getPort(), server_fd);
+    } else {
+      close(server_fd);
+    }
+    return;
+  }
+}
@@ -0,0 +1,52 @@
+/**
+ * File: refresher.h
+ * -----------------
+ * Defines the HTTPRefresher class, which refreshes stale cache entries
+ * in the background.  When the cache serves an entry that's gone stale
+ * but is still within its stale-while-revalidate window, the client gets
+ * the stale copy right away, and the entry is handed to the refresher,
+ * whose own pool of threads asks the origin whether it's still good (or
+ * fetches it anew) without anyone waiting on the answer.  The cache makes
+ * sure an entry is never refreshed twice at once, nor while a client's
+ * miss on it is already being fetched.
+ */
+
+#ifndef _http_refresher_
+#define _http_refresher_
+
+#include <cstddef>    // for size_t
+
+#include "cache.h"
+#include "origin-pool.h"
+#include "request.h"
+#include "resolver.h"
+#include "thread-pool.h"
+
+class HTTPRefresher {
+ public:
+
+/**
+ * Constructs the refresher, which refreshes stale entries of the supplied
+ * cache on numThreads threads of its own, and installs it as the cache's
+ * refresher.
+ */
+  HTTPRefresher(HTTPResolver& resolver, HTTPCache& cache, size_t numThreads = 4);
+
+/**
+ * Schedules the stale entry for request to be refreshed.  The request is
+ * copied, so the caller needn't keep it around.
+ */
+  void refresh(const HTTPRequest& request);
+
+ private:
+  HTTPCache& cache;
+  HTTPOriginPool originPool;
+  ThreadPool pool;
+
+  void fetch(HTTPRequest& request);
+
+  HTTPRefresher(const HTTPRefresher& original) = delete;
+  HTTPRefresher& operator=(const HTTPRefresher& rhs) = delete;
+};
+
+#endif
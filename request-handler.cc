@@ -4,118 +4,441 @@
  * Provides the implementation for the HTTPRequestHandler class.
  */
 
+#include <chrono>                // for seconds
+#include <condition_variable>    // for condition_variable
 #include <iostream>              // for flush
 #include <string>                // for string
-#include <netdb.h>                // for gethostbyname
-#include <sys/socket.h>           // for socket, AF_INET
-#include <sys/types.h>            // for SOCK_STREAM
-#include <unistd.h>               // for close
+#include <thread>                // for thread
+#include <fcntl.h>                // for fcntl
+#include <unistd.h>               // for close, dup
+#include <sys/socket.h>           // for setsockopt
+#include <sys/time.h>             // for struct timeval
 
 #include "request-handler.h"
+#include "arena.h"
 #include "request.h"
 #include "response.h"
+#include "io-vector.h"
 #include "ostreamlock.h"
+#include "tunnel.h"
+#include "zero-copy.h"
 
 using namespace std;
 
 /**
- * Services a request by posting a placeholder payload.  The implementation
- * of this method will change dramatically as you work toward your final milestone.
+ * Each worker services one client connection at a time, request after
+ * request, for as long as both the client and the responses allow the
+ * connection to persist.  A request is answered from the cache when it
+ * can be, waits on another worker's fetch of the same response when there
+ * is one, and is otherwise forwarded to the origin over a pooled
+ * connection, with the response streamed through to the client as it
+ * arrives and cached behind it.  CONNECT requests are handed off to a
+ * tunnel, which ends the loop.
  */
 
 const int kClientSocketError = -1;
 const int kBadRequest = 400;
 const int kForbiddenRequest = 403;
-#define TMPLEN 8192
-
-HTTPRequestHandler::HTTPRequestHandler(void)
- : blacklist("blocked-domains.txt") {}
-
-static int createClientSocket(const string& host, unsigned short port) {
-  struct hostent hbuf, *hp; /* output DNS host entry */
-  char tmp[TMPLEN];         /* temporary scratch buffer */
-  int my_h_errno, rc;       /* DNS error code and return code */
-  rc = gethostbyname_r(host.c_str(), &hbuf, tmp, TMPLEN, &hp, &my_h_errno);
-  if (rc != 0) {
-    cout << "gethostbyname_r error: " << hstrerror(my_h_errno) << endl;
-  }
-  //cout << "official hostname: " <<  hp->h_name << endl;
-  int s = socket(AF_INET, SOCK_STREAM, 0);
-  if (s < 0) return kClientSocketError;
-
-  struct sockaddr_in serverAddress;
-  memset(&serverAddress, 0, sizeof(serverAddress));
-  serverAddress.sin_family = AF_INET;
-  serverAddress.sin_port = htons(port);
-  serverAddress.sin_addr.s_addr =
-    ((struct in_addr *)hbuf.h_addr)->s_addr;
-
-  if (connect(s, (struct sockaddr *) &serverAddress,
-	      sizeof(serverAddress)) != 0) {
-    close(s);
-    return kClientSocketError;
-  }
+const int kPayloadTooLarge = 413;
+const int kNotModified = 304;
+const int kBadGateway = 502;
+const int kClientIdleTimeout = 5; // in seconds
+const int kFetchWaitTimeout = 5;  // in seconds
 
-  return s;
-}
+HTTPRequestHandler::HTTPRequestHandler(HTTPResolver& resolver, HTTPCache& cache)
+ : blacklist("blocked-domains.txt"), resolver(resolver), cache(cache),
+   originPool(resolver, /* nonblocking = */ false) {}
 
 bool HTTPRequestHandler::ingestRequest(const string& clientIPAddress, 
-iosockstream &client_stream, HTTPRequest &request, HTTPResponse &response){
+iosockstream &client_stream, HTTPRequest &request, HTTPResponse &response,
+HTTPCache::cached_payload_t &cachedPayload, bool &fetching){
   try {
     request.ingestRequestLine(client_stream);
     /*cout << oslock << request.getMethod() << " " << request.getURL() <<  " "
        << request.getServer() << " " << request.getProtocol() << " "
        << request.getPort() << " " << request.getPath() << endl << osunlock;*/
+    request.ingestHeader(client_stream, clientIPAddress);
   } catch(HTTPBadRequestException exception){
+    response.setProtocol("HTTP/1.1");
     response.setPayload(exception.what());
  	  response.setResponseCode(kBadRequest);
     return false;
   }
+  // the full request is consumed before it's vetted, so that the
+  // connection is left at the start of the next request either way
+  if (!request.hasValidFraming()) {
+    // where the payload ends, and the next request starts, can't be known
+    response.setProtocol("HTTP/1.1");
+    response.setPayload("Ambiguous payload framing.");
+    response.setResponseCode(kBadRequest);
+    return false;
+  }
+  HTTPPayload::Status status = request.ingestPayload(client_stream);
+  if (status != HTTPPayload::kComplete) {
+    bool tooLarge = status == HTTPPayload::kTooLarge;
+    response.setProtocol("HTTP/1.1");
+    response.setPayload(tooLarge ? "Payload too large." : "Malformed payload.");
+    response.setResponseCode(tooLarge ? kPayloadTooLarge : kBadRequest);
+    return false;
+  }
   if(!blacklist.serverIsAllowed(request.getServer())){
+    response.setProtocol("HTTP/1.1");
     response.setPayload("Forbidden Content");
  	  response.setResponseCode(kForbiddenRequest);
 	  return false;
   };
-  request.ingestHeader(client_stream, clientIPAddress);
-  request.ingestPayload(client_stream);
-  if(cache.containsCacheEntry_r(request, response)){
+  // in case the origin has to be contacted, its name is resolved while
+  // the cache is consulted (and while any fetch in progress is waited on)
+  resolver.prefetch(request.getServer());
+  if(cache.containsCacheEntry_r(request, response, cachedPayload)){
 	  cout << oslock << "contain cache entry" << endl << osunlock;
 	  return false;
   }
+  if(awaitFetch(request, fetching) &&
+     cache.containsCacheEntry_r(request, response, cachedPayload)){
+	  return false;
+  }
   return true;
 }
 
-void HTTPRequestHandler::ingestResponse(iosockstream &server_stream, 
-  HTTPRequest &request, HTTPResponse &response)
+/**
+ * Claims the fetch of the request from the origin, or, if another worker
+ * already has, blocks until that fetch is over (or for kFetchWaitTimeout
+ * seconds, whichever comes first), so its response can be served from
+ * the cache instead.  Returns true if the worker waited, and sets fetching
+ * to whether it's become the fetcher.  The waiter outlives the wait should
+ * it time out, so the state it signals is shared with it.
+ */
+typedef struct {
+  mutex m;
+  condition_variable cv;
+  bool fetched;
+} fetch_wait_t;
+
+bool HTTPRequestHandler::awaitFetch(const HTTPRequest &request, bool &fetching) {
+  shared_ptr<fetch_wait_t> wait(new fetch_wait_t);
+  wait->fetched = false;
+  HTTPCache::FetchRole role = cache.beginFetch_r(request, [wait]() -> void {
+      lock_guard<mutex> lg(wait->m);
+      wait->fetched = true;
+      wait->cv.notify_all();
+    });
+  fetching = role == HTTPCache::kFetching;
+  if (role != HTTPCache::kWaiting) return false;
+  unique_lock<mutex> ul(wait->m);
+  wait->cv.wait_for(ul, chrono::seconds(kFetchWaitTimeout), [wait]() { return wait->fetched; });
+  return true;
+}
+
+/**
+ * Sends the request to the origin server over a pooled connection and
+ * relays the response back to the client.  A pooled connection may have been
+ * closed by the origin while it sat idle, so if a reused connection yields
+ * no response at all, the request is retried once over a fresh connection.
+ * socket++'s sockbuf closes its descriptor when it's destroyed, so the
+ * streams are layered over a duplicate, leaving the original free to be
+ * returned to the pool.  A request with a stale cache entry is sent with
+ * that entry's validators, and should the origin answer that the entry is
+ * still good, it's the entry that's published.  Should the origin be
+ * unreachable, report that it failed, or send a response whose length
+ * can't be determined, a stale entry is published in its place if its
+ * stale-if-error window permits.  Returns false, having sent the client
+ * nothing, if there's neither a response nor a stale entry to publish.  On return, persistent has been updated to reflect whether
+ * the client connection can be used again.
+ */
+static const int kMaxForwardAttempts = 2;
+bool HTTPRequestHandler::forwardRequest(iosockstream &client_stream, HTTPRequest &request,
+  HTTPResponse &response, bool &persistent, bool &fetching) {
+  int client_fd = static_cast<sockbuf *>(client_stream.rdbuf())->sd();
+  request.requestPersistentConnection();
+  bool revalidating = cache.addValidators_r(request);
+  for (int attempt = 0; attempt < kMaxForwardAttempts; attempt++) {
+    bool reused;
+    int server_fd = originPool.acquire(request.getServer(), request.getPort(), reused);
+    if (server_fd == kClientSocketError) break;
+    sockbuf sb(dup(server_fd));
+    iosockstream server_stream(&sb);
+    IOVector iov;
+    request.serialize(iov);
+    response.setRequestTime(time(NULL));
+    bool sent = iov.sendCompletely(server_fd);
+    if (sent) response.ingestResponseHeader(server_stream);
+    if (!sent || server_stream.fail() || !response.hasValidFraming()) {
+      close(server_fd);
+      if (reused && response.getProtocol().empty()) continue;
+      break;
+    }
+
+    if (response.reportsOriginFailure() &&
+        publishStaleResponse(client_stream, client_fd, request, persistent)) {
+      close(server_fd);
+      return true;
+    }
+
+    bool reusable = response.permitsConnectionReuse();
+    if (revalidating && response.getResponseCode() == kNotModified) {
+      if (reusable) {
+        originPool.release(request.getServer(), request.getPort(), server_fd);
+      } else {
+        close(server_fd);
+      }
+      if (publishRefreshedResponse(client_stream, client_fd, request, response, persistent)) {
+        return true;
+      }
+      request.setValidators("", ""); // the entry vanished, so ask for all of it
+      revalidating = false;
+      response = HTTPResponse();
+      continue;
+    }
+
+    persistent = persistent && response.hasDelimitedPayload();
+    response.setPersistentConnection(persistent);
+    bool relayed = relayResponse(server_stream, client_stream, request, response,
+                                 sb.sd(), client_fd, fetching);
+    persistent = persistent && relayed;
+    if (relayed && reusable) {
+      originPool.release(request.getServer(), request.getPort(), server_fd);
+    } else {
+      close(server_fd);
+    }
+    return true;
+  }
+
+  return publishStaleResponse(client_stream, client_fd, request, persistent);
+}
+
+/**
+ * Publishes the response header to the client as soon as it's been read,
+ * and then streams the payload through without buffering all of it.  Only
+ * when the response is cacheable is a copy of the payload retained, so
+ * that it can be cached once the relay is complete; otherwise the bulk of
+ * the payload is spliced from one socket to the other.  A fetcher whose
+ * response turns out not to be cacheable releases its waiters right away,
+ * rather than making them wait out the relay for nothing.  A cacheable one
+ * is handed to the cache's writers, which release them once it's stored,
+ * so the worker can get on with the client's next request meanwhile.
+ * A payload that ends only when the origin closes is relayed until then,
+ * but never cached, since there's no telling whether all of it arrived.
+ */
+bool HTTPRequestHandler::relayResponse(iosockstream &server_stream,
+  iosockstream &client_stream, HTTPRequest &request, HTTPResponse &response,
+  int server_fd, int client_fd, bool &fetching)
 {
-  response.ingestResponseHeader(server_stream);
-  response.ingestPayload(server_stream);
-  if(cache.shouldCache(request, response)){
+  bool cacheable = cache.shouldCache(request, response) && response.hasDelimitedPayload();
+  if (fetching && !cacheable) {
+    cache.endFetch_r(request);
+    fetching = false;
+  }
+  response.writeHeader(client_stream);
+  bool relayed = request.getMethod() == "HEAD" ||
+    response.relayPayload(server_stream, client_stream, cacheable, server_fd, client_fd);
+  client_stream << flush;
+  if(relayed && cacheable){
 	  cout << oslock << "cache entry" << endl << osunlock;
-	  cache.cacheEntry_r(request, response);
+	  cache.cacheEntryBehind_r(request, response, fetching);
+	  fetching = false;
+  }
+  return relayed;
+}
+
+/**
+ * Connects to the server named by a CONNECT request and hands the tunnel
+ * over to the tunnel loop, which relays it from then on, so the worker
+ * thread is free to return to the pool right away.  Anything the client
+ * sent right behind its request is already sitting in client_stream's
+ * buffer, so it's passed along to be sent through the tunnel first.  The
+ * client socket is duplicated, since client_stream closes the original.
+ */
+bool HTTPRequestHandler::tunnelRequest(iosockstream &client_stream, int client_fd,
+  const HTTPRequest &request) {
+  EventLoop *loop;
+  try {
+    loop = &getTunnelLoop();
+  } catch (const HTTPProxyException& hpe) {
+    cerr << oslock << hpe.what() << endl << osunlock;
+    return false;
+  }
+
+  int server_fd = originPool.connect(request.getServer(), request.getPort());
+  if (server_fd == kClientSocketError) return false;
+  int tunnel_fd = dup(client_fd);
+  if (tunnel_fd < 0) {
+    close(server_fd);
+    return false;
+  }
+
+  string leftover;
+  streamsize buffered = client_stream.rdbuf()->in_avail();
+  if (buffered > 0) {
+    leftover.resize(buffered);
+    client_stream.read(&leftover[0], buffered);
+  }
+
+  for (int fd: {tunnel_fd, server_fd}) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
   }
+
+  string description = request.getURL();
+  loop->post([loop, tunnel_fd, server_fd, leftover, description]() -> void {
+      shared_ptr<HTTPTunnel> tunnel(new HTTPTunnel(*loop, tunnel_fd, server_fd,
+                                                   HTTPTunnel::kEstablishedResponse,
+                                                   leftover, description));
+      tunnel->start();
+    });
+  return true;
+}
+
+/**
+ * Returns the event loop that relays every tunnel, starting it (along
+ * with the one thread that drives it) the first time a tunnel is requested.
+ */
+EventLoop& HTTPRequestHandler::getTunnelLoop() {
+  call_once(tunnelLoopStarted, [this]() -> void {
+      tunnelLoop.reset(new EventLoop);
+      EventLoop *loop = tunnelLoop.get();
+      thread t([loop]() -> void { loop->run(); });
+      t.detach();
+    });
+  return *tunnelLoop;
+}
+
+/**
+ * Publishes a cache hit: the header (whose Connection header has already
+ * been rewritten for this client) is sent with MSG_MORE, so the kernel
+ * holds on to it until the payload follows, and the payload is sent straight
+ * from the cache entry file with sendfile.  A small entry therefore goes
+ * out as a single segment, header and all.  A hit from the memory tier
+ * goes out with a single sendmsg, payload straight from the cached entry.
+ */
+bool HTTPRequestHandler::publishCachedResponse(iosockstream &client_stream, int client_fd,
+  HTTPResponse &response, HTTPCache::cached_payload_t &cachedPayload) {
+  client_stream << flush;
+  IOVector iov;
+  response.serialize(iov, /* includePayload = */ false);
+  if (cachedPayload.entry) {
+    iov.append(cachedPayload.entry->serialized.data() + cachedPayload.offset,
+               cachedPayload.length);
+    return !client_stream.fail() && iov.sendCompletely(client_fd);
+  }
+
+  int flags = cachedPayload.length > 0 ? MSG_MORE : 0;
+  bool published = !client_stream.fail() && iov.sendCompletely(client_fd, flags) &&
+    sendfileCompletely(client_fd, cachedPayload.fd, cachedPayload.offset, cachedPayload.length);
+  close(cachedPayload.fd);
+  return published;
+}
+
+/**
+ * Publishes a response that's already been assembled in full with a single
+ * sendmsg, bypassing client_stream (which is flushed first, although
+ * nothing is ever left in it between responses).
+ */
+bool HTTPRequestHandler::publishResponse(iosockstream &client_stream, int client_fd,
+  const HTTPResponse &response) {
+  client_stream << flush;
+  IOVector iov;
+  response.serialize(iov);
+  return !client_stream.fail() && iov.sendCompletely(client_fd);
 }
 
+/**
+ * Publishes a 502 (Bad Gateway) when the origin can't be reached (and
+ * there's nothing stale to publish in its place).  The connection isn't
+ * used again afterwards.
+ */
+void HTTPRequestHandler::publishBadGateway(iosockstream &client_stream, int client_fd) {
+  HTTPResponse response;
+  response.setProtocol("HTTP/1.1");
+  response.setPayload("Could not connect to origin server.");
+  response.setResponseCode(kBadGateway);
+  response.setPersistentConnection(false);
+  publishResponse(client_stream, client_fd, response);
+}
+
+/**
+ * Publishes the stale cache entry the request revalidated, now that the
+ * origin has answered 304 (Not Modified).  Returns false without sending
+ * anything if the entry has vanished in the meantime.
+ */
+bool HTTPRequestHandler::publishRefreshedResponse(iosockstream &client_stream, int client_fd,
+  const HTTPRequest &request, const HTTPResponse &notModified, bool &persistent) {
+  HTTPResponse refreshed;
+  HTTPCache::cached_payload_t cachedPayload = { kClientSocketError, 0, 0 };
+  if (!cache.refreshCacheEntry_r(request, notModified, refreshed, cachedPayload)) return false;
+  persistent = persistent && refreshed.hasDelimitedPayload();
+  refreshed.setPersistentConnection(persistent);
+  persistent = publishCachedResponse(client_stream, client_fd, refreshed, cachedPayload) &&
+    persistent;
+  return true;
+}
+
+/**
+ * Publishes the request's stale cache entry in place of the response the
+ * origin failed to deliver.  Returns false without sending anything if
+ * there's no entry that may stand in for it.
+ */
+bool HTTPRequestHandler::publishStaleResponse(iosockstream &client_stream, int client_fd,
+  const HTTPRequest &request, bool &persistent) {
+  HTTPResponse stale;
+  HTTPCache::cached_payload_t cachedPayload = { kClientSocketError, 0, 0 };
+  if (!cache.containsStaleEntry_r(request, stale, cachedPayload)) return false;
+  persistent = persistent && stale.hasDelimitedPayload();
+  stale.setPersistentConnection(persistent);
+  persistent = publishCachedResponse(client_stream, client_fd, stale, cachedPayload) &&
+    persistent;
+  return true;
+}
+
+/**
+ * Services every request the client sends over the connection, in order,
+ * for as long as both sides agree to keep it open.  Pipelined requests need
+ * no special handling: whatever the client sent beyond the current request
+ * simply waits in client_stream's buffer until the next iteration.  A client
+ * that stays quiet for kClientIdleTimeout seconds is dropped, so that it
+ * can't hold on to a worker thread indefinitely.  Each request and its
+ * response are allocated from an arena leased for just that iteration,
+ * which the worker thread recycles in one go once the response is out.
+ */
 void HTTPRequestHandler::serviceRequest(const pair<int, string>& connection)
 	throw() {
+  struct timeval timeout = { kClientIdleTimeout, 0 };
+  setsockopt(connection.first, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
   sockbuf sb(connection.first);
   iosockstream client_stream(&sb);
-  HTTPRequest request;
-  HTTPResponse response;
-  int client_fd;
-  if(!ingestRequest(connection.second, client_stream, request, response)){
- 	  client_stream << response << flush;
-    return;
-  }
-  client_fd = createClientSocket(request.getServer(), request.getPort());
-  if(client_fd == kClientSocketError) {
-      cerr << oslock << "can not open a client socket" << endl << osunlock;
-      return;
+  while (client_stream.peek() != EOF) {
+    ArenaLease arena;
+    HTTPRequest request(arena.get());
+    HTTPResponse response(arena.get());
+    bool persistent;
+    HTTPCache::cached_payload_t cachedPayload = { kClientSocketError, 0, 0 };
+    bool fetching = false;
+    if(ingestRequest(connection.second, client_stream, request, response, cachedPayload,
+                     fetching)){
+      persistent = request.permitsPersistentConnection();
+      if (request.getMethod() == "CONNECT") {
+        if (!tunnelRequest(client_stream, connection.first, request)) {
+          publishBadGateway(client_stream, connection.first);
+        }
+        return;
+      }
+      bool forwarded = forwardRequest(client_stream, request, response, persistent, fetching);
+      if (fetching) cache.endFetch_r(request);
+      if (!forwarded) {
+        publishBadGateway(client_stream, connection.first);
+        return;
+      }
+    } else {
+      persistent = response.getResponseCode() != kBadRequest &&
+        response.getResponseCode() != kPayloadTooLarge &&
+        request.permitsPersistentConnection() && response.hasDelimitedPayload();
+      response.setPersistentConnection(persistent);
+      if (cachedPayload.fd != kClientSocketError || cachedPayload.entry) {
+        persistent = publishCachedResponse(client_stream, connection.first, response,
+                                           cachedPayload) && persistent;
+      } else {
+        persistent = publishResponse(client_stream, connection.first, response) && persistent;
+      }
+    }
+    if (!persistent || client_stream.fail()) return;
   }
-  sockbuf sb2(client_fd);
-  iosockstream server_stream(&sb2);
-  //send request to original server
-  server_stream << request << flush;
-  ingestResponse(server_stream, request, response);
-  client_stream << response << flush;
 }
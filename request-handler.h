@@ -10,13 +10,18 @@
 
 #include <utility>     // for pair
 #include <string>      // for string
+#include <memory>      // for unique_ptr
+#include <mutex>       // for once_flag
 #include "socket++/sockstream.h" // for sockbuf, iosockstream
 #include "blacklist.h"
 #include "cache.h"
+#include "origin-pool.h"
+#include "resolver.h"
+#include "event-loop.h"
 
 class HTTPRequestHandler {
  public:
-    HTTPRequestHandler(void);
+    HTTPRequestHandler(HTTPResolver& resolver, HTTPCache& cache);
 
 /**
  * Reads the entire HTTP request from the provided socket (the int portion
@@ -30,11 +35,32 @@ class HTTPRequestHandler {
 
  private:
     bool ingestRequest(const std::string& clientIPAddress, iosockstream 
-        &client_stream, HTTPRequest &request, HTTPResponse &response);
-    void ingestResponse(iosockstream &client_stream, HTTPRequest &request, 
-        HTTPResponse &response);
+        &client_stream, HTTPRequest &request, HTTPResponse &response,
+        HTTPCache::cached_payload_t &cachedPayload, bool &fetching);
+    bool awaitFetch(const HTTPRequest &request, bool &fetching);
+    bool forwardRequest(iosockstream &client_stream, HTTPRequest &request,
+        HTTPResponse &response, bool &persistent, bool &fetching);
+    bool relayResponse(iosockstream &server_stream, iosockstream &client_stream,
+        HTTPRequest &request, HTTPResponse &response, int server_fd, int client_fd,
+        bool &fetching);
+    bool tunnelRequest(iosockstream &client_stream, int client_fd,
+        const HTTPRequest &request);
+    EventLoop& getTunnelLoop();
+    bool publishCachedResponse(iosockstream &client_stream, int client_fd,
+        HTTPResponse &response, HTTPCache::cached_payload_t &cachedPayload);
+    bool publishRefreshedResponse(iosockstream &client_stream, int client_fd,
+        const HTTPRequest &request, const HTTPResponse &notModified, bool &persistent);
+    bool publishStaleResponse(iosockstream &client_stream, int client_fd,
+        const HTTPRequest &request, bool &persistent);
+    bool publishResponse(iosockstream &client_stream, int client_fd,
+        const HTTPResponse &response);
+    void publishBadGateway(iosockstream &client_stream, int client_fd);
     HTTPBlacklist blacklist;
-    HTTPCache cache;
+    HTTPResolver& resolver;
+    HTTPCache& cache;
+    HTTPOriginPool originPool;
+    std::unique_ptr<EventLoop> tunnelLoop;
+    std::once_flag tunnelLoopStarted;
 };
 
 #endif
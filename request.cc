@@ -13,6 +13,7 @@ using namespace std;
 static const string kWhiteSpaceDelimiters = " \r\n\t";
 static const string kProtocolPrefix = "http://";
 static const unsigned short kDefaultPort = 80;
+static const unsigned short kDefaultTunnelPort = 443;
 void HTTPRequest::ingestRequestLine(istream& instream) throw (HTTPBadRequestException) {
   getline(instream, requestLine);
   if (instream.fail()) {
@@ -22,35 +23,69 @@ void HTTPRequest::ingestRequestLine(istream& instream) throw (HTTPBadRequestExce
   requestLine = trim(requestLine);
   istringstream iss(requestLine);
   iss >> method >> url >> protocol;
-  server = url;
-  cout << server << endl;
-  size_t pos = server.find(kProtocolPrefix);
-  server.erase(0, kProtocolPrefix.size());
-  pos = server.find('/');
-  if (pos == string::npos) {
-    // url came in as something like http://www.google.com, without the trailing /
-    // in that case, least server as is (it'd be www.google.com), and manually set
-    // path to be "/"
-    path = "/";
-  } else {
-    path = server.substr(pos);
-    server.erase(pos);
+  interpretURL();
+}
+
+void HTTPRequest::ingestRequestLine(const HTTPParser& parser) throw (HTTPBadRequestException) {
+  if (parser.getMethod().empty() || parser.getTarget().empty()) {
+    throw HTTPBadRequestException("First line of request could not be read.");
   }
-  port = kDefaultPort;
-  pos = server.find(':');
-  if (pos == string::npos) return;
-  port = strtol(server.c_str() + pos + 1, NULL, 0); // assume port is well-formed
-  server.erase(pos);
+
+  method = parser.getMethod().toString();
+  url = parser.getTarget().toString();
+  protocol = parser.getProtocol().toString();
+  interpretURL();
+}
+
+void HTTPRequest::ingestHeader(istream& instream, const string& clientIPAddress)
+  throw (HTTPBadRequestException) {
+  if (!requestHeader.ingestHeader(instream)) {
+    throw HTTPBadRequestException("Whitespace before a header field's colon.");
+  }
+  cacheControl = CacheControl(requestHeader.getValuesAsString(HTTPHeader::kCacheControl));
+  addForwardingHeaders(clientIPAddress);
+}
+
+void HTTPRequest::ingestHeader(const HTTPParser& parser, const string& clientIPAddress) {
+  requestHeader.ingestHeader(parser);
+  cacheControl = CacheControl(requestHeader.getValuesAsString(HTTPHeader::kCacheControl));
+  addForwardingHeaders(clientIPAddress);
+}
+
+void HTTPRequest::requestPersistentConnection() {
+  requestHeader.removeHeader(HTTPHeader::kProxyConnection);
+  requestHeader.addHeader(HTTPHeader::kConnection, "keep-alive");
+}
+
+bool HTTPRequest::permitsPersistentConnection() const {
+  string connection = StringView(requestHeader.getValuesAsString(HTTPHeader::kConnection) + " " +
+    requestHeader.getValuesAsString(HTTPHeader::kProxyConnection)).toLowerCaseString();
+  if (protocol == "HTTP/1.1") return connection.find("close") == string::npos;
+  return connection.find("keep-alive") != string::npos;
+}
+
+bool HTTPRequest::permitsCachedResponse() const {
+  if (cacheControl.hasNoCache() || cacheControl.getMaxAge() == 0) return false;
+  if (requestHeader.containsName(HTTPHeader::kCacheControl)) return true;
+  return requestHeader.getValuesAsString(HTTPHeader::kPragma).find("no-cache") == string::npos;
 }
 
-void HTTPRequest::ingestHeader(istream& instream, const string& clientIPAddress) {
-  requestHeader.ingestHeader(instream);
-  requestHeader.addHeader("x-forwarded-proto", "http");
-  if (requestHeader.containsName("x-forwarded-for")) {
-    string value = requestHeader.getValueAsString("x-forwarded-for") + "," + clientIPAddress;
-    requestHeader.addHeader("x-forwarded-for", value);
+bool HTTPRequest::isConditional() const {
+  return requestHeader.containsName(HTTPHeader::kIfNoneMatch) ||
+    requestHeader.containsName(HTTPHeader::kIfModifiedSince);
+}
+
+void HTTPRequest::setValidators(const string& etag, const string& lastModified) {
+  if (etag.empty()) {
+    requestHeader.removeHeader(HTTPHeader::kIfNoneMatch);
   } else {
-    requestHeader.addHeader("x-forwarded-for", clientIPAddress);
+    requestHeader.addHeader(HTTPHeader::kIfNoneMatch, etag);
+  }
+
+  if (lastModified.empty()) {
+    requestHeader.removeHeader(HTTPHeader::kIfModifiedSince);
+  } else {
+    requestHeader.addHeader(HTTPHeader::kIfModifiedSince, lastModified);
   }
 }
 
@@ -58,15 +93,80 @@ bool HTTPRequest::containsName(const string& name) const {
   return requestHeader.containsName(name);
 }
 
-void HTTPRequest::ingestPayload(istream& instream) {
-  if (getMethod() != "POST") return;
-  payload.ingestPayload(requestHeader, instream);
+HTTPPayload::Status HTTPRequest::ingestPayload(istream& instream) {
+  return payload.ingestPayload(requestHeader, instream);
+}
+
+bool HTTPRequest::hasValidFraming() const {
+  if (!requestHeader.containsName(HTTPHeader::kTransferEncoding)) {
+    return requestHeader.hasValidContentLength();
+  }
+  return !requestHeader.containsName(HTTPHeader::kContentLength) &&
+    requestHeader.hasChunkedPayload();
+}
+
+static const string kSpace = " ";
+static const string kLineTerminator = "\r\n";
+void HTTPRequest::serialize(IOVector& iov) const {
+  iov.append(method);
+  iov.append(kSpace);
+  iov.append(path);
+  iov.append(kSpace);
+  iov.append(protocol);
+  iov.append(kLineTerminator);
+  requestHeader.serialize(iov);
+  iov.append(kLineTerminator); // blank line not printed by request header
+  payload.serialize(iov);
 }
 
 ostream& operator<<(ostream& os, const HTTPRequest& rh) {
-  os << rh.method << " " << rh.path << " " << rh.protocol << "\r\n";
-  os << rh.requestHeader;
-  os << "\r\n"; // blank line not printed by request header
-  os << rh.payload;
+  IOVector iov;
+  rh.serialize(iov);
+  iov.writeTo(os);
   return os;
 }
+
+/** Private methods **/
+
+/**
+ * Splits url into the server, port, and path it names.
+ */
+void HTTPRequest::interpretURL() {
+  server = url;
+  size_t pos;
+  if (method == "CONNECT") {
+    // CONNECT requests name just the server and port, as with
+    // CONNECT www.google.com:443 HTTP/1.1, and there's no path at all
+    path = "";
+    port = kDefaultTunnelPort;
+  } else {
+    pos = server.find(kProtocolPrefix);
+    if (pos == 0) server.erase(0, kProtocolPrefix.size());
+    pos = server.find('/');
+    if (pos == string::npos) {
+      // url came in as something like http://www.google.com, without the trailing /
+      // in that case, least server as is (it'd be www.google.com), and manually set
+      // path to be "/"
+      path = "/";
+    } else {
+      path = server.substr(pos);
+      server.erase(pos);
+    }
+    port = kDefaultPort;
+  }
+  pos = server.find(':');
+  if (pos == string::npos) return;
+  port = strtol(server.c_str() + pos + 1, NULL, 0); // assume port is well-formed
+  server.erase(pos);
+}
+
+void HTTPRequest::addForwardingHeaders(const string& clientIPAddress) {
+  requestHeader.addHeader(HTTPHeader::kXForwardedProto, "http");
+  if (requestHeader.containsName(HTTPHeader::kXForwardedFor)) {
+    string value = requestHeader.getValuesAsString(HTTPHeader::kXForwardedFor) + "," +
+      clientIPAddress;
+    requestHeader.addHeader(HTTPHeader::kXForwardedFor, value);
+  } else {
+    requestHeader.addHeader(HTTPHeader::kXForwardedFor, clientIPAddress);
+  }
+}
@@ -13,7 +13,10 @@
 #include <vector>
 #include <map>
 
+#include "cache-control.h"
+#include "cache-key.h"
 #include "header.h"
+#include "parser.h"
 #include "payload.h"
 #include "proxy-exception.h"
 
@@ -29,6 +32,14 @@ class HTTPRequest {
 
  public:
 
+/**
+ * Constructs an empty request whose header and payload are allocated
+ * from the supplied arena, or from the heap if there isn't one.
+ */
+
+  HTTPRequest(Arena *arena = NULL) :
+    requestHeader(arena), payload(arena), cacheKeyKnown(false) {}
+
 /**
  * Ingests, parses, and stores the first line of the HTTP request.
  * Recall that the first line of any valid proxied HTTP request is
@@ -40,10 +51,22 @@ class HTTPRequest {
  *
  *   GET http://www.facebook.com/jerry HTTP/1.1
  *   POST http://graph.facebook.com/like?url=www.nytimes.com HTTP/1.1
+ *
+ * The one exception is CONNECT, whose second token names just the
+ * server and port to tunnel to, as with:
+ *
+ *   CONNECT www.google.com:443 HTTP/1.1
  */
 
   void ingestRequestLine(std::istream& instream) throw (HTTPBadRequestException);
 
+/**
+ * Populates the request line from a parser that's parsed the entire
+ * request header, as an alternative to reading it from an istream.
+ */
+
+  void ingestRequestLine(const HTTPParser& parser) throw (HTTPBadRequestException);
+
 /**
  * Ingests everything beyond the first line up to the first
  * blank line (where all lines, including the visibly blank line,
@@ -62,9 +85,20 @@ class HTTPRequest {
  * One caveat: is a header line begins with a blank space, then it isn't introducing
  * a new name.  Instead, the line (after being right-trimmed) is providing a continuation
  * of the previous line's value.
+ *
+ * An HTTPBadRequestException is thrown, once the entire header has been read, if
+ * any name is followed by whitespace before its ':' (RFC 9112, section 5.1).
+ */
+
+  void ingestHeader(std::istream& instream, const std::string& clientIPAddress)
+    throw (HTTPBadRequestException);
+
+/**
+ * Populates the header from a parser that's parsed the entire request
+ * header, as an alternative to reading it from an istream.
  */
 
-  void ingestHeader(std::istream& instream, const std::string& clientIPAddress);
+  void ingestHeader(const HTTPParser& parser, const std::string& clientIPAddress);
 
 /**
  * Ingests everything after the blank line following the header.
@@ -72,10 +106,37 @@ class HTTPRequest {
  * pure text (it might be a photo with pixel bytes that look like
  * text, or newlines, or gobbledygook).  That means that the payload
  * portion isn't read in as C++ string text, but as general character
- * data.
+ * data.  Returns how the ingestion went (see HTTPPayload::Status).
+ */
+
+  HTTPPayload::Status ingestPayload(std::istream& instream);
+
+/**
+ * Returns true if and only if the end of the request's payload can be
+ * found unambiguously: Transfer-Encoding, if present, must end in chunked,
+ * and any Content-Length must be a plain decimal number.  A request with
+ * both is refused too (RFC 9112, section 6.1), since a proxy and an
+ * origin server that disagree on which one wins can be sent a second,
+ * smuggled request inside the first one's payload.
+ */
+  bool hasValidFraming() const;
+
+/**
+ * Rewrites the hop-by-hop connection headers supplied by the client
+ * so that the origin server is instead asked to keep the (pooled)
+ * connection open once it has responded.
  */
 
-  void ingestPayload(std::istream& instream);
+  void requestPersistentConnection();
+
+/**
+ * Returns true if and only if the client is willing to send further
+ * requests over the same connection: HTTP/1.1 clients are unless they
+ * say "close", and HTTP/1.0 clients are only if they say "keep-alive"
+ * (in either a Connection or a Proxy-Connection header).
+ */
+
+  bool permitsPersistentConnection() const;
 
 /**
  * The next five methods are all const, inlined accessors.
@@ -97,10 +158,70 @@ class HTTPRequest {
 
   bool containsName(const std::string& name) const;
 
+/**
+ * Provides read-only access to the full collection of name-value
+ * pairs, so that callers can examine framing headers (Content-Length,
+ * Transfer-Encoding) without needing to re-parse anything.
+ */
+
+  const HTTPHeader& getHeader() const { return requestHeader; }
+
+/**
+ * Returns the request's Cache-Control directives, as parsed when
+ * the header was ingested.
+ */
+
+  const CacheControl& getCacheControl() const { return cacheControl; }
+
+/**
+ * Returns true unless the client insists that the origin server be
+ * consulted rather than a cache (by way of no-cache, max-age=0, or the
+ * HTTP/1.0 "Pragma: no-cache").
+ */
+
+  bool permitsCachedResponse() const;
+
+/**
+ * Returns true if and only if the client made the request conditional
+ * on its own copy of the response having changed (with If-None-Match or
+ * If-Modified-Since).
+ */
+
+  bool isConditional() const;
+
+/**
+ * Makes the request conditional on the response identified by the
+ * supplied validators having changed (RFC 9110, section 13.1), with
+ * If-None-Match for the entity tag and If-Modified-Since for the
+ * last-modified date.  Empty validators remove the matching header.
+ */
+
+  void setValidators(const std::string& etag, const std::string& lastModified);
+
+/**
+ * Appends the entire request, as it's to be forwarded to the origin
+ * server, to the supplied IOVector.  The pieces are appended by
+ * reference, so the request must outlive the IOVector's use.
+ */
+
+  void serialize(IOVector& iov) const;
+
+/**
+ * The cache computes the key it files the response to the request under
+ * just once, and remembers it in the request itself (see HTTPCache).  The
+ * key is derived from the request line alone, which never changes once
+ * it's been ingested, so it's remembered even by a const request.
+ */
+
+  bool hasCacheKey() const { return cacheKeyKnown; }
+  const CacheKey& getCacheKey() const { return cacheKey; }
+  void rememberCacheKey(const CacheKey& key) const { cacheKey = key; cacheKeyKnown = true; }
+
  private:
   std::string requestLine;
   HTTPHeader requestHeader;
   HTTPPayload payload;
+  CacheControl cacheControl;
 
   std::string method;
   std::string url;
@@ -108,6 +229,11 @@ class HTTPRequest {
   unsigned short port;
   std::string path;
   std::string protocol;
+  mutable CacheKey cacheKey;
+  mutable bool cacheKeyKnown;
+
+  void interpretURL();
+  void addForwardingHeaders(const std::string& clientIPAddress);
 };
 
 #endif
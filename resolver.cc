@@ -0,0 +1,203 @@
+/**
+ * File: resolver.cc
+ * -----------------
+ * Presents the implementation of the HTTPResolver class.
+ */
+
+#include "resolver.h"
+
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <utility>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+static const time_t kRefreshWindow = 10;        // in seconds
+static const size_t kMaxEntriesPerShard = 1024;
+
+/**
+ * getaddrinfo is the thread-safe replacement for gethostbyname_r, and
+ * it's asked for IPv4 addresses only, since that's all the origin pool
+ * knows how to connect to.
+ */
+static bool lookupAddress(const string& host, struct in_addr& address) {
+  struct addrinfo hints, *results;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host.c_str(), NULL, &hints, &results) != 0) return false;
+  bool found = results != NULL;
+  if (found) address = ((struct sockaddr_in *) results->ai_addr)->sin_addr;
+  freeaddrinfo(results);
+  return found;
+}
+
+HTTPResolver::HTTPResolver(size_t numThreads, int positiveTTL, int negativeTTL) :
+  positiveTTL(positiveTTL), negativeTTL(negativeTTL), hits(0), negativeHits(0),
+  misses(0), coalesced(0), failures(0), lookups(0), totalLookupTime(0),
+  maxLookupTime(0), lookupPool(numThreads) {}
+
+/**
+ * A cached address that's about to expire is still handed out, but a
+ * lookup is started in the background so that hosts in steady use are
+ * refreshed before anyone has to wait on them.
+ */
+bool HTTPResolver::resolve(const string& host, bool& resolved, struct in_addr& address,
+                           const Callback& callback) {
+  if (inet_pton(AF_INET, host.c_str(), &address) == 1) {
+    resolved = true;
+    return true;
+  }
+
+  shard_t& shard = getShard(host);
+  time_t now = time(NULL);
+  lock_guard<mutex> lg(shard.m);
+  auto found = shard.entries.find(host);
+  if (found != shard.entries.end() && found->second.expirationTime > now) {
+    entry_t& entry = found->second;
+    resolved = entry.resolved;
+    address = entry.address;
+    if (!resolved) {
+      negativeHits++;
+      return true;
+    }
+
+    hits++;
+    if (!entry.inFlight && entry.expirationTime - now <= kRefreshWindow) {
+      entry.inFlight = true;
+      scheduleLookup(host);
+    }
+    return true;
+  }
+
+  if (found == shard.entries.end()) {
+    if (shard.entries.size() >= kMaxEntriesPerShard) pruneExpiredEntries(shard, now);
+    entry_t entry;
+    entry.resolved = false;
+    entry.expirationTime = 0;
+    entry.inFlight = false;
+    found = shard.entries.insert(make_pair(host, entry)).first;
+  }
+
+  entry_t& entry = found->second;
+  entry.waiters.push_back(callback);
+  if (entry.inFlight) {
+    coalesced++;
+    return false;
+  }
+
+  misses++;
+  entry.inFlight = true;
+  scheduleLookup(host);
+  return false;
+}
+
+void HTTPResolver::prefetch(const string& host) {
+  bool resolved;
+  struct in_addr address;
+  resolve(host, resolved, address, [](bool resolved, const struct in_addr& address) {});
+}
+
+/**
+ * The promise is shared with the callback, which outlives the wait should
+ * the wait time out.
+ */
+bool HTTPResolver::resolve(const string& host, struct in_addr& address, long timeout) {
+  bool resolved;
+  shared_ptr<promise<pair<bool, struct in_addr> > > answer(new promise<pair<bool, struct in_addr> >);
+  future<pair<bool, struct in_addr> > result = answer->get_future();
+  if (resolve(host, resolved, address, [answer](bool found, const struct in_addr& result) {
+        answer->set_value(make_pair(found, result));
+      })) {
+    return resolved;
+  }
+
+  if (result.wait_for(chrono::milliseconds(timeout)) != future_status::ready) return false;
+  pair<bool, struct in_addr> answered = result.get();
+  address = answered.second;
+  return answered.first;
+}
+
+HTTPResolver::stats_t HTTPResolver::getStats() const {
+  stats_t stats;
+  stats.hits = hits;
+  stats.negativeHits = negativeHits;
+  stats.misses = misses;
+  stats.coalesced = coalesced;
+  stats.failures = failures;
+  stats.lookups = lookups;
+  stats.totalLookupTime = totalLookupTime;
+  stats.maxLookupTime = maxLookupTime;
+  return stats;
+}
+
+/** Private methods **/
+
+HTTPResolver::shard_t& HTTPResolver::getShard(const string& host) {
+  return shards[hash<string>()(host) % kNumShards];
+}
+
+void HTTPResolver::scheduleLookup(const string& host) {
+  lookupPool.schedule([this, host]() -> void { lookup(host); });
+}
+
+/**
+ * Performs the lookup, records the answer, and then notifies everyone
+ * who was waiting on it (outside of the lock, since the callbacks are
+ * arbitrary).  Should a background refresh fail, the address it was meant
+ * to replace is kept until it expires on its own.
+ */
+void HTTPResolver::lookup(const string& host) {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  struct in_addr address;
+  bool resolved = lookupAddress(host, address);
+  recordLookupTime(chrono::duration_cast<chrono::microseconds>
+                   (chrono::steady_clock::now() - start).count());
+  if (!resolved) failures++;
+
+  vector<Callback> waiters;
+  shard_t& shard = getShard(host);
+  time_t now = time(NULL);
+  shard.m.lock();
+  entry_t& entry = shard.entries[host];
+  entry.inFlight = false;
+  if (resolved || !entry.resolved || entry.expirationTime <= now) {
+    entry.resolved = resolved;
+    entry.address = address;
+    entry.expirationTime = now + (resolved ? positiveTTL : negativeTTL);
+  }
+  waiters.swap(entry.waiters);
+  resolved = entry.resolved;
+  address = entry.address;
+  shard.m.unlock();
+
+  for (const Callback& callback: waiters) {
+    callback(resolved, address);
+  }
+}
+
+void HTTPResolver::recordLookupTime(uint64_t microseconds) {
+  lookups++;
+  totalLookupTime += microseconds;
+  uint64_t max = maxLookupTime;
+  while (microseconds > max && !maxLookupTime.compare_exchange_weak(max, microseconds));
+}
+
+/**
+ * Keeps a shard from growing without bound by discarding every answer
+ * that's expired.  Entries with a lookup in flight are left alone, since
+ * there are callers waiting on them.
+ */
+void HTTPResolver::pruneExpiredEntries(shard_t& shard, time_t now) {
+  for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+    if (!it->second.inFlight && it->second.expirationTime <= now) {
+      it = shard.entries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
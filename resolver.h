@@ -0,0 +1,129 @@
+/**
+ * File: resolver.h
+ * ----------------
+ * Defines the HTTPResolver class, which resolves origin server names
+ * to IPv4 addresses on behalf of the rest of the proxy.  Answers (both
+ * positive and negative) are cached for a fixed time to live, concurrent
+ * lookups for the same name are coalesced into a single one, and all
+ * lookups are carried out by a small pool of resolver threads, so that
+ * event loop threads never block on DNS.  Threaded workers start their
+ * lookups early, and never wait on one for longer than a fixed timeout.
+ *
+ * Lookups go through getaddrinfo, so that /etc/hosts and the rest of the
+ * system's name service configuration are honored, but getaddrinfo
+ * doesn't report the TTLs of the records behind its answers, so answers
+ * are cached for fixed times instead.
+ */
+
+#ifndef _http_resolver_
+#define _http_resolver_
+
+#include <atomic>
+#include <cstddef>       // for size_t
+#include <cstdint>       // for uint64_t
+#include <ctime>         // for time_t
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>  // for struct in_addr
+
+#include "thread-pool.h"
+
+class HTTPResolver {
+ public:
+
+/**
+ * Callbacks are invoked with resolved set to true and the address filled
+ * in if the name could be resolved, and with resolved set to false otherwise.
+ */
+  typedef std::function<void(bool resolved, const struct in_addr& address)> Callback;
+
+  typedef struct {
+    size_t hits;              // answered from a cached address
+    size_t negativeHits;      // answered from a cached failure
+    size_t misses;            // required a lookup
+    size_t coalesced;         // piggybacked on a lookup already in flight
+    size_t failures;          // lookups that failed to produce an address
+    uint64_t lookups;         // lookups actually performed, refreshes included
+    uint64_t totalLookupTime; // in microseconds
+    uint64_t maxLookupTime;   // in microseconds
+  } stats_t;
+
+/**
+ * Constructs a resolver whose lookups are performed by numThreads
+ * threads.  Addresses are cached for positiveTTL seconds, and failures
+ * for negativeTTL seconds.
+ */
+  HTTPResolver(size_t numThreads = 4, int positiveTTL = 60, int negativeTTL = 5);
+
+/**
+ * Resolves the supplied host without blocking.  If the answer is already
+ * known (the host is a numeric address, or a fresh answer is cached), then
+ * resolved and address are set accordingly and true is returned.
+ * Otherwise, false is returned and the callback is invoked, on one of
+ * the resolver's own threads, once the answer is known.
+ */
+  bool resolve(const std::string& host, bool& resolved, struct in_addr& address,
+               const Callback& callback);
+
+/**
+ * Starts resolving the supplied host in the background, unless its answer
+ * is already known or on its way, so that a later resolve finds it sooner.
+ */
+  void prefetch(const std::string& host);
+
+/**
+ * Resolves the supplied host, blocking the calling thread until the
+ * answer is known or timeout milliseconds pass, whichever comes first.
+ * Returns true and fills in address if and only if the host was resolved
+ * in time.  A lookup that times out carries on regardless, and its
+ * answer is cached for whoever asks next.
+ */
+  bool resolve(const std::string& host, struct in_addr& address, long timeout = 5000);
+
+/**
+ * Returns a snapshot of the resolver's counters.
+ */
+  stats_t getStats() const;
+
+ private:
+  typedef struct {
+    bool resolved;
+    struct in_addr address;
+    time_t expirationTime;       // 0 until the first answer arrives
+    bool inFlight;
+    std::vector<Callback> waiters;
+  } entry_t;
+
+  typedef struct {
+    std::mutex m;
+    std::unordered_map<std::string, entry_t> entries;
+  } shard_t;
+
+  static const size_t kNumShards = 16;
+  shard_t shards[kNumShards];
+  int positiveTTL;
+  int negativeTTL;
+  std::atomic<size_t> hits;
+  std::atomic<size_t> negativeHits;
+  std::atomic<size_t> misses;
+  std::atomic<size_t> coalesced;
+  std::atomic<size_t> failures;
+  std::atomic<uint64_t> lookups;
+  std::atomic<uint64_t> totalLookupTime;
+  std::atomic<uint64_t> maxLookupTime;
+  ThreadPool lookupPool;
+
+  shard_t& getShard(const std::string& host);
+  void scheduleLookup(const std::string& host);
+  void lookup(const std::string& host);
+  void recordLookupTime(uint64_t microseconds);
+  void pruneExpiredEntries(shard_t& shard, time_t now);
+
+  HTTPResolver(const HTTPResolver& original) = delete;
+  HTTPResolver& operator=(const HTTPResolver& rhs) = delete;
+};
+
+#endif
@@ -6,12 +6,22 @@
 
 #include "response.h"
 
+#include <algorithm>
+#include <map>
 #include <sstream>
+#include "http-date.h"
 #include "proxy-exception.h"
+#include "string-utils.h"
 using namespace std;
 
 /** Public methods and functions **/
 
+/**
+ * Both versions note when the response arrived and parse its
+ * Cache-Control directives, once, for the freshness calculations below.
+ * A Content-Length sent along with Transfer-Encoding is removed then, so
+ * it's never forwarded with a payload it doesn't describe.
+ */
 void HTTPResponse::ingestResponseHeader(istream& instream) {
   string responseCodeLine;
   getline(instream, responseCodeLine);
@@ -23,10 +33,103 @@ void HTTPResponse::ingestResponseHeader(istream& instream) {
   iss >> code;
   setResponseCode(code);
   responseHeader.ingestHeader(instream);
+  noteArrival();
+}
+
+void HTTPResponse::ingestResponseHeader(const HTTPParser& parser) {
+  setProtocol(parser.getProtocol().toString());
+  setResponseCode(parser.getStatusCode());
+  responseHeader.ingestHeader(parser);
+  noteArrival();
+}
+
+bool HTTPResponse::ingestPayload(std::istream& instream) {
+  return payload.ingestPayload(responseHeader, instream) == HTTPPayload::kComplete;
 }
 
-void HTTPResponse::ingestPayload(std::istream& instream) {
-  payload.ingestPayload(responseHeader, instream);
+bool HTTPResponse::relayPayload(istream& instream, ostream& outstream, bool& retain,
+                                int infd, int outfd) {
+  if (!hasDelimitedPayload()) return payload.relayPayloadUntilClose(instream, outstream);
+  return payload.relayPayload(responseHeader, instream, outstream, retain, infd, outfd);
+}
+
+void HTTPResponse::writeHeader(ostream& os) const {
+  IOVector iov;
+  serialize(iov, /* includePayload = */ false);
+  iov.writeTo(os);
+}
+
+/**
+ * The status lines for every code we know of are formatted once, up front,
+ * for both HTTP/1.0 and HTTP/1.1, so the common case needs nothing more than
+ * a table lookup.  Anything else is formatted on the spot.
+ */
+static const struct {
+  int code;
+  const char *message;
+} kStatusMessages[] = {
+  {100, "Continue"}, {101, "Switching Protocols"},
+  {200, "OK"}, {201, "Created"}, {202, "Accepted"},
+  {203, "Non-Authoritative Information"}, {204, "No Content"},
+  {205, "Reset Content"}, {206, "Partial Content"},
+  {300, "Multiple Choices"}, {301, "Permanently Moved"}, {302, "Found"},
+  {303, "See Other"}, {304, "Not Modified"}, {305, "Use Proxy"},
+  {307, "Temporary Redirect"},
+  {400, "Bad Request"}, {401, "Unauthorized"}, {402, "Payment Required"},
+  {403, "Forbidden"}, {404, "Not Found"}, {405, "Method Not Allowed"},
+  {406, "Not Acceptable"}, {407, "Proxy Authentication Required"},
+  {408, "Request Timeout"}, {409, "Conflict"}, {410, "Gone"},
+  {413, "Payload Too Large"},
+  {500, "Internal Server Error"}, {502, "Bad Gateway"},
+  {505, "HTTP Version Not Supported"}, {510, "General Proxy Failure"},
+};
+
+static const string kUnknownStatusMessage = "Unknown Code";
+static const string kLineTerminator = "\r\n";
+
+static map<int, string> formatStatusLines(const string& protocol) {
+  map<int, string> lines;
+  for (const auto& status: kStatusMessages) {
+    ostringstream oss;
+    oss << protocol << " " << status.code << " " << status.message << kLineTerminator;
+    lines[status.code] = oss.str();
+  }
+
+  return lines;
+}
+
+static const map<int, string> kHTTP10StatusLines = formatStatusLines("HTTP/1.0");
+static const map<int, string> kHTTP11StatusLines = formatStatusLines("HTTP/1.1");
+
+static const string *findStatusLine(const string& protocol, int code) {
+  const map<int, string>& lines = protocol == "HTTP/1.1" ? kHTTP11StatusLines : kHTTP10StatusLines;
+  if (protocol != "HTTP/1.1" && protocol != "HTTP/1.0") return NULL;
+  auto found = lines.find(code);
+  return found == lines.end() ? NULL : &found->second;
+}
+
+static string formatStatusLine(const string& protocol, int code) {
+  const char *message = kUnknownStatusMessage.c_str();
+  for (const auto& status: kStatusMessages) {
+    if (status.code == code) message = status.message;
+  }
+
+  ostringstream oss;
+  oss << protocol << " " << code << " " << message << kLineTerminator;
+  return oss.str();
+}
+
+void HTTPResponse::serialize(IOVector& iov, bool includePayload) const {
+  const string *statusLine = findStatusLine(protocol, code);
+  if (statusLine != NULL) {
+    iov.append(*statusLine);
+  } else {
+    iov.appendCopy(formatStatusLine(protocol, code));
+  }
+
+  responseHeader.serialize(iov);
+  iov.append(kLineTerminator); // blank line not printed by response header
+  if (includePayload) payload.serialize(iov);
 }
 
 void HTTPResponse::setProtocol(const string& protocol) {
@@ -41,70 +144,186 @@ void HTTPResponse::setPayload(const string& payload) {
   this->payload.setPayload(responseHeader, payload);
 }
 
+void HTTPResponse::setRequestTime(time_t requestTime) {
+  this->requestTime = requestTime;
+}
+
+/**
+ * Status codes whose responses may be cached without explicit freshness
+ * information (RFC 9110, section 15.1).  206 is left out because the proxy
+ * doesn't cache partial content.
+ */
+static bool isHeuristicallyCacheable(int code) {
+  switch (code) {
+  case 200: case 203: case 204: case 300: case 301: case 308:
+  case 404: case 405: case 410: case 414: case 501:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * Status codes whose responses may be cached, given explicit freshness
+ * information (RFC 9111, section 3): the heuristically cacheable ones,
+ * and the temporary redirects.
+ */
+static bool isCacheable(int code) {
+  return isHeuristicallyCacheable(code) || code == 302 || code == 307;
+}
+
+/**
+ * Applies the conditions RFC 9111 (section 3) places on what a shared
+ * cache may store that the response alone determines.  no-cache would
+ * allow storing, but only for responses the cache revalidates before
+ * every use, so such responses aren't stored, and neither are those that
+ * vary on "*", whichever of their Vary fields names it.  Nor are those
+ * with a transfer coding other than chunked, since only chunked is undone
+ * before the payload is stored.
+ */
 bool HTTPResponse::permitsCaching() const {
-  if (!responseHeader.containsName("Cache-Control")) return false;
-  const string& cacheControlValue = responseHeader.getValueAsString("Cache-Control");
-  if (cacheControlValue.find("private") != string::npos) return false;
-  if (cacheControlValue.find("no-cache") != string::npos) return false;
-  if (cacheControlValue.find("no-store") != string::npos) return false;
+  if (!isCacheable(code)) return false;
+  StringView codings = responseHeader.getValueAsString(HTTPHeader::kTransferEncoding);
+  if (!codings.empty() && !codings.equalsIgnoreCase("chunked")) return false;
+  if (cacheControl.hasNoStore() || cacheControl.hasPrivate() || cacheControl.hasNoCache()) return false;
+  if (("," + getVaryNames() + ",").find(",*,") != string::npos) return false;
+  bool explicitFreshness = cacheControl.getSharedMaxAge() != CacheControl::kUnset ||
+    cacheControl.getMaxAge() != CacheControl::kUnset || responseHeader.containsName(HTTPHeader::kExpires);
+  if (!explicitFreshness && !cacheControl.hasPublic() && !isHeuristicallyCacheable(code)) return false;
   return getTTL() > 0;
 }
 
-int HTTPResponse::getTTL() const {
-  if (!responseHeader.containsName("Cache-Control")) return 0;
-  const string& cacheControlValue = responseHeader.getValueAsString("Cache-Control");
-  size_t pos = cacheControlValue.find("max-age=");
-  if (pos == string::npos) return 0;
-  string maxAgeValue = cacheControlValue.substr(pos + 8);
-  istringstream iss(maxAgeValue);
-  int maxAge;
-  iss >> maxAge;
-  return maxAge;
+/**
+ * Heuristic freshness is a tenth of the time since the resource was last
+ * modified, as of the response, which is what RFC 9111 suggests, but never
+ * more than a day.
+ */
+static const long kMaxHeuristicLifetime = 24 * 60 * 60;
+long HTTPResponse::getFreshnessLifetime() const {
+  if (cacheControl.getSharedMaxAge() != CacheControl::kUnset) return cacheControl.getSharedMaxAge();
+  if (cacheControl.getMaxAge() != CacheControl::kUnset) return cacheControl.getMaxAge();
+  if (responseHeader.containsName(HTTPHeader::kExpires)) {
+    time_t expires = parseHTTPDate(responseHeader.getValueAsString(HTTPHeader::kExpires));
+    return expires < 0 ? 0 : max<long>(0, expires - getDate());
+  }
+
+  if (!isHeuristicallyCacheable(code) && !cacheControl.hasPublic()) return 0;
+  time_t lastModified = parseHTTPDate(responseHeader.getValueAsString(HTTPHeader::kLastModified));
+  if (lastModified < 0 || lastModified >= getDate()) return 0;
+  return min<long>((getDate() - lastModified) / 10, kMaxHeuristicLifetime);
+}
+
+/**
+ * Computes the corrected initial age exactly as RFC 9111 (section 4.2.3)
+ * prescribes: the larger of the age implied by the Date header and the
+ * Age header's value plus however long the response took to arrive.
+ */
+long HTTPResponse::getInitialAge() const {
+  long ageValue = max<long>(0, responseHeader.getValueAsNumber(HTTPHeader::kAge));
+  long apparentAge = max<long>(0, responseTime - getDate());
+  long responseDelay = max<long>(0, responseTime - requestTime);
+  return max(apparentAge, ageValue + responseDelay);
+}
+
+long HTTPResponse::getCurrentAge() const {
+  return getInitialAge() + max<long>(0, time(NULL) - responseTime);
+}
+
+long HTTPResponse::getTTL() const {
+  return getFreshnessLifetime() - getCurrentAge();
+}
+
+/**
+ * The stored Age is dropped first, since it measured the stored response's
+ * age when it arrived, and would otherwise outlive the refresh.
+ */
+void HTTPResponse::refresh(const HTTPResponse& notModified) {
+  responseHeader.removeHeader(HTTPHeader::kAge);
+  responseHeader.updateHeader(notModified.responseHeader);
+  cacheControl = CacheControl(responseHeader.getValuesAsString(HTTPHeader::kCacheControl));
+  requestTime = notModified.requestTime;
+  responseTime = notModified.responseTime;
+}
+
+void HTTPResponse::setAge(long age) {
+  responseHeader.addHeader(HTTPHeader::kAge, to_string(age));
+}
+
+bool HTTPResponse::reportsOriginFailure() const {
+  return code == 500 || code == 502 || code == 503 || code == 504;
+}
+
+string HTTPResponse::getVaryNames() const {
+  string values = responseHeader.getValuesAsString(HTTPHeader::kVary);
+  StringView vary(values);
+  vector<string> names;
+  size_t start = 0;
+  while (start <= vary.size()) {
+    size_t comma = vary.find(',', start);
+    if (comma == StringView::npos) comma = vary.size();
+    StringView name = vary.substr(start, comma - start).trim();
+    if (!name.empty()) names.push_back(name.toLowerCaseString());
+    start = comma + 1;
+  }
+
+  sort(names.begin(), names.end());
+  names.erase(unique(names.begin(), names.end()), names.end());
+  string joined;
+  for (const string& name: names) {
+    if (!joined.empty()) joined += ',';
+    joined += name;
+  }
+
+  return joined;
+}
+
+bool HTTPResponse::permitsConnectionReuse() const {
+  string connection = StringView(responseHeader.getValuesAsString(HTTPHeader::kConnection)).toLowerCaseString();
+  bool persistent = protocol == "HTTP/1.1" ?
+    connection.find("close") == string::npos :
+    connection.find("keep-alive") != string::npos;
+  return persistent && hasDelimitedPayload();
+}
+
+bool HTTPResponse::hasDelimitedPayload() const {
+  if ((code >= 100 && code < 200) || code == 204 || code == 304) return true;
+  return responseHeader.hasChunkedPayload() || responseHeader.containsName(HTTPHeader::kContentLength);
+}
+
+void HTTPResponse::setPersistentConnection(bool persistent) {
+  responseHeader.removeHeader(HTTPHeader::kKeepAlive);
+  responseHeader.addHeader(HTTPHeader::kConnection, persistent ? "keep-alive" : "close");
+}
+
+void HTTPResponse::setChunkedTransferEncoding() {
+  responseHeader.removeHeader(HTTPHeader::kContentLength);
+  string codings = responseHeader.getValuesAsString(HTTPHeader::kTransferEncoding);
+  responseHeader.addHeader(HTTPHeader::kTransferEncoding, codings.empty() ? "chunked" : codings + ", chunked");
 }
 
 ostream& operator<<(ostream& os, const HTTPResponse& hr) {
-  os << hr.protocol << " " << hr.code << " "
-     << hr.getStatusMessage(hr.code) << "\r\n";
-  os << hr.responseHeader;
-  os << "\r\n"; // blank line not printed by response header
-  os << hr.payload;
+  IOVector iov;
+  hr.serialize(iov);
+  iov.writeTo(os);
   return os;
 }
 
-/** Private Methods **/
+/** Private methods **/
 
-string HTTPResponse::getStatusMessage(int code) const {
-  switch (code) {
-  case 100: return "Continue";
-  case 101: return "Switching Protocols";
-  case 200: return "OK";
-  case 201: return "Created";
-  case 202: return "Accepted";
-  case 203: return "Non-Authoritative Information";
-  case 204: return "No Content";
-  case 205: return "Reset Content";
-  case 206: return "Partial Content";
-  case 300: return "Multiple Choices";
-  case 301: return "Permanently Moved";
-  case 302: return "Found";
-  case 303: return "See Other";
-  case 304: return "Not Modified";
-  case 305: return "Use Proxy";
-  case 307: return "Temporary Redirect";
-  case 400: return "Bad Request";
-  case 401: return "Unauthorized";
-  case 402: return "Payment Required";
-  case 403: return "Forbidden";
-  case 404: return "Not Found";
-  case 405: return "Method Not Allowed";
-  case 406: return "Not Acceptable";
-  case 407: return "Proxy Authentication Required";
-  case 408: return "Request Timeout";
-  case 409: return "Conflict";
-  case 410: return "Gone";
-  case 500: return "Internal Server Error";
-  case 505: return "HTTP Version Not Supported";
-  case 510: return "General Proxy Failure";
-  default: return "Unknown Code";
+void HTTPResponse::noteArrival() {
+  if (responseHeader.containsName(HTTPHeader::kTransferEncoding)) {
+    responseHeader.removeHeader(HTTPHeader::kContentLength);
   }
+  cacheControl = CacheControl(responseHeader.getValuesAsString(HTTPHeader::kCacheControl));
+  responseTime = time(NULL);
+  if (requestTime == 0) requestTime = responseTime;
+}
+
+/**
+ * Returns the time the Date header names, or the time the response
+ * arrived if it doesn't have a valid one (RFC 9110, section 6.6.1).
+ */
+time_t HTTPResponse::getDate() const {
+  time_t date = parseHTTPDate(responseHeader.getValueAsString(HTTPHeader::kDate));
+  return date < 0 ? responseTime : date;
 }
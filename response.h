@@ -14,7 +14,9 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <ctime>
 
+#include "cache-control.h"
 #include "header.h"
 #include "payload.h"
 
@@ -30,6 +32,14 @@ class HTTPResponse {
 
  public:
 
+  /**
+   * Constructs an empty response whose header and payload are allocated
+   * from the supplied arena, or from the heap if there isn't one.
+   */
+
+  HTTPResponse(Arena *arena = NULL) :
+    responseHeader(arena), payload(arena), requestTime(0), responseTime(0) {}
+
   /**
    * Ingests everything up through and including the first
    * blank line of the server's response to an HTTP request.
@@ -37,12 +47,49 @@ class HTTPResponse {
 
   void ingestResponseHeader(std::istream& instream);
 
+  /**
+   * Populates the status line and header from a parser that's parsed
+   * the entire response header, as an alternative to reading them from
+   * an istream.
+   */
+
+  void ingestResponseHeader(const HTTPParser& parser);
+
   /**
    * Ingests the payload portion of the server's response
-   * to an HTTP request.
+   * to an HTTP request.  Returns false unless all of it was
+   * ingested (see HTTPPayload::ingestPayload).
+   */
+
+  bool ingestPayload(std::istream& instream);
+
+  /**
+   * Streams the payload portion of the server's response
+   * straight through to outstream (see HTTPPayload::relayPayload),
+   * retaining a copy only if asked to (and clearing retain if the
+   * payload proves too large to), and splicing it from infd to
+   * outfd if they're supplied.  Returns true if and only if the
+   * entire payload was relayed.
+   */
+
+  bool relayPayload(std::istream& instream, std::ostream& outstream, bool& retain,
+                    int infd = -1, int outfd = -1);
+
+  /**
+   * Publishes everything up through and including the blank
+   * line that ends the response header, but not the payload.
+   */
+
+  void writeHeader(std::ostream& os) const;
+
+  /**
+   * Appends the status line, the header, and (if includePayload is
+   * true) the payload to the supplied IOVector, so that all of it can be
+   * sent with a single system call.  Everything's appended by reference,
+   * so the response must outlive the IOVector's use.
    */
 
-  void ingestPayload(std::istream& instream);
+  void serialize(IOVector& iov, bool includePayload = true) const;
 
   /**
    * Sets the protocol to be the one specified.  The
@@ -80,29 +127,154 @@ class HTTPResponse {
 
   void setPayload(const std::string& payload);
 
+  /**
+   * Records when the request this responds to was sent, so the
+   * time the response spent in transit counts toward its age.
+   * Otherwise, the request is taken to have been sent the moment
+   * the response arrived.
+   */
+
+  void setRequestTime(time_t requestTime);
+
+  /**
+   * Returns the response's Cache-Control directives, as parsed
+   * when the header was ingested.
+   */
+
+  const CacheControl& getCacheControl() const { return cacheControl; }
+
   /**
    * Returns true if and only if the HTTPResponse is
-   * cachable and can be returned as is when the same
-   * exact request comes through later on.
+   * cachable (by a shared cache, as far as the response
+   * itself is concerned) and can be returned as is when the
+   * same exact request comes through later on.
    */
 
   bool permitsCaching() const;
 
+  /**
+   * Returns the number of seconds the response stays fresh
+   * for, counting from when it was generated (RFC 9111,
+   * section 4.2.1): s-maxage, max-age, Expires, and finally a
+   * heuristic based on Last-Modified, in that order of precedence.
+   */
+
+  long getFreshnessLifetime() const;
+
+  /**
+   * Returns the response's age, in seconds, when it arrived
+   * (the corrected initial age of RFC 9111, section 4.2.3),
+   * and its age right now.
+   */
+
+  long getInitialAge() const;
+  long getCurrentAge() const;
+
   /**
    * Returns the time-to-live, which is the number
    * of remaining seconds for which a cacheable object
-   * is still valid.
+   * is still valid.  It's 0 or negative once the response
+   * has gone stale.
+   */
+
+  long getTTL() const;
+
+  /**
+   * Freshens a stored response with the 304 response to a
+   * request that revalidated it (RFC 9111, section 4.3.4):
+   * the 304's header fields replace the stored ones, and the
+   * response is taken to have arrived when the 304 did, so its
+   * age and freshness start over.
+   */
+
+  void refresh(const HTTPResponse& notModified);
+
+  /**
+   * Replaces the Age header, for responses served from
+   * the cache.
+   */
+
+  void setAge(long age);
+
+  /**
+   * Returns true if and only if the response reports that
+   * the origin failed to produce a proper one (500, 502, 503,
+   * or 504), in which case a stale response may stand in for
+   * it (RFC 5861, section 4).
+   */
+
+  bool reportsOriginFailure() const;
+
+  /**
+   * Returns the names of the request headers the response
+   * says it varies on (across all of its Vary fields), lowercased,
+   * sorted, and joined with commas, or the empty string if it doesn't vary.
+   */
+
+  std::string getVaryNames() const;
+
+  /**
+   * Returns true if and only if the connection the response
+   * arrived on can be used for another request: the server
+   * must be willing to keep it open, and the end of the payload
+   * must be identifiable without the server closing it.
+   */
+
+  bool permitsConnectionReuse() const;
+
+  /**
+   * Returns true unless the response's Content-Length isn't a plain
+   * decimal number, in which case the length of its payload is unknowable
+   * and the response can't be relayed (RFC 9112, section 6.3).  Any
+   * Content-Length arriving alongside Transfer-Encoding has already been
+   * dropped in favor of the latter.
+   */
+
+  bool hasValidFraming() const { return responseHeader.hasValidContentLength(); }
+
+  /**
+   * Returns true if and only if the end of the payload can be
+   * identified without the sender closing the connection (i.e.
+   * the payload is chunked, has a declared length, or is
+   * absent by virtue of the response code).
+   */
+
+  bool hasDelimitedPayload() const;
+
+  /**
+   * Replaces the hop-by-hop Connection header so the client
+   * is told whether the connection stays open after this response.
+   */
+
+  void setPersistentConnection(bool persistent);
+
+  /**
+   * Marks the payload as chunked, for responses whose payload
+   * the proxy frames as chunks itself.  Chunked is appended after
+   * any transfer codings the origin server already applied.
+   */
+
+  void setChunkedTransferEncoding();
+
+  /**
+   * Provides read-only access to the response header, so
+   * that callers can examine framing headers (Content-Length,
+   * Transfer-Encoding) before the payload has been ingested.
    */
 
-  int getTTL() const;
+  const HTTPHeader& getHeader() const { return responseHeader; }
 
  private:
   int code;
   std::string protocol;
   HTTPHeader responseHeader;
   HTTPPayload payload;
+  CacheControl cacheControl;
+  time_t requestTime;
+  time_t responseTime;
 
-  std::string getStatusMessage(int code) const;
+  void noteArrival();
+  time_t getDate() const;
 };
 
 #endif
@@ -0,0 +1,175 @@
+/**
+ * File: scan-bench.cc
+ * -------------------
+ * A standalone benchmark for the scanning kernels exported by scan.h.
+ * Each kernel walks a few representative request headers delimiter by
+ * delimiter, the way the parsers do, and is compared against memchr and
+ * a byte-at-a-time loop like the one scan.cc falls back on.  Throughput is
+ * reported in bytes per cycle, where cycles are read from the timestamp
+ * counter on x86 processors; elsewhere, it's reported in bytes per
+ * nanosecond instead.
+ *
+ * Build with "make scan-bench" and run with no arguments.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TIMESTAMP_COUNTER
+#endif
+
+using namespace std;
+
+static const size_t kMinBytesScanned = 256 << 20; // 256MB per measurement
+static const int kNumTrials = 5;
+
+typedef struct {
+  const char *name;
+  size_t (*scanForByte)(const char *data, size_t length, char target);
+  size_t (*scanForEither)(const char *data, size_t length, char first, char second);
+} contender_t;
+
+static size_t scalarScanForByte(const char *data, size_t length, char target) {
+  for (size_t pos = 0; pos < length; pos++) {
+    if (data[pos] == target) return pos;
+  }
+  return length;
+}
+
+static size_t scalarScanForEither(const char *data, size_t length, char first, char second) {
+  for (size_t pos = 0; pos < length; pos++) {
+    if (data[pos] == first || data[pos] == second) return pos;
+  }
+  return length;
+}
+
+static size_t memchrScanForByte(const char *data, size_t length, char target) {
+  const void *found = memchr(data, target, length);
+  return found == NULL ? length : static_cast<const char *>(found) - data;
+}
+
+/**
+ * memchr has no two-delimiter form, so the nearest of two memchr scans
+ * stands in for it.  The second scan goes no further than the first match.
+ */
+static size_t memchrScanForEither(const char *data, size_t length, char first, char second) {
+  size_t pos = memchrScanForByte(data, length, first);
+  return memchrScanForByte(data, pos, second);
+}
+
+static string buildBrowserRequest() {
+  return
+    "GET http://www.example.com/articles/2016/performance-engineering.html?ref=front HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+}
+
+static string buildCookieRequest() {
+  string cookie;
+  while (cookie.size() < 4096) {
+    cookie += "session_" + to_string(cookie.size()) + "=0123456789abcdef0123456789abcdef; ";
+  }
+  return
+    "GET http://www.example.com/account HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Cookie: " + cookie + "\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+}
+
+static string buildShortRequest() {
+  return "GET http://www.example.com/ HTTP/1.0\r\nHost: www.example.com\r\n\r\n";
+}
+
+static uint64_t readClock() {
+#ifdef HAVE_TIMESTAMP_COUNTER
+  return __rdtsc();
+#else
+  return chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/**
+ * Walks the header from one delimiter to the next, as the parsers do,
+ * until at least kMinBytesScanned bytes have been scanned, and returns the
+ * best throughput of kNumTrials runs.  The matches are summed into sink so
+ * that none of the scanning can be optimized away.
+ */
+static double measure(const string& header, const contender_t& contender, bool either,
+                      volatile size_t& sink) {
+  size_t passes = kMinBytesScanned / header.size() + 1;
+  const char *data = header.data();
+  size_t length = header.size();
+  double best = 0;
+  for (int trial = 0; trial < kNumTrials; trial++) {
+    size_t matches = 0;
+    uint64_t start = readClock();
+    for (size_t pass = 0; pass < passes; pass++) {
+      size_t pos = 0;
+      while (pos < length) {
+        pos += either ?
+          contender.scanForEither(data + pos, length - pos, ' ', '\t') :
+          contender.scanForByte(data + pos, length - pos, '\n');
+        pos++;
+        matches++;
+      }
+    }
+    uint64_t elapsed = readClock() - start;
+    sink += matches;
+    double throughput = double(passes * length) / (elapsed == 0 ? 1 : elapsed);
+    if (throughput > best) best = throughput;
+  }
+  return best;
+}
+
+int main() {
+  const contender_t contenders[] = {
+    { "scan.h", scanForByte, scanForEither },
+    { "memchr", memchrScanForByte, memchrScanForEither },
+    { "scalar", scalarScanForByte, scalarScanForEither },
+  };
+  const struct { const char *name; string header; } workloads[] = {
+    { "short request", buildShortRequest() },
+    { "browser request", buildBrowserRequest() },
+    { "4KB cookie", buildCookieRequest() },
+  };
+
+#ifdef HAVE_TIMESTAMP_COUNTER
+  const char *units = "bytes/cycle";
+#else
+  const char *units = "bytes/ns";
+#endif
+  volatile size_t sink = 0;
+  cout << left << setw(18) << "workload" << setw(14) << "scan" << setw(10) << "kernel"
+       << units << endl;
+  for (const auto& workload: workloads) {
+    for (bool either: { false, true }) {
+      for (const contender_t& contender: contenders) {
+        double throughput = measure(workload.header, contender, either, sink);
+        cout << left << setw(18) << workload.name
+             << setw(14) << (either ? "scanForEither" : "scanForByte")
+             << setw(10) << contender.name
+             << fixed << setprecision(3) << throughput << endl;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,189 @@
+/**
+ * File: scan.cc
+ * -------------
+ * Presents the implementation of the scanning kernels exported by
+ * scan.h.  The vector kernels are compiled with target attributes rather
+ * than with -mavx2, so the binary still runs on processors without AVX2,
+ * and which kernel gets used is decided at runtime, the first time any
+ * of them is needed.
+ */
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SCAN_KERNELS
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static size_t scalarScanForByte(const char *data, size_t length, char target) {
+  for (size_t pos = 0; pos < length; pos++) {
+    if (data[pos] == target) return pos;
+  }
+  return length;
+}
+
+static size_t scalarScanForEither(const char *data, size_t length, char first, char second) {
+  for (size_t pos = 0; pos < length; pos++) {
+    if (data[pos] == first || data[pos] == second) return pos;
+  }
+  return length;
+}
+
+static char toLower(char ch) {
+  return ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch;
+}
+
+static bool scalarEqualsIgnoreCase(const char *lhs, const char *rhs, size_t length) {
+  for (size_t pos = 0; pos < length; pos++) {
+    if (toLower(lhs[pos]) != toLower(rhs[pos])) return false;
+  }
+  return true;
+}
+
+#ifdef HAVE_X86_SCAN_KERNELS
+
+/**
+ * Each block is compared against the delimiter(s) all at once, and the
+ * comparison results are collapsed into a bit mask whose lowest set bit
+ * identifies the first match.  Whatever's left over after the last full
+ * block is handed to the next narrower kernel.  The AVX2 kernels clear the
+ * upper halves of the vector registers before doing so, since running
+ * legacy SSE instructions while they're dirty costs far more than the
+ * tail does.
+ */
+__attribute__((target("sse2")))
+static size_t sse2ScanForByte(const char *data, size_t length, char target) {
+  const __m128i needle = _mm_set1_epi8(target);
+  size_t pos = 0;
+  for (; pos + 16 <= length; pos += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) (data + pos));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+    if (mask != 0) return pos + __builtin_ctz(mask);
+  }
+
+  return pos + scalarScanForByte(data + pos, length - pos, target);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2ScanForEither(const char *data, size_t length, char first, char second) {
+  const __m128i firstNeedle = _mm_set1_epi8(first);
+  const __m128i secondNeedle = _mm_set1_epi8(second);
+  size_t pos = 0;
+  for (; pos + 16 <= length; pos += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) (data + pos));
+    __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(block, firstNeedle),
+                                   _mm_cmpeq_epi8(block, secondNeedle));
+    int mask = _mm_movemask_epi8(matches);
+    if (mask != 0) return pos + __builtin_ctz(mask);
+  }
+
+  return pos + scalarScanForEither(data + pos, length - pos, first, second);
+}
+
+/**
+ * Lowercases the ASCII letters in the block by setting their 0x20 bit,
+ * which is exactly what distinguishes upper- from lowercase in ASCII.  The
+ * signed comparisons leave bytes of 0x80 and up alone, since they read as
+ * negative.
+ */
+__attribute__((target("sse2")))
+static __m128i sse2ToLower(__m128i block) {
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('A' - 1)),
+                                _mm_cmplt_epi8(block, _mm_set1_epi8('Z' + 1)));
+  return _mm_or_si128(block, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2")))
+static bool sse2EqualsIgnoreCase(const char *lhs, const char *rhs, size_t length) {
+  size_t pos = 0;
+  for (; pos + 16 <= length; pos += 16) {
+    __m128i left = sse2ToLower(_mm_loadu_si128((const __m128i *) (lhs + pos)));
+    __m128i right = sse2ToLower(_mm_loadu_si128((const __m128i *) (rhs + pos)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(left, right)) != 0xffff) return false;
+  }
+
+  return scalarEqualsIgnoreCase(lhs + pos, rhs + pos, length - pos);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2ScanForByte(const char *data, size_t length, char target) {
+  const __m256i needle = _mm256_set1_epi8(target);
+  size_t pos = 0;
+  for (; pos + 32 <= length; pos += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *) (data + pos));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+    if (mask != 0) return pos + __builtin_ctz(mask);
+  }
+
+  _mm256_zeroupper(); // the SSE2 kernel is legacy encoded
+  return pos + sse2ScanForByte(data + pos, length - pos, target);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2ScanForEither(const char *data, size_t length, char first, char second) {
+  const __m256i firstNeedle = _mm256_set1_epi8(first);
+  const __m256i secondNeedle = _mm256_set1_epi8(second);
+  size_t pos = 0;
+  for (; pos + 32 <= length; pos += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *) (data + pos));
+    __m256i matches = _mm256_or_si256(_mm256_cmpeq_epi8(block, firstNeedle),
+                                      _mm256_cmpeq_epi8(block, secondNeedle));
+    unsigned int mask = _mm256_movemask_epi8(matches);
+    if (mask != 0) return pos + __builtin_ctz(mask);
+  }
+
+  _mm256_zeroupper(); // the SSE2 kernel is legacy encoded
+  return pos + sse2ScanForEither(data + pos, length - pos, first, second);
+}
+
+#endif
+
+typedef struct {
+  size_t (*scanForByte)(const char *data, size_t length, char target);
+  size_t (*scanForEither)(const char *data, size_t length, char first, char second);
+  bool (*equalsIgnoreCase)(const char *lhs, const char *rhs, size_t length);
+} kernel_t;
+
+static kernel_t selectKernel() {
+  kernel_t kernel = { scalarScanForByte, scalarScanForEither, scalarEqualsIgnoreCase };
+#ifdef HAVE_X86_SCAN_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernel.scanForByte = avx2ScanForByte;
+    kernel.scanForEither = avx2ScanForEither;
+    kernel.equalsIgnoreCase = sse2EqualsIgnoreCase;
+  } else if (__builtin_cpu_supports("sse2")) {
+    kernel.scanForByte = sse2ScanForByte;
+    kernel.scanForEither = sse2ScanForEither;
+    kernel.equalsIgnoreCase = sse2EqualsIgnoreCase;
+  }
+#endif
+  return kernel;
+}
+
+/**
+ * The kernel is selected on first use rather than during static
+ * initialization, so scanning is safe from other static initializers too.
+ */
+static const kernel_t& getKernel() {
+  static const kernel_t kernel = selectKernel();
+  return kernel;
+}
+
+size_t scanForByte(const char *data, size_t length, char target) {
+  return getKernel().scanForByte(data, length, target);
+}
+
+size_t scanForEither(const char *data, size_t length, char first, char second) {
+  return getKernel().scanForEither(data, length, first, second);
+}
+
+/**
+ * Header names are rarely longer than 16 bytes, so there's no AVX2 kernel
+ * for this one; the SSE2 kernel is used on AVX2 processors as well.
+ */
+bool equalsIgnoreCase(const char *lhs, const char *rhs, size_t length) {
+  return getKernel().equalsIgnoreCase(lhs, rhs, length);
+}
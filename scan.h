@@ -0,0 +1,35 @@
+/**
+ * File: scan.h
+ * ------------
+ * Exports the delimiter scanning kernels the parsers rely on to find
+ * line ends, header separators, and token boundaries, along with the
+ * case-insensitive comparison used to match header names.  On x86 processors
+ * the bytes are compared 16 (SSE2) or 32 (AVX2) at a time, whichever the
+ * processor the proxy finds itself running on supports; elsewhere, they're
+ * compared one at a time.
+ */
+
+#ifndef _scan_
+#define _scan_
+
+#include <cstddef>   // for size_t
+
+/**
+ * Returns the offset of the first occurrence of target within the
+ * length bytes at data, or length if there isn't one.
+ */
+size_t scanForByte(const char *data, size_t length, char target);
+
+/**
+ * Returns the offset of the first byte within the length bytes at data
+ * that's equal to either first or second, or length if there isn't one.
+ */
+size_t scanForEither(const char *data, size_t length, char first, char second);
+
+/**
+ * Returns true if and only if the length bytes at lhs and rhs are the
+ * same, treating the ASCII letters case-insensitively.
+ */
+bool equalsIgnoreCase(const char *lhs, const char *rhs, size_t length);
+
+#endif
@@ -9,7 +9,8 @@
 #include "scheduler.h"
 using namespace std;
 
-HTTPProxyScheduler::HTTPProxyScheduler() : thread_pool(20) {}
+HTTPProxyScheduler::HTTPProxyScheduler(HTTPResolver& resolver, HTTPCache& cache) :
+  handler(resolver, cache), thread_pool(20) {}
 
 void HTTPProxyScheduler::scheduleRequest(int connectionfd,
   const string& clientIPAddress) {
@@ -11,12 +11,13 @@
 
 #include <string>
 #include "request-handler.h"
+#include "resolver.h"
 #include "thread-pool.h"
 
 class HTTPProxyScheduler {
 
  public:
-  HTTPProxyScheduler();
+  HTTPProxyScheduler(HTTPResolver& resolver, HTTPCache& cache);
   void scheduleRequest(int connectionfd, const std::string& clientIPAddress);
 
  private:
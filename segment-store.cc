@@ -0,0 +1,851 @@
+/**
+ * File: segment-store.cc
+ * ----------------------
+ * Presents the implementation of the HTTPSegmentStore class.  Every
+ * record on disk is a record_t followed immediately by its data (a
+ * tombstone is a record_t with none), and the
+ * checkpoint is a checkpoint_t, followed by a covered_t for each segment
+ * (saying how much of it the checkpoint accounts for), followed by an
+ * entry_t for each key in the index.
+ */
+
+#include "segment-store.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>      // for IOV_MAX
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "checksum.h"
+#include "ostreamlock.h"
+#include "thread-pool.h"
+
+using namespace std;
+
+static const uint32_t kRecordMagic = 0x48505332;     // "HPS2"
+static const uint32_t kTombstoneMagic = 0x48505354;  // "HPST"
+static const uint32_t kCheckpointMagic = 0x48504932; // "HPI2"
+static const int64_t kRemoved = INT64_MIN; // the expiration scanSegment reports tombstones with
+static const string kSegmentPrefix = "segment-";
+static const string kCheckpointName = "index";
+
+typedef struct {
+  uint32_t magic;
+  uint32_t segmentCount;
+  uint64_t entryCount;
+} checkpoint_t;
+
+typedef struct {
+  uint32_t id;
+  uint32_t unused;
+  uint64_t size;
+} covered_t;
+
+typedef struct {
+  CacheKey key;
+  HTTPSegmentStore::location_t location;
+} entry_t;
+
+/**
+ * Writes everything iov refers to at offset, picking up where pwritev
+ * leaves off when it writes only part of it.
+ */
+static bool writeCompletely(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+  while (iovcnt > 0) {
+    ssize_t count = pwritev(fd, iov, iovcnt, offset);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) return false;
+    offset += count;
+    while (iovcnt > 0 && size_t(count) >= iov->iov_len) {
+      count -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + count;
+      iov->iov_len -= count;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Like the above, for a single buffer.
+ */
+static bool writeBuffer(int fd, const void *data, size_t length, off_t offset) {
+  struct iovec iov = { const_cast<void *>(data), length };
+  return length == 0 || writeCompletely(fd, &iov, 1, offset);
+}
+
+HTTPSegmentStore::HTTPSegmentStore(const string& directory, EvictionPolicy::Kind policy,
+                                   uint64_t maxBytes, uint64_t maxEntries, int staleRetention,
+                                   size_t segmentSize, int maintenanceInterval) :
+  directory(directory), staleRetention(staleRetention), segmentSize(segmentSize), maintenanceInterval(maintenanceInterval),
+  changes(0), nextSegmentId(1), stopping(false) {
+  policies.push_back(unique_ptr<EvictionPolicy>(EvictionPolicy::create(policy, maxBytes,
+                                                                       maxEntries)));
+  for (int kind = 0; kind < EvictionPolicy::kNumKinds; kind++) {
+    if (kind == policy) continue;
+    policies.push_back(unique_ptr<EvictionPolicy>(
+      EvictionPolicy::create(EvictionPolicy::Kind(kind), maxBytes, maxEntries)));
+  }
+  recover();
+  maintainer = thread([this]() -> void { maintain(); });
+}
+
+HTTPSegmentStore::~HTTPSegmentStore() {
+  {
+    lock_guard<mutex> lg(maintenanceLock);
+    stopping = true;
+  }
+  maintenanceCondition.notify_all();
+  maintainer.join();
+  checkpoint();
+}
+
+/**
+ * An entry past its retention is forgotten without appendLock, which every other
+ * change to the index holds.  The only harm that can come of that is that
+ * a compaction copying the entry at the same time indexes it again, and
+ * it's forgotten all over again the next time it's looked up.
+ */
+bool HTTPSegmentStore::find(const CacheKey& key, location_t& location) {
+  lock_guard<mutex> lg(indexLock);
+  auto found = index.find(key);
+  if (found != index.end() && isDiscardable(found->second.expiration, time(NULL))) {
+    drop(key);
+    for (const auto& policy: policies) policy->remove(key);
+    found = index.end();
+  }
+
+  if (found == index.end()) {
+    recordLookup(key, NULL);
+    return false;
+  }
+
+  location = found->second;
+  recordLookup(key, &location);
+  return true;
+}
+
+bool HTTPSegmentStore::peek(const CacheKey& key, location_t& location) const {
+  lock_guard<mutex> lg(indexLock);
+  auto found = index.find(key);
+  if (found == index.end() || isDiscardable(found->second.expiration, time(NULL))) return false;
+  location = found->second;
+  return true;
+}
+
+void HTTPSegmentStore::touch(const CacheKey& key) {
+  unique_lock<mutex> ul(indexLock, try_to_lock);
+  if (!ul.owns_lock()) return;
+  auto found = index.find(key);
+  if (found != index.end()) recordLookup(key, &found->second);
+}
+
+bool HTTPSegmentStore::append(const CacheKey& key, const string& data, time_t expiration,
+                              time_t generated) {
+  return appendRecord(key, data.data(), data.size(), expiration, generated, NULL);
+}
+
+/**
+ * Every record is offered to the policies before any is written, and then
+ * each run of admitted records that fits in the active segment is written
+ * with a single pwritev.
+ */
+void HTTPSegmentStore::append(vector<pending_t>& batch) {
+  lock_guard<mutex> al(appendLock);
+  {
+    lock_guard<mutex> il(indexLock);
+    for (pending_t& pending: batch) {
+      pending.appended = admit(pending.key, sizeof(record_t) + pending.data->size());
+    }
+  }
+
+  vector<record_t> records(batch.size());
+  size_t next = 0;
+  while (next < batch.size()) {
+    if (!batch[next].appended) {
+      next++;
+      continue;
+    }
+
+    if (!rollOver(sizeof(record_t) + batch[next].data->size())) {
+      lock_guard<mutex> il(indexLock);
+      for (; next < batch.size(); next++) {
+        if (batch[next].appended) policies[0]->remove(batch[next].key);
+        batch[next].appended = false;
+      }
+      break;
+    }
+
+    vector<struct iovec> iov;
+    vector<size_t> run;    // the records written together
+    uint64_t offset = active->size, end = active->size;
+    for (; next < batch.size() && iov.size() + 2 <= IOV_MAX; next++) {
+      const pending_t& pending = batch[next];
+      if (!pending.appended) continue;
+      size_t recordSize = sizeof(record_t) + pending.data->size();
+      if (!run.empty() && end + recordSize > segmentSize) break;
+      records[next] = { kRecordMagic, uint32_t(pending.data->size()), 0, 0, pending.key,
+                        pending.expiration, pending.generated };
+      sealRecord(records[next], pending.data->data());
+      iov.push_back({ &records[next], sizeof(record_t) });
+      iov.push_back({ const_cast<char *>(pending.data->data()), pending.data->size() });
+      run.push_back(next);
+      end += recordSize;
+    }
+
+    bool written = writeCompletely(active->fd, iov.data(), iov.size(), offset);
+    if (written) active->size = end; // and otherwise overwritten by the next append
+    lock_guard<mutex> il(indexLock);
+    for (size_t i: run) {
+      pending_t& pending = batch[i];
+      if (!written) {
+        policies[0]->remove(pending.key);
+        pending.appended = false;
+        continue;
+      }
+
+      location_t location = { active->id, uint32_t(pending.data->size()), offset + sizeof(record_t),
+                              pending.expiration, pending.generated };
+      offset += sizeof(record_t) + pending.data->size();
+      auto found = index.find(pending.key);
+      if (found != index.end()) forget(found->second);
+      index[pending.key] = location;
+      active->liveBytes += sizeof(record_t) + pending.data->size();
+      changes++;
+    }
+  }
+}
+
+/**
+ * The tombstone is only needed when there's a record for it to cancel.
+ * It's dead space from the moment it's written; should it fail to be
+ * written, the key is still gone until the proxy is restarted.
+ */
+void HTTPSegmentStore::remove(const CacheKey& key) {
+  lock_guard<mutex> al(appendLock);
+  {
+    lock_guard<mutex> il(indexLock);
+    bool indexed = index.count(key) > 0;
+    drop(key);
+    for (const auto& policy: policies) policy->remove(key);
+    if (!indexed) return;
+  }
+
+  if (!rollOver(sizeof(record_t))) return;
+  record_t tombstone = { kTombstoneMagic, 0, 0, 0, key, kRemoved, 0 };
+  sealRecord(tombstone, NULL);
+  if (writeBuffer(active->fd, &tombstone, sizeof(tombstone), active->size)) {
+    active->size += sizeof(tombstone);
+    lock_guard<mutex> il(indexLock);
+    changes++;
+  }
+}
+
+ssize_t HTTPSegmentStore::read(const location_t& location, void *buffer, size_t length,
+                               size_t offset) const {
+  shared_ptr<segment_t> segment = getSegment(location.segment);
+  if (!segment) return -1;
+  if (offset >= location.length) return 0;
+  if (length > location.length - offset) length = location.length - offset;
+  return pread(segment->fd, buffer, length, location.offset + offset);
+}
+
+int HTTPSegmentStore::duplicate(const location_t& location) const {
+  shared_ptr<segment_t> segment = getSegment(location.segment);
+  return segment ? fcntl(segment->fd, F_DUPFD_CLOEXEC, 0) : -1;
+}
+
+vector<HTTPSegmentStore::stats_t> HTTPSegmentStore::getStats() const {
+  lock_guard<mutex> lg(indexLock);
+  vector<stats_t> stats;
+  for (size_t i = 0; i < policies.size(); i++) {
+    const EvictionPolicy& policy = *policies[i];
+    stats.push_back({policy.getName(), i == 0, policy.getHits(), policy.getMisses(),
+                     policy.getEntries(), policy.getBytes()});
+  }
+  return stats;
+}
+
+/** Private methods **/
+
+HTTPSegmentStore::segment::~segment() {
+  if (fd >= 0) close(fd);
+}
+
+shared_ptr<HTTPSegmentStore::segment_t> HTTPSegmentStore::getSegment(uint32_t id) const {
+  lock_guard<mutex> lg(indexLock);
+  auto found = segments.find(id);
+  return found == segments.end() ? shared_ptr<segment_t>() : found->second;
+}
+
+/**
+ * Opens the identified segment (creating it if asked to), and returns it
+ * with its size taken from the file, or an empty pointer if it couldn't
+ * be opened.
+ */
+static const int kSegmentPermissions = 0644;
+shared_ptr<HTTPSegmentStore::segment_t> HTTPSegmentStore::openSegment(uint32_t id, bool create) {
+  int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0);
+  int fd = open(getSegmentPath(id).c_str(), flags, kSegmentPermissions);
+  if (fd < 0) return shared_ptr<segment_t>();
+  shared_ptr<segment_t> segment(new segment_t);
+  segment->id = id;
+  segment->fd = fd;
+  segment->liveBytes = 0;
+  struct stat st;
+  segment->size = fstat(fd, &st) == 0 ? st.st_size : 0;
+  return segment;
+}
+
+string HTTPSegmentStore::getSegmentPath(uint32_t id) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%08u", id);
+  return directory + "/" + kSegmentPrefix + name;
+}
+
+/**
+ * Appends a record to the active segment, rolling over to a new one if
+ * it's full, and points the index at it.  When a record is being copied
+ * out of a segment under compaction, replacing is where it's being copied
+ * from, and nothing is copied if the key has been stored again (or
+ * removed) in the meantime; since every append holds appendLock, that can't
+ * change between the check and the write, so a copy is never appended
+ * after the record that superseded it.
+ */
+bool HTTPSegmentStore::appendRecord(const CacheKey& key, const char *data, size_t length,
+                                    time_t expiration, time_t generated,
+                                    const location_t *replacing) {
+  lock_guard<mutex> al(appendLock);
+  size_t recordSize = sizeof(record_t) + length;
+  if (replacing != NULL) {
+    lock_guard<mutex> il(indexLock);
+    auto found = index.find(key);
+    if (found == index.end() || found->second.segment != replacing->segment ||
+        found->second.offset != replacing->offset) {
+      return true;
+    }
+  } else {
+    lock_guard<mutex> il(indexLock);
+    if (!admit(key, recordSize)) return false;
+  }
+
+  if (!rollOver(recordSize)) return false;
+
+  record_t record = { kRecordMagic, uint32_t(length), 0, 0, key, expiration, generated };
+  sealRecord(record, data);
+  struct iovec iov[] = {
+    { &record, sizeof(record) },
+    { const_cast<char *>(data), length }
+  };
+  uint64_t offset = active->size;
+  if (!writeCompletely(active->fd, iov, 2, offset)) { // overwritten by the next append
+    lock_guard<mutex> il(indexLock);
+    if (replacing == NULL) policies[0]->remove(key);
+    return false;
+  }
+
+  active->size += recordSize;
+  location_t location = { active->id, uint32_t(length), offset + sizeof(record),
+                          expiration, generated };
+  lock_guard<mutex> il(indexLock);
+  auto found = index.find(key);
+  if (replacing != NULL && found == index.end()) return true; // discarded while being copied
+  if (found != index.end()) forget(found->second);
+  index[key] = location;
+  active->liveBytes += recordSize;
+  changes++;
+  return true;
+}
+
+/**
+ * Makes sure the active segment has room for a record of recordSize bytes,
+ * rolling over to a new segment if it hasn't, unless it's empty, in which
+ * case the record gets it to itself however large it is.  Returns false if
+ * the new segment couldn't be created.  The caller must hold appendLock.
+ */
+bool HTTPSegmentStore::rollOver(size_t recordSize) {
+  if (active && (active->size == 0 || active->size + recordSize <= segmentSize)) return true;
+  shared_ptr<segment_t> next = openSegment(nextSegmentId, /* create = */ true);
+  if (!next) return false;
+  nextSegmentId++;
+  lock_guard<mutex> il(indexLock);
+  segments[next->id] = next;
+  active = next;
+  return true;
+}
+
+/**
+ * Fills in the record's checksum, which covers the record itself (with
+ * the checksum zeroed) and the record.length bytes of data that follow it.
+ */
+void HTTPSegmentStore::sealRecord(record_t& record, const char *data) {
+  record.checksum = 0;
+  uint32_t checksum = crc32c(&record, sizeof(record));
+  record.checksum = crc32c(data, record.length, checksum);
+}
+
+bool HTTPSegmentStore::isIntact(const record_t& record, const char *data) {
+  record_t unsealed = record;
+  unsealed.checksum = 0;
+  return crc32c(data, record.length, crc32c(&unsealed, sizeof(unsealed))) == record.checksum;
+}
+
+/**
+ * Accounts for the record at location having become dead space.  The
+ * caller must hold indexLock.
+ */
+void HTTPSegmentStore::forget(const location_t& location) {
+  auto found = segments.find(location.segment);
+  if (found != segments.end()) found->second->liveBytes -= sizeof(record_t) + location.length;
+}
+
+bool HTTPSegmentStore::isDiscardable(int64_t expiration, time_t now) const {
+  return expiration + staleRetention < now;
+}
+
+/**
+ * Removes key from the index without telling the policies.  The caller
+ * must hold indexLock.
+ */
+void HTTPSegmentStore::drop(const CacheKey& key) {
+  auto found = index.find(key);
+  if (found == index.end()) return;
+  forget(found->second);
+  index.erase(found);
+  changes++;
+}
+
+/**
+ * Offers key to every policy, and drops whatever the active one evicts to
+ * make room for it, along with the record key previously had (which is
+ * superseded whether or not key is admitted).  Returns whether the active
+ * policy admitted key.  The caller must hold indexLock.
+ */
+bool HTTPSegmentStore::admit(const CacheKey& key, uint64_t size) {
+  drop(key);
+  vector<CacheKey> evicted;
+  bool admitted = policies[0]->admit(key, size, evicted);
+  for (const CacheKey& victim: evicted) {
+    drop(victim);
+  }
+  for (size_t i = 1; i < policies.size(); i++) {
+    evicted.clear();
+    policies[i]->admit(key, size, evicted);
+  }
+  return admitted;
+}
+
+/**
+ * Reports a lookup of key to every policy.  The active policy keeps
+ * exactly the entries in the index, so it hits if and only if the entry
+ * was found; the others hit if they'd have kept the entry themselves, and
+ * when they wouldn't have, they admit it as though it had just been
+ * fetched.  The caller must hold indexLock.
+ */
+void HTTPSegmentStore::recordLookup(const CacheKey& key, const location_t *found) {
+  policies[0]->recordAccess(key, found != NULL);
+  for (size_t i = 1; i < policies.size(); i++) {
+    EvictionPolicy& policy = *policies[i];
+    bool hit = policy.contains(key);
+    policy.recordAccess(key, hit);
+    if (!hit && found != NULL) {
+      vector<CacheKey> evicted;
+      policy.admit(key, sizeof(record_t) + found->length, evicted);
+    }
+  }
+}
+
+/**
+ * Admits every recovered entry to the policies, oldest record first, so
+ * recency is approximately preserved across restarts, and drops whatever
+ * doesn't fit in the budget (which may have shrunk since the entries were
+ * stored).
+ */
+void HTTPSegmentStore::seedPolicies() {
+  vector<entry_t> recovered;
+  recovered.reserve(index.size());
+  for (const auto& entry: index) {
+    recovered.push_back({entry.first, entry.second});
+  }
+  sort(recovered.begin(), recovered.end(), [](const entry_t& lhs, const entry_t& rhs) {
+      return lhs.location.segment != rhs.location.segment ?
+        lhs.location.segment < rhs.location.segment : lhs.location.offset < rhs.location.offset;
+    });
+  for (const entry_t& entry: recovered) {
+    vector<CacheKey> evicted;
+    if (!policies[0]->admit(entry.key, sizeof(record_t) + entry.location.length, evicted)) {
+      index.erase(entry.key);
+    }
+    for (const CacheKey& victim: evicted) {
+      index.erase(victim);
+    }
+    for (size_t i = 1; i < policies.size(); i++) {
+      evicted.clear();
+      policies[i]->admit(entry.key, sizeof(record_t) + entry.location.length, evicted);
+    }
+  }
+}
+
+/**
+ * Opens every segment in the directory, loads the checkpoint, and replays
+ * whatever the checkpoint doesn't account for.  The segments are scanned
+ * in parallel, but their records are indexed in the order they were
+ * appended, so that the newest record for each key wins (and a tombstone
+ * takes with it whatever came before it).  A scan is worth
+ * checkpointing straight away, so it needn't be repeated should the proxy
+ * be restarted before the maintenance thread gets around to it.
+ */
+static const size_t kMaxScanThreads = 8;
+void HTTPSegmentStore::recover() {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  DIR *dir = opendir(directory.c_str());
+  if (dir != NULL) {
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      string name = entry->d_name;
+      if (name.compare(0, kSegmentPrefix.size(), kSegmentPrefix) != 0) continue;
+      uint32_t id = strtoul(name.c_str() + kSegmentPrefix.size(), NULL, 10);
+      shared_ptr<segment_t> segment = openSegment(id, /* create = */ false);
+      if (segment) segments[id] = segment;
+    }
+    closedir(dir);
+  }
+
+  map<uint32_t, uint64_t> replayFrom;
+  uint64_t expired = 0;
+  bool checkpointed = loadCheckpoint(replayFrom, expired);
+  if (!checkpointed) {
+    index.clear();
+    replayFrom.clear();
+    expired = 0;
+  }
+
+  vector<pair<segment_t *, uint64_t> > unscanned;
+  for (const auto& segment: segments) {
+    auto found = replayFrom.find(segment.first);
+    uint64_t offset = found == replayFrom.end() ? 0 : found->second;
+    if (offset < segment.second->size) unscanned.push_back(make_pair(segment.second.get(), offset));
+  }
+
+  vector<vector<pair<CacheKey, location_t> > > scanned(unscanned.size());
+  if (!unscanned.empty()) {
+    size_t numThreads = min<size_t>(unscanned.size(),
+                                    max<size_t>(1, min<size_t>(thread::hardware_concurrency(),
+                                                               kMaxScanThreads)));
+    cout << oslock << "     [Warming up the cache: scanning " << unscanned.size()
+         << " segments " << (checkpointed ? "past the checkpoint" : "in full") << " on "
+         << numThreads << " threads.]" << endl << osunlock;
+    mutex progressLock;
+    size_t finished = 0;
+    ThreadPool pool(numThreads);
+    for (size_t i = 0; i < unscanned.size(); i++) {
+      pool.schedule([this, i, &unscanned, &scanned, &progressLock, &finished]() {
+          scanSegment(*unscanned[i].first, unscanned[i].second, scanned[i]);
+          lock_guard<mutex> lg(progressLock);
+          finished++;
+          if (finished * 10 / unscanned.size() != (finished - 1) * 10 / unscanned.size()) {
+            cout << oslock << "     [Warming up the cache: scanned " << finished << " of "
+                 << unscanned.size() << " segments.]" << endl << osunlock;
+          }
+        });
+    }
+    pool.wait();
+  }
+
+  time_t now = time(NULL);
+  uint64_t records = 0;
+  for (const vector<pair<CacheKey, location_t> >& segmentRecords: scanned) {
+    for (const pair<CacheKey, location_t>& record: segmentRecords) {
+      if (record.second.expiration == kRemoved) {
+        index.erase(record.first);
+      } else if (isDiscardable(record.second.expiration, now)) {
+        index.erase(record.first);
+        expired++;
+      } else {
+        index[record.first] = record.second;
+      }
+    }
+    records += segmentRecords.size();
+  }
+
+  seedPolicies();
+  for (const auto& entry: index) {
+    segments[entry.second.segment]->liveBytes += sizeof(record_t) + entry.second.length;
+  }
+  if (!segments.empty()) {
+    active = segments.rbegin()->second;
+    nextSegmentId = max(nextSegmentId, active->id + 1);
+  }
+  changes = 1; // so the replayed records make it into the next checkpoint
+  if (records > 0) checkpoint();
+
+  long elapsed = chrono::duration_cast<chrono::milliseconds>(
+    chrono::steady_clock::now() - start).count();
+  cout << oslock << "     [Cache warmed up in " << elapsed << "ms: " << index.size()
+       << " entries, " << records << " records replayed, " << expired
+       << " expired entries dropped.]" << endl << osunlock;
+}
+
+/**
+ * Loads the index from the checkpoint, and records how much of each
+ * segment it accounts for in replayFrom.  Entries in segments that have
+ * since been compacted away are dropped, since their records were copied
+ * to a later segment, beyond the part the checkpoint accounts for, and so
+ * are entries past their retention, which are counted in expired.
+ * Returns false if there's no usable checkpoint, including when a segment
+ * has somehow shrunk since it was taken.
+ */
+bool HTTPSegmentStore::loadCheckpoint(map<uint32_t, uint64_t>& replayFrom, uint64_t& expired) {
+  ifstream infile((directory + "/" + kCheckpointName).c_str(), ios::in | ios::binary);
+  checkpoint_t header;
+  if (!infile.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      header.magic != kCheckpointMagic) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < header.segmentCount; i++) {
+    covered_t covered;
+    if (!infile.read(reinterpret_cast<char *>(&covered), sizeof(covered))) return false;
+    nextSegmentId = max(nextSegmentId, covered.id + 1);
+    auto found = segments.find(covered.id);
+    if (found == segments.end()) continue;
+    if (found->second->size < covered.size) return false;
+    replayFrom[covered.id] = covered.size;
+  }
+
+  time_t now = time(NULL);
+  index.reserve(header.entryCount);
+  for (uint64_t i = 0; i < header.entryCount; i++) {
+    entry_t entry;
+    if (!infile.read(reinterpret_cast<char *>(&entry), sizeof(entry))) return false;
+    if (replayFrom.count(entry.location.segment) == 0) continue;
+    if (isDiscardable(entry.location.expiration, now)) {
+      expired++;
+    } else {
+      index[entry.key] = entry.location;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Collects every record in the segment from offset on, in order, into
+ * records, reporting tombstones with an expiration of kRemoved.  The
+ * segment is read sequentially, a large block at a time, rather than with
+ * a pread per record, and the block grows to fit any record larger than
+ * it.  A record that's cut short or fails its checksum (say, because the
+ * proxy died while appending it) ends the segment, and is truncated away
+ * so the next append overwrites it.  Only the segment itself is touched,
+ * so segments can be scanned in parallel.
+ */
+static const size_t kScanBlockSize = 1 << 20;
+void HTTPSegmentStore::scanSegment(segment_t& segment, uint64_t offset,
+                                   vector<pair<CacheKey, location_t> >& records) const {
+  vector<char> block(kScanBlockSize);
+  uint64_t blockStart = 0, blockEnd = 0; // the stretch of the segment held in block
+  while (offset < segment.size) {
+    record_t record;
+    if (offset + sizeof(record) > blockEnd) {
+      ssize_t count = pread(segment.fd, &block[0],
+                            min<uint64_t>(block.size(), segment.size - offset), offset);
+      blockStart = offset;
+      blockEnd = offset + max<ssize_t>(count, 0);
+    }
+
+    bool intact = offset + sizeof(record) <= blockEnd;
+    if (intact) {
+      memcpy(&record, &block[offset - blockStart], sizeof(record));
+      bool tombstone = record.magic == kTombstoneMagic && record.length == 0;
+      intact = (record.magic == kRecordMagic || tombstone) &&
+        offset + sizeof(record) + record.length <= segment.size;
+    }
+
+    if (intact && offset + sizeof(record) + record.length > blockEnd) {
+      uint64_t needed = sizeof(record) + record.length;
+      if (block.size() < needed) block.resize(needed);
+      ssize_t count = pread(segment.fd, &block[0],
+                            min<uint64_t>(block.size(), segment.size - offset), offset);
+      blockStart = offset;
+      blockEnd = offset + max<ssize_t>(count, 0);
+      intact = offset + needed <= blockEnd;
+    }
+
+    if (!intact || !isIntact(record, &block[offset - blockStart + sizeof(record)])) {
+      if (ftruncate(segment.fd, offset) == 0) segment.size = offset;
+      break;
+    }
+
+    int64_t expiration = record.magic == kTombstoneMagic ? kRemoved : record.expiration;
+    location_t location = { segment.id, record.length, offset + sizeof(record),
+                            expiration, record.generated };
+    records.push_back(make_pair(record.key, location));
+    offset += sizeof(record) + record.length;
+  }
+}
+
+/**
+ * Writes the index out to a temporary file and renames it into place, so
+ * a crash partway through leaves the previous checkpoint intact.  Holding
+ * appendLock while the index is copied guarantees the segment sizes
+ * recorded alongside it are exactly the ones it accounts for.  Those
+ * stretches of the segments are flushed to disk before the checkpoint is,
+ * and the checkpoint before it's renamed into place (and the rename
+ * before the directory is flushed), so a crash never leaves a checkpoint
+ * accounting for records that didn't make it to disk.
+ */
+void HTTPSegmentStore::checkpoint() {
+  vector<entry_t> entries;
+  vector<covered_t> covered;
+  vector<shared_ptr<segment_t> > flushed;
+  {
+    lock_guard<mutex> al(appendLock);
+    lock_guard<mutex> il(indexLock);
+    if (changes == 0) return;
+    changes = 0;
+    entries.reserve(index.size());
+    for (const auto& entry: index) {
+      entries.push_back({entry.first, entry.second});
+    }
+    for (const auto& segment: segments) {
+      covered.push_back({segment.first, 0, segment.second->size});
+      flushed.push_back(segment.second);
+    }
+  }
+
+  string path = directory + "/" + kCheckpointName;
+  string temporaryPath = path + ".tmp";
+  checkpoint_t header = { kCheckpointMagic, uint32_t(covered.size()), entries.size() };
+  bool written = true;
+  for (const shared_ptr<segment_t>& segment: flushed) {
+    if (fdatasync(segment->fd) != 0) written = false;
+  }
+
+  int fd = -1;
+  if (written) {
+    fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+              kSegmentPermissions);
+    written = fd >= 0 &&
+      writeBuffer(fd, &header, sizeof(header), 0) &&
+      writeBuffer(fd, covered.data(), covered.size() * sizeof(covered_t), sizeof(header)) &&
+      writeBuffer(fd, entries.data(), entries.size() * sizeof(entry_t),
+                  sizeof(header) + covered.size() * sizeof(covered_t)) &&
+      fdatasync(fd) == 0;
+  }
+  if (fd >= 0 && close(fd) != 0) written = false;
+  written = written && rename(temporaryPath.c_str(), path.c_str()) == 0;
+  if (written) {
+    int dirfd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    written = dirfd >= 0 && fsync(dirfd) == 0;
+    if (dirfd >= 0) close(dirfd);
+  }
+
+  if (!written) {
+    lock_guard<mutex> il(indexLock);
+    changes++; // try again next time
+  }
+}
+
+/**
+ * Compacts every segment other than the active one that's at least half
+ * dead space.
+ */
+void HTTPSegmentStore::compact() {
+  vector<uint32_t> candidates;
+  {
+    lock_guard<mutex> al(appendLock);
+    lock_guard<mutex> il(indexLock);
+    for (const auto& segment: segments) {
+      if (segment.second == active) continue;
+      if (segment.second->liveBytes * 2 <= segment.second->size) candidates.push_back(segment.first);
+    }
+  }
+
+  for (uint32_t id: candidates) {
+    compactSegment(id);
+  }
+}
+
+/**
+ * Copies the live records in the identified segment that are still within
+ * their retention to the active one, and deletes the segment once nothing
+ * refers to it.  Anyone in the middle of reading from it holds on to it
+ * (and so its descriptor) until they're done.
+ */
+void HTTPSegmentStore::compactSegment(uint32_t id) {
+  shared_ptr<segment_t> segment;
+  vector<entry_t> live;
+  {
+    lock_guard<mutex> il(indexLock);
+    auto found = segments.find(id);
+    if (found == segments.end()) return;
+    segment = found->second;
+    for (const auto& entry: index) {
+      if (entry.second.segment == id) live.push_back({entry.first, entry.second});
+    }
+  }
+
+  time_t now = time(NULL);
+  string data;
+  for (const entry_t& entry: live) {
+    const location_t& location = entry.location;
+    if (isDiscardable(location.expiration, now)) {
+      lock_guard<mutex> al(appendLock);
+      lock_guard<mutex> il(indexLock);
+      auto found = index.find(entry.key);
+      if (found != index.end() && found->second.segment == id &&
+          found->second.offset == location.offset) {
+        drop(entry.key);
+        for (const auto& policy: policies) policy->remove(entry.key);
+      }
+      continue;
+    }
+
+    data.resize(location.length);
+    if (pread(segment->fd, &data[0], location.length, location.offset) !=
+        ssize_t(location.length)) {
+      continue;
+    }
+    appendRecord(entry.key, data.data(), data.size(), location.expiration, location.generated,
+                 &location);
+  }
+
+  lock_guard<mutex> il(indexLock);
+  if (segment->liveBytes > 0) return;
+  segments.erase(id);
+  unlink(getSegmentPath(id).c_str());
+  changes++;
+}
+
+/**
+ * Checkpoints and compacts the store every maintenanceInterval seconds,
+ * until the store is destroyed.  Checkpointing first means a tombstone is
+ * accounted for by a checkpoint before compaction can delete the segment
+ * holding it, so the record it cancelled can't come back on replay.
+ */
+void HTTPSegmentStore::maintain() {
+  unique_lock<mutex> ul(maintenanceLock);
+  while (!stopping) {
+    maintenanceCondition.wait_for(ul, chrono::seconds(maintenanceInterval));
+    if (stopping) break;
+    ul.unlock();
+    checkpoint();
+    compact();
+    ul.lock();
+  }
+}
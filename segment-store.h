@@ -0,0 +1,243 @@
+/**
+ * File: segment-store.h
+ * ---------------------
+ * Defines the HTTPSegmentStore class, which is where the cache keeps its
+ * entries on disk.  Entries are appended, one record after another, to a
+ * handful of large segment files, and an index held in memory maps each
+ * key to the segment, offset, and length of its most recent record (along
+ * with when the entry expires, so that can be checked without touching the
+ * disk).  Finding an entry therefore costs one probe of the index, and
+ * reading it one pread, however many entries there are.
+ *
+ * Records are never rewritten.  A key that's stored again simply gets a
+ * newer record, and the one it supersedes becomes dead space, which a
+ * background thread reclaims by compacting segments that are mostly dead:
+ * their live records are copied to the end of the newest segment and the
+ * old segment is deleted.  The same thread periodically checkpoints the
+ * index to disk, so a restarted proxy needs only to load the checkpoint and
+ * replay whatever was appended after it, rather than reading every record.
+ * Segments that need replaying (all of them, when there's no usable
+ * checkpoint) are scanned in parallel, and entries past their retention
+ * are dropped as they're recovered.
+ * Records are kept for a while after they expire, so that whoever finds
+ * one stale can ask the origin whether it's still good, rather than
+ * fetching it all over again.
+ *
+ * Every record carries a checksum, so a record that was only partly
+ * written when the proxy died (or has since been corrupted) is never
+ * replayed.  Removing a key appends a tombstone record, so the record it
+ * removed isn't resurrected by a replay either.  A checkpoint is only put
+ * in place once the segment contents it accounts for, and the checkpoint
+ * itself, have reached the disk.
+ *
+ * The store is kept within a budget of bytes and entries by an
+ * EvictionPolicy, which is consulted whenever an entry is appended.  The
+ * policies that weren't chosen are run alongside it, on their own
+ * bookkeeping alone, so the hit ratio each would have achieved on the same
+ * traffic can be compared with the chosen one's.
+ */
+
+#ifndef _http_segment_store_
+#define _http_segment_store_
+
+#include <cstddef>      // for size_t
+#include <cstdint>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>      // for pair
+#include <vector>
+#include <sys/types.h>  // for ssize_t
+
+#include "eviction-policy.h"
+
+class HTTPSegmentStore {
+ public:
+
+/**
+ * Where the data of a key's record lies, and the expiration and
+ * generation times it was stored with.
+ */
+  typedef struct {
+    uint32_t segment;
+    uint32_t length;
+    uint64_t offset;
+    int64_t expiration;
+    int64_t generated;
+  } location_t;
+
+/**
+ * The hit and miss counts of a policy, along with how much it's keeping.
+ * Only the active policy's entries are actually in the store.
+ */
+  typedef struct {
+    std::string policy;
+    bool active;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t entries;
+    uint64_t bytes;
+  } stats_t;
+
+/**
+ * Opens the store kept in the supplied directory (which must already
+ * exist), rebuilding the index from the most recent checkpoint and the
+ * records appended since, and reporting how long that took.  The supplied policy keeps the live records
+ * within maxBytes bytes and maxEntries entries, and records are discarded
+ * staleRetention seconds after they expire.  Segments are rolled over
+ * once they grow past segmentSize bytes, and the store is checkpointed and
+ * compacted every maintenanceInterval seconds.
+ */
+  HTTPSegmentStore(const std::string& directory,
+                   EvictionPolicy::Kind policy = EvictionPolicy::kTinyLFU,
+                   uint64_t maxBytes = 1ULL << 30, uint64_t maxEntries = 1 << 20,
+                   int staleRetention = 0, size_t segmentSize = 64 << 20, int maintenanceInterval = 30);
+
+/**
+ * Stops the maintenance thread and checkpoints the index one last time.
+ */
+  ~HTTPSegmentStore();
+
+/**
+ * Populates location with where the data stored under key lies and
+ * returns true, or returns false if nothing is stored under key (in which
+ * case an entry past its retention is forgotten).  The entry may well have
+ * expired, which is for the caller to check.  The lookup counts as a hit
+ * or a miss accordingly.
+ */
+  bool find(const CacheKey& key, location_t& location);
+
+/**
+ * Like find, except that the lookup neither counts as an access nor
+ * forgets anything, for callers taking a second look at an entry they've
+ * already found.
+ */
+  bool peek(const CacheKey& key, location_t& location) const;
+
+/**
+ * Counts a hit on key that was served from elsewhere (from memory, say),
+ * so the policies know it's still in use.  Hits are dropped rather than
+ * waited on when the index is busy.
+ */
+  void touch(const CacheKey& key);
+
+/**
+ * Appends a record holding the supplied data under key, superseding any
+ * record already stored under it.  Returns false if the policy declined
+ * to admit it, or it couldn't be written.
+ */
+  bool append(const CacheKey& key, const std::string& data, time_t expiration, time_t generated);
+
+/**
+ * A record to be appended as part of a batch.  appended is set to
+ * whether it was, just as the four-argument append would have returned.
+ */
+  typedef struct {
+    CacheKey key;
+    const std::string *data;
+    time_t expiration;
+    time_t generated;
+    bool appended;
+  } pending_t;
+
+/**
+ * Appends a record for each of the pending records, in order, writing as
+ * many of them at once as fit in the active segment.
+ */
+  void append(std::vector<pending_t>& batch);
+
+/**
+ * Forgets whatever's stored under key, appending a tombstone so it stays
+ * forgotten across a restart.
+ */
+  void remove(const CacheKey& key);
+
+/**
+ * Reads up to length bytes of the data at location, starting offset bytes
+ * in, into buffer.  Returns what pread does.
+ */
+  ssize_t read(const location_t& location, void *buffer, size_t length, size_t offset = 0) const;
+
+/**
+ * Returns a descriptor for the segment holding the data at location,
+ * which the caller must close, or -1 if the segment is gone.  The
+ * descriptor remains usable even if the segment is compacted away.
+ */
+  int duplicate(const location_t& location) const;
+
+/**
+ * Returns the counters of every policy, the active one first.
+ */
+  std::vector<stats_t> getStats() const;
+
+ private:
+  typedef struct segment {
+    uint32_t id;
+    int fd;
+    uint64_t size;         // bytes of records appended so far
+    uint64_t liveBytes;    // bytes of records the index still refers to
+    ~segment();
+  } segment_t;
+
+  typedef struct {
+    uint32_t magic;        // distinguishes records from tombstones
+    uint32_t length;       // of the data that follows
+    uint32_t checksum;     // CRC-32C of the record (with this zeroed) and its data
+    uint32_t unused;
+    CacheKey key;
+    int64_t expiration;
+    int64_t generated;
+  } record_t;
+
+  std::string directory;
+  int staleRetention;
+  size_t segmentSize;
+  int maintenanceInterval;
+
+  mutable std::mutex indexLock;    // guards index, segments, liveBytes, and policies
+  std::unordered_map<CacheKey, location_t> index;
+  std::vector<std::unique_ptr<EvictionPolicy> > policies; // the active one first
+  std::map<uint32_t, std::shared_ptr<segment_t> > segments;
+  uint64_t changes;                // since the last checkpoint
+
+  std::mutex appendLock;           // serializes appends, and is acquired before indexLock
+  std::shared_ptr<segment_t> active;
+  uint32_t nextSegmentId;          // never reused, so a stale checkpoint can't mistake one for another
+
+  std::mutex maintenanceLock;
+  std::condition_variable maintenanceCondition;
+  bool stopping;
+  std::thread maintainer;
+
+  std::shared_ptr<segment_t> getSegment(uint32_t id) const;
+  std::shared_ptr<segment_t> openSegment(uint32_t id, bool create);
+  std::string getSegmentPath(uint32_t id) const;
+  bool appendRecord(const CacheKey& key, const char *data, size_t length, time_t expiration,
+                    time_t generated, const location_t *replacing);
+  bool rollOver(size_t recordSize);
+  static void sealRecord(record_t& record, const char *data);
+  static bool isIntact(const record_t& record, const char *data);
+  bool isDiscardable(int64_t expiration, time_t now) const;
+  void forget(const location_t& location);
+  void drop(const CacheKey& key);
+  bool admit(const CacheKey& key, uint64_t size);
+  void recordLookup(const CacheKey& key, const location_t *found);
+  void seedPolicies();
+  void recover();
+  bool loadCheckpoint(std::map<uint32_t, uint64_t>& replayFrom, uint64_t& expired);
+  void scanSegment(segment_t& segment, uint64_t offset,
+                   std::vector<std::pair<CacheKey, location_t> >& records) const;
+  void checkpoint();
+  void compact();
+  void compactSegment(uint32_t id);
+  void maintain();
+
+  HTTPSegmentStore(const HTTPSegmentStore& original) = delete;
+  HTTPSegmentStore& operator=(const HTTPSegmentStore& rhs) = delete;
+};
+
+#endif
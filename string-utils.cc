@@ -6,6 +6,7 @@ using namespace std;
 string trim(string &str)
 {
   size_t first = str.find_first_not_of(' ');
+  if (first == string::npos) return "";
   size_t last = str.find_last_not_of(' ');
   return str.substr(first, (last - first + 1));
 }
@@ -22,6 +23,6 @@ std::string toLowerCase(const std::string &str)
   locale loc;
   string::size_type len = str.length();
   for (string::size_type i=0; i<len; i++)
-    std::tolower(tmp[i],loc);
+    tmp[i] = std::tolower(tmp[i],loc);
   return tmp;
 }
@@ -0,0 +1,124 @@
+/**
+ * File: string-view.h
+ * -------------------
+ * Defines the StringView class, which is a read-only window onto
+ * characters owned by someone else (typically a connection's receive
+ * buffer).  It's what std::string_view would be, were it available in
+ * the dialect of C++ the proxy is built with, and it exists so parsing
+ * can slice and trim without allocating.  A StringView is only valid for
+ * as long as the characters it refers to are neither moved nor modified.
+ */
+
+#ifndef _string_view_
+#define _string_view_
+
+#include <cstddef>     // for size_t
+#include <cstring>     // for memchr, memcmp, strlen
+#include <ostream>
+#include <string>
+
+#include "scan.h"
+
+class StringView {
+ public:
+  static const size_t npos = static_cast<size_t>(-1);
+
+  StringView() : ptr(NULL), length(0) {}
+  StringView(const char *data, size_t size) : ptr(data), length(size) {}
+  StringView(const std::string& str) : ptr(str.data()), length(str.size()) {}
+  StringView(const char *str) : ptr(str), length(strlen(str)) {}
+
+  const char *data() const { return ptr; }
+  size_t size() const { return length; }
+  bool empty() const { return length == 0; }
+  char operator[](size_t index) const { return ptr[index]; }
+  const char *begin() const { return ptr; }
+  const char *end() const { return ptr + length; }
+
+/**
+ * Returns the window onto the count characters starting at pos (or
+ * onto all of those remaining, if there are fewer than count).
+ */
+  StringView substr(size_t pos, size_t count = npos) const {
+    if (pos > length) pos = length;
+    if (count > length - pos) count = length - pos;
+    return StringView(ptr + pos, count);
+  }
+
+/**
+ * Returns the position of the first occurrence of ch at or beyond pos,
+ * or npos if there isn't one.
+ */
+  size_t find(char ch, size_t pos = 0) const {
+    if (pos >= length) return npos;
+    const void *found = memchr(ptr + pos, ch, length - pos);
+    return found == NULL ? npos : (const char *) found - ptr;
+  }
+
+/**
+ * Returns the position of the first occurrence of needle at or beyond
+ * pos, or npos if there isn't one.
+ */
+  size_t find(const StringView& needle, size_t pos = 0) const {
+    if (needle.length == 0) return pos <= length ? pos : npos;
+    while (pos + needle.length <= length) {
+      size_t candidate = find(needle.ptr[0], pos);
+      if (candidate == npos || candidate + needle.length > length) return npos;
+      if (memcmp(ptr + candidate, needle.ptr, needle.length) == 0) return candidate;
+      pos = candidate + 1;
+    }
+    return npos;
+  }
+
+/**
+ * Returns the window with all leading and trailing spaces and tabs
+ * excluded.
+ */
+  StringView trim() const {
+    size_t first = 0, last = length;
+    while (first < last && isBlank(ptr[first])) first++;
+    while (last > first && isBlank(ptr[last - 1])) last--;
+    return StringView(ptr + first, last - first);
+  }
+
+  bool equals(const StringView& other) const {
+    return length == other.length && (length == 0 || memcmp(ptr, other.ptr, length) == 0);
+  }
+
+/**
+ * Compares the two windows, treating the ASCII letters case-insensitively,
+ * which is how header names and most header values are compared.
+ */
+  bool equalsIgnoreCase(const StringView& other) const {
+    return length == other.length && ::equalsIgnoreCase(ptr, other.ptr, length);
+  }
+
+  std::string toString() const { return std::string(ptr, length); }
+
+/**
+ * Returns a copy of the characters with the ASCII letters lowercased,
+ * without paying for the locale-aware tolower.
+ */
+  std::string toLowerCaseString() const {
+    std::string lowered(ptr, length);
+    for (size_t i = 0; i < length; i++) lowered[i] = toLower(lowered[i]);
+    return lowered;
+  }
+
+  static constexpr char toLower(char ch) { return ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch; }
+
+ private:
+  const char *ptr;
+  size_t length;
+
+  static bool isBlank(char ch) { return ch == ' ' || ch == '\t'; }
+};
+
+inline bool operator==(const StringView& lhs, const StringView& rhs) { return lhs.equals(rhs); }
+inline bool operator!=(const StringView& lhs, const StringView& rhs) { return !lhs.equals(rhs); }
+
+inline std::ostream& operator<<(std::ostream& os, const StringView& sv) {
+  return os.write(sv.data(), sv.size());
+}
+
+#endif
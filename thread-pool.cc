@@ -16,7 +16,9 @@ ThreadPool::ThreadPool(size_t numThreads)
     sem_wait_task(new semaphore(0)),
     sem_worker_res(new semaphore(numThreads)),
     sem_wait(new semaphore(0)),
-    num_of_task(0)
+    sem_exited(new semaphore(0)),
+    num_of_task(0),
+    done(false)
 {
   for (auto &worker : workers){
       worker.is_working = false;
@@ -27,6 +29,25 @@ ThreadPool::ThreadPool(size_t numThreads)
   thread t([this]() -> void { this->dispatcher(); });
   t.detach();
 }
+
+/**
+ * The threads are detached, so each of them signals sem_exited on its way
+ * out, and the semaphores they block on can't be destroyed until every one
+ * of them has.  The dispatcher is stopped first, so that no further
+ * workers are activated while the active ones are being stopped.
+ */
+ThreadPool::~ThreadPool()
+{
+  done = true;
+  sem_wait_task->signal();  // in case the dispatcher is waiting on a task
+  sem_worker_res->signal(); // ...or on a free worker
+  sem_exited->wait();
+  for (auto &worker : workers) {
+    if (!worker.is_active) continue;
+    worker.sem_wait_task->signal();
+    sem_exited->wait();
+  }
+}
 void ThreadPool::schedule(const function<void(void)> &thunk)
 {
   unique_lock<mutex> lock(this->m);
@@ -45,6 +66,10 @@ void ThreadPool::dispatcher(void)
   while(true){
     sem_wait_task->wait();
     sem_worker_res->wait();
+    if (done) {
+      sem_exited->signal();
+      return;
+    }
     worker_mutex.lock();
     size_t worker_len = workers.size();
     size_t idx;
@@ -75,6 +100,10 @@ void ThreadPool::do_task(const size_t index)
     unique_ptr<semaphore>& sem_copy = workers[index].sem_wait_task;
     task_mutex.unlock();
     sem_copy->wait();
+    if (done) {
+      sem_exited->signal();
+      return;
+    }
     workers[index].thunk();
     workers[index].is_working = false;
     sem_worker_res->signal();
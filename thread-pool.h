@@ -30,6 +30,13 @@ public:
  */
   ThreadPool(size_t numThreads);
 
+  /**
+ * Shuts down the dispatcher and every worker thread, waiting for any
+ * thunk that's already running to finish.  Thunks that haven't yet
+ * been started are discarded.
+ */
+  ~ThreadPool();
+
   /**
  * Schedules the provided thunk (which is something that can
  * be invoked as a zero-argument function without a return value)
@@ -57,7 +64,9 @@ private:
   std::unique_ptr<semaphore> sem_wait_task;
   std::unique_ptr<semaphore> sem_worker_res;
   std::unique_ptr<semaphore> sem_wait;
+  std::unique_ptr<semaphore> sem_exited;
   std::atomic_int num_of_task;
+  std::atomic<bool> done;
   std::mutex m;
   std::mutex worker_mutex;
   std::mutex task_mutex;
@@ -0,0 +1,254 @@
+/**
+ * File: tunnel.cc
+ * ---------------
+ * Presents the implementation of the HTTPTunnel class.
+ */
+
+#include "tunnel.h"
+
+#include <cerrno>
+#include <iostream>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "ostreamlock.h"
+
+using namespace std;
+
+const string HTTPTunnel::kEstablishedResponse = "HTTP/1.1 200 Connection Established\r\n\r\n";
+
+static const size_t kSpliceSize = 64 * 1024;
+static const size_t kRelayBufferSize = 16 * 1024;
+static const size_t kNoTimer = 0;
+
+HTTPTunnel::HTTPTunnel(EventLoop& loop, int clientfd, int originfd, const string& toClient,
+                       const string& toOrigin, const string& description, long idleTimeout) :
+  loop(loop), clientfd(clientfd), originfd(originfd), description(description),
+  idleTimeout(idleTimeout), splicing(loop.getBackend() == EventLoop::kEpoll), clientEvents(0), originEvents(0), idleTimer(kNoTimer),
+  lastActivity(chrono::steady_clock::now()), closed(false) {
+  upstream.from = clientfd;
+  upstream.to = originfd;
+  upstream.pending = toOrigin;
+  downstream.from = originfd;
+  downstream.to = clientfd;
+  downstream.pending = toClient;
+  for (direction_t *direction: {&upstream, &downstream}) {
+    direction->pendingOffset = 0;
+    direction->sourceClosed = false;
+    direction->shutDown = false;
+    direction->bytesRelayed = 0;
+  }
+}
+
+HTTPTunnel::~HTTPTunnel() {
+  if (!closed) {
+    ::close(clientfd);
+    ::close(originfd);
+  }
+}
+
+/**
+ * Both sockets may still be watched by the connection that's handing
+ * them over, in which case watching them here replaces its handlers.
+ */
+void HTTPTunnel::start() {
+  if (splicing && (!upstream.pipe.open(/* nonblocking = */ true) ||
+                   !downstream.pipe.open(/* nonblocking = */ true))) {
+    cerr << oslock << "     [Could not create the pipes for the tunnel to "
+         << description << ".]" << endl << osunlock;
+    closed = true;
+    loop.unwatch(clientfd);
+    loop.unwatch(originfd);
+    ::close(clientfd);
+    ::close(originfd);
+    return;
+  }
+
+  shared_ptr<HTTPTunnel> self = shared_from_this();
+  runGuarded([this, self]() {
+      loop.watch(clientfd, 0, [self](uint32_t events) {
+          self->runGuarded([self]() { self->onEvent(); });
+        });
+      loop.watch(originfd, 0, [self](uint32_t events) {
+          self->runGuarded([self]() { self->onEvent(); });
+        });
+      armIdleTimer(idleTimeout);
+      onEvent(); // sends the pending bytes and establishes the initial interests
+    });
+}
+
+/** Private methods **/
+
+/**
+ * Runs one step of servicing the tunnel, closing it should the step
+ * throw, so that it's unregistered (and released) rather than left
+ * holding both sockets.
+ */
+void HTTPTunnel::runGuarded(const function<void(void)>& step) {
+  try {
+    step();
+  } catch (const exception& e) {
+    cerr << oslock << "Unexpected failure while servicing the tunnel to " << description
+         << ": " << e.what() << endl << osunlock;
+    close();
+  } catch (...) {
+    cerr << oslock << "Unexpected failure while servicing the tunnel to " << description
+         << "." << endl << osunlock;
+    close();
+  }
+}
+
+/**
+ * Whichever socket is ready, both directions are advanced as far as they
+ * can go, and the interest sets are then recomputed from scratch.  That's
+ * a few more system calls than strictly necessary, but it keeps the state
+ * machine small, and the splices that find nothing to do are cheap.
+ */
+void HTTPTunnel::onEvent() {
+  if (closed) return;
+  size_t before = upstream.bytesRelayed + downstream.bytesRelayed;
+  if (!advance(upstream) || !advance(downstream)) {
+    close();
+    return;
+  }
+
+  if (upstream.bytesRelayed + downstream.bytesRelayed != before) {
+    lastActivity = chrono::steady_clock::now();
+  }
+
+  if (upstream.shutDown && downstream.shutDown) {
+    close(); // both sides have finished sending
+    return;
+  }
+
+  updateInterest();
+}
+
+/**
+ * Moves as much as possible in the supplied direction: first whatever is
+ * pending, then alternately filling the pipe from the source and draining
+ * it into the destination (or, when not splicing, alternately receiving
+ * into pending and sending it along).  Once the source reaches end of file
+ * and the pipe has been drained, the end of file is passed along by
+ * shutting down the destination's write side.  Returns false if the tunnel
+ * should be torn down because either socket failed.
+ */
+bool HTTPTunnel::advance(direction_t& direction) {
+  while (true) {
+    while (direction.pendingOffset < direction.pending.size()) {
+      ssize_t count = loop.send(direction.to, direction.pending.data() + direction.pendingOffset,
+                                direction.pending.size() - direction.pendingOffset, MSG_NOSIGNAL);
+      if (count > 0) {
+        direction.pendingOffset += count;
+        direction.bytesRelayed += count;
+      } else if (count < 0 && errno == EINTR) {
+        continue;
+      } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+      } else {
+        return false;
+      }
+    }
+
+    if (splicing || direction.sourceClosed) break;
+    char buffer[kRelayBufferSize];
+    ssize_t count = loop.receive(direction.from, buffer, sizeof(buffer));
+    if (count > 0) {
+      direction.pending.assign(buffer, count);
+      direction.pendingOffset = 0;
+      continue;
+    }
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (count < 0) return false;
+    direction.sourceClosed = true;
+  }
+
+  while (splicing) {
+    if (direction.pipe.buffered() > 0) {
+      size_t buffered = direction.pipe.buffered();
+      if (direction.pipe.drain(direction.to) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return false;
+      }
+      direction.bytesRelayed += buffered - direction.pipe.buffered();
+      if (direction.pipe.buffered() > 0) return true; // destination isn't keeping up
+    }
+
+    if (direction.sourceClosed) break;
+    ssize_t count = direction.pipe.fill(direction.from, kSpliceSize);
+    if (count > 0) continue;
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (count < 0) return false;
+    direction.sourceClosed = true;
+  }
+
+  if (!direction.shutDown) {
+    loop.shutdownWrites(direction.to);
+    direction.shutDown = true;
+  }
+
+  return true;
+}
+
+bool HTTPTunnel::isBacklogged(const direction_t& direction) const {
+  return direction.pendingOffset < direction.pending.size() || direction.pipe.buffered() > 0;
+}
+
+/**
+ * A socket is watched for readability only while the direction reading
+ * from it has room to take more, and for writability only while the
+ * direction writing to it has something backed up.
+ */
+void HTTPTunnel::updateInterest() {
+  uint32_t events = 0;
+  if (!upstream.sourceClosed && !isBacklogged(upstream)) events |= EPOLLIN;
+  if (isBacklogged(downstream)) events |= EPOLLOUT;
+  if (events != clientEvents) {
+    clientEvents = events;
+    loop.modify(clientfd, events);
+  }
+
+  events = 0;
+  if (!downstream.sourceClosed && !isBacklogged(downstream)) events |= EPOLLIN;
+  if (isBacklogged(upstream)) events |= EPOLLOUT;
+  if (events != originEvents) {
+    originEvents = events;
+    loop.modify(originfd, events);
+  }
+}
+
+/**
+ * Rather than being rearmed on every relayed byte, the idle timer fires
+ * periodically and checks how long it's been since the last one, rearming
+ * itself for whatever's left of the timeout if there's been activity since.
+ * The timer only holds a weak reference, so it never keeps a tunnel alive.
+ */
+void HTTPTunnel::armIdleTimer(long milliseconds) {
+  weak_ptr<HTTPTunnel> weak = shared_from_this();
+  idleTimer = loop.addTimer(milliseconds, [weak]() -> void {
+      shared_ptr<HTTPTunnel> self = weak.lock();
+      if (!self || self->closed) return;
+      self->idleTimer = kNoTimer;
+      long idle = chrono::duration_cast<chrono::milliseconds>
+        (chrono::steady_clock::now() - self->lastActivity).count();
+      if (idle >= self->idleTimeout) {
+        self->close();
+      } else {
+        self->armIdleTimer(self->idleTimeout - idle);
+      }
+    });
+}
+
+void HTTPTunnel::close() {
+  if (closed) return;
+  closed = true;
+  loop.cancelTimer(idleTimer);
+  idleTimer = kNoTimer;
+  cout << oslock << "     [Tunnel to " << description << " closed after relaying "
+       << upstream.bytesRelayed << " bytes up and " << downstream.bytesRelayed
+       << " bytes down.]" << endl << osunlock;
+  loop.unwatch(clientfd);
+  loop.unwatch(originfd);
+  ::close(clientfd);
+  ::close(originfd);
+}
@@ -0,0 +1,91 @@
+/**
+ * File: tunnel.h
+ * --------------
+ * Defines the HTTPTunnel class, which relays the raw bytes of a CONNECT
+ * tunnel (typically a TLS session) between a client and an origin server
+ * on behalf of an EventLoop.  Bytes are spliced from one socket to the
+ * other through a pipe per direction, so they never pass through user space,
+ * and no thread is ever dedicated to a tunnel, however long it stays open.
+ * With an io_uring loop, which does the receiving and sending itself, the
+ * bytes are relayed through a buffer per direction instead.
+ */
+
+#ifndef _http_tunnel_
+#define _http_tunnel_
+
+#include <chrono>     // for steady_clock
+#include <cstddef>    // for size_t
+#include <cstdint>    // for uint32_t
+#include <functional> // for function
+#include <memory>     // for enable_shared_from_this
+#include <string>
+
+#include "event-loop.h"
+#include "zero-copy.h"
+
+class HTTPTunnel: public std::enable_shared_from_this<HTTPTunnel> {
+ public:
+
+/**
+ * The response that tells the client its tunnel has been established.
+ */
+  static const std::string kEstablishedResponse;
+
+/**
+ * Constructs a tunnel between the two supplied (already connected and
+ * non-blocking) sockets, which the tunnel takes ownership of.  toClient and
+ * toOrigin are sent ahead of anything relayed in the same direction (which
+ * is how the 200 response and any bytes the client sent right behind its
+ * CONNECT request get through).  The tunnel is closed once nothing has
+ * moved in either direction for idleTimeout milliseconds.
+ */
+  HTTPTunnel(EventLoop& loop, int clientfd, int originfd, const std::string& toClient,
+             const std::string& toOrigin, const std::string& description,
+             long idleTimeout = 60000);
+  ~HTTPTunnel();
+
+/**
+ * Registers both sockets with the event loop, which must be the calling
+ * thread's.  From then on, the tunnel keeps itself alive until it closes.
+ */
+  void start();
+
+ private:
+  typedef struct {
+    int from;
+    int to;
+    std::string pending;     // sent ahead of everything spliced (or the bytes being relayed)
+    size_t pendingOffset;
+    SplicePipe pipe;         // left closed when relaying through pending
+    bool sourceClosed;       // from has reached end of file
+    bool shutDown;           // ...and to has been told so
+    size_t bytesRelayed;
+  } direction_t;
+
+  EventLoop& loop;
+  int clientfd;
+  int originfd;
+  std::string description;
+  long idleTimeout;
+  bool splicing;
+  direction_t upstream;      // client to origin
+  direction_t downstream;    // origin to client
+  uint32_t clientEvents;
+  uint32_t originEvents;
+  size_t idleTimer;
+  std::chrono::steady_clock::time_point lastActivity;
+  bool closed;
+
+  void runGuarded(const std::function<void(void)>& step);
+  void onEvent();
+  bool advance(direction_t& direction);
+  bool isBacklogged(const direction_t& direction) const;
+  void updateInterest();
+  void armIdleTimer(long milliseconds);
+  void close();
+
+  HTTPTunnel(const HTTPTunnel& original) = delete;
+  HTTPTunnel& operator=(const HTTPTunnel& rhs) = delete;
+};
+
+#endif
@@ -0,0 +1,120 @@
+/**
+ * File: zero-copy.cc
+ * ------------------
+ * Presents the implementation of the SplicePipe class and the splice
+ * and sendfile helpers exported by zero-copy.h.
+ */
+
+#include "zero-copy.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+using namespace std;
+
+static const size_t kSpliceChunkSize = 64 * 1024; // the default pipe capacity
+
+SplicePipe::SplicePipe() : nonblocking(false), bufferedBytes(0) {
+  fds[0] = fds[1] = -1;
+}
+
+SplicePipe::~SplicePipe() {
+  close();
+}
+
+bool SplicePipe::open(bool nonblocking) {
+  if (isOpen()) return true;
+  this->nonblocking = nonblocking;
+  bufferedBytes = 0;
+  int flags = O_CLOEXEC | (nonblocking ? O_NONBLOCK : 0);
+  if (pipe2(fds, flags) < 0) {
+    fds[0] = fds[1] = -1;
+    return false;
+  }
+
+  return true;
+}
+
+void SplicePipe::close() {
+  if (!isOpen()) return;
+  ::close(fds[0]);
+  ::close(fds[1]);
+  fds[0] = fds[1] = -1;
+  bufferedBytes = 0;
+}
+
+ssize_t SplicePipe::fill(int infd, size_t max) {
+  unsigned int flags = SPLICE_F_MOVE | (nonblocking ? SPLICE_F_NONBLOCK : 0);
+  ssize_t count;
+  do {
+    count = splice(infd, NULL, fds[1], NULL, min(max, kSpliceChunkSize), flags);
+  } while (count < 0 && errno == EINTR);
+  if (count > 0) bufferedBytes += count;
+  return count;
+}
+
+ssize_t SplicePipe::drain(int outfd) {
+  unsigned int flags = SPLICE_F_MOVE | (nonblocking ? SPLICE_F_NONBLOCK : 0);
+  size_t total = 0;
+  while (bufferedBytes > 0) {
+    ssize_t count = splice(fds[0], NULL, outfd, NULL, bufferedBytes, flags);
+    if (count > 0) {
+      bufferedBytes -= count;
+      total += count;
+    } else if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (total > 0) {
+      break; // report progress now, and the failure on the next call
+    } else {
+      return -1;
+    }
+  }
+
+  return total;
+}
+
+/**
+ * Each worker thread holds on to its own pipe for the life of the thread,
+ * so the blocking relay path doesn't create and destroy one per payload.
+ * A relay that fails partway through leaves the pipe in an unknown state,
+ * so it's closed and recreated the next time around.
+ */
+bool spliceCompletely(int infd, int outfd, size_t count) {
+  static thread_local SplicePipe pipe;
+  if (!pipe.open(/* nonblocking = */ false)) return false;
+  while (count > 0) {
+    ssize_t filled = pipe.fill(infd, count);
+    if (filled <= 0) {
+      pipe.close();
+      return false;
+    }
+
+    count -= filled;
+    while (pipe.buffered() > 0) {
+      if (pipe.drain(outfd) <= 0) {
+        pipe.close();
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool sendfileCompletely(int outfd, int infd, off_t offset, size_t count) {
+  while (count > 0) {
+    ssize_t sent = sendfile(outfd, infd, &offset, count);
+    if (sent > 0) {
+      count -= sent;
+    } else if (sent < 0 && errno == EINTR) {
+      continue;
+    } else {
+      return false;
+    }
+  }
+
+  return true;
+}
@@ -0,0 +1,84 @@
+/**
+ * File: zero-copy.h
+ * -----------------
+ * Defines the SplicePipe class and a pair of helper functions that move
+ * payload bytes between descriptors entirely within the kernel, by way of
+ * splice and sendfile, rather than copying them through user space buffers
+ * and iostreams.  Large, uncached payloads are relayed this way, and cache
+ * hits are published straight from the cache entry files.
+ */
+
+#ifndef _zero_copy_
+#define _zero_copy_
+
+#include <cstddef>       // for size_t
+#include <sys/types.h>   // for ssize_t, off_t
+
+class SplicePipe {
+ public:
+
+/**
+ * Constructs a SplicePipe without creating the underlying pipe.  That's
+ * deferred until open is called, so that an object that may never relay a
+ * large payload doesn't pay two descriptors for the privilege.
+ */
+  SplicePipe();
+  ~SplicePipe();
+
+/**
+ * Creates the underlying pipe (if it doesn't already exist), and returns
+ * true if and only if it's available for splicing.  If nonblocking is true,
+ * then fill and drain never block on the pipe itself.
+ */
+  bool open(bool nonblocking);
+
+/**
+ * Closes the underlying pipe, discarding anything still in it.
+ */
+  void close();
+
+  bool isOpen() const { return fds[0] != -1; }
+
+/**
+ * Returns the number of bytes that have been spliced into the pipe but
+ * not yet spliced out of it.
+ */
+  size_t buffered() const { return bufferedBytes; }
+
+/**
+ * Splices up to max bytes from infd into the pipe.  Returns the number of
+ * bytes moved, 0 if infd has reached end of file, or -1 (with errno set) on
+ * failure, including EAGAIN when nothing could be moved without blocking.
+ */
+  ssize_t fill(int infd, size_t max);
+
+/**
+ * Splices as much of what's in the pipe as possible out to outfd.  Returns
+ * the number of bytes moved, or -1 (with errno set) on failure.
+ */
+  ssize_t drain(int outfd);
+
+ private:
+  int fds[2];
+  bool nonblocking;
+  size_t bufferedBytes;
+
+  SplicePipe(const SplicePipe& original) = delete;
+  SplicePipe& operator=(const SplicePipe& rhs) = delete;
+};
+
+/**
+ * Moves exactly count bytes from infd (typically a blocking socket) to
+ * outfd, splicing them through a pipe private to the calling thread.
+ * Returns true if and only if all count bytes were moved.
+ */
+bool spliceCompletely(int infd, int outfd, size_t count);
+
+/**
+ * Publishes count bytes of the file open as infd, starting at offset, to
+ * the (blocking) outfd using sendfile.  Returns true if and only if all
+ * count bytes were sent.
+ */
+bool sendfileCompletely(int outfd, int infd, off_t offset, size_t count);
+
+#endif